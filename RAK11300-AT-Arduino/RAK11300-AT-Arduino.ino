@@ -42,7 +42,13 @@ void setup(void)
 	// Get default credentials
 	init_flash();
 
-	Serial1.begin(115200);
+	// Find uplinks queued before the reset
+	init_uplink_queue();
+
+	// Find the log of received packets
+	init_rx_log();
+
+	Serial1.begin(g_lorawan_settings.at_baudrate);
 
 	// Initialize the battery readings
 	init_batt();
@@ -84,44 +90,33 @@ void loop()
 		if ((event.value.signals & SIGNAL_JOIN) == SIGNAL_JOIN)
 		{
 			APP_LOG("APP", "Start Join");
-			init_lora();
+			init_lorawan();
 			digitalWrite(LED_BLUE, HIGH);
 		}
-		if ((event.value.signals & SIGNAL_JOIN_SUCCESS) == SIGNAL_JOIN_SUCCESS)
-		{
-			DualSerial("AT+JOIN=SUCCESS\n");
-			digitalWrite(LED_BLUE, LOW);
-		}
-		if ((event.value.signals & SIGNAL_JOIN_FAIL) == SIGNAL_JOIN_FAIL)
+		if ((event.value.signals & SIGNAL_ASYNC) == SIGNAL_ASYNC)
 		{
-			DualSerial("AT+JOIN=FAIL\n");
+			async_report();
 			digitalWrite(LED_BLUE, LOW);
 		}
-		if ((event.value.signals & SIGNAL_UNCONF_TX) == SIGNAL_UNCONF_TX)
+		if ((event.value.signals & (SIGNAL_ASYNC | SIGNAL_QUEUE)) != 0)
 		{
-			DualSerial("AT+SEND=SUCCESS\n");
-			digitalWrite(LED_BLUE, LOW);
+			// Send the next queued packet after a join or a finished send
+			uplink_queue_send();
 		}
-		if ((event.value.signals & SIGNAL_CONF_TX_ACK) == SIGNAL_CONF_TX_ACK)
+		if ((event.value.signals & SIGNAL_RX) == SIGNAL_RX)
 		{
-			DualSerial("AT+SEND=SUCCESS\n");
+			rx_queue_report();
 			digitalWrite(LED_BLUE, LOW);
 		}
-		if ((event.value.signals & SIGNAL_CONF_TX_NAK) == SIGNAL_CONF_TX_NAK)
+		if ((event.value.signals & SIGNAL_LBT) == SIGNAL_LBT)
 		{
-			DualSerial("AT+SEND=FAIL\n");
-			digitalWrite(LED_BLUE, LOW);
+			// Repeat the CAD of the P2P packet after the backoff time
+			p2p_tx_retry();
 		}
-		if ((event.value.signals & SIGNAL_RX) == SIGNAL_RX)
+		if ((event.value.signals & SIGNAL_HOP) == SIGNAL_HOP)
 		{
-			APP_LOG("APP", "RX finished %d bytes, RSSI %d, SNR %d\n", g_rx_data_len, g_last_rssi, g_last_snr);
-			DualSerial("RX:%d:%d:%d:%d:", g_last_fport, g_rx_data_len, g_last_rssi, g_last_snr);
-			for (int idx = 0; idx < g_rx_data_len; idx++)
-			{
-				DualSerial("%02X", g_rx_lora_data[idx]);
-			}
-			DualSerial("\nOK\n");
-			digitalWrite(LED_BLUE, LOW);
+			// No P2P packets for the hop reset time, start the hopping sequence again
+			p2p_hop_reset();
 		}
 		if ((event.value.signals & SIGNAL_SEND) == SIGNAL_SEND)
 		{
@@ -133,14 +128,18 @@ void loop()
 			{
 				if (g_lpwan_has_joined)
 				{
+					// AT+SEND uses the same send buffer and MAC on the AT command task
+					at_cmd_lock();
 					lmh_error_status result = send_lora_packet(m_lora_app_data, 4);
+					at_cmd_unlock();
 					switch (result)
 					{
 					case LMH_SUCCESS:
 						APP_LOG("APP", "Packet queued successful");
 						break;
 					case LMH_BUSY:
-						APP_LOG("APP", "LoRa transceiver is busy, retry in next cycle!");
+						APP_LOG("APP", "LoRa transceiver is busy, packet queued");
+						uplink_queue_add(m_lora_app_data, 4, 0);
 						break;
 					case LMH_ERROR:
 						APP_LOG("APP", "Packet error, too big to send with current DR");
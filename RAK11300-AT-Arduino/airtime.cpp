@@ -0,0 +1,148 @@
+/**
+ * @file airtime.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Sliding window accounting of the LoRa P2P time on air
+ * @version 0.1
+ * @date 2021-10-09
+ * 
+ * @copyright Copyright (c) 2021
+ * 
+ */
+#include "main.h"
+
+/** Length of one bucket in milliseconds */
+#define AIRTIME_BUCKET_TIME 60000
+/** Number of buckets, the window is one hour */
+#define AIRTIME_BUCKETS 60
+/** Length of the window in milliseconds */
+#define AIRTIME_WINDOW (AIRTIME_BUCKET_TIME * AIRTIME_BUCKETS)
+
+/** Time on air per minute of the last hour, the bucket of the current minute is g_airtime_bucket */
+static uint32_t g_airtime[AIRTIME_BUCKETS] = {0};
+static uint8_t g_airtime_bucket = 0;
+/** Start time of the current bucket */
+static time_t g_airtime_bucket_start = 0;
+
+/** Time on air of the queued packets that are not sent yet */
+static uint32_t g_airtime_reserved = 0;
+
+/**
+ * @brief Move the window to the current time, buckets older than one hour are cleared
+ * Must be called inside a critical section
+ * 
+ */
+static void airtime_advance(void)
+{
+	uint32_t steps = (millis() - g_airtime_bucket_start) / AIRTIME_BUCKET_TIME;
+	if (steps == 0)
+	{
+		return;
+	}
+	g_airtime_bucket_start += steps * AIRTIME_BUCKET_TIME;
+	if (steps > AIRTIME_BUCKETS)
+	{
+		steps = AIRTIME_BUCKETS;
+	}
+	while (steps-- > 0)
+	{
+		g_airtime_bucket = (g_airtime_bucket + 1) % AIRTIME_BUCKETS;
+		g_airtime[g_airtime_bucket] = 0;
+	}
+}
+
+/**
+ * @brief Sum of the time on air in the window
+ * Must be called inside a critical section
+ * 
+ * @return uint32_t time on air in milliseconds
+ */
+static uint32_t airtime_sum(void)
+{
+	airtime_advance();
+	uint32_t sum = 0;
+	for (uint8_t idx = 0; idx < AIRTIME_BUCKETS; idx++)
+	{
+		sum += g_airtime[idx];
+	}
+	return sum;
+}
+
+/**
+ * @brief Reserve the time on air of a packet before it is queued
+ * The reservation counts against the budget until the packet is sent or dropped
+ * 
+ * @param airtime time on air of the packet in milliseconds
+ * @return true if the packet fits into the budget, false if it would exceed it
+ */
+bool airtime_reserve(uint32_t airtime)
+{
+	bool fits = true;
+	core_util_critical_section_enter();
+	if (g_lorawan_settings.p2p_airtime_budget != 0)
+	{
+		fits = (airtime_sum() + g_airtime_reserved + airtime) <= g_lorawan_settings.p2p_airtime_budget;
+	}
+	if (fits)
+	{
+		g_airtime_reserved += airtime;
+	}
+	core_util_critical_section_exit();
+	return fits;
+}
+
+/**
+ * @brief Release the reservation of a packet
+ * Called from the radio callbacks when the transmission is finished
+ * 
+ * @param airtime time on air of the packet in milliseconds
+ * @param sent true if the packet was transmitted and its time on air is counted
+ */
+void airtime_release(uint32_t airtime, bool sent)
+{
+	core_util_critical_section_enter();
+	g_airtime_reserved -= airtime;
+	if (sent)
+	{
+		airtime_advance();
+		g_airtime[g_airtime_bucket] += airtime;
+	}
+	core_util_critical_section_exit();
+}
+
+/**
+ * @brief Time on air of the last hour
+ * 
+ * @return uint32_t time on air in milliseconds
+ */
+uint32_t airtime_used(void)
+{
+	core_util_critical_section_enter();
+	uint32_t used = airtime_sum();
+	core_util_critical_section_exit();
+	return used;
+}
+
+/**
+ * @brief Time on air of the queued packets that are not sent yet
+ * 
+ * @return uint32_t time on air in milliseconds
+ */
+uint32_t airtime_reserved(void)
+{
+	return g_airtime_reserved;
+}
+
+/**
+ * @brief Time on air that can still be used in the window
+ * Without a budget the whole hour is the limit
+ * 
+ * @return uint32_t time on air in milliseconds
+ */
+uint32_t airtime_remaining(void)
+{
+	uint32_t budget = g_lorawan_settings.p2p_airtime_budget != 0 ? g_lorawan_settings.p2p_airtime_budget : AIRTIME_WINDOW;
+	core_util_critical_section_enter();
+	uint32_t used = airtime_sum() + g_airtime_reserved;
+	core_util_critical_section_exit();
+	return used < budget ? budget - used : 0;
+}
@@ -0,0 +1,164 @@
+/**
+ * @file at_async.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Request IDs and completion reports of send and join requests
+ * @version 0.1
+ * @date 2021-10-09
+ * 
+ * @copyright Copyright (c) 2021
+ * 
+ */
+#include "main.h"
+
+/** Number of completions that can wait for the loop thread, must be a power of 2 */
+#define ASYNC_QUEUE_SIZE 8
+
+/** Completion of an asynchronous operation */
+struct s_async_completion
+{
+	// ASYNC_OP_xxx
+	uint8_t op;
+	// ASYNC_xxx
+	uint8_t result;
+	// Number of retries
+	uint8_t retries;
+	// Request ID, 0 if the operation was not started with a request ID
+	uint16_t id;
+	// Time on air in milliseconds
+	uint32_t airtime;
+};
+
+/** Completion queue, written from the LoRa callbacks, read by the loop thread */
+static s_async_completion g_async_queue[ASYNC_QUEUE_SIZE];
+static volatile uint8_t g_async_head = 0;
+static volatile uint8_t g_async_tail = 0;
+
+/** Number of completions lost because the completion queue was full */
+static uint32_t g_async_overruns = 0;
+
+/** Request ID and time on air of the operation in progress, ID 0 if none */
+static volatile uint16_t g_async_id[ASYNC_OP_NUM] = {0};
+static volatile uint32_t g_async_airtime[ASYNC_OP_NUM] = {0};
+
+/** Last assigned request ID */
+static uint16_t g_async_last_id = 0;
+
+/** Names of the operations, used in the completion reports */
+static const char *async_op_names[ASYNC_OP_NUM] = {"SEND", "PSEND", "JOIN"};
+/** Names of the results, used in the completion reports */
+static const char *async_result_names[] = {"SUCCESS", "FAIL", "BUSY"};
+
+/**
+ * @brief Assign a new request ID
+ * Used for requests that are queued before the operation starts
+ * 
+ * @return uint16_t request ID, never 0
+ */
+uint16_t async_new_id(void)
+{
+	// IDs are assigned by the AT command task and the loop thread
+	core_util_critical_section_enter();
+	g_async_last_id++;
+	if (g_async_last_id == 0)
+	{
+		g_async_last_id = 1;
+	}
+	uint16_t id = g_async_last_id;
+	core_util_critical_section_exit();
+	return id;
+}
+
+/**
+ * @brief Mark an operation with an already assigned request ID as started
+ * 
+ * @param op ASYNC_OP_xxx
+ * @param id request ID from async_new_id()
+ * @param airtime time on air in milliseconds
+ */
+void async_begin(uint8_t op, uint16_t id, uint32_t airtime)
+{
+	g_async_airtime[op] = airtime;
+	g_async_id[op] = id;
+}
+
+/**
+ * @brief Assign a request ID to a started operation
+ * 
+ * @param op ASYNC_OP_xxx
+ * @param airtime time on air in milliseconds
+ * @return uint16_t request ID, never 0
+ */
+uint16_t async_start(uint8_t op, uint32_t airtime)
+{
+	uint16_t id = async_new_id();
+	async_begin(op, id, airtime);
+	return id;
+}
+
+/**
+ * @brief Get the request ID of the operation in progress
+ * 
+ * @param op ASYNC_OP_xxx
+ * @return uint16_t request ID, 0 if no operation is in progress
+ */
+uint16_t async_pending(uint8_t op)
+{
+	return g_async_id[op];
+}
+
+/**
+ * @brief Queue the completion of an operation and wake up the loop thread to report it
+ * 
+ * @param op ASYNC_OP_xxx
+ * @param result ASYNC_xxx
+ * @param retries number of retries
+ */
+void async_complete(uint8_t op, uint8_t result, uint8_t retries)
+{
+	if ((uint8_t)(g_async_head - g_async_tail) >= ASYNC_QUEUE_SIZE)
+	{
+		// The report is lost, but the operation is finished
+		g_async_overruns++;
+		g_async_id[op] = 0;
+		g_async_airtime[op] = 0;
+		return;
+	}
+
+	s_async_completion *completion = &g_async_queue[g_async_head % ASYNC_QUEUE_SIZE];
+	completion->op = op;
+	completion->result = result;
+	completion->retries = retries;
+	completion->id = g_async_id[op];
+	completion->airtime = g_async_airtime[op];
+	g_async_id[op] = 0;
+	g_async_airtime[op] = 0;
+	g_async_head++;
+
+	if (loop_thread != NULL)
+	{
+		osSignalSet(loop_thread, SIGNAL_ASYNC);
+	}
+}
+
+/**
+ * @brief Report all queued completions
+ * Format is AT+<operation>=<result>:<request ID>:<time on air>:<retries>
+ * 
+ */
+void async_report(void)
+{
+	while (g_async_tail != g_async_head)
+	{
+		s_async_completion *completion = &g_async_queue[g_async_tail % ASYNC_QUEUE_SIZE];
+		DualSerial("AT+%s=%s:%d:%" PRIu32 ":%d\n", async_op_names[completion->op],
+				   async_result_names[completion->result], completion->id,
+				   completion->airtime, completion->retries);
+		g_async_tail++;
+	}
+
+	if (g_async_overruns != 0)
+	{
+		APP_LOG("ASYNC", "%" PRIu32 " completions lost", g_async_overruns);
+		g_async_overruns = 0;
+	}
+}
@@ -0,0 +1,563 @@
+/**
+ * @file at_bin.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Binary framed host protocol
+ * @version 0.1
+ * @date 2021-10-09
+ * 
+ * @copyright Copyright (c) 2021
+ * 
+ * Frames are SLIP (RFC 1055) encoded:
+ * | opcode (1) | sequence (1) | payload length (2, LSB first) | payload | CRC16 (2, LSB first) |
+ * The CRC16 (CCITT, polynom 0x1021, start 0xFFFF) covers header and payload.
+ * Replies have the same sequence number as the request and the opcode with BIN_OP_REPLY set.
+ */
+#include "at_cmd.h"
+
+/** Opcodes */
+/** LoRaWAN uplink, payload is fPort + data */
+#define BIN_OP_SEND 0x01
+/** LoRa P2P packet, payload is data */
+#define BIN_OP_PSEND 0x02
+/** Received packet (device to host), payload is fPort + RSSI (2, LSB first) + SNR + data */
+#define BIN_OP_RX 0x03
+/** AT command without the AT prefix, reply is the AT response text */
+#define BIN_OP_AT 0x04
+/** Status, reply is result + mode + join status + RSSI (2, LSB first) + SNR + P2P RX mode */
+#define BIN_OP_STATUS 0x05
+/** Unsolicited message text (device to host) */
+#define BIN_OP_EVENT 0x06
+/** Logged received packets (device to host), payload is log entries as stored in the flash, each padded to 4 bytes */
+#define BIN_OP_LOG 0x07
+/** Read the log of received packets, LOG frames are sent first, reply is result + number of entries (4, LSB first) */
+#define BIN_OP_LOGREAD 0x08
+/** Flag for reply frames */
+#define BIN_OP_REPLY 0x80
+
+#define BIN_HEADER_SIZE 4
+#define BIN_CRC_SIZE 2
+#define BIN_MAX_PAYLOAD 260
+#define BIN_FRAME_SIZE (BIN_HEADER_SIZE + BIN_MAX_PAYLOAD + BIN_CRC_SIZE)
+
+/** SLIP special characters */
+#define SLIP_END 0xC0
+#define SLIP_ESC 0xDB
+#define SLIP_ESC_END 0xDC
+#define SLIP_ESC_ESC 0xDD
+
+/** Binary mode status and frame decoder of one port */
+struct s_bin_port
+{
+	// Flag if binary mode is active
+	bool active = false;
+	// Flag if last received byte was SLIP_ESC
+	bool escape = false;
+	// Flag if the frame was too long
+	bool overflow = false;
+	// Length of decoded frame
+	uint16_t len = 0;
+	// Decoded frame
+	uint8_t frame[BIN_FRAME_SIZE];
+};
+static s_bin_port g_bin_ports[AT_PORT_NUM];
+
+/** SLIP encoded output frame, worst case every byte is escaped */
+static uint8_t g_bin_tx[BIN_FRAME_SIZE * 2 + 2];
+/** Frames are sent from the serial and the loop thread */
+static Mutex g_bin_tx_lock;
+
+/** CRC16 CCITT nibble table */
+static const uint16_t crc16_table[16] = {0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+										 0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF};
+
+/**
+ * @brief Calculate CRC16 CCITT
+ * 
+ * @param data data
+ * @param len length of data
+ * @param crc start value or CRC of previous data
+ * @return uint16_t CRC
+ */
+static uint16_t bin_crc16(const uint8_t *data, uint16_t len, uint16_t crc)
+{
+	for (uint16_t idx = 0; idx < len; idx++)
+	{
+		crc = (crc << 4) ^ crc16_table[(crc >> 12) ^ (data[idx] >> 4)];
+		crc = (crc << 4) ^ crc16_table[(crc >> 12) ^ (data[idx] & 0x0F)];
+	}
+	return crc;
+}
+
+/**
+ * @brief SLIP encode data into the output frame
+ * 
+ * @param data data
+ * @param len length of data
+ * @param out write index into g_bin_tx
+ * @return uint16_t new write index
+ */
+static uint16_t bin_slip_encode(const uint8_t *data, uint16_t len, uint16_t out)
+{
+	for (uint16_t idx = 0; idx < len; idx++)
+	{
+		if (data[idx] == SLIP_END)
+		{
+			g_bin_tx[out++] = SLIP_ESC;
+			g_bin_tx[out++] = SLIP_ESC_END;
+		}
+		else if (data[idx] == SLIP_ESC)
+		{
+			g_bin_tx[out++] = SLIP_ESC;
+			g_bin_tx[out++] = SLIP_ESC_ESC;
+		}
+		else
+		{
+			g_bin_tx[out++] = data[idx];
+		}
+	}
+	return out;
+}
+
+/**
+ * @brief Send a frame to a port
+ * Payloads longer than BIN_MAX_PAYLOAD are split into several frames
+ * 
+ * @param port port number
+ * @param opcode opcode
+ * @param seq sequence number
+ * @param data payload
+ * @param len length of payload
+ */
+static void bin_send_frame(uint8_t port, uint8_t opcode, uint8_t seq, const uint8_t *data, uint16_t len)
+{
+	do
+	{
+		uint16_t chunk = len > BIN_MAX_PAYLOAD ? BIN_MAX_PAYLOAD : len;
+		uint8_t header[BIN_HEADER_SIZE] = {opcode, seq, (uint8_t)(chunk & 0xFF), (uint8_t)(chunk >> 8)};
+		uint16_t crc = bin_crc16(header, BIN_HEADER_SIZE, 0xFFFF);
+		crc = bin_crc16(data, chunk, crc);
+		uint8_t crc_bytes[BIN_CRC_SIZE] = {(uint8_t)(crc & 0xFF), (uint8_t)(crc >> 8)};
+
+		g_bin_tx_lock.lock();
+		uint16_t out = 0;
+		g_bin_tx[out++] = SLIP_END;
+		out = bin_slip_encode(header, BIN_HEADER_SIZE, out);
+		out = bin_slip_encode(data, chunk, out);
+		out = bin_slip_encode(crc_bytes, BIN_CRC_SIZE, out);
+		g_bin_tx[out++] = SLIP_END;
+		at_port_sink(port)->write(g_bin_tx, out);
+		g_bin_tx_lock.unlock();
+
+		data += chunk;
+		len -= chunk;
+	} while (len > 0);
+}
+
+/**
+ * @brief Send a reply frame with only a result code
+ * 
+ * @param port port number
+ * @param opcode opcode of the request
+ * @param seq sequence number of the request
+ * @param result 0 or AT_ERRNO_xxx
+ */
+static void bin_send_result(uint8_t port, uint8_t opcode, uint8_t seq, uint8_t result)
+{
+	bin_send_frame(port, opcode | BIN_OP_REPLY, seq, &result, 1);
+}
+
+/**
+ * @brief Send the reply frame of a send request
+ * On success the result code is followed by the request ID of the packet,
+ * a P2P request adds the free places in the transmit queue
+ * 
+ * @param port port number
+ * @param opcode opcode of the request
+ * @param seq sequence number of the request
+ * @param result 0 or AT_ERRNO_xxx
+ * @param id request ID of the packet
+ */
+static void bin_send_request_id(uint8_t port, uint8_t opcode, uint8_t seq, uint8_t result, uint16_t id)
+{
+	if (result != 0)
+	{
+		bin_send_result(port, opcode, seq, result);
+		return;
+	}
+	uint8_t reply[4] = {result, (uint8_t)(id & 0xFF), (uint8_t)(id >> 8), p2p_tx_queue_free()};
+	bin_send_frame(port, opcode | BIN_OP_REPLY, seq, reply, opcode == BIN_OP_PSEND ? 4 : 3);
+}
+
+/**
+ * @brief Output that packs everything written into reply frames
+ * Used as sink for the AT command parser
+ * 
+ */
+class BinFrameSink : public Print
+{
+public:
+	BinFrameSink(uint8_t port, uint8_t opcode, uint8_t seq) : _port(port), _opcode(opcode), _seq(seq) {}
+
+	size_t write(uint8_t data)
+	{
+		return write(&data, 1);
+	}
+
+	size_t write(const uint8_t *buffer, size_t size)
+	{
+		bin_send_frame(_port, _opcode, _seq, buffer, size);
+		return size;
+	}
+
+private:
+	uint8_t _port;
+	uint8_t _opcode;
+	uint8_t _seq;
+};
+
+/**
+ * @brief Send a LoRaWAN packet
+ * 
+ * @param payload fPort + data
+ * @param len length of payload
+ * @return uint8_t 0 or AT_ERRNO_xxx
+ */
+static uint8_t bin_exec_send(uint8_t *payload, uint16_t len)
+{
+	if (!g_lpwan_has_joined || !g_lorawan_settings.lorawan_enable)
+	{
+		return AT_ERRNO_NOALLOW;
+	}
+	if ((len < 2) || (len > 256) || (payload[0] == 0))
+	{
+		return AT_ERRNO_PARA_VAL;
+	}
+	if (send_lora_packet(&payload[1], len - 1, payload[0]) != LMH_SUCCESS)
+	{
+		return AT_ERRNO_SYS;
+	}
+	return 0;
+}
+
+/**
+ * @brief Send a LoRa P2P packet
+ * 
+ * @param payload data
+ * @param len length of payload
+ * @param id receives the request ID of the packet
+ * @return uint8_t 0 or AT_ERRNO_xxx
+ */
+static uint8_t bin_exec_p2p_send(uint8_t *payload, uint16_t len, uint16_t *id)
+{
+	if (g_lorawan_settings.lorawan_enable)
+	{
+		return AT_ERRNO_NOALLOW;
+	}
+	if ((len == 0) || (len > 255))
+	{
+		return AT_ERRNO_PARA_VAL;
+	}
+	if (p2p_time_on_air(len) > airtime_remaining())
+	{
+		// Airtime budget of the last hour is used up
+		return AT_ERRNO_NOALLOW;
+	}
+	*id = send_p2p_packet(payload, len);
+	if (*id == 0)
+	{
+		// Transmit queue is full
+		return AT_ERRNO_SYS;
+	}
+	return 0;
+}
+
+/**
+ * @brief Execute an AT command through the AT command parser
+ * The AT response is sent in reply frames
+ * 
+ * @param port port number
+ * @param seq sequence number
+ * @param payload AT command without the "AT" prefix
+ * @param len length of payload
+ */
+static void bin_exec_at(uint8_t port, uint8_t seq, uint8_t *payload, uint16_t len)
+{
+	char atcmd[ATCMD_SIZE];
+
+	if (len > (ATCMD_SIZE - 3))
+	{
+		bin_send_result(port, BIN_OP_AT, seq, AT_ERRNO_PARA_NUM);
+		return;
+	}
+
+	atcmd[0] = 'A';
+	atcmd[1] = 'T';
+	for (uint16_t idx = 0; idx < len; idx++)
+	{
+		atcmd[idx + 2] = toupper(payload[idx]);
+	}
+	atcmd[len + 2] = '\0';
+
+	BinFrameSink sink(port, BIN_OP_AT | BIN_OP_REPLY, seq);
+	at_cmd_exec(atcmd, len + 2, &sink, port);
+}
+
+/**
+ * @brief Send the device status
+ * 
+ * @param port port number
+ * @param seq sequence number
+ */
+static void bin_exec_status(uint8_t port, uint8_t seq)
+{
+	uint8_t status[7];
+	status[0] = 0;
+	status[1] = g_lorawan_settings.lorawan_enable ? 1 : 0;
+	status[2] = g_lpwan_has_joined ? 1 : 0;
+	status[3] = (uint8_t)(g_last_rssi & 0xFF);
+	status[4] = (uint8_t)(g_last_rssi >> 8);
+	status[5] = (uint8_t)g_last_snr;
+	status[6] = g_lora_p2p_rx_mode;
+	bin_send_frame(port, BIN_OP_STATUS | BIN_OP_REPLY, seq, status, sizeof(status));
+}
+
+/** LOG frame that is filled with log entries */
+struct s_bin_log
+{
+	// Port and sequence number of the request
+	uint8_t port;
+	uint8_t seq;
+	// Used bytes of the frame
+	uint16_t len;
+	// Log entries
+	uint8_t data[BIN_MAX_PAYLOAD];
+};
+
+/**
+ * @brief Add a log entry to the LOG frame, the frame is sent when it is full
+ * 
+ * @param entry log entry followed by the payload
+ * @param arg LOG frame
+ */
+static void bin_log_entry(const s_rx_log_entry *entry, void *arg)
+{
+	s_bin_log *log = (s_bin_log *)arg;
+	uint16_t size = (sizeof(s_rx_log_entry) + entry->len + 3) & ~3;
+	if (log->len + size > BIN_MAX_PAYLOAD)
+	{
+		bin_send_frame(log->port, BIN_OP_LOG, log->seq, log->data, log->len);
+		log->len = 0;
+	}
+	memcpy(&log->data[log->len], entry, size);
+	log->len += size;
+}
+
+/**
+ * @brief Send the log of received packets, oldest packet first
+ * 
+ * @param port port number
+ * @param seq sequence number
+ */
+static void bin_exec_logread(uint8_t port, uint8_t seq)
+{
+	s_bin_log log;
+	log.port = port;
+	log.seq = seq;
+	log.len = 0;
+
+	uint32_t count = rx_log_read(bin_log_entry, &log);
+	if (log.len != 0)
+	{
+		bin_send_frame(port, BIN_OP_LOG, seq, log.data, log.len);
+	}
+
+	uint8_t reply[5] = {0, (uint8_t)(count & 0xFF), (uint8_t)(count >> 8), (uint8_t)(count >> 16), (uint8_t)(count >> 24)};
+	bin_send_frame(port, BIN_OP_LOGREAD | BIN_OP_REPLY, seq, reply, sizeof(reply));
+}
+
+/**
+ * @brief Check and execute a received frame
+ * 
+ * @param port port number
+ */
+static void bin_handle_frame(uint8_t port)
+{
+	s_bin_port *bin = &g_bin_ports[port];
+	uint8_t opcode = bin->frame[0];
+	uint8_t seq = bin->frame[1];
+
+	if (bin->len < (BIN_HEADER_SIZE + BIN_CRC_SIZE))
+	{
+		// Too short to be a valid frame, ignore it
+		return;
+	}
+
+	uint16_t len = bin->frame[2] | (bin->frame[3] << 8);
+	uint16_t crc = bin->frame[bin->len - 2] | (bin->frame[bin->len - 1] << 8);
+	if ((len != (bin->len - BIN_HEADER_SIZE - BIN_CRC_SIZE)) || (crc != bin_crc16(bin->frame, bin->len - BIN_CRC_SIZE, 0xFFFF)))
+	{
+		bin_send_result(port, opcode, seq, AT_ERRNO_PARA_NUM);
+		return;
+	}
+
+	uint8_t *payload = &bin->frame[BIN_HEADER_SIZE];
+	uint8_t result;
+	uint16_t id = 0;
+
+	if (opcode == BIN_OP_AT)
+	{
+		// The AT command parser takes the lock itself
+		bin_exec_at(port, seq, payload, len);
+		return;
+	}
+
+	// Binary requests share the send buffers and the radio with the AT commands
+	at_cmd_lock();
+	switch (opcode)
+	{
+	case BIN_OP_SEND:
+		result = bin_exec_send(payload, len);
+		bin_send_request_id(port, opcode, seq, result, async_pending(ASYNC_OP_SEND));
+		break;
+	case BIN_OP_PSEND:
+		result = bin_exec_p2p_send(payload, len, &id);
+		bin_send_request_id(port, opcode, seq, result, id);
+		break;
+	case BIN_OP_STATUS:
+		bin_exec_status(port, seq);
+		break;
+	case BIN_OP_LOGREAD:
+		bin_exec_logread(port, seq);
+		break;
+	default:
+		bin_send_result(port, opcode, seq, AT_ERRNO_NOSUPP);
+		break;
+	}
+	at_cmd_unlock();
+}
+
+/**
+ * @brief Check if a port is in binary mode
+ * 
+ * @param port port number
+ * @return true if the port is in binary mode
+ */
+bool bin_mode_active(uint8_t port)
+{
+	if (port >= AT_PORT_NUM)
+	{
+		return false;
+	}
+	return g_bin_ports[port].active;
+}
+
+/**
+ * @brief Switch a port to binary mode
+ * 
+ * @param port port number
+ */
+void bin_mode_start(uint8_t port)
+{
+	g_bin_ports[port].len = 0;
+	g_bin_ports[port].escape = false;
+	g_bin_ports[port].overflow = false;
+	g_bin_ports[port].active = true;
+}
+
+/**
+ * @brief Switch a port back to ASCII AT commands
+ * 
+ * @param port port number
+ */
+void bin_mode_stop(uint8_t port)
+{
+	g_bin_ports[port].active = false;
+}
+
+/**
+ * @brief Feed a received byte into the frame decoder of a port
+ * 
+ * @param data received byte
+ * @param port port number
+ */
+void bin_serial_input(uint8_t data, uint8_t port)
+{
+	s_bin_port *bin = &g_bin_ports[port];
+
+	if (data == SLIP_END)
+	{
+		if ((bin->len != 0) && !bin->overflow)
+		{
+			bin_handle_frame(port);
+		}
+		bin->len = 0;
+		bin->escape = false;
+		bin->overflow = false;
+		return;
+	}
+
+	if (bin->escape)
+	{
+		bin->escape = false;
+		if (data == SLIP_ESC_END)
+		{
+			data = SLIP_END;
+		}
+		else if (data == SLIP_ESC_ESC)
+		{
+			data = SLIP_ESC;
+		}
+	}
+	else if (data == SLIP_ESC)
+	{
+		bin->escape = true;
+		return;
+	}
+
+	if (bin->len < BIN_FRAME_SIZE)
+	{
+		bin->frame[bin->len++] = data;
+	}
+	else
+	{
+		bin->overflow = true;
+	}
+}
+
+/**
+ * @brief Send an unsolicited message text as event frame
+ * 
+ * @param port port number
+ * @param data message text
+ * @param len length of message
+ */
+void bin_send_event(uint8_t port, const uint8_t *data, uint16_t len)
+{
+	bin_send_frame(port, BIN_OP_EVENT, 0, data, len);
+}
+
+/**
+ * @brief Send a received packet as RX frame
+ * 
+ * @param port port number
+ * @param fport fPort of the packet (0 for LoRa P2P)
+ * @param rssi RSSI of the packet
+ * @param snr SNR of the packet
+ * @param data received data
+ * @param len length of received data
+ */
+void bin_send_rx(uint8_t port, uint8_t fport, int16_t rssi, int8_t snr, const uint8_t *data, uint16_t len)
+{
+	uint8_t rx_frame[BIN_MAX_PAYLOAD];
+
+	if (len > (BIN_MAX_PAYLOAD - 4))
+	{
+		len = BIN_MAX_PAYLOAD - 4;
+	}
+	rx_frame[0] = fport;
+	rx_frame[1] = (uint8_t)(rssi & 0xFF);
+	rx_frame[2] = (uint8_t)(rssi >> 8);
+	rx_frame[3] = (uint8_t)snr;
+	memcpy(&rx_frame[4], data, len);
+	bin_send_frame(port, BIN_OP_RX, 0, rx_frame, len + 4);
+}
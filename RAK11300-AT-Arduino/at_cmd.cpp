@@ -10,30 +10,70 @@
  */
 #include "at_cmd.h"
 
-#define AT_ERROR "+CME ERROR:"
-#define ATCMD_SIZE 160
-#define ATQUERY_SIZE 128
-
-#define AT_ERRNO_NOSUPP (1)
-#define AT_ERRNO_NOALLOW (2)
-#define AT_ERRNO_PARA_VAL (5)
-#define AT_ERRNO_PARA_NUM (6)
-#define AT_ERRNO_SYS (8)
-#define AT_CB_PRINT (0xFF)
-
-static char atcmd[ATCMD_SIZE];
-static uint16_t atcmd_index = 0;
+
+/** Number of slots in the command hash table, power of 2 and at least twice the number of commands */
+#define AT_HASH_SIZE 128
+#define AT_HASH_EMPTY 0xFF
+
+/** Parser context of one AT command transport */
+struct s_at_port
+{
+	// Output of echo and replies
+	Print *sink;
+	// Received command line
+	char atcmd[ATCMD_SIZE];
+	// Write index into the command line
+	uint16_t atcmd_index;
+	// Flag if received characters are echoed
+	bool echo;
+	// Flag for verbose text result codes, numeric result codes otherwise
+	bool verbose;
+};
+static s_at_port g_at_ports[AT_PORT_NUM] = {{&Serial, {0}, 0, true, true}, {&Serial1, {0}, 0, true, true}};
+
+/** Response of the AT command in progress, sink NULL => output goes to all ports */
+static s_at_resp g_at_resp;
+
+/** Port of the AT command in progress */
+static uint8_t g_at_cmd_port = AT_PORT_NUM;
+
+/** Name of the AT command in progress, selects the setting of the generic handlers */
+static const char *g_at_cmd_name = NULL;
+
+/** Only one AT command is executed at a time */
+static Mutex g_at_cmd_lock;
+
+/** Wake up interval of the AT command task in milliseconds */
+#define AT_IDLE_TIMEOUT 500
+/** Signal to wake up the AT command task */
+#define SIGNAL_AT_CMD 0x0001
+
+/** Received command line waiting for execution */
+struct s_at_queue_entry
+{
+	// Port the command was received on
+	uint8_t port;
+	// Length of the command
+	uint16_t atcmd_index;
+	// Command including "AT", 0 terminated, also used for the reply
+	char atcmd[ATCMD_SIZE];
+};
+/** Command queue, written by the serial task, read by the AT command task */
+static s_at_queue_entry g_at_queue[AT_QUEUE_SIZE];
+static volatile uint8_t g_at_queue_head = 0;
+static volatile uint8_t g_at_queue_tail = 0;
+/** Number of free entries in the command queue */
+static Semaphore g_at_queue_free(AT_QUEUE_SIZE);
+
+/** Task that executes the queued commands */
+static Thread _thread_at_cmd(osPriorityNormal, 4096);
+static osThreadId _at_cmd_task_thread = NULL;
+
 static char g_at_query_buf[ATQUERY_SIZE];
 
 /** LoRaWAN application data buffer. */
 uint8_t m_lora_app_data_buffer[256];
 
-char *bandwidths[] = {(char *)"125", (char *)"250", (char *)"500", (char *)"062", (char *)"041", (char *)"031", (char *)"020", (char *)"015", (char *)"010", (char *)"007"};
-
-char *region_names[] = {(char *)"AS923", (char *)"AU915", (char *)"CN470", (char *)"CN779",
-						(char *)"EU433", (char *)"EU868", (char *)"KR920", (char *)"IN865",
-						(char *)"US915", (char *)"AS923-2", (char *)"AS923-3", (char *)"AS923-4", (char *)"RU864"};
-
 typedef struct atcmd_s
 {
 	const char *cmd_name;		   // CMD NAME
@@ -46,6 +86,8 @@ typedef struct atcmd_s
 void set_new_config(void)
 {
 	Radio.Sleep();
+	p2p_hop_restart();
+	Radio.SetChannel(p2p_hop_frequency());
 	Radio.SetTxConfig(MODEM_LORA, g_lorawan_settings.p2p_tx_power, 0, g_lorawan_settings.p2p_bandwidth,
 					  g_lorawan_settings.p2p_sf, g_lorawan_settings.p2p_cr,
 					  g_lorawan_settings.p2p_preamble_len, false,
@@ -59,64 +101,18 @@ void set_new_config(void)
 }
 
 /**
- * @brief Convert Hex string into uint8_t array
+ * @brief Formatted output to the port that sent the current AT command.
+ * The output is buffered and written when the command is finished.
+ * Outside of a command (e.g. during setup) the output goes to all ports.
  * 
- * @param hex Hex string
- * @param bin uint8_t
- * @param bin_length Length of array
- * @return int -1 if conversion failed
+ * @param format printf format string
  */
-static int hex2bin(const char *hex, uint8_t *bin, uint16_t bin_length)
+void at_printf(const char *format, ...)
 {
-	uint16_t hex_length = strlen(hex);
-	const char *hex_end = hex + hex_length;
-	uint8_t *cur = bin;
-	uint8_t num_chars = hex_length & 1;
-	uint8_t byte = 0;
-
-	if (hex_length % 2 != 0)
-	{
-		return -1;
-	}
-
-	if (hex_length / 2 > bin_length)
-	{
-		return -1;
-	}
-
-	while (hex < hex_end)
-	{
-		if ('A' <= *hex && *hex <= 'F')
-		{
-			byte |= 10 + (*hex - 'A');
-		}
-		else if ('a' <= *hex && *hex <= 'f')
-		{
-			byte |= 10 + (*hex - 'a');
-		}
-		else if ('0' <= *hex && *hex <= '9')
-		{
-			byte |= *hex - '0';
-		}
-		else
-		{
-			return -1;
-		}
-		hex++;
-		num_chars++;
-
-		if (num_chars >= 2)
-		{
-			num_chars = 0;
-			*cur++ = byte;
-			byte = 0;
-		}
-		else
-		{
-			byte <<= 4;
-		}
-	}
-	return cur - bin;
+	va_list args;
+	va_start(args, format);
+	at_resp_vprintf(&g_at_resp, format, args);
+	va_end(args);
 }
 
 /**
@@ -125,69 +121,26 @@ static int hex2bin(const char *hex, uint8_t *bin, uint16_t bin_length)
  */
 void at_settings(void)
 {
-	AT_PRINTF("Device status:\n");
-	AT_PRINTF("   Auto join %s\n", g_lorawan_settings.auto_join ? "enabled" : "disabled");
-	AT_PRINTF("   Mode %s\n", g_lorawan_settings.lorawan_enable ? "LPWAN" : "P2P");
-	AT_PRINTF("LPWAN status:\n");
-	AT_PRINTF("   Marks: %02X %02X\n", g_lorawan_settings.valid_mark_1, g_lorawan_settings.valid_mark_2);
-	AT_PRINTF("   Dev EUI %02X%02X%02X%02X%02X%02X%02X%02X\n", g_lorawan_settings.node_device_eui[0], g_lorawan_settings.node_device_eui[1],
-			  g_lorawan_settings.node_device_eui[2], g_lorawan_settings.node_device_eui[3],
-			  g_lorawan_settings.node_device_eui[4], g_lorawan_settings.node_device_eui[5],
-			  g_lorawan_settings.node_device_eui[6], g_lorawan_settings.node_device_eui[7]);
-	AT_PRINTF("   App EUI %02X%02X%02X%02X%02X%02X%02X%02X\n", g_lorawan_settings.node_app_eui[0], g_lorawan_settings.node_app_eui[1],
-			  g_lorawan_settings.node_app_eui[2], g_lorawan_settings.node_app_eui[3],
-			  g_lorawan_settings.node_app_eui[4], g_lorawan_settings.node_app_eui[5],
-			  g_lorawan_settings.node_app_eui[6], g_lorawan_settings.node_app_eui[7]);
-	AT_PRINTF("   App Key %02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X\n",
-			  g_lorawan_settings.node_app_key[0], g_lorawan_settings.node_app_key[1],
-			  g_lorawan_settings.node_app_key[2], g_lorawan_settings.node_app_key[3],
-			  g_lorawan_settings.node_app_key[4], g_lorawan_settings.node_app_key[5],
-			  g_lorawan_settings.node_app_key[6], g_lorawan_settings.node_app_key[7],
-			  g_lorawan_settings.node_app_key[8], g_lorawan_settings.node_app_key[9],
-			  g_lorawan_settings.node_app_key[10], g_lorawan_settings.node_app_key[11],
-			  g_lorawan_settings.node_app_key[12], g_lorawan_settings.node_app_key[13],
-			  g_lorawan_settings.node_app_key[14], g_lorawan_settings.node_app_key[15]);
-	AT_PRINTF("   Dev Addr %08lX\n", g_lorawan_settings.node_dev_addr);
-	AT_PRINTF("   NWS Key %02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X\n",
-			  g_lorawan_settings.node_nws_key[0], g_lorawan_settings.node_nws_key[1],
-			  g_lorawan_settings.node_nws_key[2], g_lorawan_settings.node_nws_key[3],
-			  g_lorawan_settings.node_nws_key[4], g_lorawan_settings.node_nws_key[5],
-			  g_lorawan_settings.node_nws_key[6], g_lorawan_settings.node_nws_key[7],
-			  g_lorawan_settings.node_nws_key[8], g_lorawan_settings.node_nws_key[9],
-			  g_lorawan_settings.node_nws_key[10], g_lorawan_settings.node_nws_key[11],
-			  g_lorawan_settings.node_nws_key[12], g_lorawan_settings.node_nws_key[13],
-			  g_lorawan_settings.node_nws_key[14], g_lorawan_settings.node_nws_key[15]);
-	AT_PRINTF("   Apps Key %02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X\n",
-			  g_lorawan_settings.node_apps_key[0], g_lorawan_settings.node_apps_key[1],
-			  g_lorawan_settings.node_apps_key[2], g_lorawan_settings.node_apps_key[3],
-			  g_lorawan_settings.node_apps_key[4], g_lorawan_settings.node_apps_key[5],
-			  g_lorawan_settings.node_apps_key[6], g_lorawan_settings.node_apps_key[7],
-			  g_lorawan_settings.node_apps_key[8], g_lorawan_settings.node_apps_key[9],
-			  g_lorawan_settings.node_apps_key[10], g_lorawan_settings.node_apps_key[11],
-			  g_lorawan_settings.node_apps_key[12], g_lorawan_settings.node_apps_key[13],
-			  g_lorawan_settings.node_apps_key[14], g_lorawan_settings.node_apps_key[15]);
-	AT_PRINTF("   OTAA %s\n", g_lorawan_settings.otaa_enabled ? "enabled" : "disabled");
-	AT_PRINTF("   ADR %s\n", g_lorawan_settings.adr_enabled ? "enabled" : "disabled");
-	AT_PRINTF("   %s Network\n", g_lorawan_settings.public_network ? "Public" : "Private");
-	AT_PRINTF("   Dutycycle %s\n", g_lorawan_settings.duty_cycle_enabled ? "enabled" : "disabled");
-	AT_PRINTF("   Repeat time %ld\n", g_lorawan_settings.send_repeat_time);
-	AT_PRINTF("   Join trials %d\n", g_lorawan_settings.join_trials);
-	AT_PRINTF("   TX Power %d\n", g_lorawan_settings.tx_power);
-	AT_PRINTF("   DR %d\n", g_lorawan_settings.data_rate);
-	AT_PRINTF("   Class %d\n", g_lorawan_settings.lora_class);
-	AT_PRINTF("   Subband %d\n", g_lorawan_settings.subband_channels);
-	AT_PRINTF("   Fport %d\n", g_lorawan_settings.app_port);
-	AT_PRINTF("   %s Message\n", g_lorawan_settings.confirmed_msg_enabled ? "Confirmed" : "Unconfirmed");
-	AT_PRINTF("   Region %s\n", region_names[g_lorawan_settings.lora_region]);
-	AT_PRINTF("   Network %s\n", g_lpwan_has_joined ? "joined" : "not joined");
-	AT_PRINTF("LoRa P2P status:\n");
-	AT_PRINTF("   P2P frequency %ld\n", g_lorawan_settings.p2p_frequency);
-	AT_PRINTF("   P2P TX Power %d\n", g_lorawan_settings.p2p_tx_power);
-	AT_PRINTF("   P2P BW %s\n", bandwidths[g_lorawan_settings.p2p_bandwidth]);
-	AT_PRINTF("   P2P SF %d\n", g_lorawan_settings.p2p_sf);
-	AT_PRINTF("   P2P CR %d\n", g_lorawan_settings.p2p_cr);
-	AT_PRINTF("   P2P Preamble length %d\n", g_lorawan_settings.p2p_preamble_len);
-	AT_PRINTF("   P2P Symbol Timeout %d\n", g_lorawan_settings.p2p_symbol_timeout);
+	static const char *group_names[] = {NULL, "Device status", "LPWAN status", "LoRa P2P status"};
+	char value[2 * SETTING_BYTES_MAX + 1];
+
+	for (uint8_t group = SETTING_GROUP_DEVICE; group <= SETTING_GROUP_P2P; group++)
+	{
+		AT_PRINTF("%s:\n", group_names[group]);
+		for (uint8_t idx = 0; idx < g_settings_num; idx++)
+		{
+			if (g_settings[idx].group == group)
+			{
+				setting_print(&g_settings[idx], value, sizeof(value), true);
+				AT_PRINTF("   %s %s\n", g_settings[idx].name, value);
+			}
+		}
+		if (group == SETTING_GROUP_LPWAN)
+		{
+			AT_PRINTF("   Network %s\n", g_lpwan_has_joined ? "joined" : "not joined");
+		}
+	}
+	at_resp_flush(&g_at_resp);
 }
 
 static int at_query_mode(void)
@@ -224,283 +177,172 @@ static int at_exec_mode(char *str)
 
 	if (need_restart)
 	{
+		settings_flush();
+		uplink_queue_flush();
+		rx_log_flush();
 		delay(100);
 		NVIC_SystemReset();
 	}
 	return 0;
 }
 
-static int at_query_p2p_freq(void)
-{
-	snprintf(g_at_query_buf, ATQUERY_SIZE, "%ld", g_lorawan_settings.p2p_frequency);
-	return 0;
-}
-
-static int at_exec_p2p_freq(char *str)
+/**
+ * @brief Check if a setting can be changed in the current work mode
+ * 
+ * @param setting setting
+ * @return int 0 if the setting can be changed
+ */
+static int at_setting_allowed(const s_setting *setting)
 {
-	if (g_lorawan_settings.lorawan_enable)
+	if (((setting->flags & SETTING_LPWAN) && !g_lorawan_settings.lorawan_enable) ||
+		((setting->flags & SETTING_P2P) && g_lorawan_settings.lorawan_enable))
 	{
 		return AT_ERRNO_NOALLOW;
 	}
-	long freq = strtol(str, NULL, 0);
-
-	if ((freq < 525000000) || (freq > 960000000))
-	{
-		return AT_ERRNO_PARA_VAL;
-	}
-
-	g_lorawan_settings.p2p_frequency = freq;
-	save_settings();
-
-	set_new_config();
-	return 0;
-}
-
-static int at_query_p2p_sf(void)
-{
-	snprintf(g_at_query_buf, ATQUERY_SIZE, "%d", g_lorawan_settings.p2p_sf);
 	return 0;
 }
 
-static int at_exec_p2p_sf(char *str)
+/**
+ * @brief Check if the P2P radio can be set up again
+ * Sleep, standby or a new RX abort a queued packet in CAD or TX, its callbacks would never come
+ * and the transmit queue would stop
+ * 
+ * @return int 0 if no P2P packet is queued, otherwise AT_ERRNO_NOALLOW
+ */
+static int at_p2p_radio_free(void)
 {
-	if (g_lorawan_settings.lorawan_enable)
+	if (p2p_tx_queue_pending() != 0)
 	{
 		return AT_ERRNO_NOALLOW;
 	}
-	long sf = strtol(str, NULL, 0);
-
-	if ((sf < 7) || (sf > 12))
-	{
-		return AT_ERRNO_PARA_VAL;
-	}
-
-	g_lorawan_settings.p2p_sf = sf;
-	save_settings();
-
-	set_new_config();
-	return 0;
-}
-
-static int at_query_p2p_bw(void)
-{
-	snprintf(g_at_query_buf, ATQUERY_SIZE, "%s", bandwidths[g_lorawan_settings.p2p_bandwidth]);
 	return 0;
 }
 
-static int at_exec_p2p_bw(char *str)
+/**
+ * @brief AT+<setting>=? Get a setting from the settings registry
+ * 
+ * @return int 0 if the command has a setting
+ */
+static int at_query_setting(void)
 {
-	if (g_lorawan_settings.lorawan_enable)
-	{
-		return AT_ERRNO_NOALLOW;
-	}
-	for (int idx = 0; idx < 10; idx++)
+	const s_setting *setting = setting_find(g_at_cmd_name);
+	if (setting == NULL)
 	{
-		if (strcmp(str, bandwidths[idx]) == 0)
-		{
-			g_lorawan_settings.p2p_bandwidth = idx;
-			save_settings();
-
-			set_new_config();
-			return 0;
-		}
+		return AT_ERRNO_SYS;
 	}
-	return AT_ERRNO_PARA_VAL;
-}
-
-static int at_query_p2p_cr(void)
-{
-	snprintf(g_at_query_buf, ATQUERY_SIZE, "%d", g_lorawan_settings.p2p_cr);
+	setting_print(setting, g_at_query_buf, ATQUERY_SIZE, false);
 	return 0;
 }
 
-static int at_exec_p2p_cr(char *str)
+/**
+ * @brief AT+<setting>=<value> Set a setting from the settings registry
+ * Range and format are checked against the registry, the P2P radio is configured again if required
+ * 
+ * @param str new value
+ * @return int 0 if the value was valid
+ */
+static int at_exec_setting(char *str)
 {
-	if (g_lorawan_settings.lorawan_enable)
+	const s_setting *setting = setting_find(g_at_cmd_name);
+	if (setting == NULL)
 	{
-		return AT_ERRNO_NOALLOW;
+		return AT_ERRNO_SYS;
 	}
-	long cr = strtol(str, NULL, 0);
-
-	if ((cr < 1) || (cr > 4))
+	int ret = at_setting_allowed(setting);
+	if ((ret == 0) && (setting->flags & SETTING_RADIO))
 	{
-		return AT_ERRNO_PARA_VAL;
+		ret = at_p2p_radio_free();
 	}
-
-	g_lorawan_settings.p2p_cr = cr;
-	save_settings();
-
-	set_new_config();
-	return 0;
-}
-
-static int at_query_p2p_pl(void)
-{
-	snprintf(g_at_query_buf, ATQUERY_SIZE, "%d", g_lorawan_settings.p2p_preamble_len);
-	return 0;
-}
-
-static int at_exec_p2p_pl(char *str)
-{
-	if (g_lorawan_settings.lorawan_enable)
+	if (ret != 0)
 	{
-		return AT_ERRNO_NOALLOW;
+		return ret;
 	}
-	long preamble_len = strtol(str, NULL, 0);
-
-	if ((preamble_len < 0) || (preamble_len > 256))
+	uint8_t old_value[SETTING_BYTES_MAX];
+	memcpy(old_value, (uint8_t *)&g_lorawan_settings + setting->offset, setting->size);
+	if (!setting_parse(setting, str, &g_lorawan_settings))
 	{
 		return AT_ERRNO_PARA_VAL;
 	}
-
-	g_lorawan_settings.p2p_preamble_len = preamble_len;
-	save_settings();
-
-	set_new_config();
-	return 0;
-}
-
-static int at_query_p2p_txp(void)
-{
-	snprintf(g_at_query_buf, ATQUERY_SIZE, "%d", g_lorawan_settings.p2p_tx_power);
-	return 0;
-}
-
-static int at_exec_p2p_txp(char *str)
-{
-	if (g_lorawan_settings.lorawan_enable)
+	if ((setting->flags & SETTING_SESSION) &&
+		(memcmp(old_value, (uint8_t *)&g_lorawan_settings + setting->offset, setting->size) != 0))
 	{
-		return AT_ERRNO_NOALLOW;
+		lpwan_session_invalidate();
 	}
-	long txp = strtol(str, NULL, 0);
+	save_settings();
 
-	if ((txp < 0) || (txp > 23))
+	if (setting->flags & SETTING_RADIO)
 	{
-		return AT_ERRNO_PARA_VAL;
+		set_new_config();
 	}
-
-	g_lorawan_settings.p2p_tx_power = txp;
-	save_settings();
-
-	set_new_config();
 	return 0;
 }
 
+/** Settings of AT+P2P in the order of the parameters */
+static const char *p2p_config_cmds[] = {"+PFREQ", "+PSF", "+PBW", "+PCR", "+PPL", "+PTP"};
+#define P2P_CONFIG_NUM (sizeof(p2p_config_cmds) / sizeof(p2p_config_cmds[0]))
+
+/**
+ * @brief AT+P2P=? Get the P2P configuration
+ * 
+ * @return int always 0
+ */
 static int at_query_p2p_config(void)
 {
-	snprintf(g_at_query_buf, ATQUERY_SIZE, "%ld:%d:%d:%d:%d:%d",
-			 g_lorawan_settings.p2p_frequency,
-			 g_lorawan_settings.p2p_sf,
-			 g_lorawan_settings.p2p_bandwidth,
-			 g_lorawan_settings.p2p_cr,
-			 g_lorawan_settings.p2p_preamble_len,
-			 g_lorawan_settings.p2p_tx_power);
+	uint16_t len = 0;
+	for (uint8_t idx = 0; idx < P2P_CONFIG_NUM; idx++)
+	{
+		if (idx != 0)
+		{
+			g_at_query_buf[len++] = ':';
+		}
+		setting_print(setting_find(p2p_config_cmds[idx]), &g_at_query_buf[len], ATQUERY_SIZE - len, false);
+		len += strlen(&g_at_query_buf[len]);
+	}
 	return 0;
 }
 
+/**
+ * @brief AT+P2P=<freq>:<sf>:<bw>:<cr>:<preamble>:<tx power> Set the P2P configuration
+ * The settings are only changed if all parameters are valid
+ * 
+ * @param str parameters
+ * @return int 0 if the parameters were valid
+ */
 static int at_exec_p2p_config(char *str)
 {
 	if (g_lorawan_settings.lorawan_enable)
 	{
 		return AT_ERRNO_NOALLOW;
 	}
-	char *param;
-
-	param = strtok(str, ":");
-
-	if (param != NULL)
+	int ret = at_p2p_radio_free();
+	if (ret != 0)
 	{
-		/* check frequency */
-		long freq = strtol(param, NULL, 0);
+		return ret;
+	}
 
-		if ((freq < 525000000) || (freq > 960000000))
+	char *params[P2P_CONFIG_NUM];
+	s_lorawan_settings check_settings = g_lorawan_settings;
+	for (uint8_t idx = 0; idx < P2P_CONFIG_NUM; idx++)
+	{
+		params[idx] = strtok(idx == 0 ? str : NULL, ":");
+		if (params[idx] == NULL)
 		{
-			return AT_ERRNO_PARA_VAL;
+			return AT_ERRNO_PARA_NUM;
 		}
-
-		g_lorawan_settings.p2p_frequency = freq;
-
-		/* check SF */
-		param = strtok(NULL, ":");
-		if (param != NULL)
+		if (!setting_parse(setting_find(p2p_config_cmds[idx]), params[idx], &check_settings))
 		{
-			long sf = strtol(param, NULL, 0);
-
-			if ((sf < 7) || (sf > 12))
-			{
-				return AT_ERRNO_PARA_VAL;
-			}
-
-			g_lorawan_settings.p2p_sf = sf;
-
-			// Check Bandwidth
-			param = strtok(NULL, ":");
-			if (param != NULL)
-			{
-				bool found_bw = false;
-				for (int idx = 0; idx < 10; idx++)
-				{
-					if (strcmp(param, bandwidths[idx]) == 0)
-					{
-						g_lorawan_settings.p2p_bandwidth = idx;
-						found_bw = true;
-					}
-				}
-				if (!found_bw)
-				{
-					return AT_ERRNO_PARA_VAL;
-				}
-
-				// Check CR
-				param = strtok(NULL, ":");
-				if (param != NULL)
-				{
-					long cr = strtol(param, NULL, 0);
-
-					if ((cr < 0) || (cr > 3))
-					{
-						return AT_ERRNO_PARA_VAL;
-					}
-
-					g_lorawan_settings.p2p_cr = cr;
-
-					// Check Preamble length
-					param = strtok(NULL, ":");
-					if (param != NULL)
-					{
-						long preamble_len = strtol(param, NULL, 0);
-
-						if ((preamble_len < 0) || (preamble_len > 256))
-						{
-							return AT_ERRNO_PARA_VAL;
-						}
-
-						g_lorawan_settings.p2p_preamble_len = preamble_len;
-
-						// Check TX power
-						param = strtok(NULL, ":");
-						if (param != NULL)
-						{
-							long txp = strtol(param, NULL, 0);
-
-							if ((txp < 0) || (txp > 23))
-							{
-								return AT_ERRNO_PARA_VAL;
-							}
-
-							g_lorawan_settings.p2p_tx_power = txp;
-
-							save_settings();
-
-							set_new_config();
-							return 0;
-						}
-					}
-				}
-			}
+			return AT_ERRNO_PARA_VAL;
 		}
 	}
-	return AT_ERRNO_PARA_NUM;
+
+	for (uint8_t idx = 0; idx < P2P_CONFIG_NUM; idx++)
+	{
+		setting_parse(setting_find(p2p_config_cmds[idx]), params[idx], &g_lorawan_settings);
+	}
+	save_settings();
+
+	set_new_config();
+	return 0;
 }
 
 static int at_exec_p2p_send(char *str)
@@ -511,22 +353,41 @@ static int at_exec_p2p_send(char *str)
 	}
 
 	int data_size = strlen(str);
-	if (!(data_size % 2 == 0) || (data_size > 254))
+	if (data_size > 254)
 	{
 		return AT_ERRNO_PARA_VAL;
 	}
 
-	int buff_idx = 0;
-	char buff_parse[3];
-	for (int idx = 0; idx <= data_size + 1; idx += 2)
+	data_size = hex_decode(str, data_size, m_lora_app_data_buffer, 256);
+	if (data_size <= 0)
+	{
+		return AT_ERRNO_PARA_VAL;
+	}
+	if (p2p_time_on_air(data_size) > airtime_remaining())
+	{
+		// Airtime budget of the last hour is used up
+		return AT_ERRNO_NOALLOW;
+	}
+	uint16_t id = send_p2p_packet(m_lora_app_data_buffer, data_size);
+	if (id == 0)
 	{
-		buff_parse[0] = str[idx];
-		buff_parse[1] = str[idx + 1];
-		buff_parse[2] = 0;
-		m_lora_app_data_buffer[buff_idx] = strtol(buff_parse, NULL, 16);
-		buff_idx++;
+		// Transmit queue is full
+		return AT_ERRNO_SYS;
 	}
-	send_p2p_packet(m_lora_app_data_buffer, data_size / 2);
+	// Reply with the request ID of the packet and the free places in the transmit queue
+	snprintf(g_at_query_buf, ATQUERY_SIZE, "%d:%d", id, p2p_tx_queue_free());
+	return 0;
+}
+
+/**
+ * @brief Query the P2P transmit queue
+ * 
+ * @return int always 0
+ */
+static int at_query_p2p_send(void)
+{
+	// Packets waiting for transmission and free places
+	snprintf(g_at_query_buf, ATQUERY_SIZE, "%d:%d", p2p_tx_queue_pending(), p2p_tx_queue_free());
 	return 0;
 }
 
@@ -544,6 +405,11 @@ static int at_exec_p2p_receive(char *str)
 	{
 		return AT_ERRNO_NOALLOW;
 	}
+	int ret = at_p2p_radio_free();
+	if (ret != 0)
+	{
+		return ret;
+	}
 
 	char *param = strtok(str, ":");
 
@@ -600,54 +466,7 @@ static int at_exec_p2p_receive(char *str)
 
 static int at_query_p2p_receive(void)
 {
-	snprintf(g_at_query_buf, ATQUERY_SIZE, "%ld", g_lora_p2p_rx_time);
-	return 0;
-}
-
-/**
- * @brief AT+BAND=? Get regional frequency band
- * 
- * @return int always 0
- */
-static int at_query_region(void)
-{
-	// 0: AS923 1: AU915 2: CN470 3: CN779 4: EU433 5: EU868 6: KR920 7: IN865 8: US915 9: AS923-2 10: AS923-3 11: AS923-4 12: RU864
-	snprintf(g_at_query_buf, ATQUERY_SIZE, "%d", g_lorawan_settings.lora_region);
-
-	return 0;
-}
-
-/**
- * @brief AT+BAND=xx Set regional frequency band
- *  Values: 0: AS923 1: AU915 2: CN470 3: CN779 4: EU433 5: EU868 6: KR920 7: IN865 8: US915 9: AS923-2 10: AS923-3 11: AS923-4 12: RU864
- * @return int 0 if valid parameter
- */
-static int at_exec_region(char *str)
-{
-	if (!g_lorawan_settings.lorawan_enable)
-	{
-		return AT_ERRNO_NOALLOW;
-	}
-	char *param;
-	uint8_t region;
-
-	param = strtok(str, ",");
-	if (param != NULL)
-	{
-		region = strtol(param, NULL, 0);
-		// RAK4630 0: AS923 1: AU915 2: CN470 3: CN779 4: EU433 5: EU868 6: KR920 7: IN865 8: US915 9: AS923-2 10: AS923-3 11: AS923-4 12: RU864
-		if (region > 12)
-		{
-			return AT_ERRNO_PARA_VAL;
-		}
-		g_lorawan_settings.lora_region = region;
-		save_settings();
-	}
-	else
-	{
-		return AT_ERRNO_PARA_VAL;
-	}
-
+	snprintf(g_at_query_buf, ATQUERY_SIZE, "%" PRIu32, g_lora_p2p_rx_time);
 	return 0;
 }
 
@@ -705,6 +524,11 @@ static int at_exec_mask(char *str)
 		{
 			return AT_ERRNO_PARA_VAL;
 		}
+		if (g_lorawan_settings.subband_channels != mask)
+		{
+			// The saved session would restore the channel mask of the old sub band
+			lpwan_session_invalidate();
+		}
 		g_lorawan_settings.subband_channels = mask;
 		save_settings();
 	}
@@ -717,367 +541,7 @@ static int at_exec_mask(char *str)
 }
 
 /**
- * @brief AT+NJM=? Return current join modus
- * 
- * @return int always 0
- */
-static int at_query_joinmode(void)
-{
-	int mode;
-	mode = g_lorawan_settings.otaa_enabled == true ? 1 : 0;
-
-	snprintf(g_at_query_buf, ATQUERY_SIZE, "%d", mode);
-	return 0;
-}
-
-/**
- * @brief AT+NJM=x Set current join modus
- * 
- * @param str 1 = OTAA 0 = ABP
- * @return int 0 if valid parameter
- */
-static int at_exec_joinmode(char *str)
-{
-	if (!g_lorawan_settings.lorawan_enable)
-	{
-		return AT_ERRNO_NOALLOW;
-	}
-	int mode = strtol(str, NULL, 0);
-
-	if (mode != 0 && mode != 1)
-	{
-		return AT_ERRNO_PARA_VAL;
-	}
-
-	g_lorawan_settings.otaa_enabled = (mode == 1 ? true : false);
-	save_settings();
-
-	return 0;
-}
-
-/**
- * @brief AT+DEVEUI=? Get current Device EUI
- * 
- * @return int always 0
- */
-static int at_query_deveui(void)
-{
-	snprintf(g_at_query_buf, ATQUERY_SIZE,
-			 "%02X%02X%02X%02X%02X%02X%02X%02X",
-			 g_lorawan_settings.node_device_eui[0],
-			 g_lorawan_settings.node_device_eui[1],
-			 g_lorawan_settings.node_device_eui[2],
-			 g_lorawan_settings.node_device_eui[3],
-			 g_lorawan_settings.node_device_eui[4],
-			 g_lorawan_settings.node_device_eui[5],
-			 g_lorawan_settings.node_device_eui[6],
-			 g_lorawan_settings.node_device_eui[7]);
-	return 0;
-}
-
-/**
- * @brief AT+DEVEUI=<XXXXXXXXXXXXXXXX> Set current Device EUI
- * @return int 0 if Dev EUI has correct length and was valid HEX
- */
-static int at_exec_deveui(char *str)
-{
-	if (!g_lorawan_settings.lorawan_enable)
-	{
-		return AT_ERRNO_NOALLOW;
-	}
-	uint8_t len;
-	uint8_t buf[8];
-
-	len = hex2bin(str, buf, 8);
-
-	if (len != 8)
-	{
-		return AT_ERRNO_PARA_VAL;
-	}
-
-	memcpy(g_lorawan_settings.node_device_eui, buf, 8);
-	save_settings();
-
-	return 0;
-}
-
-/**
- * @brief AT+APPEUI=? Get current Application (Join) EUI
- * 
- * @return int always 0
- */
-static int at_query_appeui(void)
-{
-	snprintf(g_at_query_buf, ATQUERY_SIZE,
-			 "%02X%02X%02X%02X%02X%02X%02X%02X",
-			 g_lorawan_settings.node_app_eui[0],
-			 g_lorawan_settings.node_app_eui[1],
-			 g_lorawan_settings.node_app_eui[2],
-			 g_lorawan_settings.node_app_eui[3],
-			 g_lorawan_settings.node_app_eui[4],
-			 g_lorawan_settings.node_app_eui[5],
-			 g_lorawan_settings.node_app_eui[6],
-			 g_lorawan_settings.node_app_eui[7]);
-	return 0;
-}
-
-/**
- * @brief AT+APPEUI=<XXXXXXXXXXXXXXXX> Set current Application (Join) EUI
- * 
- * @return int 0 if App EUI has correct length and was valid HEX
- */
-static int at_exec_appeui(char *str)
-{
-	if (!g_lorawan_settings.lorawan_enable)
-	{
-		return AT_ERRNO_NOALLOW;
-	}
-	uint8_t len;
-	uint8_t buf[8];
-
-	len = hex2bin(str, buf, 8);
-	if (len != 8)
-	{
-		return AT_ERRNO_PARA_VAL;
-	}
-
-	memcpy(g_lorawan_settings.node_app_eui, buf, 8);
-	save_settings();
-
-	return 0;
-}
-
-/**
- * @brief AT+APPKEY=? Get current Application Key
- * 
- * @return int always 0
- */
-static int at_query_appkey(void)
-{
-	uint8_t i;
-	uint8_t len = 0;
-
-	for (i = 0; i < 16; i++)
-	{
-		len += snprintf(g_at_query_buf + len, ATQUERY_SIZE - len, "%02X", g_lorawan_settings.node_app_key[i]);
-		if (ATQUERY_SIZE <= len)
-		{
-			return -1;
-		}
-	}
-	return 0;
-}
-
-/**
- * @brief AT+APPKEY=<XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX> Set current Application (Join) EUI
- * 
- * @return int 0 if App Key has correct length and was valid HEX
- */
-static int at_exec_appkey(char *str)
-{
-	if (!g_lorawan_settings.lorawan_enable)
-	{
-		return AT_ERRNO_NOALLOW;
-	}
-	uint8_t buf[16];
-	uint8_t len;
-
-	len = hex2bin(str, buf, 16);
-	if (len != 16)
-	{
-		return AT_ERRNO_PARA_VAL;
-	}
-
-	memcpy(g_lorawan_settings.node_app_key, buf, 16);
-	save_settings();
-
-	return 0;
-}
-
-/**
- * @brief AT+DEVADDR=? Get device address
- * 
- * @return int always 0
- */
-static int at_query_devaddr(void)
-{
-	snprintf(g_at_query_buf, ATQUERY_SIZE, "%08lX\n", g_lorawan_settings.node_dev_addr);
-	return 0;
-}
-
-/**
- * @brief AT+DEVADDR=<XXXXXXXX> Set device address
- * 
- * @return int 0 if device address has correct length and was valid HEX
- */
-static int at_exec_devaddr(char *str)
-{
-	if (!g_lorawan_settings.lorawan_enable)
-	{
-		return AT_ERRNO_NOALLOW;
-	}
-	int i;
-	uint8_t len;
-	uint8_t buf[4];
-	uint8_t swap_buf[4];
-
-	len = hex2bin(str, buf, 4);
-	if (len != 4)
-	{
-		return AT_ERRNO_PARA_VAL;
-	}
-
-	for (i = 0; i < 4; i++)
-	{
-		swap_buf[i] = buf[3 - i];
-	}
-
-	memcpy(&g_lorawan_settings.node_dev_addr, swap_buf, 4);
-	save_settings();
-
-	return 0;
-}
-
-/**
- * @brief AT+APPSKEY=? Get application session key
- * 
- * @return int always 0
- */
-static int at_query_appskey(void)
-{
-	uint8_t i;
-	uint8_t len = 0;
-
-	for (i = 0; i < 16; i++)
-	{
-		len += snprintf(g_at_query_buf + len, ATQUERY_SIZE - len, "%02X", g_lorawan_settings.node_apps_key[i]);
-		if (ATQUERY_SIZE <= len)
-		{
-			return -1;
-		}
-	}
-
-	return 0;
-}
-
-/**
- * @brief AT+APPSKEY=<XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX> Set application session key
- * 
- * @return int 0 if App session Key has correct length and was valid HEX
- */
-static int at_exec_appskey(char *str)
-{
-	if (!g_lorawan_settings.lorawan_enable)
-	{
-		return AT_ERRNO_NOALLOW;
-	}
-	uint8_t len;
-	uint8_t buf[16];
-
-	len = hex2bin(str, buf, 16);
-	if (len != 16)
-	{
-		return AT_ERRNO_PARA_VAL;
-	}
-
-	memcpy(g_lorawan_settings.node_apps_key, buf, 16);
-	save_settings();
-
-	return 0;
-}
-
-/**
- * @brief AT+NWSKEY=? Get network session key
- * 
- * @return int always 0
- */
-static int at_query_nwkskey(void)
-{
-	uint8_t i;
-	uint8_t len = 0;
-
-	for (i = 0; i < 16; i++)
-	{
-		len += snprintf(g_at_query_buf + len, ATQUERY_SIZE - len, "%02X", g_lorawan_settings.node_nws_key[i]);
-		if (ATQUERY_SIZE <= len)
-		{
-			return -1;
-		}
-	}
-
-	return 0;
-}
-
-/**
- * @brief AT+NWSKEY=<XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX> Set network session key
- * 
- * @return int 0 if Network session key has correct length and was valid HEX
- */
-static int at_exec_nwkskey(char *str)
-{
-	if (!g_lorawan_settings.lorawan_enable)
-	{
-		return AT_ERRNO_NOALLOW;
-	}
-	uint8_t len;
-	uint8_t buf[16];
-
-	len = hex2bin(str, buf, 16);
-	if (len != 16)
-	{
-		return AT_ERRNO_PARA_VAL;
-	}
-
-	memcpy(g_lorawan_settings.node_nws_key, buf, 16);
-	save_settings();
-
-	return 0;
-}
-
-/**
- * @brief AT+CLASS=? Get device class
- * 
- * @return int always 0
- */
-static int at_query_class(void)
-{
-	snprintf(g_at_query_buf, ATQUERY_SIZE, "%c", g_lorawan_settings.lora_class + 65);
-
-	return 0;
-}
-
-/**
- * @brief AT+CLASS=X Set device class
- * 
- * @param str Class A or C, B not supported
- * @return int if class was valid
- */
-static int at_exec_class(char *str)
-{
-	if (!g_lorawan_settings.lorawan_enable)
-	{
-		return AT_ERRNO_NOALLOW;
-	}
-	uint8_t cls;
-	char *param;
-
-	param = strtok(str, ",");
-	cls = (uint8_t)param[0];
-	// Class B is not supported
-	// if (cls != 'A' && cls != 'B' && cls != 'C')
-	if (cls != 'A' && cls != 'C')
-	{
-		return AT_ERRNO_PARA_VAL;
-	}
-
-	g_lorawan_settings.lora_class = cls - 65;
-	save_settings();
-
-	return 0;
-}
-
-/**
- * @brief AT+NJM=? Get join mode
+ * @brief AT+NJM=? Get join mode
  * 
  * @return int always 0
  */
@@ -1131,6 +595,11 @@ static int at_exec_join(char *str)
 		{
 			return AT_ERRNO_PARA_VAL;
 		}
+		if (!g_lorawan_settings.lorawan_enable && (at_p2p_radio_free() != 0))
+		{
+			// The radio is switched below
+			return AT_ERRNO_NOALLOW;
+		}
 		g_lorawan_settings.auto_join = (autoJoin == 1 ? true : false);
 
 		if (!g_lorawan_settings.lorawan_enable)
@@ -1180,6 +649,11 @@ static int at_exec_join(char *str)
 				g_lorawan_settings.join_trials = nbtrials;
 			}
 		}
+		if (bJoin == 1)
+		{
+			// An explicit join request always starts a new OTAA join
+			lpwan_session_invalidate();
+		}
 		save_settings();
 
 		if ((bJoin == 1) && !g_lorawan_initialized) // ==0 stop join, not support, yet
@@ -1191,15 +665,19 @@ static int at_exec_join(char *str)
 			if (loop_thread != NULL)
 			{
 				APP_LOG("AT", "Request Join");
+				snprintf(g_at_query_buf, ATQUERY_SIZE, "%d", async_start(ASYNC_OP_JOIN, 0));
 				osSignalSet(loop_thread, SIGNAL_JOIN);
 			}
 		}
 
-		if ((bJoin == 1) && g_lorawan_initialized && (lmh_join_status_get() != LMH_SET))
+		if ((bJoin == 1) && g_lorawan_initialized &&
+			((lmh_join_status_get() != LMH_SET) || g_lorawan_settings.otaa_enabled))
 		{
-			// If if not yet joined, start join
+			// If not yet joined or joined with OTAA (e.g. a restored session the network dropped), start join
 			APP_LOG("AT", "Start Join");
+			g_lpwan_has_joined = false;
 			delay(100);
+			snprintf(g_at_query_buf, ATQUERY_SIZE, "%d", async_start(ASYNC_OP_JOIN, 0));
 			lmh_join();
 			return 0;
 		}
@@ -1240,321 +718,744 @@ static int at_query_join_status()
 }
 
 /**
- * @brief AT+CFM=? Get current confirm/unconfirmed packet status
+ * @brief AT+SENDFREQ=? Get current send frequency
  * 
  * @return int always 0
  */
-static int at_query_confirm(void)
+static int at_query_sendfreq(void)
 {
-	snprintf(g_at_query_buf, ATQUERY_SIZE, "%d", g_lorawan_settings.confirmed_msg_enabled);
+	// Return time in seconds, but it is saved in milli seconds
+	snprintf(g_at_query_buf, ATQUERY_SIZE, "%d", (g_lorawan_settings.send_repeat_time == 0) ? 0 : (int)(g_lorawan_settings.send_repeat_time / 1000));
+
 	return 0;
 }
 
 /**
- * @brief AT+CFM=X Set confirmed / unconfirmed packet sending
+ * @brief AT+SENDFREQ=<value> Set current send frequency
  * 
- * @param str 0 = unconfirmed 1 = confirmed packet
- * @return int 0 if correct parameter
+ * @param str send frequency in seconds between 0 (disabled) and 3600
+ * @return int 
  */
-static int at_exec_confirm(char *str)
+static int at_exec_sendfreq(char *str)
 {
-	if (!g_lorawan_settings.lorawan_enable)
-	{
-		return AT_ERRNO_NOALLOW;
-	}
-	int cfm;
+	long time = strtol(str, NULL, 0);
 
-	cfm = strtol(str, NULL, 0);
-	if (cfm != 0 && cfm != 1)
+	if ((time < 0) || (time > 3600))
 	{
 		return AT_ERRNO_PARA_VAL;
 	}
 
-	g_lorawan_settings.confirmed_msg_enabled = (lmh_confirm)cfm;
-	save_settings();
+	g_lorawan_settings.send_repeat_time = time * 1000;
 
-	return 0;
-}
+	if (g_lorawan_settings.send_repeat_time != 0)
+	{
+		TimerStop(&app_timer);
+		TimerSetValue(&app_timer, g_lorawan_settings.send_repeat_time);
+		TimerStart(&app_timer);
+	}
+	else
+	{
+		TimerStop(&app_timer);
+	}
 
-/**
- * @brief AT+DR=? Get current datarate
- * 
- * @return int always 0
- */
-static int at_query_datarate(void)
+	save_settings();
+
+	return 0;
+}
+
+static int at_exec_send(char *str)
 {
-	snprintf(g_at_query_buf, ATQUERY_SIZE, "%d", g_lorawan_settings.data_rate);
+	if (!g_lpwan_has_joined || !g_lorawan_settings.lorawan_enable)
+	{
+		Serial.printf("joined = %s\n", g_lpwan_has_joined ? "true" : "false");
+		Serial.printf("enabled = %s\n", g_lorawan_settings.lorawan_enable ? "true" : "false");
+		return AT_ERRNO_NOALLOW;
+	}
+
+	// Get fPort
+	char *param;
+
+	param = strtok(str, ":");
+	uint16_t fPort = strtol(param, NULL, 0);
+	if ((fPort == 0) || (fPort > 255))
+	{
+		return AT_ERRNO_PARA_VAL;
+	}
+
+	// Get data to send
+	param = strtok(NULL, ":");
+	if (param == NULL)
+	{
+		return AT_ERRNO_PARA_NUM;
+	}
+	int data_size = strlen(param);
+	if (data_size > 254)
+	{
+		return AT_ERRNO_PARA_VAL;
+	}
+
+	data_size = hex_decode(param, data_size, m_lora_app_data_buffer, 256);
+	if (data_size <= 0)
+	{
+		return AT_ERRNO_PARA_VAL;
+	}
+	if (send_lora_packet(m_lora_app_data_buffer, data_size, fPort) != LMH_SUCCESS)
+	{
+		return AT_ERRNO_SYS;
+	}
+	// Reply with the request ID of the packet
+	snprintf(g_at_query_buf, ATQUERY_SIZE, "%d", async_pending(ASYNC_OP_SEND));
 	return 0;
 }
 
 /**
- * @brief AT+DR=X Set datarate
+ * @brief AT+QSEND=<port>:<data> Queue data for sending, also if not joined
  * 
- * @param str 0 to 15, depending on region
- * @return int 0 if correct parameter
+ * @param str fPort and HEX data
+ * @return int 0 if the packet was queued
  */
-static int at_exec_datarate(char *str)
+static int at_exec_qsend(char *str)
 {
 	if (!g_lorawan_settings.lorawan_enable)
 	{
 		return AT_ERRNO_NOALLOW;
 	}
-	uint8_t datarate;
 
-	datarate = strtol(str, NULL, 0);
+	// Get fPort
+	char *param;
 
-	if (datarate > 15)
+	param = strtok(str, ":");
+	uint16_t fPort = strtol(param, NULL, 0);
+	if ((fPort == 0) || (fPort > 255))
 	{
 		return AT_ERRNO_PARA_VAL;
 	}
 
-	g_lorawan_settings.data_rate = datarate;
-	save_settings();
+	// Get data to send
+	param = strtok(NULL, ":");
+	if (param == NULL)
+	{
+		return AT_ERRNO_PARA_NUM;
+	}
+	int data_size = strlen(param);
+	if (data_size > 484)
+	{
+		return AT_ERRNO_PARA_VAL;
+	}
 
+	uint8_t data[242];
+	data_size = hex_decode(param, data_size, data, sizeof(data));
+	if (data_size <= 0)
+	{
+		return AT_ERRNO_PARA_VAL;
+	}
+	if (!uplink_queue_add(data, data_size, fPort))
+	{
+		return AT_ERRNO_PARA_VAL;
+	}
+	// Reply with the number of queued packets
+	snprintf(g_at_query_buf, ATQUERY_SIZE, "%" PRIu32, g_uplink_queue_count);
 	return 0;
 }
 
 /**
- * @brief AT+ADR=? Get current adaptive datarate status
+ * @brief AT+QUEUE=? Get the status of the uplink queue
+ * <queued packets>:<sent packets>:<dropped packets>:<flash page writes>
  * 
  * @return int always 0
  */
-static int at_query_adr(void)
+static int at_query_queue(void)
 {
-	snprintf(g_at_query_buf, ATQUERY_SIZE, "%d", g_lorawan_settings.adr_enabled ? 1 : 0);
+	snprintf(g_at_query_buf, ATQUERY_SIZE, "%" PRIu32 ":%" PRIu32 ":%" PRIu32 ":%" PRIu32, g_uplink_queue_count, g_uplink_queue_sent,
+			 g_uplink_queue_dropped, g_uplink_queue_writes);
 	return 0;
 }
 
 /**
- * @brief AT+ADR=X Enable/disable adaptive datarate
+ * @brief AT+QUEUE=0 Discard all queued packets
  * 
- * @param str 0 = disable, 1 = enable ADR
- * @return int 0 if correct parameter
+ * @param str 0
+ * @return int 0 if the queue was cleared
  */
-static int at_exec_adr(char *str)
+static int at_exec_queue(char *str)
 {
-	if (!g_lorawan_settings.lorawan_enable)
+	if ((str[0] != '0') || (str[1] != 0))
 	{
-		return AT_ERRNO_NOALLOW;
+		return AT_ERRNO_PARA_VAL;
 	}
-	int adr;
+	uplink_queue_clear();
+	return 0;
+}
 
-	adr = strtol(str, NULL, 0);
-	if (adr != 0 && adr != 1)
+/**
+ * @brief AT+RXLOG=? Get the status of the log of received packets
+ * <logging enabled>:<logged packets>:<flash page writes>
+ * 
+ * @return int always 0
+ */
+static int at_query_rxlog(void)
+{
+	snprintf(g_at_query_buf, ATQUERY_SIZE, "%d:%" PRIu32 ":%" PRIu32, g_lorawan_settings.rx_log_enable, g_rx_log_count,
+			 g_rx_log_writes);
+	return 0;
+}
+
+/**
+ * @brief AT+RXLOG=<0|1|2> Disable or enable the log of received packets, 2 erases the log
+ * 
+ * @param str 0, 1 or 2
+ * @return int 0 if the command was accepted
+ */
+static int at_exec_rxlog(char *str)
+{
+	int rxlog = strtol(str, NULL, 0);
+	if ((rxlog < 0) || (rxlog > 2))
 	{
 		return AT_ERRNO_PARA_VAL;
 	}
 
-	g_lorawan_settings.adr_enabled = (adr == 1 ? true : false);
-
+	if (rxlog == 2)
+	{
+		rx_log_clear();
+		return 0;
+	}
+	g_lorawan_settings.rx_log_enable = rxlog;
 	save_settings();
+	return 0;
+}
+
+/**
+ * @brief Print a logged packet
+ * LOG:<boot>:<time>:<fPort>:<frequency>:<SF>:<RSSI>:<SNR>:<size>:<data>
+ * 
+ * @param entry logged packet followed by the payload
+ * @param arg not used
+ */
+static void at_print_rx_log(const s_rx_log_entry *entry, void *arg)
+{
+	AT_PRINTF("LOG:%" PRIu32 ":%" PRIu32 ":%d:%" PRIu32 ":%d:%d:%d:%d:", entry->boot, entry->time, entry->fport, entry->freq, entry->sf,
+			  entry->rssi, entry->snr, entry->size);
+	at_resp_hex(&g_at_resp, (const uint8_t *)entry + sizeof(s_rx_log_entry), entry->len);
+	AT_PRINTF("\r\n");
+}
 
+/**
+ * @brief AT+LOGREAD=? Stream the log of received packets, oldest packet first
+ * 
+ * @return int always 0
+ */
+static int at_query_logread(void)
+{
+	uint32_t count = rx_log_read(at_print_rx_log, NULL);
+	snprintf(g_at_query_buf, ATQUERY_SIZE, "%" PRIu32, count);
 	return 0;
 }
 
 /**
- * @brief AT+TXP=? Get current TX power setting
+ * @brief AT+BATT=? Get current battery value (0 to 255)
  * 
  * @return int always 0
  */
-static int at_query_txpower(void)
+static int at_query_battery(void)
 {
-	snprintf(g_at_query_buf, ATQUERY_SIZE, "%d", g_lorawan_settings.tx_power);
+	// Battery level is from 1 to 254, 254 meaning fully charged.
+	snprintf(g_at_query_buf, ATQUERY_SIZE, "%d", get_lora_batt());
+
 	return 0;
 }
 
 /**
- * @brief AT+TXP Set TX power
+ * @brief AT+RSSI=? Get RSSI of last received package
  * 
- * @param str TX power 0 to 10
  * @return int always 0
  */
-static int at_exec_txpower(char *str)
+static int at_query_rssi(void)
 {
-	if (!g_lorawan_settings.lorawan_enable)
-	{
-		return AT_ERRNO_NOALLOW;
-	}
-	uint8_t tx_power;
+	snprintf(g_at_query_buf, ATQUERY_SIZE, "%d", g_last_rssi);
 
-	tx_power = strtol(str, NULL, 0);
+	return 0;
+}
 
-	if (tx_power > 10)
-	{
-		return AT_ERRNO_PARA_VAL;
-	}
+/**
+ * @brief AT+SNR=? Get SNR of last received package
+ * 
+ * @return int always 0
+ */
+static int at_query_snr(void)
+{
+	snprintf(g_at_query_buf, ATQUERY_SIZE, "%d", g_last_snr);
 
-	g_lorawan_settings.tx_power = tx_power;
+	return 0;
+}
 
-	save_settings();
+/**
+ * @brief AT+RXQUEUE=? Get the status of the queue of received packets
+ * <received packets>:<packets lost because the queue was full>:<packets waiting to be reported>
+ * 
+ * @return int always 0
+ */
+static int at_query_rxqueue(void)
+{
+	snprintf(g_at_query_buf, ATQUERY_SIZE, "%" PRIu32 ":%" PRIu32 ":%d", g_rx_queue_received, g_rx_queue_overflows, rx_queue_pending());
 
 	return 0;
 }
 
 /**
- * @brief AT+SENDFREQ=? Get current send frequency
+ * @brief AT+VER=? Get firmware version and build date
  * 
  * @return int always 0
  */
-static int at_query_sendfreq(void)
+static int at_query_version(void)
 {
-	// Return time in seconds, but it is saved in milli seconds
-	snprintf(g_at_query_buf, ATQUERY_SIZE, "%d", (g_lorawan_settings.send_repeat_time == 0) ? 0 : (int)(g_lorawan_settings.send_repeat_time / 1000));
+	snprintf(g_at_query_buf, ATQUERY_SIZE, "%d.%d.%d %s %s", g_sw_ver_1, g_sw_ver_2, g_sw_ver_3, __DATE__, __TIME__);
 
 	return 0;
 }
 
 /**
- * @brief AT+SENDFREQ=<value> Set current send frequency
+ * @brief ATZ Initiate a system reset
  * 
- * @param str send frequency in seconds between 0 (disabled) and 3600
- * @return int 
+ * @return int always 0
  */
-static int at_exec_sendfreq(char *str)
+static int at_exec_reboot(void)
 {
-	long time = strtol(str, NULL, 0);
+	// Do not lose changed settings, queued and logged packets that are not written yet
+	settings_flush();
+	uplink_queue_flush();
+	rx_log_flush();
+	delay(100);
+	NVIC_SystemReset();
+	return 0;
+}
 
-	if ((time < 0) || (time > 3600))
-	{
-		return AT_ERRNO_PARA_VAL;
-	}
+static int at_query_status(void)
+{
+	at_settings();
+	snprintf(g_at_query_buf, ATQUERY_SIZE, " ");
 
-	g_lorawan_settings.send_repeat_time = time * 1000;
+	return 0;
+}
 
-	if (g_lorawan_settings.send_repeat_time != 0)
+/**
+ * @brief ATR Restore flash defaults
+ * 
+ * @return int always 0
+ */
+static int at_exec_restore(void)
+{
+	lpwan_session_invalidate();
+	flash_reset();
+	at_init_ports();
+	serial1_set_baud(g_lorawan_settings.at_baudrate, g_lorawan_settings.at_flow_control);
+	return 0;
+}
+
+/**
+ * @brief AT+BINMODE=? Get binary mode status of the port
+ * 
+ * @return int always 0
+ */
+static int at_query_binmode(void)
+{
+	snprintf(g_at_query_buf, ATQUERY_SIZE, "%d", bin_mode_active(g_at_cmd_port) ? 1 : 0);
+	return 0;
+}
+
+/**
+ * @brief AT+BINMODE=X Switch the port to binary framed mode or back to ASCII
+ * 
+ * @param str 0 = ASCII AT commands, 1 = binary frames
+ * @return int 0 if correct parameter
+ */
+static int at_exec_binmode(char *str)
+{
+	if (g_at_cmd_port >= AT_PORT_NUM)
 	{
-		TimerStop(&app_timer);
-		TimerSetValue(&app_timer, g_lorawan_settings.send_repeat_time);
-		TimerStart(&app_timer);
+		return AT_ERRNO_NOALLOW;
+	}
+	if (str[0] == '0')
+	{
+		bin_mode_stop(g_at_cmd_port);
+	}
+	else if (str[0] == '1')
+	{
+		bin_mode_start(g_at_cmd_port);
 	}
 	else
 	{
-		TimerStop(&app_timer);
+		return AT_ERRNO_PARA_VAL;
 	}
+	return 0;
+}
 
+/**
+ * @brief Switch the echo of the requesting port and save it as default
+ * 
+ * @param echo 0 => echo off, 1 => echo on
+ * @return int always 0
+ */
+static int at_set_echo(uint8_t echo)
+{
+	if (g_at_cmd_port < AT_PORT_NUM)
+	{
+		g_at_ports[g_at_cmd_port].echo = echo;
+	}
+	g_lorawan_settings.at_echo = echo;
 	save_settings();
-
 	return 0;
 }
 
-static int at_exec_send(char *str)
+static int at_exec_echo_off(void)
 {
-	if (!g_lpwan_has_joined || !g_lorawan_settings.lorawan_enable)
+	return at_set_echo(0);
+}
+
+static int at_exec_echo_on(void)
+{
+	return at_set_echo(1);
+}
+
+/**
+ * @brief Switch the result codes of the requesting port and save it as default
+ * 
+ * @param verbose 0 => numeric result codes, 1 => verbose text result codes
+ * @return int always 0
+ */
+static int at_set_verbose(uint8_t verbose)
+{
+	if (g_at_cmd_port < AT_PORT_NUM)
 	{
-		Serial.printf("joined = %s\n", g_lpwan_has_joined ? "true" : "false");
-		Serial.printf("enabled = %s\n", g_lorawan_settings.lorawan_enable ? "true" : "false");
-		return AT_ERRNO_NOALLOW;
+		g_at_ports[g_at_cmd_port].verbose = verbose;
 	}
+	g_lorawan_settings.at_verbose = verbose;
+	save_settings();
+	return 0;
+}
 
-	// Get fPort
+static int at_exec_numeric(void)
+{
+	return at_set_verbose(0);
+}
+
+static int at_exec_verbose(void)
+{
+	return at_set_verbose(1);
+}
+
+/**
+ * @brief Get baud rate and flow control of Serial1
+ * 
+ * @return int always 0
+ */
+static int at_query_baud(void)
+{
+	uint32_t baud;
+	uint8_t flow_control;
+	serial1_get_baud(&baud, &flow_control);
+	snprintf(g_at_query_buf, ATQUERY_SIZE, "%" PRIu32 ":%d", baud, flow_control);
+	return 0;
+}
+
+/**
+ * @brief Set baud rate and optional RTS/CTS flow control of Serial1
+ * 
+ * @param str <baudrate>[:<flow control 0|1>]
+ * @return int 0 if the change was requested
+ */
+static int at_exec_baud(char *str)
+{
 	char *param;
+	long flow_control = 0;
 
 	param = strtok(str, ":");
-	uint16_t fPort = strtol(param, NULL, 0);
-	if ((fPort == 0) || (fPort > 255))
+	if (param == NULL)
 	{
-		return AT_ERRNO_PARA_VAL;
+		return AT_ERRNO_PARA_NUM;
 	}
-
-	// Get data to send
-	param = strtok(NULL, ":");
-	int data_size = strlen(param);
-	if (!(data_size % 2 == 0) || (data_size > 254))
+	long baud = strtol(param, NULL, 0);
+	if (!serial1_baud_valid(baud))
 	{
 		return AT_ERRNO_PARA_VAL;
 	}
 
-	int buff_idx = 0;
-	char buff_parse[3];
-	for (int idx = 0; idx <= data_size + 1; idx += 2)
+	param = strtok(NULL, ":");
+	if (param != NULL)
 	{
-		buff_parse[0] = param[idx];
-		buff_parse[1] = param[idx + 1];
-		buff_parse[2] = 0;
-		m_lora_app_data_buffer[buff_idx] = strtol(buff_parse, NULL, 16);
-		buff_idx++;
+		flow_control = strtol(param, NULL, 0);
+		if ((flow_control != 0) && (flow_control != 1))
+		{
+			return AT_ERRNO_PARA_VAL;
+		}
 	}
-	send_lora_packet(m_lora_app_data_buffer, data_size / 2, fPort);
+
+	serial1_set_baud(baud, flow_control);
 	return 0;
 }
 
 /**
- * @brief AT+BATT=? Get current battery value (0 to 255)
+ * @brief Get the statistics of the settings storage
+ * <save requests>:<sector erases>:<sector erases avoided>:<records in the settings log>:<boot replay time in us>
  * 
  * @return int always 0
  */
-static int at_query_battery(void)
+static int at_query_save(void)
 {
-	// Battery level is from 1 to 254, 254 meaning fully charged.
-	snprintf(g_at_query_buf, ATQUERY_SIZE, "%d", get_lora_batt());
+	uint32_t requests = g_settings_save_requests;
+	uint32_t erases = g_settings_erases;
+	snprintf(g_at_query_buf, ATQUERY_SIZE, "%" PRIu32 ":%" PRIu32 ":%" PRIu32 ":%" PRIu32 ":%" PRIu32, requests, erases,
+			 requests > erases ? requests - erases : 0, g_settings_log_records, g_settings_boot_time);
+	return 0;
+}
 
+/**
+ * @brief Write changed settings to the flash now
+ * 
+ * @return int always 0
+ */
+static int at_exec_save(void)
+{
+	settings_flush();
 	return 0;
 }
 
 /**
- * @brief AT+RSSI=? Get RSSI of last received package
+ * @brief Get the statistics of the flash operations
+ * <longest interrupt blackout in us>:<longest blackout with busy radio in us>:<erases that waited for the radio>:
+ * <erases with busy radio>:<pending erase jobs>:<erased sectors>:<programmed pages>:<sum of all blackouts in us>
  * 
  * @return int always 0
  */
-static int at_query_rssi(void)
+static int at_query_flash(void)
 {
-	snprintf(g_at_query_buf, ATQUERY_SIZE, "%d", g_last_rssi);
+	snprintf(g_at_query_buf, ATQUERY_SIZE, "%" PRIu32 ":%" PRIu32 ":%" PRIu32 ":%" PRIu32 ":%d:%" PRIu32 ":%" PRIu32 ":%" PRIu32, g_flash_blackout_max, g_flash_blackout_radio,
+			 g_flash_erase_deferred, g_flash_erase_forced, flash_jobs_pending(),
+			 g_flash_erases, g_flash_programs, g_flash_blackout_total);
+	return 0;
+}
 
+/**
+ * @brief AT+FLASH=0 Reset the statistics of the flash operations
+ * 
+ * @param str 0
+ * @return int 0 if the statistics were reset
+ */
+static int at_exec_flash(char *str)
+{
+	if ((str[0] != '0') || (str[1] != 0))
+	{
+		return AT_ERRNO_PARA_VAL;
+	}
+	g_flash_blackout_max = 0;
+	g_flash_blackout_radio = 0;
+	g_flash_erase_deferred = 0;
+	g_flash_erase_forced = 0;
+	g_flash_erases = 0;
+	g_flash_programs = 0;
+	g_flash_blackout_total = 0;
 	return 0;
 }
 
 /**
- * @brief AT+SNR=? Get SNR of last received package
+ * @brief AT+PCAD=? Get the statistics of the P2P listen before talk
+ * <CAD with free channel>:<CAD with busy channel>:<packets dropped after all retries>
  * 
  * @return int always 0
  */
-static int at_query_snr(void)
+static int at_query_p2p_cad(void)
 {
-	snprintf(g_at_query_buf, ATQUERY_SIZE, "%d", g_last_snr);
+	snprintf(g_at_query_buf, ATQUERY_SIZE, "%" PRIu32 ":%" PRIu32 ":%" PRIu32, g_p2p_cad_clear, g_p2p_cad_busy, g_p2p_lbt_dropped);
+	return 0;
+}
+
+/**
+ * @brief AT+PCAD=0 Reset the statistics of the P2P listen before talk
+ * 
+ * @param str 0
+ * @return int 0 if the statistics were reset
+ */
+static int at_exec_p2p_cad(char *str)
+{
+	if ((str[0] != '0') || (str[1] != 0))
+	{
+		return AT_ERRNO_PARA_VAL;
+	}
+	g_p2p_cad_clear = 0;
+	g_p2p_cad_busy = 0;
+	g_p2p_lbt_dropped = 0;
+	return 0;
+}
 
+/**
+ * @brief AT+TOA=<length> Calculate the time on air of a P2P packet with the current P2P settings
+ * 
+ * @param str payload length 1 .. 255
+ * @return int 0 if the length was valid
+ */
+static int at_exec_toa(char *str)
+{
+	char *end;
+	long len = strtol(str, &end, 10);
+	if ((end == str) || (*end != 0) || (len < 1) || (len > 255))
+	{
+		return AT_ERRNO_PARA_VAL;
+	}
+	snprintf(g_at_query_buf, ATQUERY_SIZE, "%" PRIu32, p2p_time_on_air(len));
 	return 0;
 }
 
 /**
- * @brief AT+VER=? Get firmware version and build date
+ * @brief AT+PAIRTIME=? Get the P2P time on air of the last hour
+ * <used time on air>:<reserved for queued packets>:<remaining budget>, all in milliseconds
  * 
  * @return int always 0
  */
-static int at_query_version(void)
+static int at_query_airtime(void)
 {
-	snprintf(g_at_query_buf, ATQUERY_SIZE, "%d.%d.%d %s %s", g_sw_ver_1, g_sw_ver_2, g_sw_ver_3, __DATE__, __TIME__);
+	snprintf(g_at_query_buf, ATQUERY_SIZE, "%" PRIu32 ":%" PRIu32 ":%" PRIu32, airtime_used(), airtime_reserved(), airtime_remaining());
+	return 0;
+}
+
+/**
+ * @brief AT+PHOP=? Get the P2P hopping configuration
+ * 0 if hopping is disabled, else <seed>:<reset time>:<frequency 1>:...:<frequency n>
+ * 
+ * @return int always 0
+ */
+static int at_query_p2p_hop(void)
+{
+	if (g_lorawan_settings.p2p_hop_num == 0)
+	{
+		snprintf(g_at_query_buf, ATQUERY_SIZE, "0");
+		return 0;
+	}
+	uint16_t len = snprintf(g_at_query_buf, ATQUERY_SIZE, "%08" PRIX32 ":%d", g_lorawan_settings.p2p_hop_seed,
+							g_lorawan_settings.p2p_hop_reset);
+	for (uint8_t idx = 0; idx < g_lorawan_settings.p2p_hop_num; idx++)
+	{
+		len += snprintf(&g_at_query_buf[len], ATQUERY_SIZE - len, ":%" PRIu32, g_lorawan_settings.p2p_hop_freq[idx]);
+	}
+	return 0;
+}
+
+/**
+ * @brief AT+PHOP=<seed>:<reset time>:<frequency 1>:...:<frequency n> Enable P2P frequency hopping
+ * AT+PHOP=0 disables hopping. The settings are only changed if all parameters are valid
+ * 
+ * @param str parameters
+ * @return int 0 if the parameters were valid
+ */
+static int at_exec_p2p_hop(char *str)
+{
+	if (g_lorawan_settings.lorawan_enable)
+	{
+		return AT_ERRNO_NOALLOW;
+	}
+	int ret = at_p2p_radio_free();
+	if (ret != 0)
+	{
+		return ret;
+	}
+
+	s_lorawan_settings check_settings = g_lorawan_settings;
+	if (strcmp(str, "0") == 0)
+	{
+		check_settings.p2p_hop_num = 0;
+	}
+	else
+	{
+		char *end;
+		// Seed, up to 8 hex digits
+		char *param = strtok(str, ":");
+		if ((param == NULL) || (strlen(param) > 8))
+		{
+			return AT_ERRNO_PARA_VAL;
+		}
+		check_settings.p2p_hop_seed = strtoul(param, &end, 16);
+		if (*end != 0)
+		{
+			return AT_ERRNO_PARA_VAL;
+		}
+
+		// Reset time in seconds
+		param = strtok(NULL, ":");
+		if (param == NULL)
+		{
+			return AT_ERRNO_PARA_NUM;
+		}
+		uint32_t reset = strtoul(param, &end, 10);
+		if ((end == param) || (*end != 0) || (reset > 3600))
+		{
+			return AT_ERRNO_PARA_VAL;
+		}
+		check_settings.p2p_hop_reset = reset;
+
+		// Channel frequencies, checked like AT+PFREQ
+		const s_setting *freq_setting = setting_find("+PFREQ");
+		uint8_t num = 0;
+		while ((param = strtok(NULL, ":")) != NULL)
+		{
+			if (num == P2P_HOP_MAX)
+			{
+				return AT_ERRNO_PARA_NUM;
+			}
+			if (!setting_parse(freq_setting, param, &check_settings))
+			{
+				return AT_ERRNO_PARA_VAL;
+			}
+			check_settings.p2p_hop_freq[num++] = check_settings.p2p_frequency;
+		}
+		if (num < 2)
+		{
+			return AT_ERRNO_PARA_NUM;
+		}
+		check_settings.p2p_hop_num = num;
+	}
 
+	g_lorawan_settings.p2p_hop_num = check_settings.p2p_hop_num;
+	g_lorawan_settings.p2p_hop_reset = check_settings.p2p_hop_reset;
+	g_lorawan_settings.p2p_hop_seed = check_settings.p2p_hop_seed;
+	memcpy(g_lorawan_settings.p2p_hop_freq, check_settings.p2p_hop_freq, sizeof(g_lorawan_settings.p2p_hop_freq));
+	save_settings();
+
+	// Start the sequence with the first channel
+	set_new_config();
 	return 0;
 }
 
 /**
- * @brief ATZ Initiate a system reset
+ * @brief AT+PHOPSTAT=? Get the packet statistics of the P2P channels
+ * One line CH:<channel>:<frequency>:<sent>:<received>:<busy CAD>:<CRC errors> per channel,
+ * followed by <position in the hopping sequence>:<current channel>
  * 
  * @return int always 0
  */
-static int at_exec_reboot(void)
-{
-	delay(100);
-	NVIC_SystemReset();
-	return 0;
-}
-
-static int at_query_status(void)
+static int at_query_p2p_hop_stats(void)
 {
-	at_settings();
-	snprintf(g_at_query_buf, ATQUERY_SIZE, " ");
-
+	uint8_t num = g_lorawan_settings.p2p_hop_num != 0 ? g_lorawan_settings.p2p_hop_num : 1;
+	for (uint8_t idx = 0; idx < num; idx++)
+	{
+		AT_PRINTF("CH:%d:%" PRIu32 ":%" PRIu32 ":%" PRIu32 ":%" PRIu32 ":%" PRIu32 "\r\n", idx,
+				  g_lorawan_settings.p2p_hop_num != 0 ? g_lorawan_settings.p2p_hop_freq[idx] : g_lorawan_settings.p2p_frequency,
+				  g_hop_stats[idx].tx, g_hop_stats[idx].rx, g_hop_stats[idx].busy, g_hop_stats[idx].crc);
+	}
+	snprintf(g_at_query_buf, ATQUERY_SIZE, "%" PRIu32 ":%d", p2p_hop_index(), p2p_hop_channel());
 	return 0;
 }
 
 /**
- * @brief ATR Restore flash defaults
+ * @brief AT+PHOPSTAT=0 Reset the packet statistics of the P2P channels
  * 
- * @return int always 0
+ * @param str 0
+ * @return int 0 if the statistics were reset
  */
-static int at_exec_restore(void)
+static int at_exec_p2p_hop_stats(char *str)
 {
-	flash_reset();
+	if ((str[0] != '0') || (str[1] != 0))
+	{
+		return AT_ERRNO_PARA_VAL;
+	}
+	memset(g_hop_stats, 0, sizeof(s_hop_stats) * P2P_HOP_MAX);
 	return 0;
 }
 
@@ -1564,52 +1465,161 @@ static int at_exec_list_all(void);
  * @brief List of all available commands with short help and pointer to functions
  * 
  */
-static atcmd_t g_at_cmd_list[] = {
+static constexpr atcmd_t g_at_cmd_list[] = {
 	/*|    CMD    |     AT+CMD?      |    AT+CMD=?    |  AT+CMD=value |  AT+CMD  |*/
 	// General commands
 	{"?", "AT commands", NULL, NULL, at_exec_list_all},
 	{"R", "Restore default", NULL, NULL, at_exec_restore},
 	{"Z", "Trig a MCU reset", NULL, NULL, at_exec_reboot},
+	{"E0", "Echo off", NULL, NULL, at_exec_echo_off},
+	{"E1", "Echo on", NULL, NULL, at_exec_echo_on},
+	{"V0", "Numeric result codes", NULL, NULL, at_exec_numeric},
+	{"V1", "Verbose result codes", NULL, NULL, at_exec_verbose},
+	{"+SAVE", "Write changed settings to flash", at_query_save, NULL, at_exec_save},
+	{"+FLASH", "Get or reset the flash operation statistics", at_query_flash, at_exec_flash, NULL},
 	// LoRaWAN keys, ID's EUI's
-	{"+APPEUI", "Get or set the application EUI", at_query_appeui, at_exec_appeui, NULL},
-	{"+APPKEY", "Get or set the application key", at_query_appkey, at_exec_appkey, NULL},
-	{"+DEVEUI", "Get or set the device EUI", at_query_deveui, at_exec_deveui, NULL},
-	{"+APPSKEY", "Get or set the application session key", at_query_appskey, at_exec_appskey, NULL},
-	{"+NWKSKEY", "Get or Set the network session key", at_query_nwkskey, at_exec_nwkskey, NULL},
-	{"+DEVADDR", "Get or set the device address", at_query_devaddr, at_exec_devaddr, NULL},
+	{"+APPEUI", "Get or set the application EUI", at_query_setting, at_exec_setting, NULL},
+	{"+APPKEY", "Get or set the application key", at_query_setting, at_exec_setting, NULL},
+	{"+DEVEUI", "Get or set the device EUI", at_query_setting, at_exec_setting, NULL},
+	{"+APPSKEY", "Get or set the application session key", at_query_setting, at_exec_setting, NULL},
+	{"+NWKSKEY", "Get or Set the network session key", at_query_setting, at_exec_setting, NULL},
+	{"+DEVADDR", "Get or set the device address", at_query_setting, at_exec_setting, NULL},
 	// Joining and sending data on LoRa network
-	{"+CFM", "Get or set the confirm mode", at_query_confirm, at_exec_confirm, NULL},
+	{"+CFM", "Get or set the confirm mode", at_query_setting, at_exec_setting, NULL},
 	{"+JOIN", "Join network", at_query_join, at_exec_join, NULL},
 	{"+NJS", "Get the join status", at_query_join_status, NULL, NULL},
-	{"+NJM", "Get or set the network join mode", at_query_joinmode, at_exec_joinmode, NULL},
+	{"+NJM", "Get or set the network join mode", at_query_setting, at_exec_setting, NULL},
 	{"+SENDFREQ", "Get or Set the automatic send time", at_query_sendfreq, at_exec_sendfreq, NULL},
 	{"+SEND", "Send data", NULL, at_exec_send, NULL},
+	{"+QSEND", "Queue data for sending", NULL, at_exec_qsend, NULL},
+	{"+QUEUE", "Get the status of or clear the uplink queue", at_query_queue, at_exec_queue, NULL},
+	{"+RXLOG", "Get or set the log of received packets", at_query_rxlog, at_exec_rxlog, NULL},
+	{"+LOGREAD", "Read the log of received packets", at_query_logread, NULL, NULL},
 	// LoRa network management
-	{"+ADR", "Get or set the adaptive data rate setting", at_query_adr, at_exec_adr, NULL},
-	{"+CLASS", "Get or set the device class", at_query_class, at_exec_class, NULL},
-	{"+DR", "Get or Set the Tx DataRate=[0..7]", at_query_datarate, at_exec_datarate, NULL},
-	{"+TXP", "Get or set the transmit power", at_query_txpower, at_exec_txpower, NULL},
-	{"+BAND", "Get and Set number corresponding to active regions", at_query_region, at_exec_region, NULL},
+	{"+ADR", "Get or set the adaptive data rate setting", at_query_setting, at_exec_setting, NULL},
+	{"+CLASS", "Get or set the device class", at_query_setting, at_exec_setting, NULL},
+	{"+DR", "Get or Set the Tx DataRate=[0..7]", at_query_setting, at_exec_setting, NULL},
+	{"+TXP", "Get or set the transmit power", at_query_setting, at_exec_setting, NULL},
+	{"+BAND", "Get and Set number corresponding to active regions", at_query_setting, at_exec_setting, NULL},
 	{"+MASK", "Get and Set channels mask", at_query_mask, at_exec_mask, NULL},
 	// Status queries
 	{"+BAT", "Get battery level", at_query_battery, NULL, NULL},
 	{"+RSSI", "Last RX packet RSSI", at_query_rssi, NULL, NULL},
 	{"+SNR", "Last RX packet SNR", at_query_snr, NULL, NULL},
+	{"+RXQUEUE", "Get the status of the receive queue", at_query_rxqueue, NULL, NULL},
 	{"+VER", "Get SW version", at_query_version, NULL, NULL},
 	{"+STATUS", "Show LoRaWAN status", at_query_status, NULL, NULL},
+	{"+BINMODE", "Switch to binary framed mode", at_query_binmode, at_exec_binmode, NULL},
+	{"+BAUD", "Get or set Serial1 baudrate and flow control", at_query_baud, at_exec_baud, NULL},
 	// LoRa P2P management
 	{"+NWM", "Switch LoRa workmode", at_query_mode, at_exec_mode, NULL},
-	{"+PFREQ", "Set P2P frequency", at_query_p2p_freq, at_exec_p2p_freq, NULL},
-	{"+PSF", "Set P2P spreading factor", at_query_p2p_sf, at_exec_p2p_sf, NULL},
-	{"+PBW", "Set P2P bandwidth", at_query_p2p_bw, at_exec_p2p_bw, NULL},
-	{"+PCR", "Set P2P coding rate", at_query_p2p_cr, at_exec_p2p_cr, NULL},
-	{"+PPL", "Set P2P preamble length", at_query_p2p_pl, at_exec_p2p_pl, NULL},
-	{"+PTP", "Set P2P TX power", at_query_p2p_txp, at_exec_p2p_txp, NULL},
+	{"+PFREQ", "Set P2P frequency", at_query_setting, at_exec_setting, NULL},
+	{"+PSF", "Set P2P spreading factor", at_query_setting, at_exec_setting, NULL},
+	{"+PBW", "Set P2P bandwidth", at_query_setting, at_exec_setting, NULL},
+	{"+PCR", "Set P2P coding rate", at_query_setting, at_exec_setting, NULL},
+	{"+PPL", "Set P2P preamble length", at_query_setting, at_exec_setting, NULL},
+	{"+PTP", "Set P2P TX power", at_query_setting, at_exec_setting, NULL},
 	{"+P2P", "Set P2P configuration", at_query_p2p_config, at_exec_p2p_config, NULL},
-	{"+PSEND", "P2P send data", NULL, at_exec_p2p_send, NULL},
+	{"+PCADR", "Set P2P CAD retries", at_query_setting, at_exec_setting, NULL},
+	{"+PBACKOFF", "Set P2P backoff time", at_query_setting, at_exec_setting, NULL},
+	{"+PCAD", "Get or reset the P2P CAD statistics", at_query_p2p_cad, at_exec_p2p_cad, NULL},
+	{"+PBUDGET", "Set P2P airtime budget per hour", at_query_setting, at_exec_setting, NULL},
+	{"+PAIRTIME", "Get the P2P airtime of the last hour", at_query_airtime, NULL, NULL},
+	{"+TOA", "Calculate the P2P time on air", NULL, at_exec_toa, NULL},
+	{"+PHOP", "Set P2P frequency hopping", at_query_p2p_hop, at_exec_p2p_hop, NULL},
+	{"+PHOPSTAT", "Get or reset the P2P channel statistics", at_query_p2p_hop_stats, at_exec_p2p_hop_stats, NULL},
+	{"+PSEND", "P2P send data", at_query_p2p_send, at_exec_p2p_send, NULL},
 	{"+PRECV", "P2P receive mode", at_query_p2p_receive, at_exec_p2p_receive, NULL},
 };
 
+/** Number of commands in g_at_cmd_list */
+#define AT_CMD_NUM (sizeof(g_at_cmd_list) / sizeof(atcmd_t))
+
+/**
+ * @brief FNV-1a hash of a command name
+ * 
+ * @param name command name, not 0 terminated
+ * @param len length of the command name
+ * @return uint32_t hash value
+ */
+static constexpr uint32_t at_hash(const char *name, uint16_t len)
+{
+	uint32_t hash = 2166136261UL;
+	for (uint16_t idx = 0; idx < len; idx++)
+	{
+		hash = (hash ^ (uint8_t)name[idx]) * 16777619UL;
+	}
+	return hash;
+}
+
+/** Command hash table, open addressing with linear probing */
+struct at_hash_table_s
+{
+	// Index into g_at_cmd_list, AT_HASH_EMPTY for unused slots
+	uint8_t slot[AT_HASH_SIZE];
+	// Precomputed length of the command names
+	uint8_t name_len[AT_CMD_NUM];
+};
+
+/**
+ * @brief Build the command hash table from g_at_cmd_list
+ * 
+ * @return at_hash_table_s hash table
+ */
+static constexpr at_hash_table_s at_build_hash_table(void)
+{
+	at_hash_table_s table = {};
+	for (uint16_t idx = 0; idx < AT_HASH_SIZE; idx++)
+	{
+		table.slot[idx] = AT_HASH_EMPTY;
+	}
+	for (uint16_t idx = 0; idx < AT_CMD_NUM; idx++)
+	{
+		uint8_t len = 0;
+		while (g_at_cmd_list[idx].cmd_name[len] != 0)
+		{
+			len++;
+		}
+		table.name_len[idx] = len;
+
+		uint16_t slot = at_hash(g_at_cmd_list[idx].cmd_name, len) & (AT_HASH_SIZE - 1);
+		while (table.slot[slot] != AT_HASH_EMPTY)
+		{
+			slot = (slot + 1) & (AT_HASH_SIZE - 1);
+		}
+		table.slot[slot] = idx;
+	}
+	return table;
+}
+
+static_assert(AT_CMD_NUM * 2 <= AT_HASH_SIZE, "AT_HASH_SIZE too small for the command list");
+static_assert(AT_CMD_NUM < AT_HASH_EMPTY, "Too many AT commands");
+
+/** Command hash table, generated at compile time */
+static constexpr at_hash_table_s g_at_cmd_hash = at_build_hash_table();
+
+/**
+ * @brief Find a command in the command list
+ * 
+ * @param name command name, not 0 terminated
+ * @param len length of the command name
+ * @return int index into g_at_cmd_list, -1 if not found
+ */
+static int at_find_cmd(const char *name, uint16_t len)
+{
+	uint16_t slot = at_hash(name, len) & (AT_HASH_SIZE - 1);
+	while (g_at_cmd_hash.slot[slot] != AT_HASH_EMPTY)
+	{
+		uint8_t idx = g_at_cmd_hash.slot[slot];
+		if ((g_at_cmd_hash.name_len[idx] == len) && (memcmp(g_at_cmd_list[idx].cmd_name, name, len) == 0))
+		{
+			return idx;
+		}
+		slot = (slot + 1) & (AT_HASH_SIZE - 1);
+	}
+	return -1;
+}
+
 /**
  * @brief List all available commands with short help
  * 
@@ -1621,9 +1631,9 @@ static int at_exec_list_all(void)
 	AT_PRINTF("AT command list\r\n");
 	AT_PRINTF("+++++++++++++++\r\n");
 
-	for (unsigned int idx = 0; idx < (sizeof(g_at_cmd_list)) / sizeof(atcmd_t); idx++)
+	for (unsigned int idx = 0; idx < AT_CMD_NUM; idx++)
 	{
-		if (idx < 4)
+		if (g_at_cmd_hash.name_len[idx] < 3)
 		{
 			AT_PRINTF("AT%s\t\t%s\r\n", g_at_cmd_list[idx].cmd_name, g_at_cmd_list[idx].cmd_desc);
 		}
@@ -1637,13 +1647,124 @@ static int at_exec_list_all(void)
 }
 
 /**
- * @brief Handle received AT command
+ * @brief Check if a port uses verbose text result codes
+ * 
+ * @param port AT port
+ * @return true verbose text result codes
+ * @return false numeric result codes
+ */
+static bool at_port_verbose(uint8_t port)
+{
+	if (port >= AT_PORT_NUM)
+	{
+		return true;
+	}
+	return g_at_ports[port].verbose;
+}
+
+/**
+ * @brief Print the information text and the result code of a command
+ * Verbose:  \r\n<info>\r\nOK\r\n or \r\n+CME ERROR:<code>\r\n
+ * Numeric:  <info>\r\n<code>\r\n with code 0 for OK
+ * With a sequence tag, the result code is preceded by #<tag> and a space
+ * 
+ * @param ret result of the command
+ * @param info information text, NULL if there is none
+ * @param verbose true for verbose text result codes
+ * @param tag sequence tag of the command, -1 if there is none
+ */
+static void at_print_result(int ret, const char *info, bool verbose, int32_t tag)
+{
+	if (verbose)
+	{
+		if (info != NULL)
+		{
+			AT_PRINTF("\r\n%s", info);
+		}
+		AT_PRINTF("\r\n");
+	}
+	else if (info != NULL)
+	{
+		AT_PRINTF("%s\r\n", info);
+	}
+
+	if (tag >= 0)
+	{
+		AT_PRINTF("#%" PRId32 " ", tag);
+	}
+
+	if (!verbose)
+	{
+		AT_PRINTF("%x\r\n", ret);
+	}
+	else if (ret == 0)
+	{
+		AT_PRINTF("OK\r\n");
+	}
+	else
+	{
+		AT_PRINTF("%s%x\r\n", AT_ERROR, ret);
+	}
+}
+
+/**
+ * @brief Read the optional sequence tag #<number> at the start of a command
+ * 
+ * @param cmd command after "AT"
+ * @param tag receives the tag, -1 if there is none
+ * @param digits receives the number of digits of the tag
+ * @return uint16_t length of the tag including '#', 0 if there is none
+ */
+static uint16_t at_parse_tag(const char *cmd, int32_t *tag, uint16_t *digits)
+{
+	*tag = -1;
+	*digits = 0;
+	if (cmd[0] != '#')
+	{
+		return 0;
+	}
+
+	*tag = 0;
+	uint16_t len = 1;
+	while ((cmd[len] >= '0') && (cmd[len] <= '9'))
+	{
+		if (*digits < AT_TAG_DIGITS)
+		{
+			*tag = *tag * 10 + (cmd[len] - '0');
+		}
+		(*digits)++;
+		len++;
+	}
+	return len;
+}
+
+/**
+ * @brief Send the response of the command in progress and release the parser
  * 
  */
-static void at_cmd_handle(void)
+static void at_cmd_done(void)
+{
+	at_resp_flush(&g_at_resp);
+	g_at_resp.sink = NULL;
+	g_at_cmd_port = AT_PORT_NUM;
+
+	// Baud rate changes are applied after the reply was sent
+	serial1_baud_apply();
+	g_at_cmd_lock.unlock();
+}
+
+/**
+ * @brief Execute an AT command line
+ * 
+ * @param atcmd command line including "AT", 0 terminated. The buffer must be ATCMD_SIZE long, it is used for the reply
+ * @param atcmd_index length of the command line
+ * @param sink output for the reply
+ * @param port port the command was received on
+ */
+void at_cmd_exec(char *atcmd, uint16_t atcmd_index, Print *sink, uint8_t port)
 {
-	uint8_t i;
 	int ret = 0;
+	bool has_info = false;
 	const char *cmd_name;
 	char *rxcmd = atcmd + 2;
 	int16_t tmp = atcmd_index - 2;
@@ -1651,66 +1772,106 @@ static void at_cmd_handle(void)
 
 	if (atcmd_index < 2 || rxcmd[tmp] != '\0')
 	{
-		atcmd_index = 0;
-		memset(atcmd, 0xff, ATCMD_SIZE);
 		return;
 	}
 
-	// Serial.printf("atcmd_index==%d=%s==\n", atcmd_index, atcmd);
-	if (atcmd_index == 2 && strncmp(atcmd, "AT", atcmd_index) == 0)
+	// Optional sequence tag #<number>, repeated in the result code
+	int32_t tag;
+	uint16_t tag_digits;
+	uint16_t tag_len = at_parse_tag(rxcmd, &tag, &tag_digits);
+	rxcmd += tag_len;
+	tmp -= tag_len;
+
+	rxcmd_index = tmp;
+
+	// Commands arrive from the AT command thread and the binary protocol
+	g_at_cmd_lock.lock();
+
+	// A command received on Serial1 confirms a new baud rate
+	if (port == AT_PORT_SERIAL1)
+	{
+		serial1_baud_confirm();
+	}
+
+	// Route all output of the command to the requesting port
+	g_at_resp.sink = sink;
+	g_at_cmd_port = port;
+
+	if (strncmp(atcmd, "AT", 2) != 0)
 	{
-		atcmd_index = 0;
-		memset(atcmd, 0xff, ATCMD_SIZE);
-		AT_PRINTF("\r\nOK\r\n");
+		// Lines and ';' separated commands without "AT" in front are not commands
+		at_print_result(AT_ERRNO_NOSUPP, NULL, at_port_verbose(port), tag);
+		at_cmd_done();
 		return;
 	}
 
-	rxcmd_index = tmp;
+	if (tag_digits > AT_TAG_DIGITS)
+	{
+		// The host could not match a cut tag to its command, the command is not executed
+		at_print_result(AT_ERRNO_PARA_NUM, NULL, at_port_verbose(port), -1);
+		at_cmd_done();
+		return;
+	}
 
-	for (i = 0; i < sizeof(g_at_cmd_list) / sizeof(atcmd_t); i++)
+	// Serial.printf("atcmd_index==%d=%s==\n", atcmd_index, atcmd);
+	if (rxcmd_index == 0)
 	{
-		cmd_name = g_at_cmd_list[i].cmd_name;
-		// Serial.printf("===rxcmd========%s================cmd_name=====%s====%d===\n", rxcmd, cmd_name, strlen(cmd_name));
-		if (strlen(cmd_name) && strncmp(rxcmd, cmd_name, strlen(cmd_name)) != 0)
-		{
-			continue;
-		}
+		// Only AT
+		at_print_result(0, NULL, at_port_verbose(port), tag);
+		at_cmd_done();
+		return;
+	}
+
+	// Split the command name from the parameters and look it up
+	uint16_t name_len = 0;
+	while ((name_len < rxcmd_index) && (rxcmd[name_len] != '=') && (rxcmd[name_len] != '?'))
+	{
+		name_len++;
+	}
+	if ((name_len == 0) && (rxcmd[0] == '?'))
+	{
+		// AT? is a command name by itself
+		name_len = 1;
+	}
+	int cmd_idx = at_find_cmd(rxcmd, name_len);
+	bool cmd_found = (cmd_idx >= 0);
 
-		// Serial.printf("===rxcmd_index========%d================strlen(cmd_name)=====%d=======\n", rxcmd_index, strlen(cmd_name));
+	if (cmd_found)
+	{
+		const atcmd_t *cmd = &g_at_cmd_list[cmd_idx];
+		cmd_name = cmd->cmd_name;
+		g_at_cmd_name = cmd_name;
 
-		if (rxcmd_index == (strlen(cmd_name) + 1) &&
-			rxcmd[strlen(cmd_name)] == '?')
+		if (rxcmd_index == (name_len + 1) &&
+			rxcmd[name_len] == '?')
 		{
 			/* test cmd */
-			if (g_at_cmd_list[i].cmd_desc)
+			if (cmd->cmd_desc)
 			{
-				if (strncmp(g_at_cmd_list[i].cmd_desc, "OK", 2) == 0)
-				{
-					snprintf(atcmd, ATCMD_SIZE, "\r\nOK\r\n");
-				}
-				else
+				if (strncmp(cmd->cmd_desc, "OK", 2) != 0)
 				{
-					snprintf(atcmd, ATCMD_SIZE, "\r\n%s:\"%s\"\r\nOK\r\n",
-							 cmd_name, g_at_cmd_list[i].cmd_desc);
+					snprintf(atcmd, ATCMD_SIZE, "%s:\"%s\"", cmd_name, cmd->cmd_desc);
+					has_info = true;
 				}
 			}
 			else
 			{
-				snprintf(atcmd, ATCMD_SIZE, "\r\n%s\r\nOK\r\n", cmd_name);
+				snprintf(atcmd, ATCMD_SIZE, "%s", cmd_name);
+				has_info = true;
 			}
 		}
-		else if (rxcmd_index == (strlen(cmd_name) + 2) &&
-				 strcmp(&rxcmd[strlen(cmd_name)], "=?") == 0)
+		else if (rxcmd_index == (name_len + 2) &&
+				 strcmp(&rxcmd[name_len], "=?") == 0)
 		{
 			/* query cmd */
-			if (g_at_cmd_list[i].query_cmd != NULL)
+			if (cmd->query_cmd != NULL)
 			{
-				ret = g_at_cmd_list[i].query_cmd();
+				ret = cmd->query_cmd();
 
 				if (ret == 0)
 				{
-					snprintf(atcmd, ATCMD_SIZE, "\r\n%s:%s\r\nOK\r\n",
-							 cmd_name, g_at_query_buf);
+					snprintf(atcmd, ATCMD_SIZE, "%s:%s", cmd_name, g_at_query_buf);
+					has_info = true;
 				}
 			}
 			else
@@ -1718,16 +1879,19 @@ static void at_cmd_handle(void)
 				ret = AT_ERRNO_NOALLOW;
 			}
 		}
-		else if (rxcmd_index > (strlen(cmd_name) + 1) &&
-				 rxcmd[strlen(cmd_name)] == '=')
+		else if (rxcmd_index > (name_len + 1) &&
+				 rxcmd[name_len] == '=')
 		{
 			/* exec cmd */
-			if (g_at_cmd_list[i].exec_cmd != NULL)
+			if (cmd->exec_cmd != NULL)
 			{
-				ret = g_at_cmd_list[i].exec_cmd(rxcmd + strlen(cmd_name) + 1);
-				if (ret == 0)
+				// Commands can return information like a request ID in the query buffer
+				g_at_query_buf[0] = '\0';
+				ret = cmd->exec_cmd(rxcmd + name_len + 1);
+				if ((ret == 0) && (g_at_query_buf[0] != '\0'))
 				{
-					snprintf(atcmd, ATCMD_SIZE, "\r\nOK\r\n");
+					snprintf(atcmd, ATCMD_SIZE, "%s:%s", cmd_name, g_at_query_buf);
+					has_info = true;
 				}
 				else if (ret == -1)
 				{
@@ -1739,17 +1903,13 @@ static void at_cmd_handle(void)
 				ret = AT_ERRNO_NOALLOW;
 			}
 		}
-		else if (rxcmd_index == strlen(cmd_name))
+		else if (rxcmd_index == name_len)
 		{
 			/* exec cmd without parameter*/
-			if (g_at_cmd_list[i].exec_cmd_no_para != NULL)
+			if (cmd->exec_cmd_no_para != NULL)
 			{
-				ret = g_at_cmd_list[i].exec_cmd_no_para();
-				if (ret == 0)
-				{
-					snprintf(atcmd, ATCMD_SIZE, "\r\nOK\r\n");
-				}
-				else if (ret == -1)
+				ret = cmd->exec_cmd_no_para();
+				if (ret == -1)
 				{
 					ret = AT_ERRNO_SYS;
 				}
@@ -1761,20 +1921,18 @@ static void at_cmd_handle(void)
 		}
 		else
 		{
-			continue;
+			cmd_found = false;
 		}
-		break;
 	}
 
 	// Check if user defined AT commands are setup
-	if (i == sizeof(g_at_cmd_list) / sizeof(atcmd_t))
+	if (!cmd_found)
 	{
 		if (user_at_handler != NULL)
 		{
 			if (user_at_handler(rxcmd, rxcmd_index))
 			{
 				ret = 0;
-				snprintf(atcmd, ATCMD_SIZE, "\r\nOK\r\n");
 			}
 			else
 			{
@@ -1783,61 +1941,264 @@ static void at_cmd_handle(void)
 		}
 		else
 		{
-		ret = AT_ERRNO_NOSUPP;
+			ret = AT_ERRNO_NOSUPP;
+		}
+	}
+
+	if (ret != AT_CB_PRINT)
+	{
+		at_print_result(ret, has_info ? atcmd : NULL, at_port_verbose(port), tag);
+	}
+	at_cmd_done();
+}
+
+/**
+ * @brief Reply to a command that did not fit into the full command queue
+ * The serial task writes the reply directly to the port, the AT command parser is not used
+ * 
+ * @param port port the command was received on
+ * @param cmd command after "AT"
+ */
+static void at_queue_busy(uint8_t port, const char *cmd)
+{
+	int32_t tag;
+	uint16_t digits;
+	at_parse_tag(cmd, &tag, &digits);
+
+	char reply[32];
+	int len = 0;
+	bool verbose = at_port_verbose(port);
+	if (verbose)
+	{
+		len += snprintf(&reply[len], sizeof(reply) - len, "\r\n");
+	}
+	if ((tag >= 0) && (digits <= AT_TAG_DIGITS))
+	{
+		len += snprintf(&reply[len], sizeof(reply) - len, "#%" PRId32 " ", tag);
+	}
+	if (verbose)
+	{
+		len += snprintf(&reply[len], sizeof(reply) - len, "%s%x\r\n", AT_ERROR, AT_ERRNO_BUSY);
+	}
+	else
+	{
+		len += snprintf(&reply[len], sizeof(reply) - len, "%x\r\n", AT_ERRNO_BUSY);
+	}
+	at_port_sink(port)->write((const uint8_t *)reply, len);
+}
+
+/**
+ * @brief Put a command into the command queue
+ * If the queue is full, the command is not executed and the port gets AT_ERRNO_BUSY,
+ * the serial task keeps reading the ports meanwhile
+ * 
+ * @param port port the command was received on
+ * @param cmd command, 0 terminated
+ * @param add_prefix true if "AT" has to be added in front of the command
+ */
+static void at_queue_put(uint8_t port, const char *cmd, bool add_prefix)
+{
+	uint16_t len = strlen(cmd);
+	if ((len + (add_prefix ? 2 : 0)) >= ATCMD_SIZE)
+	{
+		return;
+	}
+
+	if (!g_at_queue_free.try_acquire())
+	{
+		at_queue_busy(port, add_prefix ? cmd : cmd + 2);
+		return;
 	}
+
+	s_at_queue_entry *entry = &g_at_queue[g_at_queue_head % AT_QUEUE_SIZE];
+	entry->port = port;
+	entry->atcmd_index = 0;
+	if (add_prefix)
+	{
+		memcpy(entry->atcmd, "AT", 2);
+		entry->atcmd_index = 2;
 	}
+	memcpy(&entry->atcmd[entry->atcmd_index], cmd, len + 1);
+	entry->atcmd_index += len;
+	g_at_queue_head++;
 
-	if (ret != 0 && ret != AT_CB_PRINT)
+	if (_at_cmd_task_thread != NULL)
 	{
-		snprintf(atcmd, ATCMD_SIZE, "\r\n%s%x\r\n", AT_ERROR, ret);
+		osSignalSet(_at_cmd_task_thread, SIGNAL_AT_CMD);
 	}
+}
 
-	if (ret != AT_CB_PRINT)
+/**
+ * @brief Handle received AT command line
+ * Commands separated by ';' are queued one by one,
+ * "AT" can be omitted for all but the first command
+ * 
+ * @param port parser context of the port the command line was received on
+ */
+static void at_cmd_handle(s_at_port *port)
+{
+	char *cmd = port->atcmd;
+	bool first = true;
+
+	while (cmd != NULL)
+	{
+		char *next = strchr(cmd, ';');
+		if (next != NULL)
+		{
+			*next++ = '\0';
+		}
+		if (cmd[0] != '\0')
+		{
+			at_queue_put(port - g_at_ports, cmd, !first && (strncmp(cmd, "AT", 2) != 0));
+		}
+		first = false;
+		cmd = next;
+	}
+
+	port->atcmd_index = 0;
+	memset(port->atcmd, 0xff, ATCMD_SIZE);
+}
+
+// Task to execute queued AT commands
+static void _at_cmd_task()
+{
+	_at_cmd_task_thread = osThreadGetId();
+
+	while (true)
 	{
-		AT_PRINTF(atcmd);
+		// Sleep until a command is queued, wake up regularly for the baud rate fallback
+		osSignalWait(0, AT_IDLE_TIMEOUT);
+
+		while (g_at_queue_tail != g_at_queue_head)
+		{
+			s_at_queue_entry *entry = &g_at_queue[g_at_queue_tail % AT_QUEUE_SIZE];
+			at_cmd_exec(entry->atcmd, entry->atcmd_index, at_port_sink(entry->port), entry->port);
+			g_at_queue_tail++;
+			g_at_queue_free.release();
+		}
+
+		g_at_cmd_lock.lock();
+		serial1_baud_check();
+		settings_flush_check();
+		uplink_queue_flush_check();
+		rx_log_flush_check();
+		flash_jobs_run();
+		g_at_cmd_lock.unlock();
 	}
+}
+
+/**
+ * @brief Lock the AT command parser
+ * Requests that change the radio or the send buffers outside of an AT command
+ * hold the lock, so they do not run at the same time as an AT command
+ * 
+ */
+void at_cmd_lock(void)
+{
+	g_at_cmd_lock.lock();
+}
+
+/**
+ * @brief Release the AT command parser
+ * 
+ */
+void at_cmd_unlock(void)
+{
+	g_at_cmd_lock.unlock();
+}
+
+/**
+ * @brief Start the task that executes queued AT commands
+ * 
+ */
+void init_at_cmd_task(void)
+{
+	_thread_at_cmd.start(_at_cmd_task);
+	_thread_at_cmd.set_priority(osPriorityNormal);
+}
+
+/**
+ * @brief Get the output of a port
+ * 
+ * @param port port number
+ * @return Print* output of the port
+ */
+Print *at_port_sink(uint8_t port)
+{
+	return g_at_ports[port].sink;
+}
 
-	atcmd_index = 0;
-	memset(atcmd, 0xff, ATCMD_SIZE);
-	return;
+/**
+ * @brief Apply the saved echo and result code settings to all ports
+ * 
+ */
+void at_init_ports(void)
+{
+	for (uint8_t port = 0; port < AT_PORT_NUM; port++)
+	{
+		g_at_ports[port].echo = g_lorawan_settings.at_echo;
+		g_at_ports[port].verbose = g_lorawan_settings.at_verbose;
+	}
 }
 
 /**
  * @brief Get Serial input and start parsing
  * 
  * @param cmd received character
+ * @param port port the character was received on
  */
-void at_serial_input(uint8_t cmd)
+void at_serial_input(uint8_t cmd, uint8_t port)
 {
-	DualSerial("%c", cmd);
+	if (port >= AT_PORT_NUM)
+	{
+		return;
+	}
+	s_at_port *at_port = &g_at_ports[port];
+
+	if (bin_mode_active(port))
+	{
+		bin_serial_input(cmd, port);
+		return;
+	}
+
+	if (at_port->echo)
+	{
+		at_port->sink->write(cmd);
+	}
 
 	// Handle backspace
 	if (cmd == '\b')
 	{
-		atcmd[atcmd_index--] = '\0';
-		DualSerial(" \b");
+		if (at_port->atcmd_index > 0)
+		{
+			at_port->atcmd[--at_port->atcmd_index] = '\0';
+		}
+		if (at_port->echo)
+		{
+			at_port->sink->write((uint8_t *)" \b", 2);
+		}
 	}
 
-  // Convert to uppercase
-  if (cmd >= 'a' && cmd <= 'z')
-  {
-    cmd = toupper(cmd);
-  }
+	// Convert to uppercase
+	if (cmd >= 'a' && cmd <= 'z')
+	{
+		cmd = toupper(cmd);
+	}
 
 	if ((cmd >= '0' && cmd <= '9') || (cmd >= 'a' && cmd <= 'z') ||
 		(cmd >= 'A' && cmd <= 'Z') || cmd == '?' || cmd == '+' || cmd == ':' ||
-		cmd == '=' || cmd == ' ' || cmd == ',')
+		cmd == '=' || cmd == ' ' || cmd == ',' || cmd == ';' || cmd == '#')
 	{
-		atcmd[atcmd_index++] = cmd;
+		at_port->atcmd[at_port->atcmd_index++] = cmd;
 	}
 	else if (cmd == '\r' || cmd == '\n')
 	{
-		atcmd[atcmd_index] = '\0';
-		at_cmd_handle();
+		at_port->atcmd[at_port->atcmd_index] = '\0';
+		at_cmd_handle(at_port);
 	}
 
-	if (atcmd_index >= ATCMD_SIZE)
+	if (at_port->atcmd_index >= ATCMD_SIZE)
 	{
-		atcmd_index = 0;
+		at_port->atcmd_index = 0;
 	}
 }
@@ -13,7 +13,25 @@
 #ifndef __AT_H__
 #define __AT_H__
 
-#define AT_PRINTF(...)          \
-	Serial.printf(__VA_ARGS__); \
-	Serial1.printf(__VA_ARGS__);
+#define AT_ERROR "+CME ERROR:"
+#define ATCMD_SIZE 160
+#define ATQUERY_SIZE 128
+/** Number of commands that can wait for execution, must be a power of 2 */
+#define AT_QUEUE_SIZE 8
+/** Maximum number of digits of a sequence tag */
+#define AT_TAG_DIGITS 9
+
+#define AT_ERRNO_NOSUPP (1)
+#define AT_ERRNO_NOALLOW (2)
+#define AT_ERRNO_BUSY (3)
+#define AT_ERRNO_PARA_VAL (5)
+#define AT_ERRNO_PARA_NUM (6)
+#define AT_ERRNO_SYS (8)
+#define AT_CB_PRINT (0xFF)
+
+void at_cmd_exec(char *atcmd, uint16_t atcmd_index, Print *sink, uint8_t port);
+Print *at_port_sink(uint8_t port);
+void at_printf(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+#define AT_PRINTF(...) at_printf(__VA_ARGS__)
 #endif
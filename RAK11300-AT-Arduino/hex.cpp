@@ -0,0 +1,125 @@
+/**
+ * @file hex.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Table based HEX encoder and decoder
+ * @version 0.1
+ * @date 2021-10-09
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "main.h"
+
+/** Marker for invalid characters in the decoder table */
+#define HEX_INVALID 0xFF
+
+/** Lookup tables for the HEX codec */
+struct hex_tables_s
+{
+	// Character => nibble value, HEX_INVALID for non HEX characters
+	uint8_t nibble[256];
+	// Byte => two upper case HEX characters
+	char chars[256][2];
+};
+
+/**
+ * @brief Build the HEX codec tables
+ *
+ * @return hex_tables_s lookup tables
+ */
+static constexpr hex_tables_s hex_build_tables(void)
+{
+	hex_tables_s tables = {};
+	for (uint16_t idx = 0; idx < 256; idx++)
+	{
+		if ((idx >= '0') && (idx <= '9'))
+		{
+			tables.nibble[idx] = idx - '0';
+		}
+		else if ((idx >= 'A') && (idx <= 'F'))
+		{
+			tables.nibble[idx] = idx - 'A' + 10;
+		}
+		else if ((idx >= 'a') && (idx <= 'f'))
+		{
+			tables.nibble[idx] = idx - 'a' + 10;
+		}
+		else
+		{
+			tables.nibble[idx] = HEX_INVALID;
+		}
+		tables.chars[idx][0] = "0123456789ABCDEF"[idx >> 4];
+		tables.chars[idx][1] = "0123456789ABCDEF"[idx & 0x0F];
+	}
+	return tables;
+}
+
+/** HEX codec tables, generated at compile time */
+static constexpr hex_tables_s g_hex_tables = hex_build_tables();
+
+/**
+ * @brief Convert a HEX string into a byte array
+ * Two bytes are decoded per loop, invalid characters are checked once at the end
+ *
+ * @param hex HEX string, upper or lower case
+ * @param hex_length number of characters in the HEX string
+ * @param bin output byte array, content is undefined if the conversion failed
+ * @param bin_length size of the output byte array
+ * @return int number of decoded bytes, -1 if the conversion failed
+ */
+int hex_decode(const char *hex, uint16_t hex_length, uint8_t *bin, uint16_t bin_length)
+{
+	const uint8_t *in = (const uint8_t *)hex;
+	const uint8_t *nibble = g_hex_tables.nibble;
+	uint8_t invalid = 0;
+	uint16_t idx = 0;
+
+	if ((hex_length & 1) || ((hex_length / 2) > bin_length))
+	{
+		return -1;
+	}
+
+	for (; (idx + 4) <= hex_length; idx += 4)
+	{
+		uint8_t n0 = nibble[in[idx]];
+		uint8_t n1 = nibble[in[idx + 1]];
+		uint8_t n2 = nibble[in[idx + 2]];
+		uint8_t n3 = nibble[in[idx + 3]];
+		invalid |= n0 | n1 | n2 | n3;
+		bin[0] = (n0 << 4) | n1;
+		bin[1] = (n2 << 4) | n3;
+		bin += 2;
+	}
+	if (idx < hex_length)
+	{
+		uint8_t n0 = nibble[in[idx]];
+		uint8_t n1 = nibble[in[idx + 1]];
+		invalid |= n0 | n1;
+		bin[0] = (n0 << 4) | n1;
+	}
+
+	// Valid nibbles never set the upper bits
+	if (invalid & 0xF0)
+	{
+		return -1;
+	}
+	return hex_length / 2;
+}
+
+/**
+ * @brief Convert a byte array into an upper case HEX string
+ *
+ * @param bin byte array
+ * @param bin_length number of bytes
+ * @param hex output string, must have space for 2 * bin_length + 1 characters
+ * @return uint16_t length of the HEX string
+ */
+uint16_t hex_encode(const uint8_t *bin, uint16_t bin_length, char *hex)
+{
+	for (uint16_t idx = 0; idx < bin_length; idx++)
+	{
+		memcpy(&hex[idx * 2], g_hex_tables.chars[bin[idx]], 2);
+	}
+	hex[bin_length * 2] = '\0';
+	return bin_length * 2;
+}
@@ -18,10 +18,52 @@ void on_tx_timeout(void);
 void on_rx_timeout(void);
 void on_rx_crc_error(void);
 void on_cad_done(bool cadResult);
+static bool p2p_tx_done(uint8_t result);
+static bool p2p_tx_backoff(void);
 
 uint8_t g_lora_p2p_rx_mode = RX_MODE_NONE;
 uint32_t g_lora_p2p_rx_time = 0;
 
+/** Number of P2P packets that can wait for transmission, must be a power of 2 */
+#define P2P_TX_QUEUE_SIZE 4
+
+/** P2P packet waiting for transmission */
+struct s_p2p_tx_packet
+{
+	// Request ID
+	uint16_t id;
+	// Time on air in milliseconds, reserved in the airtime budget
+	uint32_t airtime;
+	// Length of the payload
+	uint8_t len;
+	// Payload
+	uint8_t data[255];
+};
+
+/** Transmit queue, written by send_p2p_packet(), read by the radio callbacks */
+static s_p2p_tx_packet g_p2p_tx_queue[P2P_TX_QUEUE_SIZE];
+static volatile uint8_t g_p2p_tx_head = 0;
+static volatile uint8_t g_p2p_tx_tail = 0;
+/** Flag if the packet at the tail of the queue is in transmission */
+static volatile bool g_p2p_tx_active = false;
+/** Only one writer at a time, packets are sent from the AT command task and the loop */
+static Mutex g_p2p_tx_lock;
+
+/** Largest exponent of the backoff, the contention window stops growing after 5 doublings */
+#define P2P_BACKOFF_MAX_EXP 5
+
+/** Busy CAD results of the packet in transmission */
+static uint8_t g_p2p_cad_attempts = 0;
+/** Timer to repeat the CAD after the backoff time */
+static TimerEvent_t p2p_backoff_timer;
+
+/** Number of CAD with a free channel */
+uint32_t g_p2p_cad_clear = 0;
+/** Number of CAD with a busy channel */
+uint32_t g_p2p_cad_busy = 0;
+/** Number of packets dropped because the channel was still busy after all retries */
+uint32_t g_p2p_lbt_dropped = 0;
+
 /**
  * @brief Initialize LoRa HW and LoRaWan MAC layer
  * 
@@ -52,7 +94,7 @@ int8_t init_lora(void)
 	}
 	Radio.Sleep(); // Radio.Standby();
 
-	Radio.SetChannel(g_lorawan_settings.p2p_frequency);
+	Radio.SetChannel(p2p_hop_frequency());
 
 	Radio.SetTxConfig(MODEM_LORA, g_lorawan_settings.p2p_tx_power, 0, g_lorawan_settings.p2p_bandwidth,
 					  g_lorawan_settings.p2p_sf, g_lorawan_settings.p2p_cr,
@@ -100,6 +142,42 @@ int8_t init_lora(void)
 	return 0;
 }
 
+/**
+ * @brief Check if the radio is in use
+ * Flash erases wait for an idle radio, the radio interrupts are not served while the flash is erased
+ * 
+ * @return true if the radio transmits or receives or a LoRaWAN RX window or join is pending
+ */
+bool lora_radio_busy(void)
+{
+	if (!g_lorawan_initialized)
+	{
+		return false;
+	}
+	return (Radio.GetStatus() != RF_IDLE) || (async_pending(ASYNC_OP_SEND) != 0) ||
+		   (async_pending(ASYNC_OP_PSEND) != 0) || (async_pending(ASYNC_OP_JOIN) != 0);
+}
+
+/**
+ * @brief Check if the radio receives without an end
+ * In LoRa P2P RX mode and LoRaWAN class C the radio is busy, but waiting for it does not help
+ * 
+ * @return true if the radio receives continuously and nothing else is pending
+ */
+bool lora_radio_rx_continuous(void)
+{
+	if (!g_lorawan_initialized || (async_pending(ASYNC_OP_SEND) != 0) || (async_pending(ASYNC_OP_PSEND) != 0) ||
+		(async_pending(ASYNC_OP_JOIN) != 0))
+	{
+		return false;
+	}
+	if (g_lorawan_settings.lorawan_enable)
+	{
+		return g_lorawan_settings.lora_class == CLASS_C;
+	}
+	return (g_lora_p2p_rx_mode == RX_MODE_RX) || (g_lora_p2p_rx_mode == RX_MODE_RX_WAIT);
+}
+
 /**
  * @brief Function to be executed on Radio Tx Done event
  */
@@ -107,11 +185,12 @@ void on_tx_done(void)
 {
 	APP_LOG("LORA", "Uncomfirmed TX finished");
 	g_rx_fin_result = true;
-	// Wake up task to report succesful join
-	if (loop_thread != NULL)
+	// Wake up task to report succesful TX
+	APP_LOG("LORA", "TX success, report event");
+	if (p2p_tx_done(ASYNC_SUCCESS))
 	{
-		APP_LOG("LORA", "TX success, report event");
-		osSignalSet(loop_thread, SIGNAL_UNCONF_TX);
+		// CAD of the next packet is running
+		return;
 	}
 	switch (g_lora_p2p_rx_mode)
 	{
@@ -142,16 +221,13 @@ void on_rx_done(uint8_t *payload, uint16_t size, int16_t rssi, int8_t snr)
 
 	g_last_rssi = rssi;
 	g_last_snr = snr;
+	g_last_fport = 0;
 
-	// Copy the data into loop data buffer
-	memcpy(g_rx_lora_data, payload, size);
-	g_rx_data_len = size;
-	// Wake up task to report succesful join
-	if (loop_thread != NULL)
-	{
-		APP_LOG("LORA", "Packet received, report event");
-		osSignalSet(loop_thread, SIGNAL_RX);
-	}
+	// Queue the data for the loop thread, with the channel before the hop to the next one
+	rx_queue_add(0, rssi, snr, payload, size, p2p_hop_frequency());
+
+	g_hop_stats[p2p_hop_channel()].rx++;
+	p2p_hop_next();
 
 	switch (g_lora_p2p_rx_mode)
 	{
@@ -176,11 +252,11 @@ void on_tx_timeout(void)
 {
 	APP_LOG("LORA", "TX timeout");
 	g_rx_fin_result = false;
-	// Wake up task to report failed join
-	if (loop_thread != NULL)
+	// Wake up task to report failed TX
+	APP_LOG("LORA", "TX failed, report event");
+	if (p2p_tx_done(ASYNC_FAIL))
 	{
-		APP_LOG("LORA", "TX failed, report event");
-		osSignalSet(loop_thread, SIGNAL_CONF_TX_NAK);
+		return;
 	}
 	switch (g_lora_p2p_rx_mode)
 	{
@@ -226,6 +302,10 @@ void on_rx_timeout(void)
  */
 void on_rx_crc_error(void)
 {
+	// The sender moved to the next channel as well
+	g_hop_stats[p2p_hop_channel()].crc++;
+	p2p_hop_next();
+
 	switch (g_lora_p2p_rx_mode)
 	{
 	default:
@@ -249,6 +329,22 @@ void on_cad_done(bool cadResult)
 {
 	if (cadResult)
 	{
+		g_p2p_cad_busy++;
+		g_hop_stats[p2p_hop_channel()].busy++;
+		if (p2p_tx_backoff())
+		{
+			APP_LOG("LORA", "CAD busy - Retry %d after backoff", g_p2p_cad_attempts);
+		}
+		else
+		{
+			// Channel is still busy after all retries, the packet is not sent
+			g_p2p_lbt_dropped++;
+			if (p2p_tx_done(ASYNC_BUSY))
+			{
+				return;
+			}
+		}
+		// Listen while waiting for the next CAD
 		switch (g_lora_p2p_rx_mode)
 		{
 		default:
@@ -267,22 +363,24 @@ void on_cad_done(bool cadResult)
 	}
 	else
 	{
-		Radio.Send(g_tx_lora_data, g_tx_data_len);
+		if (!g_p2p_tx_active || (g_p2p_tx_tail == g_p2p_tx_head))
+		{
+			// Late CAD result after the radio was set up again, no packet is waiting for it
+			return;
+		}
+		g_p2p_cad_clear++;
+		s_p2p_tx_packet *packet = &g_p2p_tx_queue[g_p2p_tx_tail % P2P_TX_QUEUE_SIZE];
+		Radio.Send(packet->data, packet->len);
 	}
 }
 
 /**
- * @brief Prepare packet to be sent and start CAD routine
+ * @brief Start CAD for the oldest packet in the transmit queue
  * 
  */
-bool send_p2p_packet(uint8_t *data, uint8_t size)
+static void p2p_tx_start(void)
 {
-	if (size > 256)
-	{
-		return false;
-	}
-	g_tx_data_len = size;
-	memcpy(g_tx_lora_data, data, size);
+	s_p2p_tx_packet *packet = &g_p2p_tx_queue[g_p2p_tx_tail % P2P_TX_QUEUE_SIZE];
 
 	// Prepare LoRa CAD
 	Radio.Sleep();
@@ -292,7 +390,214 @@ bool send_p2p_packet(uint8_t *data, uint8_t size)
 	digitalWrite(LED_BUILTIN, HIGH);
 
 	// Start CAD
+	async_begin(ASYNC_OP_PSEND, packet->id, packet->airtime);
 	Radio.StartCad();
+}
+
+/**
+ * @brief Report the end of a transmission and start the next queued packet
+ * Called from the radio callbacks, the next CAD starts without waiting for the loop
+ * 
+ * @param result ASYNC_xxx
+ * @return true if the next packet was started, false if the queue is empty
+ */
+static bool p2p_tx_done(uint8_t result)
+{
+	if (!g_p2p_tx_active)
+	{
+		return false;
+	}
+	// Busy CAD results before the final one are reported as retries
+	async_complete(ASYNC_OP_PSEND, result, g_p2p_cad_attempts);
+	g_p2p_cad_attempts = 0;
+	// A packet that timed out was on air as well
+	airtime_release(g_p2p_tx_queue[g_p2p_tx_tail % P2P_TX_QUEUE_SIZE].airtime, result != ASYNC_BUSY);
+	if (result != ASYNC_BUSY)
+	{
+		// Only packets on air move the receivers to the next channel
+		g_hop_stats[p2p_hop_channel()].tx++;
+		p2p_hop_next();
+	}
+	g_p2p_tx_tail++;
+
+	core_util_critical_section_enter();
+	bool next = (g_p2p_tx_tail != g_p2p_tx_head);
+	if (!next)
+	{
+		g_p2p_tx_active = false;
+	}
+	core_util_critical_section_exit();
+
+	if (next)
+	{
+		p2p_tx_start();
+	}
+	return next;
+}
+
+/**
+ * @brief Wake up the loop thread when the backoff time is over
+ * 
+ */
+static void p2p_backoff_wakeup(void)
+{
+	if (loop_thread != NULL)
+	{
+		osSignalSet(loop_thread, SIGNAL_LBT);
+	}
+}
 
+/**
+ * @brief Wait a random backoff time before the CAD is repeated
+ * The contention window doubles with every busy CAD of the packet, the time is
+ * taken from the upper half of the window, so nodes that collided spread out
+ * 
+ * @return true if the CAD is repeated, false if all retries are used up
+ */
+static bool p2p_tx_backoff(void)
+{
+	if (!g_p2p_tx_active || (g_p2p_cad_attempts >= g_lorawan_settings.p2p_cad_retries))
+	{
+		return false;
+	}
+	uint8_t exp = g_p2p_cad_attempts < P2P_BACKOFF_MAX_EXP ? g_p2p_cad_attempts : P2P_BACKOFF_MAX_EXP;
+	g_p2p_cad_attempts++;
+
+	uint32_t window = (uint32_t)g_lorawan_settings.p2p_backoff << exp;
+	// The radio random generator differs between nodes, the Arduino random() sequence does not
+	uint32_t time = window / 2 + Radio.Random() % (window / 2 + 1);
+
+	p2p_backoff_timer.oneShot = true;
+	TimerInit(&p2p_backoff_timer, p2p_backoff_wakeup);
+	TimerSetValue(&p2p_backoff_timer, time);
+	TimerStart(&p2p_backoff_timer);
 	return true;
 }
+
+/**
+ * @brief Repeat the CAD of the packet in transmission after the backoff time
+ * Called from the loop thread
+ * 
+ */
+void p2p_tx_retry(void)
+{
+	if (g_p2p_tx_active && !g_lorawan_settings.lorawan_enable)
+	{
+		p2p_tx_start();
+	}
+}
+
+/**
+ * @brief Queue a packet for sending, CAD is started if no other packet is in transmission
+ * 
+ * @param data payload
+ * @param size length of payload
+ * @return uint16_t request ID of the packet, 0 if the transmit queue is full or the airtime budget is used up
+ */
+uint16_t send_p2p_packet(uint8_t *data, uint8_t size)
+{
+	g_p2p_tx_lock.lock();
+	uint32_t airtime = p2p_time_on_air(size);
+	if (((uint8_t)(g_p2p_tx_head - g_p2p_tx_tail) >= P2P_TX_QUEUE_SIZE) || !airtime_reserve(airtime))
+	{
+		g_p2p_tx_lock.unlock();
+		return 0;
+	}
+
+	s_p2p_tx_packet *packet = &g_p2p_tx_queue[g_p2p_tx_head % P2P_TX_QUEUE_SIZE];
+	uint16_t id = async_new_id();
+	packet->id = id;
+	packet->airtime = airtime;
+	packet->len = size;
+	memcpy(packet->data, data, size);
+	// The packet has to be complete before the radio callbacks can see it
+	__DMB();
+	g_p2p_tx_head++;
+
+	// The radio callbacks start queued packets while a transmission is running
+	core_util_critical_section_enter();
+	bool start = !g_p2p_tx_active;
+	g_p2p_tx_active = true;
+	core_util_critical_section_exit();
+
+	if (start)
+	{
+		p2p_tx_start();
+	}
+	g_p2p_tx_lock.unlock();
+	return id;
+}
+
+/**
+ * @brief Get the number of P2P packets waiting for transmission, including the one in transmission
+ * 
+ * @return uint8_t number of packets
+ */
+uint8_t p2p_tx_queue_pending(void)
+{
+	return g_p2p_tx_head - g_p2p_tx_tail;
+}
+
+/**
+ * @brief Get the number of free places in the P2P transmit queue
+ * 
+ * @return uint8_t number of packets that can be queued
+ */
+uint8_t p2p_tx_queue_free(void)
+{
+	return P2P_TX_QUEUE_SIZE - p2p_tx_queue_pending();
+}
+
+/**
+ * @brief Calculate the time on air of a LoRa packet
+ * Explicit header and CRC on, low data rate optimization is used for symbols longer than 16 ms
+ * Formula of the SX126x datasheet, all bandwidths are 500 kHz divided by an integer,
+ * so the symbol time is an exact number of microseconds
+ * 
+ * @param sf spreading factor 5 .. 12
+ * @param bw bandwidth 0: 125 kHz, 1: 250 kHz, 2: 500 kHz, 3: 62.5 kHz, 4: 41.67 kHz, 5: 31.25 kHz,
+ *           6: 20.83 kHz, 7: 15.63 kHz, 8: 10.42 kHz, 9: 7.81 kHz
+ * @param cr coding rate 1: 4/5, 2: 4/6, 3: 4/7, 4: 4/8
+ * @param preamble_len preamble length in symbols
+ * @param size payload size
+ * @return uint32_t time on air in milliseconds, rounded up
+ */
+uint32_t lora_time_on_air(uint8_t sf, uint8_t bw, uint8_t cr, uint16_t preamble_len, uint16_t size)
+{
+	// Divider of 500 kHz for each bandwidth
+	static const uint8_t bandwidth_dividers[10] = {4, 2, 1, 8, 12, 16, 24, 32, 48, 64};
+	if (bw > 9)
+	{
+		bw = 0;
+	}
+
+	// Symbol time in microseconds, 2^SF / 500 kHz = 2^SF * 2 us
+	uint32_t t_sym = (1UL << sf) * 2 * bandwidth_dividers[bw];
+	uint8_t ldro = (t_sym > 16000) ? 1 : 0;
+
+	// Number of payload symbols, SF5 and SF6 have no 8 bit extension of the header
+	int32_t bits = 8 * size - 4 * sf + 20 + 16 + ((sf < 7) ? 0 : 8);
+	int32_t divider = 4 * (sf - 2 * ldro);
+	uint32_t n_payload = 8;
+	if (bits > 0)
+	{
+		n_payload += ((bits + divider - 1) / divider) * (cr + 4);
+	}
+
+	// Preamble takes preamble length + 4.25 symbols, with SF5 and SF6 + 6.25 symbols
+	uint32_t preamble_quarters = preamble_len * 4 + ((sf < 7) ? 25 : 17);
+	uint64_t t_us = ((uint64_t)preamble_quarters * t_sym) / 4 + (uint64_t)n_payload * t_sym;
+	return (t_us + 999) / 1000;
+}
+
+/**
+ * @brief Calculate the time on air of a LoRa P2P packet with the current P2P settings
+ * 
+ * @param size payload size
+ * @return uint32_t time on air in milliseconds, rounded up
+ */
+uint32_t p2p_time_on_air(uint16_t size)
+{
+	return lora_time_on_air(g_lorawan_settings.p2p_sf, g_lorawan_settings.p2p_bandwidth, g_lorawan_settings.p2p_cr,
+							g_lorawan_settings.p2p_preamble_len, size);
+}
@@ -0,0 +1,177 @@
+/**
+ * @file p2p_hop.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Frequency hopping over a list of channels for LoRa P2P
+ * @version 0.1
+ * @date 2021-10-09
+ * 
+ * @copyright Copyright (c) 2021
+ * 
+ */
+#include "main.h"
+
+/**
+ * Every packet on air moves all nodes with the same seed and channel list to the next channel.
+ * The sequence is cut into rounds of one packet per channel, each round is a permutation of the
+ * channels shuffled with the seed, so all channels are used equally often. A node that missed a
+ * packet is one channel off, after P2P hop reset time without packets all nodes start again
+ * with the first channel of the sequence.
+ */
+
+/** Position in the hopping sequence, number of packets since the sequence started */
+static volatile uint32_t g_hop_index = 0;
+/** Timer to restart the sequence after a time without packets */
+static TimerEvent_t hop_reset_timer;
+
+/** Packet statistics of each channel, channel 0 is used without hopping */
+s_hop_stats g_hop_stats[P2P_HOP_MAX];
+
+/**
+ * @brief Get the channel of a position in the hopping sequence
+ * 
+ * @param index position in the sequence
+ * @return uint8_t channel number
+ */
+static uint8_t p2p_hop_channel_at(uint32_t index)
+{
+	uint8_t num = g_lorawan_settings.p2p_hop_num;
+	uint8_t order[P2P_HOP_MAX];
+	for (uint8_t idx = 0; idx < num; idx++)
+	{
+		order[idx] = idx;
+	}
+
+	// Fisher-Yates shuffle of the round, the random numbers come from the seed and the round number
+	uint32_t round = index / num;
+	uint32_t state = calc_crc32(g_lorawan_settings.p2p_hop_seed, (const uint8_t *)&round, sizeof(round)) | 1;
+	for (uint8_t idx = num - 1; idx > 0; idx--)
+	{
+		// xorshift32
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		uint8_t swap = state % (idx + 1);
+		uint8_t channel = order[idx];
+		order[idx] = order[swap];
+		order[swap] = channel;
+	}
+	return order[index % num];
+}
+
+/**
+ * @brief Get the current channel
+ * 
+ * @return uint8_t channel number, 0 if hopping is disabled
+ */
+uint8_t p2p_hop_channel(void)
+{
+	if (g_lorawan_settings.p2p_hop_num == 0)
+	{
+		return 0;
+	}
+	return p2p_hop_channel_at(g_hop_index);
+}
+
+/**
+ * @brief Get the frequency of the current channel
+ * 
+ * @return uint32_t frequency in Hz, the P2P frequency if hopping is disabled
+ */
+uint32_t p2p_hop_frequency(void)
+{
+	if (g_lorawan_settings.p2p_hop_num == 0)
+	{
+		return g_lorawan_settings.p2p_frequency;
+	}
+	return g_lorawan_settings.p2p_hop_freq[p2p_hop_channel()];
+}
+
+/**
+ * @brief Wake up the loop thread to restart the hopping sequence
+ * 
+ */
+static void p2p_hop_reset_wakeup(void)
+{
+	if (loop_thread != NULL)
+	{
+		osSignalSet(loop_thread, SIGNAL_HOP);
+	}
+}
+
+/**
+ * @brief Move to the next channel after a packet was sent or received
+ * Called from the radio callbacks before the radio is restarted
+ * 
+ */
+void p2p_hop_next(void)
+{
+	if (g_lorawan_settings.p2p_hop_num == 0)
+	{
+		return;
+	}
+	g_hop_index++;
+	// The frequency can only be changed in standby
+	Radio.Standby();
+	Radio.SetChannel(p2p_hop_frequency());
+
+	if (g_lorawan_settings.p2p_hop_reset != 0)
+	{
+		hop_reset_timer.oneShot = true;
+		TimerInit(&hop_reset_timer, p2p_hop_reset_wakeup);
+		TimerSetValue(&hop_reset_timer, g_lorawan_settings.p2p_hop_reset * 1000);
+		TimerStart(&hop_reset_timer);
+	}
+}
+
+/**
+ * @brief Start the hopping sequence again with the first channel
+ * Called from the loop thread after P2P hop reset time without packets
+ * 
+ */
+void p2p_hop_reset(void)
+{
+	if ((g_lorawan_settings.p2p_hop_num == 0) || (g_hop_index == 0))
+	{
+		return;
+	}
+	if (p2p_tx_queue_pending() != 0)
+	{
+		// The next packet restarts the timer
+		return;
+	}
+	g_hop_index = 0;
+	bool receiving = (Radio.GetStatus() == RF_RX_RUNNING);
+	Radio.Standby();
+	Radio.SetChannel(p2p_hop_frequency());
+	if (receiving)
+	{
+		// Listen on the first channel
+		Radio.Rx(g_lora_p2p_rx_mode == RX_MODE_RX_TIMED ? g_lora_p2p_rx_time : 0);
+	}
+	else
+	{
+		Radio.Sleep();
+	}
+	APP_LOG("HOP", "Hopping sequence restarted");
+}
+
+/**
+ * @brief Get the position in the hopping sequence
+ * 
+ * @return uint32_t number of packets since the sequence started
+ */
+uint32_t p2p_hop_index(void)
+{
+	return g_hop_index;
+}
+
+/**
+ * @brief Set the hopping sequence back to the first channel without changing the radio
+ * Used when the configuration changes, the caller sets up the radio
+ * 
+ */
+void p2p_hop_restart(void)
+{
+	// A reset timer that is still running finds the sequence at the start and does nothing
+	g_hop_index = 0;
+}
@@ -0,0 +1,194 @@
+/**
+ * @file page_ring.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Ring of flash pages, new entries are collected in a RAM page and written page by page
+ * The sector ahead of the writer is erased early, its entries are dropped when the writer enters the sector before it.
+ * Used by the uplink queue and the log of received packets, the callers lock the ring.
+ * @version 0.1
+ * @date 2021-10-09
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "main.h"
+
+/** Number of flash pages in one sector */
+#define PAGE_RING_SECTOR_PAGES (FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE)
+
+/**
+ * @brief Get a page of the ring in the flash
+ *
+ * @param ring page ring
+ * @param page page number
+ * @return const uint8_t* page data
+ */
+const uint8_t *page_ring_page(const s_page_ring *ring, uint16_t page)
+{
+	return (const uint8_t *)(XIP_BASE + ring->offset + page * FLASH_PAGE_SIZE);
+}
+
+/**
+ * @brief Number of flash pages in the ring
+ *
+ * @param ring page ring
+ * @return uint16_t number of pages
+ */
+uint16_t page_ring_pages(const s_page_ring *ring)
+{
+	return ring->sectors * PAGE_RING_SECTOR_PAGES;
+}
+
+/**
+ * @brief Sector after the sector with the newest page, it is erased ahead of the writer
+ *
+ * @param ring page ring
+ * @return uint16_t sector number
+ */
+static uint16_t page_ring_next_sector(const s_page_ring *ring)
+{
+	uint16_t pages = page_ring_pages(ring);
+	uint16_t newest = (ring->write_page + pages - 1) % pages;
+	return (newest / PAGE_RING_SECTOR_PAGES + 1) % ring->sectors;
+}
+
+/**
+ * @brief Check if a page was written in the current round of the ring
+ *
+ * @param ring page ring
+ * @param page page number
+ * @return true if the page holds entries
+ */
+bool page_ring_valid(const s_page_ring *ring, uint16_t page)
+{
+	if ((page / PAGE_RING_SECTOR_PAGES) == page_ring_next_sector(ring))
+	{
+		return false;
+	}
+	const s_page_ring_header *header = (const s_page_ring_header *)page_ring_page(ring, page);
+	return (header->magic == ring->magic) && (header->seq < ring->seq) &&
+		   (ring->seq - header->seq <= page_ring_pages(ring));
+}
+
+/**
+ * @brief Find the newest page in the flash after a reboot
+ * The writer continues after the newest page
+ *
+ * @param ring page ring
+ * @return uint16_t newest page, PAGE_RING_NONE if the ring is empty
+ */
+uint16_t page_ring_init(s_page_ring *ring)
+{
+	uint16_t newest = PAGE_RING_NONE;
+	uint32_t newest_seq = 0;
+
+	for (uint16_t page = 0; page < page_ring_pages(ring); page++)
+	{
+		const s_page_ring_header *header = (const s_page_ring_header *)page_ring_page(ring, page);
+		if ((header->magic == ring->magic) && (header->seq >= newest_seq))
+		{
+			newest = page;
+			newest_seq = header->seq;
+		}
+	}
+	if (newest == PAGE_RING_NONE)
+	{
+		return PAGE_RING_NONE;
+	}
+
+	ring->write_page = (newest + 1) % page_ring_pages(ring);
+	ring->seq = newest_seq + 1;
+	flash_erase_later(ring->offset + page_ring_next_sector(ring) * FLASH_SECTOR_SIZE);
+	return newest;
+}
+
+/**
+ * @brief Start a new RAM page, the space for the header is used
+ * Unused bytes stay erased
+ *
+ * @param ring page ring
+ */
+void page_ring_start(s_page_ring *ring)
+{
+	memset(ring->page, 0xFF, FLASH_PAGE_SIZE);
+	ring->len = sizeof(s_page_ring_header);
+	ring->time = millis();
+}
+
+/**
+ * @brief Write the RAM page to the flash, the RAM page must not be empty
+ * When the writer enters a sector, the sector after it with the oldest entries is erased ahead
+ *
+ * @param ring page ring
+ * @param drop called with the first page of a sector before its entries are erased
+ * @return uint16_t page that was written
+ */
+uint16_t page_ring_write(s_page_ring *ring, void (*drop)(uint16_t first_page))
+{
+	uint16_t pages = page_ring_pages(ring);
+
+	// Skip pages that were damaged by a power loss during programming
+	while (true)
+	{
+		if ((ring->write_page % PAGE_RING_SECTOR_PAGES) == 0)
+		{
+			// Start of a sector, the oldest entries in the sector after it are dropped
+			drop((ring->write_page + PAGE_RING_SECTOR_PAGES) % pages);
+			// Usually erased ahead already
+			flash_erase(ring->offset + ring->write_page * FLASH_PAGE_SIZE);
+		}
+		const uint32_t *page_data = (const uint32_t *)page_ring_page(ring, ring->write_page);
+		uint16_t idx = 0;
+		while ((idx < FLASH_PAGE_SIZE / 4) && (page_data[idx] == 0xFFFFFFFF))
+		{
+			idx++;
+		}
+		if (idx == FLASH_PAGE_SIZE / 4)
+		{
+			break;
+		}
+		ring->write_page = (ring->write_page + 1) % pages;
+	}
+
+	s_page_ring_header *header = (s_page_ring_header *)ring->page;
+	header->magic = ring->magic;
+	header->seq = ring->seq;
+	flash_program(ring->offset + ring->write_page * FLASH_PAGE_SIZE, ring->page, ring->len);
+
+	uint16_t written = ring->write_page;
+	ring->seq++;
+	ring->write_page = (ring->write_page + 1) % pages;
+	ring->len = 0;
+	if ((ring->write_page % PAGE_RING_SECTOR_PAGES) == 1)
+	{
+		// First page of a sector, erase the next sector while the radio is idle
+		flash_erase_later(ring->offset + page_ring_next_sector(ring) * FLASH_SECTOR_SIZE);
+	}
+	return written;
+}
+
+/**
+ * @brief Check if the RAM page waited long enough to be written
+ *
+ * @param ring page ring
+ * @param delay time in milliseconds the first entry waits in RAM
+ * @return true if the RAM page is due and the flash is free
+ */
+bool page_ring_due(const s_page_ring *ring, uint32_t delay)
+{
+	return (ring->len != 0) && ((millis() - ring->time) > delay) && !flash_defer(ring->time + delay);
+}
+
+/**
+ * @brief Erase the ring and the RAM page
+ *
+ * @param ring page ring
+ */
+void page_ring_clear(s_page_ring *ring)
+{
+	for (uint16_t sector = 0; sector < ring->sectors; sector++)
+	{
+		flash_erase(ring->offset + sector * FLASH_SECTOR_SIZE);
+	}
+	ring->len = 0;
+	ring->write_page = 0;
+}
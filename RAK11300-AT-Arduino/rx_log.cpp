@@ -0,0 +1,297 @@
+/**
+ * @file rx_log.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Circular log of received packets in the flash
+ * @version 0.1
+ * @date 2021-10-09
+ * 
+ * @copyright Copyright (c) 2021
+ * 
+ */
+#include "main.h"
+
+/** Number of flash pages in the log */
+#define RX_LOG_PAGES (RX_LOG_SECTORS * FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE)
+/** Number of flash pages in one sector */
+#define RX_LOG_SECTOR_PAGES (FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE)
+/** Marker of a written log page "RXL1" */
+#define RX_LOG_MAGIC 0x314C5852
+
+/** Time in milliseconds a packet waits in RAM before its page is written to the flash */
+#define RX_LOG_WRITE_DELAY 60000
+/** Largest payload that is logged, longer payloads are cut */
+#define RX_LOG_MAX_LEN (FLASH_PAGE_SIZE - sizeof(s_page_ring_header) - sizeof(s_rx_log_entry))
+
+/** Pages of the log in the flash and the RAM page with the newest entries */
+static s_page_ring g_rx_log = {RX_LOG_OFFSET, RX_LOG_SECTORS, RX_LOG_MAGIC, 0, 1};
+/** Number of this boot, stored with every entry */
+static uint32_t g_rx_log_boot = 1;
+
+/** Access from the AT command task and the loop */
+static Mutex g_rx_log_lock;
+
+/** Number of entries in the log */
+uint32_t g_rx_log_count = 0;
+/** Number of pages written to the flash */
+uint32_t g_rx_log_writes = 0;
+
+/**
+ * @brief Check byte of an entry
+ * 
+ * @param entry entry followed by the payload
+ * @return uint8_t check byte
+ */
+static uint8_t rx_log_check(const s_rx_log_entry *entry)
+{
+	uint32_t crc = calc_crc32(0, &entry->len, 1);
+	crc = calc_crc32(crc, &entry->fport, sizeof(s_rx_log_entry) - 2);
+	return calc_crc32(crc, (const uint8_t *)entry + sizeof(s_rx_log_entry), entry->len) & 0xFF;
+}
+
+/**
+ * @brief Size of an entry in the page
+ * 
+ * @param len length of the payload
+ * @return uint16_t size of entry and payload, padded to 4 bytes
+ */
+static uint16_t rx_log_entry_size(uint8_t len)
+{
+	return (sizeof(s_rx_log_entry) + len + 3) & ~3;
+}
+
+/**
+ * @brief Go through the entries of a page
+ * The walk stops at the first damaged entry, the lengths after it cannot be trusted
+ * 
+ * @param data page data
+ * @param len used bytes of the page
+ * @param callback called for each entry, can be NULL
+ * @param arg argument for the callback
+ * @return uint32_t number of entries
+ */
+static uint32_t rx_log_walk(const uint8_t *data, uint16_t len, void (*callback)(const s_rx_log_entry *entry, void *arg), void *arg)
+{
+	uint32_t count = 0;
+	uint16_t idx = sizeof(s_page_ring_header);
+	while (idx + sizeof(s_rx_log_entry) <= len)
+	{
+		const s_rx_log_entry *entry = (const s_rx_log_entry *)&data[idx];
+		if ((entry->len == 0xFF) || (idx + rx_log_entry_size(entry->len) > len) || (entry->check != rx_log_check(entry)))
+		{
+			break;
+		}
+		if (callback != NULL)
+		{
+			callback(entry, arg);
+		}
+		count++;
+		idx += rx_log_entry_size(entry->len);
+	}
+	return count;
+}
+
+/**
+ * @brief Find the newest boot number in the entries of a page
+ * 
+ * @param entry entry
+ * @param arg receives the highest boot number
+ */
+static void rx_log_last_boot(const s_rx_log_entry *entry, void *arg)
+{
+	uint32_t *boot = (uint32_t *)arg;
+	if (entry->boot > *boot)
+	{
+		*boot = entry->boot;
+	}
+}
+
+/**
+ * @brief Find the log in the flash after a reboot
+ * 
+ */
+void init_rx_log(void)
+{
+	uint16_t newest = page_ring_init(&g_rx_log);
+	if (newest == PAGE_RING_NONE)
+	{
+		return;
+	}
+
+	g_rx_log_count = 0;
+	for (uint16_t page = 0; page < RX_LOG_PAGES; page++)
+	{
+		if (page_ring_valid(&g_rx_log, page))
+		{
+			g_rx_log_count += rx_log_walk(page_ring_page(&g_rx_log, page), FLASH_PAGE_SIZE, NULL, NULL);
+		}
+	}
+
+	uint32_t boot = 0;
+	rx_log_walk(page_ring_page(&g_rx_log, newest), FLASH_PAGE_SIZE, rx_log_last_boot, &boot);
+	g_rx_log_boot = boot + 1;
+	APP_LOG("RXLOG", "%" PRIu32 " packets logged, boot %" PRIu32 ", next page %d", g_rx_log_count, g_rx_log_boot, g_rx_log.write_page);
+}
+
+/**
+ * @brief Remove the entries of a sector from the count before the sector is erased
+ * 
+ * @param first_page first page of the sector
+ */
+static void rx_log_drop(uint16_t first_page)
+{
+	for (uint16_t page = first_page; page < first_page + RX_LOG_SECTOR_PAGES; page++)
+	{
+		if (page_ring_valid(&g_rx_log, page))
+		{
+			g_rx_log_count -= rx_log_walk(page_ring_page(&g_rx_log, page), FLASH_PAGE_SIZE, NULL, NULL);
+		}
+	}
+}
+
+/**
+ * @brief Write the RAM page with the new entries to the flash
+ * 
+ */
+static void rx_log_write_page(void)
+{
+	if (g_rx_log.len == 0)
+	{
+		return;
+	}
+	page_ring_write(&g_rx_log, rx_log_drop);
+	g_rx_log_writes++;
+}
+
+/**
+ * @brief Add a received packet to the log if logging is enabled
+ * The entry is collected in RAM and written to the flash when the page is full
+ * or RX_LOG_WRITE_DELAY after the first entry of the page
+ * 
+ * @param fport fPort of the packet (0 for LoRa P2P)
+ * @param rssi RSSI of the packet
+ * @param snr SNR of the packet
+ * @param data received data
+ * @param size length of received data
+ * @param time time of reception in milliseconds
+ * @param freq frequency the packet was received on in Hz (0 for LoRaWAN)
+ */
+void rx_log_add(uint8_t fport, int16_t rssi, int8_t snr, const uint8_t *data, uint8_t size, time_t time, uint32_t freq)
+{
+	if (!g_lorawan_settings.rx_log_enable)
+	{
+		return;
+	}
+
+	uint8_t len = size > RX_LOG_MAX_LEN ? RX_LOG_MAX_LEN : size;
+
+	g_rx_log_lock.lock();
+	if (g_rx_log.len + rx_log_entry_size(len) > FLASH_PAGE_SIZE)
+	{
+		rx_log_write_page();
+	}
+	if (g_rx_log.len == 0)
+	{
+		page_ring_start(&g_rx_log);
+	}
+
+	s_rx_log_entry *entry = (s_rx_log_entry *)&g_rx_log.page[g_rx_log.len];
+	entry->len = len;
+	entry->fport = fport;
+	entry->rssi = rssi;
+	entry->snr = snr;
+	entry->size = size;
+	entry->boot = g_rx_log_boot;
+	entry->time = time;
+	entry->freq = freq;
+	// The LoRaWAN MAC does not report the data rate of a downlink
+	entry->sf = g_lorawan_settings.lorawan_enable ? 0 : g_lorawan_settings.p2p_sf;
+	memcpy(&g_rx_log.page[g_rx_log.len + sizeof(s_rx_log_entry)], data, len);
+	entry->check = rx_log_check(entry);
+	g_rx_log.len += rx_log_entry_size(len);
+	g_rx_log_count++;
+	g_rx_log_lock.unlock();
+}
+
+/**
+ * @brief Go through all entries of the log, oldest first
+ * Each page is copied before its entries are reported, the log is not locked
+ * while the callback sends the entries out
+ * 
+ * @param callback called for each entry, the payload follows the entry
+ * @param arg argument for the callback
+ * @return uint32_t number of entries
+ */
+uint32_t rx_log_read(void (*callback)(const s_rx_log_entry *entry, void *arg), void *arg)
+{
+	uint8_t page_copy[FLASH_PAGE_SIZE] __attribute__((aligned(4)));
+	uint32_t count = 0;
+
+	g_rx_log_lock.lock();
+	uint16_t page = g_rx_log.write_page;
+	g_rx_log_lock.unlock();
+
+	// The oldest page is the next page to write
+	for (uint16_t idx = 0; idx < RX_LOG_PAGES; idx++)
+	{
+		g_rx_log_lock.lock();
+		bool valid = page_ring_valid(&g_rx_log, page);
+		if (valid)
+		{
+			memcpy(page_copy, page_ring_page(&g_rx_log, page), FLASH_PAGE_SIZE);
+		}
+		g_rx_log_lock.unlock();
+
+		if (valid)
+		{
+			count += rx_log_walk(page_copy, FLASH_PAGE_SIZE, callback, arg);
+		}
+		page = (page + 1) % RX_LOG_PAGES;
+	}
+
+	// Newest entries that are not written yet
+	g_rx_log_lock.lock();
+	uint16_t len = g_rx_log.len;
+	memcpy(page_copy, g_rx_log.page, len);
+	g_rx_log_lock.unlock();
+	count += rx_log_walk(page_copy, len, callback, arg);
+
+	return count;
+}
+
+/**
+ * @brief Write the logged entries from RAM to the flash
+ * Called before a reset
+ * 
+ */
+void rx_log_flush(void)
+{
+	g_rx_log_lock.lock();
+	rx_log_write_page();
+	g_rx_log_lock.unlock();
+}
+
+/**
+ * @brief Write the logged entries from RAM to the flash after RX_LOG_WRITE_DELAY
+ * 
+ */
+void rx_log_flush_check(void)
+{
+	g_rx_log_lock.lock();
+	if (page_ring_due(&g_rx_log, RX_LOG_WRITE_DELAY))
+	{
+		rx_log_write_page();
+	}
+	g_rx_log_lock.unlock();
+}
+
+/**
+ * @brief Erase the log
+ * 
+ */
+void rx_log_clear(void)
+{
+	g_rx_log_lock.lock();
+	page_ring_clear(&g_rx_log);
+	g_rx_log_count = 0;
+	g_rx_log_lock.unlock();
+}
@@ -0,0 +1,283 @@
+/**
+ * @file settings.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Registry of the settings, used by the AT commands and the status output
+ * @version 0.1
+ * @date 2021-10-09
+ * 
+ * @copyright Copyright (c) 2021
+ * 
+ */
+#include "main.h"
+
+/** Offset and size of a field in s_lorawan_settings */
+#define SETTING(field) offsetof(s_lorawan_settings, field), sizeof(s_lorawan_settings::field)
+
+/** Value names of the settings */
+const char *bandwidths[] = {"125", "250", "500", "062", "041", "031", "020", "015", "010", "007"};
+const char *region_names[] = {"AS923", "AU915", "CN470", "CN779", "EU433", "EU868", "KR920", "IN865",
+							  "US915", "AS923-2", "AS923-3", "AS923-4", "RU864"};
+static const char *const names_enabled[] = {"disabled", "enabled"};
+static const char *const names_network[] = {"private", "public"};
+static const char *const names_mode[] = {"P2P", "LPWAN"};
+// Class B is not supported
+static const char *const names_class[] = {"A", NULL, "C"};
+static const char *const names_verbose[] = {"numeric", "verbose"};
+static const char *const names_flow_control[] = {"off", "RTS/CTS"};
+static const char *const names_session[] = {"none", "valid"};
+
+/** All settings that are shown in the status output, sorted by their offset */
+constexpr s_setting g_settings[] = {
+	/*| AT command | Name | Field | Format | Flags | Status group | Min | Max | Value names |*/
+	{NULL, "Marks", offsetof(s_lorawan_settings, valid_mark_1), 2, SETTING_BYTES, 0, SETTING_GROUP_LPWAN, 0, 0, NULL},
+	{"+DEVEUI", "Dev EUI", SETTING(node_device_eui), SETTING_BYTES, SETTING_LPWAN | SETTING_SESSION, SETTING_GROUP_LPWAN, 0, 0, NULL},
+	{"+APPEUI", "App EUI", SETTING(node_app_eui), SETTING_BYTES, SETTING_LPWAN | SETTING_SESSION, SETTING_GROUP_LPWAN, 0, 0, NULL},
+	{"+APPKEY", "App Key", SETTING(node_app_key), SETTING_BYTES, SETTING_LPWAN | SETTING_SESSION, SETTING_GROUP_LPWAN, 0, 0, NULL},
+	{"+DEVADDR", "Dev Addr", SETTING(node_dev_addr), SETTING_HEX, SETTING_LPWAN, SETTING_GROUP_LPWAN, 0, 0xFFFFFFFF, NULL},
+	{"+NWKSKEY", "NWS Key", SETTING(node_nws_key), SETTING_BYTES, SETTING_LPWAN, SETTING_GROUP_LPWAN, 0, 0, NULL},
+	{"+APPSKEY", "Apps Key", SETTING(node_apps_key), SETTING_BYTES, SETTING_LPWAN, SETTING_GROUP_LPWAN, 0, 0, NULL},
+	{"+NJM", "OTAA", SETTING(otaa_enabled), SETTING_DEC, SETTING_LPWAN | SETTING_SESSION, SETTING_GROUP_LPWAN, 0, 1, names_enabled},
+	{"+ADR", "ADR", SETTING(adr_enabled), SETTING_DEC, SETTING_LPWAN, SETTING_GROUP_LPWAN, 0, 1, names_enabled},
+	{NULL, "Network type", SETTING(public_network), SETTING_DEC, 0, SETTING_GROUP_LPWAN, 0, 1, names_network},
+	{NULL, "Dutycycle", SETTING(duty_cycle_enabled), SETTING_DEC, 0, SETTING_GROUP_LPWAN, 0, 1, names_enabled},
+	{NULL, "Repeat time", SETTING(send_repeat_time), SETTING_DEC, 0, SETTING_GROUP_LPWAN, 0, 3600000, NULL},
+	{NULL, "Join trials", SETTING(join_trials), SETTING_DEC, 0, SETTING_GROUP_LPWAN, 0, 255, NULL},
+	{"+TXP", "TX Power", SETTING(tx_power), SETTING_DEC, SETTING_LPWAN, SETTING_GROUP_LPWAN, 0, 10, NULL},
+	{"+DR", "DR", SETTING(data_rate), SETTING_DEC, SETTING_LPWAN, SETTING_GROUP_LPWAN, 0, 15, NULL},
+	{"+CLASS", "Class", SETTING(lora_class), SETTING_NAME, SETTING_LPWAN, SETTING_GROUP_LPWAN, 0, 2, names_class},
+	{NULL, "Subband", SETTING(subband_channels), SETTING_DEC, 0, SETTING_GROUP_LPWAN, 1, 12, NULL},
+	{NULL, "Auto join", SETTING(auto_join), SETTING_DEC, 0, SETTING_GROUP_DEVICE, 0, 1, names_enabled},
+	{NULL, "Fport", SETTING(app_port), SETTING_DEC, 0, SETTING_GROUP_LPWAN, 1, 223, NULL},
+	{"+CFM", "Confirmed messages", SETTING(confirmed_msg_enabled), SETTING_DEC, SETTING_LPWAN, SETTING_GROUP_LPWAN, 0, 1, names_enabled},
+	{"+BAND", "Region", SETTING(lora_region), SETTING_DEC, SETTING_LPWAN | SETTING_SESSION, SETTING_GROUP_LPWAN, 0, 12, region_names},
+	{NULL, "Mode", SETTING(lorawan_enable), SETTING_DEC, 0, SETTING_GROUP_DEVICE, 0, 1, names_mode},
+	{"+PFREQ", "P2P frequency", SETTING(p2p_frequency), SETTING_DEC, SETTING_P2P | SETTING_RADIO, SETTING_GROUP_P2P, 525000000, 960000000, NULL},
+	{"+PTP", "P2P TX Power", SETTING(p2p_tx_power), SETTING_DEC, SETTING_P2P | SETTING_RADIO, SETTING_GROUP_P2P, 0, 23, NULL},
+	{"+PBW", "P2P BW", SETTING(p2p_bandwidth), SETTING_NAME, SETTING_P2P | SETTING_RADIO, SETTING_GROUP_P2P, 0, 9, bandwidths},
+	{"+PSF", "P2P SF", SETTING(p2p_sf), SETTING_DEC, SETTING_P2P | SETTING_RADIO, SETTING_GROUP_P2P, 7, 12, NULL},
+	{"+PCR", "P2P CR", SETTING(p2p_cr), SETTING_DEC, SETTING_P2P | SETTING_RADIO, SETTING_GROUP_P2P, 1, 4, NULL},
+	{"+PPL", "P2P Preamble length", SETTING(p2p_preamble_len), SETTING_DEC, SETTING_P2P | SETTING_RADIO, SETTING_GROUP_P2P, 0, 255, NULL},
+	{NULL, "P2P Symbol Timeout", SETTING(p2p_symbol_timeout), SETTING_DEC, 0, SETTING_GROUP_P2P, 0, 0xFFFF, NULL},
+	{NULL, "AT echo", SETTING(at_echo), SETTING_DEC, 0, SETTING_GROUP_NONE, 0, 1, names_enabled},
+	{NULL, "AT result codes", SETTING(at_verbose), SETTING_DEC, 0, SETTING_GROUP_NONE, 0, 1, names_verbose},
+	{NULL, "Serial1 baudrate", SETTING(at_baudrate), SETTING_DEC, 0, SETTING_GROUP_NONE, 0, 0xFFFFFFFF, NULL},
+	{NULL, "Serial1 flow control", SETTING(at_flow_control), SETTING_DEC, 0, SETTING_GROUP_NONE, 0, 1, names_flow_control},
+	{NULL, "Session", SETTING(session_valid), SETTING_DEC, 0, SETTING_GROUP_NONE, 0, 1, names_session},
+	{NULL, "Session Dev Addr", SETTING(session_dev_addr), SETTING_HEX, 0, SETTING_GROUP_NONE, 0, 0xFFFFFFFF, NULL},
+	{NULL, "Session FCntUp", SETTING(session_fcnt_up), SETTING_DEC, 0, SETTING_GROUP_NONE, 0, 0xFFFFFFFF, NULL},
+	{NULL, "Session FCntDown", SETTING(session_fcnt_down), SETTING_DEC, 0, SETTING_GROUP_NONE, 0, 0xFFFFFFFF, NULL},
+	{NULL, "RX log", SETTING(rx_log_enable), SETTING_DEC, 0, SETTING_GROUP_NONE, 0, 1, names_enabled},
+	{"+PCADR", "P2P CAD retries", SETTING(p2p_cad_retries), SETTING_DEC, SETTING_P2P, SETTING_GROUP_P2P, 0, 10, NULL},
+	{"+PBACKOFF", "P2P backoff", SETTING(p2p_backoff), SETTING_DEC, SETTING_P2P, SETTING_GROUP_P2P, 10, 10000, NULL},
+	{"+PBUDGET", "P2P airtime budget", SETTING(p2p_airtime_budget), SETTING_DEC, SETTING_P2P, SETTING_GROUP_P2P, 0, 3600000, NULL},
+	{NULL, "P2P hopping channels", SETTING(p2p_hop_num), SETTING_DEC, 0, SETTING_GROUP_P2P, 0, P2P_HOP_MAX, NULL},
+	{NULL, "P2P hopping reset", SETTING(p2p_hop_reset), SETTING_DEC, 0, SETTING_GROUP_P2P, 0, 3600, NULL},
+	{NULL, "P2P hopping seed", SETTING(p2p_hop_seed), SETTING_HEX, 0, SETTING_GROUP_P2P, 0, 0xFFFFFFFF, NULL},
+};
+
+/** Number of settings in g_settings */
+#define SETTINGS_NUM (sizeof(g_settings) / sizeof(s_setting))
+const uint8_t g_settings_num = SETTINGS_NUM;
+
+/**
+ * @brief Check the entries of g_settings at compile time
+ * 
+ * @return true if all entries are consistent
+ */
+static constexpr bool settings_check(void)
+{
+	for (uint16_t idx = 0; idx < SETTINGS_NUM; idx++)
+	{
+		const s_setting *setting = &g_settings[idx];
+		if ((idx > 0) && (setting->offset <= g_settings[idx - 1].offset))
+		{
+			return false;
+		}
+		if (setting->format == SETTING_BYTES)
+		{
+			if (setting->size > SETTING_BYTES_MAX)
+			{
+				return false;
+			}
+			continue;
+		}
+		if ((setting->size != 1) && (setting->size != 2) && (setting->size != 4))
+		{
+			return false;
+		}
+		if ((setting->size < 4) && (setting->max >= (1UL << (8 * setting->size))))
+		{
+			return false;
+		}
+		if ((setting->min > setting->max) || ((setting->format == SETTING_NAME) && (setting->names == NULL)))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static_assert(SETTINGS_NUM < 256, "Too many settings");
+static_assert(settings_check(), "g_settings is not sorted by offset or has an invalid size or range");
+
+/**
+ * @brief Find the setting of an AT command
+ * 
+ * @param cmd_name AT command like "+PSF"
+ * @return const s_setting* setting, NULL if the command has no setting
+ */
+const s_setting *setting_find(const char *cmd_name)
+{
+	for (uint8_t idx = 0; idx < SETTINGS_NUM; idx++)
+	{
+		if ((g_settings[idx].cmd_name != NULL) && (strcmp(g_settings[idx].cmd_name, cmd_name) == 0))
+		{
+			return &g_settings[idx];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @brief Get the value of a numeric setting
+ * 
+ * @param setting setting, not SETTING_BYTES
+ * @return uint32_t value
+ */
+uint32_t setting_get(const s_setting *setting)
+{
+	const uint8_t *field = (const uint8_t *)&g_lorawan_settings + setting->offset;
+	switch (setting->size)
+	{
+	case 1:
+		return *field;
+	case 2:
+	{
+		uint16_t value;
+		memcpy(&value, field, 2);
+		return value;
+	}
+	default:
+	{
+		uint32_t value;
+		memcpy(&value, field, 4);
+		return value;
+	}
+	}
+}
+
+/**
+ * @brief Check a new value of a setting and store it
+ * 
+ * @param setting setting
+ * @param str new value in the format of the AT command
+ * @param settings settings the value is stored in
+ * @return true if the value was valid, settings are not changed otherwise
+ */
+bool setting_parse(const s_setting *setting, const char *str, s_lorawan_settings *settings)
+{
+	uint8_t *field = (uint8_t *)settings + setting->offset;
+	uint8_t buf[SETTING_BYTES_MAX];
+	uint32_t value = 0;
+
+	switch (setting->format)
+	{
+	case SETTING_BYTES:
+		if (hex_decode(str, strlen(str), buf, setting->size) != setting->size)
+		{
+			return false;
+		}
+		memcpy(field, buf, setting->size);
+		return true;
+	case SETTING_HEX:
+		// MSB first
+		if (hex_decode(str, strlen(str), buf, setting->size) != setting->size)
+		{
+			return false;
+		}
+		for (uint8_t idx = 0; idx < setting->size; idx++)
+		{
+			value = (value << 8) | buf[idx];
+		}
+		break;
+	case SETTING_NAME:
+	{
+		uint32_t idx = setting->min;
+		while ((idx <= setting->max) && ((setting->names[idx] == NULL) || (strcmp(str, setting->names[idx]) != 0)))
+		{
+			idx++;
+		}
+		value = idx;
+		break;
+	}
+	default:
+	{
+		char *end;
+		if ((str[0] < '0') || (str[0] > '9'))
+		{
+			return false;
+		}
+		value = strtoul(str, &end, 10);
+		if (*end != '\0')
+		{
+			return false;
+		}
+		break;
+	}
+	}
+
+	if ((value < setting->min) || (value > setting->max) ||
+		((setting->names != NULL) && (setting->names[value] == NULL)))
+	{
+		return false;
+	}
+
+	switch (setting->size)
+	{
+	case 1:
+		*field = value;
+		break;
+	case 2:
+	{
+		uint16_t value_16 = value;
+		memcpy(field, &value_16, 2);
+		break;
+	}
+	default:
+		memcpy(field, &value, 4);
+		break;
+	}
+	return true;
+}
+
+/**
+ * @brief Write the value of a setting as text
+ * 
+ * @param setting setting
+ * @param buf output buffer
+ * @param size size of the output buffer, at least 2 * SETTING_BYTES_MAX + 1
+ * @param status true for the status output with the value names, false for the AT command format
+ */
+void setting_print(const s_setting *setting, char *buf, uint16_t size, bool status)
+{
+	if (setting->format == SETTING_BYTES)
+	{
+		hex_encode((const uint8_t *)&g_lorawan_settings + setting->offset, setting->size, buf);
+		return;
+	}
+
+	uint32_t value = setting_get(setting);
+	if ((setting->names != NULL) && (status || (setting->format == SETTING_NAME)) &&
+		(value <= setting->max) && (setting->names[value] != NULL))
+	{
+		snprintf(buf, size, "%s", setting->names[value]);
+	}
+	else if (setting->format == SETTING_HEX)
+	{
+		snprintf(buf, size, "%0*lX", setting->size * 2, (unsigned long)value);
+	}
+	else
+	{
+		snprintf(buf, size, "%lu", (unsigned long)value);
+	}
+}
@@ -8,7 +8,32 @@
  * @copyright Copyright (c) 2021
  * 
  */
-#include "main.h"
+#include "at_cmd.h"
+#include <hardware/uart.h>
+#include <hardware/gpio.h>
+
+/** Size of the Serial1 RX ring buffer, must be a power of 2 */
+#define SERIAL_RX_BUFF_SIZE 512
+#define SERIAL_RX_BUFF_MASK (SERIAL_RX_BUFF_SIZE - 1)
+
+/** Fallback wake up of the serial task in milliseconds, in case an RX event was missed */
+#define SERIAL_IDLE_TIMEOUT 500
+
+/** Time in milliseconds a new Serial1 baud rate must be confirmed by an AT command before falling back to the default */
+#define SERIAL1_BAUD_FALLBACK_TIME 30000
+
+/** RP2040 UART behind Serial1 and its flow control pins */
+#define SERIAL1_UART uart0
+#define SERIAL1_CTS_PIN 2
+#define SERIAL1_RTS_PIN 3
+
+//***************************************************
+// Signals to wake up the serial task
+//***************************************************
+/** Data received on USB Serial */
+#define SIGNAL_SERIAL_USB_RX 0x0001
+/** Data received on Serial1 */
+#define SIGNAL_SERIAL1_RX 0x0002
 
 /** The event handler thread */
 Thread _thread_handle_serial(osPriorityNormal, 4096);
@@ -16,69 +41,427 @@ Thread _thread_handle_serial(osPriorityNormal, 4096);
 /** Thread id for lora event thread */
 osThreadId _serial_task_thread = NULL;
 
+/** Ring buffer filled from the Serial1 RX interrupt */
+struct s_serial_rx_buffer
+{
+	volatile uint16_t head = 0;
+	volatile uint16_t tail = 0;
+	uint8_t data[SERIAL_RX_BUFF_SIZE];
+};
+static s_serial_rx_buffer serial1_rx_buffer;
+
+/** Number of bytes lost because the Serial1 RX ring buffer was full */
+volatile uint32_t g_serial1_rx_overruns = 0;
+
+/** Low level serial object behind Serial1 */
+static mbed::UnbufferedSerial *serial1_hw = NULL;
+
+/** Flag if RTS/CTS flow control is enabled on Serial1 */
+static volatile bool serial1_flow_control = false;
+/** Flag if the RX interrupt was disabled because the RX ring buffer was full */
+static volatile bool serial1_rx_paused = false;
+
+/** Supported baud rates of Serial1 */
+static const uint32_t serial1_baud_rates[] = {9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600};
+
+/** Active baud rate and flow control of Serial1 */
+static uint32_t serial1_baud = SERIAL1_DEFAULT_BAUD;
+static uint8_t serial1_flow = 0;
+
+/** Requested baud rate and flow control, applied by the serial task after the reply was sent */
+static uint32_t serial1_new_baud = 0;
+static uint8_t serial1_new_flow = 0;
+
+/** Time of the last baud rate change, 0 if the active baud rate is confirmed */
+static time_t serial1_baud_change_time = 0;
+
+/**
+ * @brief Serial1 RX interrupt handler
+ * Moves all received bytes into the RX ring buffer and wakes up the serial task
+ * 
+ */
 void serial1_rx_handler(void)
+{
+	uint8_t rx_char;
+	while (serial1_hw->readable())
+	{
+		uint16_t next = (serial1_rx_buffer.head + 1) & SERIAL_RX_BUFF_MASK;
+		if (next == serial1_rx_buffer.tail)
+		{
+			if (serial1_flow_control)
+			{
+				// Leave the data in the UART FIFO, RTS stops the host until the serial task made space
+				uart_set_irq_enables(SERIAL1_UART, false, false);
+				serial1_rx_paused = true;
+				break;
+			}
+			serial1_hw->read(&rx_char, 1);
+			g_serial1_rx_overruns++;
+			continue;
+		}
+		serial1_hw->read(&rx_char, 1);
+		serial1_rx_buffer.data[serial1_rx_buffer.head] = rx_char;
+		serial1_rx_buffer.head = next;
+	}
+
+	if (_serial_task_thread != NULL)
+	{
+		osSignalSet(_serial_task_thread, SIGNAL_SERIAL1_RX);
+	}
+}
+
+/**
+ * @brief USB Serial RX callback
+ * The USB stack buffers the data, only wake up the serial task
+ * 
+ */
+void usb_rx_handler(void)
 {
 	if (_serial_task_thread != NULL)
 	{
-		osSignalSet(_serial_task_thread, SIGNAL_RX);
+		osSignalSet(_serial_task_thread, SIGNAL_SERIAL_USB_RX);
 	}
 }
 
+/**
+ * @brief Route the Serial1 RX interrupt to serial1_rx_handler()
+ * Must be called again after every Serial1.begin(), because begin()
+ * attaches the default RX handler of the core
+ * 
+ */
+void serial1_attach_rx(void)
+{
+	serial1_hw = static_cast<mbed::UnbufferedSerial *>((mbed::FileHandle *)Serial1);
+	serial1_hw->attach(serial1_rx_handler, mbed::SerialBase::RxIrq);
+}
+
+/**
+ * @brief Check if a baud rate is supported by Serial1
+ * 
+ * @param baud baud rate
+ * @return true if supported
+ */
+bool serial1_baud_valid(uint32_t baud)
+{
+	for (uint8_t idx = 0; idx < sizeof(serial1_baud_rates) / sizeof(serial1_baud_rates[0]); idx++)
+	{
+		if (serial1_baud_rates[idx] == baud)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * @brief Configure baud rate and flow control of Serial1
+ * Waits until all pending output is sent with the old settings
+ * 
+ * @param baud baud rate
+ * @param flow_control 1 => RTS/CTS flow control, 0 => no flow control
+ */
+static void serial1_config(uint32_t baud, uint8_t flow_control)
+{
+	uart_tx_wait_blocking(SERIAL1_UART);
+	serial1_hw->baud(baud);
+	if (flow_control)
+	{
+		gpio_set_function(SERIAL1_CTS_PIN, GPIO_FUNC_UART);
+		gpio_set_function(SERIAL1_RTS_PIN, GPIO_FUNC_UART);
+		uart_set_hw_flow(SERIAL1_UART, true, true);
+	}
+	else
+	{
+		uart_set_hw_flow(SERIAL1_UART, false, false);
+		gpio_set_function(SERIAL1_CTS_PIN, GPIO_FUNC_NULL);
+		gpio_set_function(SERIAL1_RTS_PIN, GPIO_FUNC_NULL);
+	}
+	serial1_flow_control = flow_control;
+	serial1_baud = baud;
+	serial1_flow = flow_control;
+}
+
+/**
+ * @brief Request new baud rate and flow control for Serial1
+ * The change is applied by the serial task after the reply of the AT command was sent.
+ * It is saved after the first AT command received on Serial1 with the new settings,
+ * without such a command Serial1 falls back to the default settings after SERIAL1_BAUD_FALLBACK_TIME
+ * 
+ * @param baud baud rate, must be one of the supported baud rates
+ * @param flow_control 1 => RTS/CTS flow control, 0 => no flow control
+ */
+void serial1_set_baud(uint32_t baud, uint8_t flow_control)
+{
+	serial1_new_flow = flow_control;
+	serial1_new_baud = baud;
+}
+
+/**
+ * @brief Get the active baud rate and flow control of Serial1
+ * 
+ * @param baud active baud rate
+ * @param flow_control active flow control
+ */
+void serial1_get_baud(uint32_t *baud, uint8_t *flow_control)
+{
+	*baud = serial1_baud;
+	*flow_control = serial1_flow;
+}
+
+/**
+ * @brief An AT command was received on Serial1, confirm the active baud rate
+ * 
+ */
+void serial1_baud_confirm(void)
+{
+	if (serial1_baud_change_time == 0)
+	{
+		return;
+	}
+	serial1_baud_change_time = 0;
+	g_lorawan_settings.at_baudrate = serial1_baud;
+	g_lorawan_settings.at_flow_control = serial1_flow;
+	save_settings();
+}
+
+/**
+ * @brief Start the time the active baud rate must be confirmed in
+ * 
+ */
+static void serial1_baud_unconfirmed(void)
+{
+	serial1_baud_change_time = millis();
+	// 0 marks a confirmed baud rate
+	if (serial1_baud_change_time == 0)
+	{
+		serial1_baud_change_time = 1;
+	}
+}
+
+/**
+ * @brief Apply a requested baud rate change
+ * Called by the AT command parser after the reply was sent
+ * 
+ */
+void serial1_baud_apply(void)
+{
+	if (serial1_new_baud != 0)
+	{
+		serial1_config(serial1_new_baud, serial1_new_flow);
+		serial1_new_baud = 0;
+		serial1_baud_unconfirmed();
+	}
+}
+
+/**
+ * @brief Fall back to the default baud rate if a new baud rate was not confirmed in time
+ * 
+ */
+void serial1_baud_check(void)
+{
+	if ((serial1_baud_change_time != 0) && ((millis() - serial1_baud_change_time) > SERIAL1_BAUD_FALLBACK_TIME))
+	{
+		serial1_config(SERIAL1_DEFAULT_BAUD, 0);
+		serial1_baud_confirm();
+	}
+}
+
+/** Response buffer for output of the loop thread */
+s_at_resp g_urc_resp;
+
+/**
+ * @brief Write the buffered output to the port(s) and empty the buffer
+ * 
+ * @param resp response buffer
+ */
+void at_resp_flush(s_at_resp *resp)
+{
+	if (resp->len == 0)
+	{
+		return;
+	}
+	if (resp->sink != NULL)
+	{
+		resp->sink->write((uint8_t *)resp->buf, resp->len);
+	}
+	else
+	{
+		for (uint8_t port = 0; port < AT_PORT_NUM; port++)
+		{
+			if (bin_mode_active(port))
+			{
+				bin_send_event(port, (uint8_t *)resp->buf, resp->len);
+			}
+			else
+			{
+				at_port_sink(port)->write((uint8_t *)resp->buf, resp->len);
+			}
+		}
+	}
+	resp->len = 0;
+}
+
+/**
+ * @brief Formatted output into the response buffer
+ * If the buffer is full, the buffered output is flushed first
+ * 
+ * @param resp response buffer
+ * @param format printf format string
+ * @param args arguments
+ */
+void at_resp_vprintf(s_at_resp *resp, const char *format, va_list args)
+{
+	va_list args_copy;
+	va_copy(args_copy, args);
+	int len = vsnprintf(&resp->buf[resp->len], AT_RESP_SIZE - resp->len, format, args_copy);
+	va_end(args_copy);
+
+	if (len < 0)
+	{
+		return;
+	}
+	if (len >= (AT_RESP_SIZE - resp->len))
+	{
+		// Does not fit, flush and format again into the empty buffer
+		at_resp_flush(resp);
+		len = vsnprintf(resp->buf, AT_RESP_SIZE, format, args);
+		if (len < 0)
+		{
+			return;
+		}
+		if (len >= AT_RESP_SIZE)
+		{
+			len = AT_RESP_SIZE - 1;
+		}
+	}
+	resp->len += len;
+}
+
+/**
+ * @brief Formatted output into the response buffer
+ * 
+ * @param resp response buffer
+ * @param format printf format string
+ */
+void at_resp_printf(s_at_resp *resp, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	at_resp_vprintf(resp, format, args);
+	va_end(args);
+}
+
+/**
+ * @brief Hex encoded output of binary data into the response buffer
+ * 
+ * @param resp response buffer
+ * @param data binary data
+ * @param len length of data
+ */
+void at_resp_hex(s_at_resp *resp, const uint8_t *data, uint16_t len)
+{
+	while (len > 0)
+	{
+		// Space for the HEX characters and the string terminator
+		uint16_t space = (AT_RESP_SIZE - resp->len - 1) / 2;
+		if (space == 0)
+		{
+			at_resp_flush(resp);
+			continue;
+		}
+		uint16_t chunk = len < space ? len : space;
+		resp->len += hex_encode(data, chunk, &resp->buf[resp->len]);
+		data += chunk;
+		len -= chunk;
+	}
+}
+
+/**
+ * @brief Report a received packet to all ports
+ * Ports in binary mode get a binary RX frame, all other ports the RX: message
+ * 
+ * @param fport fPort of the packet (0 for LoRa P2P)
+ * @param rssi RSSI of the packet
+ * @param snr SNR of the packet
+ * @param data received data
+ * @param len length of received data
+ */
+void at_report_rx(uint8_t fport, int16_t rssi, int8_t snr, uint8_t *data, uint16_t len)
+{
+	for (uint8_t port = 0; port < AT_PORT_NUM; port++)
+	{
+		if (bin_mode_active(port))
+		{
+			bin_send_rx(port, fport, rssi, snr, data, len);
+		}
+		else
+		{
+			g_urc_resp.sink = at_port_sink(port);
+			at_resp_printf(&g_urc_resp, "RX:%d:%d:%d:%d:", fport, len, rssi, snr);
+			at_resp_hex(&g_urc_resp, data, len);
+			at_resp_printf(&g_urc_resp, "\nOK\n");
+			at_resp_flush(&g_urc_resp);
+		}
+	}
+	g_urc_resp.sink = NULL;
+}
+
 // Task to handle timer events
 void _serial_task()
 {
 	_serial_task_thread = osThreadGetId();
-	// attachInterrupt(SERIAL1_RX, serial1_rx_handler, RISING);
 
 	// Flush for serial USB RX
-	if (Serial.available())
+	while (Serial.available() > 0)
 	{
-		while (Serial.available() > 0)
-		{
-			Serial.read();
-			delay(10);
-		}
+		Serial.read();
 	}
 
 	// Flush for serial 1 RX
-	if (Serial1.available())
+	serial1_rx_buffer.tail = serial1_rx_buffer.head;
+
+	Serial.attach(usb_rx_handler);
+	serial1_attach_rx();
+	serial1_config(g_lorawan_settings.at_baudrate, g_lorawan_settings.at_flow_control);
+	if ((serial1_baud != SERIAL1_DEFAULT_BAUD) || (serial1_flow != 0))
 	{
-		while (Serial1.available() > 0)
-		{
-			Serial1.read();
-			delay(10);
-		}
+		// Saved settings the host cannot talk with would lock out Serial1, they fall back like a new baud rate
+		serial1_baud_unconfirmed();
 	}
 
 	while (true)
 	{
-		// Wait for serial USB RX
-		if (Serial.available())
+		// Sleep until data arrives on one of the ports
+		osSignalWait(0, SERIAL_IDLE_TIMEOUT);
+
+		// Handle serial USB RX
+		while (Serial.available() > 0)
 		{
-			while (Serial.available() > 0)
-			{
-				at_serial_input(uint8_t(Serial.read()));
-				delay(5);
-			}
+			at_serial_input(uint8_t(Serial.read()), AT_PORT_USB);
 		}
 
-		// Wait for serial 1 RX
-		// osEvent event = osSignalWait(0, osWaitForever);
-		if (Serial1.available())
+		// Handle serial 1 RX
+		while (serial1_rx_buffer.tail != serial1_rx_buffer.head)
 		{
-			while (Serial1.available() > 0)
-			{
-				at_serial_input(uint8_t(Serial1.read()));
-				delay(5);
-			}
+			uint8_t rx_char = serial1_rx_buffer.data[serial1_rx_buffer.tail];
+			serial1_rx_buffer.tail = (serial1_rx_buffer.tail + 1) & SERIAL_RX_BUFF_MASK;
+			at_serial_input(rx_char, AT_PORT_SERIAL1);
+		}
+
+		// Ring buffer is empty, resume RX if it was stopped by flow control
+		if (serial1_rx_paused)
+		{
+			serial1_rx_paused = false;
+			uart_set_irq_enables(SERIAL1_UART, true, false);
 		}
-		delay(100);
-		yield();
 	}
 }
 
 bool init_serial_task(void)
 {
+	at_init_ports();
+	init_at_cmd_task();
+
 	_thread_handle_serial.start(_serial_task);
 	_thread_handle_serial.set_priority(osPriorityNormal);
 
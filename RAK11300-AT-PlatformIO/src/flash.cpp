@@ -10,12 +10,231 @@
  */
 #include "main.h"
 #include <hardware/flash.h>
+#include <stddef.h>
 
 uint16_t g_sw_ver_1 = 1; // major version increase on API change / not backwards compatible
 uint16_t g_sw_ver_2 = 0; // minor version increase on API change / backward compatible
 uint16_t g_sw_ver_3 = 0; // patch version increase on bugfix, no affect on API
 
-#define FLASH_TARGET_OFFSET (PICO_FLASH_SIZE_BYTES - FLASH_SECTOR_SIZE)
+/** Marker of a valid settings log sector "SLOG" */
+#define SETTINGS_LOG_MAGIC 0x474F4C53
+/** Unchanged bytes between two changes that are still written as one record */
+#define SETTINGS_LOG_MERGE_GAP 4
+
+/** Largest settings image of any layout version, record lengths are 8 bit */
+#define SETTINGS_IMAGE_MAX 256
+/** Size of the settings image of layout version 1, the AT interface settings were appended in version 2 */
+#define SETTINGS_V1_SIZE offsetof(s_lorawan_settings, at_echo)
+/** Size of the settings image of layout version 2, the LoRaWAN session was appended in version 3 */
+#define SETTINGS_V2_SIZE offsetof(s_lorawan_settings, session_valid)
+/** Size of the settings image of layout version 3, the RX log flag was appended in version 4 */
+#define SETTINGS_V3_SIZE offsetof(s_lorawan_settings, rx_log_enable)
+/** Size of the settings image of layout version 4, the P2P listen before talk settings were appended in version 5 */
+#define SETTINGS_V4_SIZE offsetof(s_lorawan_settings, p2p_cad_retries)
+/** Size of the settings image of layout version 5, the P2P airtime budget was appended in version 6 */
+#define SETTINGS_V5_SIZE offsetof(s_lorawan_settings, p2p_airtime_budget)
+/** Size of the settings image of layout version 6, the P2P hopping channels were appended in version 7 */
+#define SETTINGS_V6_SIZE offsetof(s_lorawan_settings, p2p_hop_num)
+/** Size of the settings image of layout version 7, the MAC parameters of the LoRaWAN session were appended in version 8 */
+#define SETTINGS_V7_SIZE offsetof(s_lorawan_settings, session_rx2_freq)
+
+static_assert(sizeof(s_lorawan_settings) < SETTINGS_IMAGE_MAX, "Settings image too large for the 8 bit record lengths");
+
+/** Header at the start of a settings log sector, written after the snapshot of the settings */
+struct s_log_sector
+{
+	// SETTINGS_LOG_MAGIC
+	uint32_t magic;
+	// Sequence number, the sector with the highest number is the active one
+	uint32_t seq;
+	// Layout version of the settings in this sector
+	uint16_t version;
+	// Size of the settings in this sector
+	uint16_t size;
+	// CRC32 of the snapshot
+	uint32_t crc;
+};
+
+/** Header of a settings log record, followed by the data, padded to 4 bytes */
+struct s_log_record
+{
+	// Offset of the data in the settings image
+	uint8_t offset;
+	// Length of the data, 0 => commit of the records before, 0xFF => end of the log
+	uint8_t len;
+	// CRC16 of offset, length and data
+	uint16_t crc;
+};
+
+/** Upgrade of a settings image to the next layout version */
+struct s_settings_migration
+{
+	// Size of the image in the old layout version
+	uint16_t size;
+	// Converts the image in place, the bytes after the old size are preset with the defaults
+	void (*migrate)(s_lorawan_settings *settings);
+};
+
+/**
+ * @brief Layout version 1 => 2, AT echo, result codes and Serial1 settings were added
+ * 
+ * @param settings settings image
+ */
+static void settings_migrate_v1(s_lorawan_settings *settings)
+{
+	settings->at_echo = 1;
+	settings->at_verbose = 1;
+	settings->at_baudrate = SERIAL1_DEFAULT_BAUD;
+	settings->at_flow_control = 0;
+}
+
+/**
+ * @brief Layout version 2 => 3, the LoRaWAN session was added
+ * 
+ * @param settings settings image
+ */
+static void settings_migrate_v2(s_lorawan_settings *settings)
+{
+	settings->session_valid = 0;
+}
+
+/**
+ * @brief Layout version 3 => 4, the RX log flag was added
+ * 
+ * @param settings settings image
+ */
+static void settings_migrate_v3(s_lorawan_settings *settings)
+{
+	settings->rx_log_enable = 0;
+}
+
+/**
+ * @brief Layout version 4 => 5, the P2P CAD retries and backoff were added
+ * 
+ * @param settings settings image
+ */
+static void settings_migrate_v4(s_lorawan_settings *settings)
+{
+	settings->p2p_cad_retries = 3;
+	settings->p2p_backoff = 100;
+}
+
+/**
+ * @brief Layout version 5 => 6, the P2P airtime budget was added
+ * 
+ * @param settings settings image
+ */
+static void settings_migrate_v5(s_lorawan_settings *settings)
+{
+	settings->p2p_airtime_budget = 0;
+}
+
+/**
+ * @brief Layout version 6 => 7, the P2P hopping channels were added
+ * 
+ * @param settings settings image
+ */
+static void settings_migrate_v6(s_lorawan_settings *settings)
+{
+	settings->p2p_hop_num = 0;
+	settings->p2p_hop_reset = 0;
+	settings->p2p_hop_seed = 0;
+	memset(settings->p2p_hop_freq, 0, sizeof(settings->p2p_hop_freq));
+}
+
+/**
+ * @brief Layout version 7 => 8, the MAC parameters of the LoRaWAN session were added
+ * A saved session without them would use the region defaults, the next boot joins again
+ * 
+ * @param settings settings image
+ */
+static void settings_migrate_v7(s_lorawan_settings *settings)
+{
+	settings->session_valid = 0;
+	settings->session_rx2_freq = 0;
+	memset(settings->session_ch_mask, 0, sizeof(settings->session_ch_mask));
+	memset(settings->session_cflist, 0, sizeof(settings->session_cflist));
+	settings->session_rx1_delay = 0;
+	settings->session_rx2_dr = 0;
+}
+
+/** Migrations, index 0 upgrades layout version 1 to 2 */
+static const s_settings_migration settings_migrations[LORAWAN_SETTINGS_VERSION - 1] = {
+	{SETTINGS_V1_SIZE, settings_migrate_v1},
+	{SETTINGS_V2_SIZE, settings_migrate_v2},
+	{SETTINGS_V3_SIZE, settings_migrate_v3},
+	{SETTINGS_V4_SIZE, settings_migrate_v4},
+	{SETTINGS_V5_SIZE, settings_migrate_v5},
+	{SETTINGS_V6_SIZE, settings_migrate_v6},
+	{SETTINGS_V7_SIZE, settings_migrate_v7},
+};
+
+/** Settings as they are stored in the settings log */
+static s_lorawan_settings g_settings_flash;
+/** Active settings log sector and its sequence number */
+static uint8_t g_settings_log_sector = 0;
+static uint32_t g_settings_log_seq = 0;
+/** Offset of the next record in the active sector */
+static uint16_t g_settings_log_pos = 0;
+
+/** Number of records in the active settings log sector */
+uint32_t g_settings_log_records = 0;
+/** Time in microseconds to find and replay the settings log at boot */
+uint32_t g_settings_boot_time = 0;
+
+/** Time in milliseconds after the last change before changed settings are written to the flash */
+#define SETTINGS_WRITE_DELAY 5000
+
+/** Flag if the settings were changed since the last write to the flash */
+static volatile bool g_settings_dirty = false;
+/** Time of the last change of the settings */
+static time_t g_settings_dirty_time = 0;
+
+/** Number of save requests, without write-behind each one could have been a sector erase */
+uint32_t g_settings_save_requests = 0;
+/** Number of sector erases done for the settings */
+uint32_t g_settings_erases = 0;
+
+/** Time in milliseconds a deferred flash operation waits for the radio before it is done anyway */
+#define FLASH_RADIO_WAIT_MAX 30000
+/** Time in milliseconds an erase that is needed now waits for the radio, covers the LoRaWAN RX windows */
+#define FLASH_ERASE_WAIT_MAX 3000
+/** Time in milliseconds between two checks of the radio while an erase waits */
+#define FLASH_RADIO_POLL 10
+/** Number of erase jobs that can wait for the radio, must be a power of 2 */
+#define FLASH_JOB_QUEUE_SIZE 4
+/** Dropped erase job */
+#define FLASH_JOB_NONE 0xFFFFFFFF
+
+/** Erase of a sector that is needed later */
+struct s_flash_job
+{
+	// Offset of the sector in the flash, FLASH_JOB_NONE if the job was dropped
+	uint32_t offset;
+	// Time the job was queued
+	time_t time;
+};
+
+/** Erase jobs, added by the flash users, run by the AT command task */
+static s_flash_job g_flash_jobs[FLASH_JOB_QUEUE_SIZE];
+static uint8_t g_flash_job_head = 0;
+static uint8_t g_flash_job_tail = 0;
+static Mutex g_flash_job_lock;
+
+/** Longest time in microseconds the interrupts were disabled for a flash operation */
+uint32_t g_flash_blackout_max = 0;
+/** Longest time in microseconds the interrupts were disabled while the radio was busy */
+uint32_t g_flash_blackout_radio = 0;
+/** Number of erases that waited for the radio */
+uint32_t g_flash_erase_deferred = 0;
+/** Number of erases done while the radio was busy */
+uint32_t g_flash_erase_forced = 0;
+/** Number of erased sectors */
+uint32_t g_flash_erases = 0;
+/** Number of programmed pages */
+uint32_t g_flash_programs = 0;
+/** Sum of the times in microseconds the interrupts were disabled for flash operations */
+uint32_t g_flash_blackout_total = 0;
 
 void make_credentials(void)
 {
@@ -86,66 +305,644 @@ void make_credentials(void)
 	{
 		Serial.printf("%02X", g_lorawan_settings.node_apps_key[idx]);
 	}
-	Serial.printf("\n\nDevice Addr = %08lX\n", g_lorawan_settings.node_dev_addr);
+	Serial.printf("\n\nDevice Addr = %08" PRIX32 "\n", g_lorawan_settings.node_dev_addr);
 #endif
 }
 
-void init_flash(void)
+/**
+ * @brief CRC16 (CCITT) of a record
+ * 
+ * @param crc start value
+ * @param data data
+ * @param len length of data
+ * @return uint16_t CRC16
+ */
+static uint16_t settings_log_crc(uint16_t crc, const uint8_t *data, uint16_t len)
 {
-	// Check if valid data is in the flash
-	s_lorawan_settings flash_settings;
+	for (uint16_t idx = 0; idx < len; idx++)
+	{
+		crc ^= (uint16_t)data[idx] << 8;
+		for (uint8_t bit = 0; bit < 8; bit++)
+		{
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+	}
+	return crc;
+}
 
-	APP_LOG("FLASH", "Flash size %lX - Flash sector size %lX", PICO_FLASH_SIZE_BYTES, FLASH_SECTOR_SIZE);
-	APP_LOG("FLASH", "Trying to read from Flash address %lX", XIP_BASE + FLASH_TARGET_OFFSET);
-	APP_LOG("FLASH", "Data size %ld", sizeof(s_lorawan_settings));
-	APP_LOG("FLASH", "Data size %ld", sizeof(flash_settings));
+/**
+ * @brief CRC32 of data, can be continued over several buffers
+ * 
+ * @param crc 0 or the CRC32 of the data before
+ * @param data data
+ * @param len length of data
+ * @return uint32_t CRC32
+ */
+uint32_t calc_crc32(uint32_t crc, const uint8_t *data, uint16_t len)
+{
+	crc = ~crc;
+	for (uint16_t idx = 0; idx < len; idx++)
+	{
+		crc ^= data[idx];
+		for (uint8_t bit = 0; bit < 8; bit++)
+		{
+			crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+		}
+	}
+	return ~crc;
+}
+
+/**
+ * @brief Size of a settings image of a layout version
+ * 
+ * @param version layout version
+ * @return uint16_t size of the image, 0 if the version is unknown
+ */
+static uint16_t settings_image_size(uint16_t version)
+{
+	if (version == LORAWAN_SETTINGS_VERSION)
+	{
+		return sizeof(s_lorawan_settings);
+	}
+	if ((version == 0) || (version > LORAWAN_SETTINGS_VERSION))
+	{
+		return 0;
+	}
+	return settings_migrations[version - 1].size;
+}
+
+/**
+ * @brief Upgrade a settings image to the current layout version
+ * 
+ * @param image settings image, SETTINGS_IMAGE_MAX bytes
+ * @param version layout version of the image
+ * @param settings receives the upgraded settings
+ */
+static void settings_upgrade(const uint8_t *image, uint16_t version, s_lorawan_settings *settings)
+{
+	s_lorawan_settings defaults;
+	memcpy((void *)settings, (void *)&defaults, sizeof(s_lorawan_settings));
+	memcpy((void *)settings, image, settings_image_size(version));
+	while (version < LORAWAN_SETTINGS_VERSION)
+	{
+		APP_LOG("FLASH", "Upgrading settings from layout version %d", version);
+		settings_migrations[version - 1].migrate(settings);
+		version++;
+	}
+}
+
+/**
+ * @brief Size of a record in the flash
+ * 
+ * @param len length of the data
+ * @return uint16_t size of header and data, padded to 4 bytes
+ */
+static uint16_t settings_log_record_size(uint8_t len)
+{
+	return (sizeof(s_log_record) + len + 3) & ~3;
+}
+
+/**
+ * @brief Check if a deferred flash operation should wait for the radio
+ * Interrupts are disabled while the flash is programmed or erased, the radio
+ * interrupts would be served late. An operation waits at most FLASH_RADIO_WAIT_MAX,
+ * in continuous RX the radio is never idle.
+ * 
+ * @param since time the operation is waiting for
+ * @return true if the operation should wait
+ */
+bool flash_defer(time_t since)
+{
+	return lora_radio_busy() && ((millis() - since) < FLASH_RADIO_WAIT_MAX);
+}
 
+/**
+ * @brief Record the time the interrupts were disabled for a flash operation
+ * 
+ * @param start time in microseconds before the interrupts were disabled
+ * @param radio_busy true if the radio was busy during the operation
+ */
+static void flash_blackout(uint32_t start, bool radio_busy)
+{
+	uint32_t blackout = micros() - start;
+	g_flash_blackout_total += blackout;
+	if (blackout > g_flash_blackout_max)
+	{
+		g_flash_blackout_max = blackout;
+	}
+	if (radio_busy && (blackout > g_flash_blackout_radio))
+	{
+		g_flash_blackout_radio = blackout;
+	}
+}
+
+/**
+ * @brief Program data into the flash at any offset
+ * Bytes outside of the data are programmed as 0xFF, which leaves them unchanged
+ * 
+ * @param offset offset in the flash
+ * @param data data
+ * @param len length of data
+ */
+void flash_program(uint32_t offset, const uint8_t *data, uint16_t len)
+{
+	uint8_t page[FLASH_PAGE_SIZE];
+	while (len > 0)
+	{
+		uint32_t page_offset = offset & ~(FLASH_PAGE_SIZE - 1);
+		uint16_t start = offset - page_offset;
+		uint16_t chunk = FLASH_PAGE_SIZE - start;
+		if (chunk > len)
+		{
+			chunk = len;
+		}
+		memset(page, 0xFF, FLASH_PAGE_SIZE);
+		memcpy(&page[start], data, chunk);
+
+		bool radio_busy = lora_radio_busy();
+		uint32_t start_time = micros();
+		uint32_t ints = save_and_disable_interrupts();
+		flash_range_program(page_offset, page, FLASH_PAGE_SIZE);
+		restore_interrupts(ints);
+		flash_blackout(start_time, radio_busy);
+		g_flash_programs++;
+
+		offset += chunk;
+		data += chunk;
+		len -= chunk;
+	}
+}
+
+/**
+ * @brief Check if a flash sector is erased
+ * 
+ * @param offset offset of the sector in the flash
+ * @return true if all bytes of the sector are 0xFF
+ */
+static bool flash_sector_erased(uint32_t offset)
+{
+	const uint32_t *sector_data = (const uint32_t *)(XIP_BASE + offset);
+	for (uint16_t idx = 0; idx < FLASH_SECTOR_SIZE / 4; idx++)
+	{
+		if (sector_data[idx] != 0xFFFFFFFF)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * @brief Erase a flash sector
+ * 
+ * @param offset offset of the sector in the flash
+ */
+static void flash_erase_sector(uint32_t offset)
+{
+	bool radio_busy = lora_radio_busy();
+	if (radio_busy)
+	{
+		g_flash_erase_forced++;
+	}
+	uint32_t start_time = micros();
 	uint32_t ints = save_and_disable_interrupts();
-	memcpy((void *)&flash_settings, (void *)(XIP_BASE + FLASH_TARGET_OFFSET), sizeof(flash_settings));
+	flash_range_erase(offset, FLASH_SECTOR_SIZE);
 	restore_interrupts(ints);
+	flash_blackout(start_time, radio_busy);
+	g_flash_erases++;
+}
+
+/**
+ * @brief Erase a flash sector, unless it is still erased
+ * The erase waits until a transmission, RX window or join is finished, at most
+ * FLASH_ERASE_WAIT_MAX. A pending erase job of the sector is dropped, the sector
+ * is erased now.
+ * 
+ * @param offset offset of the sector in the flash
+ * @return true if the sector was erased, false if it was still erased
+ */
+bool flash_erase(uint32_t offset)
+{
+	if (!flash_sector_erased(offset) && lora_radio_busy() && !lora_radio_rx_continuous())
+	{
+		g_flash_erase_deferred++;
+		time_t start = millis();
+		while (lora_radio_busy() && !lora_radio_rx_continuous() && ((millis() - start) < FLASH_ERASE_WAIT_MAX))
+		{
+			delay(FLASH_RADIO_POLL);
+		}
+	}
+
+	g_flash_job_lock.lock();
+	for (uint8_t idx = g_flash_job_tail; idx != g_flash_job_head; idx++)
+	{
+		if (g_flash_jobs[idx % FLASH_JOB_QUEUE_SIZE].offset == offset)
+		{
+			g_flash_jobs[idx % FLASH_JOB_QUEUE_SIZE].offset = FLASH_JOB_NONE;
+		}
+	}
+	bool erase = !flash_sector_erased(offset);
+	if (erase)
+	{
+		flash_erase_sector(offset);
+	}
+	g_flash_job_lock.unlock();
+	return erase;
+}
+
+/**
+ * @brief Queue the erase of a flash sector that is needed later
+ * The sector is erased by flash_jobs_run() when the radio is idle
+ * 
+ * @param offset offset of the sector in the flash
+ */
+void flash_erase_later(uint32_t offset)
+{
+	g_flash_job_lock.lock();
+	for (uint8_t idx = g_flash_job_tail; idx != g_flash_job_head; idx++)
+	{
+		if (g_flash_jobs[idx % FLASH_JOB_QUEUE_SIZE].offset == offset)
+		{
+			g_flash_job_lock.unlock();
+			return;
+		}
+	}
+	if ((uint8_t)(g_flash_job_head - g_flash_job_tail) >= FLASH_JOB_QUEUE_SIZE)
+	{
+		// Queue is full, the sector is erased when it is used
+		g_flash_job_lock.unlock();
+		return;
+	}
+	g_flash_jobs[g_flash_job_head % FLASH_JOB_QUEUE_SIZE].offset = offset;
+	g_flash_jobs[g_flash_job_head % FLASH_JOB_QUEUE_SIZE].time = millis();
+	g_flash_job_head++;
+	g_flash_job_lock.unlock();
+}
+
+/**
+ * @brief Run the queued erase jobs while the radio is idle
+ * A job that waited FLASH_RADIO_WAIT_MAX runs also if the radio is busy
+ * 
+ */
+void flash_jobs_run(void)
+{
+	g_flash_job_lock.lock();
+	while (g_flash_job_tail != g_flash_job_head)
+	{
+		s_flash_job *job = &g_flash_jobs[g_flash_job_tail % FLASH_JOB_QUEUE_SIZE];
+		if (job->offset != FLASH_JOB_NONE)
+		{
+			if (flash_defer(job->time))
+			{
+				break;
+			}
+			if (!flash_sector_erased(job->offset))
+			{
+				flash_erase_sector(job->offset);
+			}
+		}
+		g_flash_job_tail++;
+	}
+	g_flash_job_lock.unlock();
+}
+
+/**
+ * @brief Number of queued erase jobs
+ * 
+ * @return uint8_t number of jobs
+ */
+uint8_t flash_jobs_pending(void)
+{
+	return g_flash_job_head - g_flash_job_tail;
+}
+
+/**
+ * @brief Append a record with a part of the settings to the active sector
+ * 
+ * @param settings settings to take the data from
+ * @param offset offset of the data in the settings
+ * @param len length of the data
+ */
+static void settings_log_append(const s_lorawan_settings *settings, uint8_t offset, uint8_t len)
+{
+	uint8_t record[sizeof(s_log_record) + sizeof(s_lorawan_settings) + 3];
+	s_log_record *header = (s_log_record *)record;
+	uint16_t size = settings_log_record_size(len);
+
+	memset(record, 0xFF, sizeof(record));
+	header->offset = offset;
+	header->len = len;
+	memcpy(&record[sizeof(s_log_record)], &((const uint8_t *)settings)[offset], len);
+	header->crc = settings_log_crc(settings_log_crc(0xFFFF, record, 2), &record[sizeof(s_log_record)], len);
+
+	flash_program(SETTINGS_LOG_OFFSET + g_settings_log_sector * FLASH_SECTOR_SIZE + g_settings_log_pos, record, size);
+	g_settings_log_pos += size;
+	g_settings_log_records++;
+}
+
+/**
+ * @brief Start a new settings log sector with a snapshot of the settings
+ * The oldest sector is erased, the active sector stays valid until the header of the new one is written
+ * 
+ * @param settings settings to write
+ */
+static void settings_log_compact(const s_lorawan_settings *settings)
+{
+	s_log_sector header;
+	uint8_t sector = (g_settings_log_sector + 1) % SETTINGS_LOG_SECTORS;
+	uint32_t sector_offset = SETTINGS_LOG_OFFSET + sector * FLASH_SECTOR_SIZE;
+
+	APP_LOG("FLASH", "Compacting settings log into sector %d", sector);
+
+	// A sector that was never used is still erased
+	if (flash_erase(sector_offset))
+	{
+		g_settings_erases++;
+	}
+
+	g_settings_log_sector = sector;
+	g_settings_log_pos = sizeof(s_log_sector);
+	g_settings_log_records = 0;
+	settings_log_append(settings, 0, sizeof(s_lorawan_settings));
+
+	header.magic = SETTINGS_LOG_MAGIC;
+	header.seq = g_settings_log_seq + 1;
+	header.version = LORAWAN_SETTINGS_VERSION;
+	header.size = sizeof(s_lorawan_settings);
+	header.crc = calc_crc32(0, (const uint8_t *)settings, sizeof(s_lorawan_settings));
+	flash_program(sector_offset, (uint8_t *)&header, sizeof(header));
+	g_settings_log_seq = header.seq;
+
+	memcpy((void *)&g_settings_flash, (void *)settings, sizeof(s_lorawan_settings));
+}
+
+/**
+ * @brief Write the changed parts of the settings as records into the settings log
+ * If the active sector has not enough space left, a new sector is started
+ * 
+ * @param settings settings to write
+ */
+static void settings_log_write(const s_lorawan_settings *settings)
+{
+	const uint8_t *new_data = (const uint8_t *)settings;
+	const uint8_t *old_data = (const uint8_t *)&g_settings_flash;
+	uint8_t run_start[sizeof(s_lorawan_settings)];
+	uint8_t run_len[sizeof(s_lorawan_settings)];
+	uint8_t runs = 0;
+	uint16_t size = 0;
+
+	// Collect the changed parts, changes with only a few unchanged bytes between them go into one record
+	for (uint16_t idx = 0; idx < sizeof(s_lorawan_settings); idx++)
+	{
+		if (new_data[idx] == old_data[idx])
+		{
+			continue;
+		}
+		if ((runs != 0) && (idx - (run_start[runs - 1] + run_len[runs - 1]) <= SETTINGS_LOG_MERGE_GAP))
+		{
+			run_len[runs - 1] = idx - run_start[runs - 1] + 1;
+		}
+		else
+		{
+			run_start[runs] = idx;
+			run_len[runs] = 1;
+			runs++;
+		}
+	}
+	if (runs == 0)
+	{
+		APP_LOG("FLASH", "Flash content identical no need to write");
+		return;
+	}
 
-	APP_LOG("FLASH", "Mark1: %0X Mark2: %0X", flash_settings.valid_mark_1, flash_settings.valid_mark_2);
-	APP_LOG("FLASH", "Region: %d", flash_settings.lora_region);
+	// The records are used at boot only if the commit record after them was written
+	size = settings_log_record_size(0);
+	for (uint8_t run = 0; run < runs; run++)
+	{
+		size += settings_log_record_size(run_len[run]);
+	}
+	if (g_settings_log_pos + size > FLASH_SECTOR_SIZE)
+	{
+		settings_log_compact(settings);
+		return;
+	}
+
+	APP_LOG("FLASH", "Appending %d records with %d bytes", runs, size);
+	for (uint8_t run = 0; run < runs; run++)
+	{
+		settings_log_append(settings, run_start[run], run_len[run]);
+	}
+	settings_log_append(settings, 0, 0);
+	memcpy((void *)&g_settings_flash, (void *)settings, sizeof(s_lorawan_settings));
+}
+
+/**
+ * @brief Replay the records of a settings log sector
+ * Only records followed by a commit record are used
+ * 
+ * @param header header of the sector
+ * @param image receives the settings image, SETTINGS_IMAGE_MAX bytes
+ * @return true if the sector has a valid snapshot
+ */
+static bool settings_log_replay(const s_log_sector *header, uint8_t *image)
+{
+	const uint8_t *sector_data = (const uint8_t *)header;
+	uint8_t work_image[SETTINGS_IMAGE_MAX];
+	uint16_t pos = sizeof(s_log_sector);
+	uint16_t commit_pos = pos;
+	uint32_t records = 0;
+
+	while (pos + sizeof(s_log_record) <= FLASH_SECTOR_SIZE)
+	{
+		const s_log_record *record = (const s_log_record *)&sector_data[pos];
+		const uint8_t *data = &sector_data[pos + sizeof(s_log_record)];
+		if ((record->offset == 0xFF) && (record->len == 0xFF) && (record->crc == 0xFFFF))
+		{
+			// End of the log
+			break;
+		}
+		uint16_t size = settings_log_record_size(record->len);
+		if ((record->offset + record->len > header->size) || (pos + size > FLASH_SECTOR_SIZE) ||
+			(record->crc != settings_log_crc(settings_log_crc(0xFFFF, &sector_data[pos], 2), data, record->len)) ||
+			((records == 0) && ((record->len != header->size) || (calc_crc32(0, data, record->len) != header->crc))))
+		{
+			APP_LOG("FLASH", "Invalid record at %d", pos);
+			pos = FLASH_SECTOR_SIZE;
+			break;
+		}
+		memcpy(&work_image[record->offset], data, record->len);
+		records++;
+		pos += size;
+
+		// The snapshot is committed by the sector header, all other records by a commit record
+		if ((records == 1) || (record->len == 0))
+		{
+			memcpy(image, work_image, header->size);
+			commit_pos = pos;
+			g_settings_log_records = records;
+		}
+	}
+	if (records == 0)
+	{
+		return false;
+	}
+
+	// After an interrupted write the next write starts a new sector, the flash after the last commit is not erased
+	g_settings_log_pos = (pos == commit_pos) ? pos : FLASH_SECTOR_SIZE;
+	return true;
+}
+
+/**
+ * @brief Find the newest settings log sector with a valid snapshot and replay its records
+ * If the newest sector is damaged, the sector before it is used
+ * 
+ * @param image receives the settings image, SETTINGS_IMAGE_MAX bytes
+ * @param version receives the layout version of the image
+ * @return true if valid settings were found
+ */
+static bool settings_log_load(uint8_t *image, uint16_t *version)
+{
+	uint32_t seq_limit = 0xFFFFFFFF;
+
+	while (true)
+	{
+		const s_log_sector *header = NULL;
+		uint8_t header_sector = 0;
+		for (uint8_t sector = 0; sector < SETTINGS_LOG_SECTORS; sector++)
+		{
+			const s_log_sector *check = (const s_log_sector *)(XIP_BASE + SETTINGS_LOG_OFFSET + sector * FLASH_SECTOR_SIZE);
+			// Sectors written by newer firmware with an unknown layout are ignored
+			if ((check->magic == SETTINGS_LOG_MAGIC) && (check->seq < seq_limit) &&
+				(settings_image_size(check->version) == check->size) && (check->size != 0) &&
+				((header == NULL) || (check->seq > header->seq)))
+			{
+				header = check;
+				header_sector = sector;
+			}
+		}
+		if (header == NULL)
+		{
+			return false;
+		}
+
+		// New sectors must get a higher sequence number than any sector found
+		if (seq_limit == 0xFFFFFFFF)
+		{
+			g_settings_log_seq = header->seq;
+		}
+		if (settings_log_replay(header, image))
+		{
+			g_settings_log_sector = header_sector;
+			*version = header->version;
+			if (seq_limit != 0xFFFFFFFF)
+			{
+				// Records appended here would be hidden by the damaged newer sector
+				APP_LOG("FLASH", "Using older settings log sector %d", header_sector);
+				g_settings_log_pos = FLASH_SECTOR_SIZE;
+			}
+			return true;
+		}
+		seq_limit = header->seq;
+	}
+}
+
+void init_flash(void)
+{
+	// Check if valid data is in the flash
+	uint8_t image[SETTINGS_IMAGE_MAX];
+	uint16_t version = 0;
 
-	if ((flash_settings.valid_mark_1 != 0xAA) || (flash_settings.valid_mark_2 != LORAWAN_DATA_MARKER))
+	uint32_t start_time = micros();
+	bool log_found = settings_log_load(image, &version);
+	g_settings_boot_time = micros() - start_time;
+	APP_LOG("FLASH", "Settings log sector %d seq %" PRIu32 " with %" PRIu32 " records, replay took %" PRIu32 " us", g_settings_log_sector,
+			g_settings_log_seq, g_settings_log_records, g_settings_boot_time);
+	if (log_found)
+	{
+		settings_upgrade(image, version, &g_lorawan_settings);
+		memcpy((void *)&g_settings_flash, (void *)&g_lorawan_settings, sizeof(s_lorawan_settings));
+		if (version != LORAWAN_SETTINGS_VERSION)
+		{
+			// The old image stays valid and is upgraded again on every boot until the
+			// next change, records in the new layout can only go into a new sector
+			g_settings_log_pos = FLASH_SECTOR_SIZE;
+		}
+		return;
+	}
+
+	APP_LOG("FLASH", "Flash size %X - Flash sector size %X", PICO_FLASH_SIZE_BYTES, FLASH_SECTOR_SIZE);
+	APP_LOG("FLASH", "Trying to read from Flash address %" PRIX32, (uint32_t)(XIP_BASE + FLASH_TARGET_OFFSET));
+	APP_LOG("FLASH", "Data size %zu", sizeof(s_lorawan_settings));
+
+	s_lorawan_settings *flash_settings = (s_lorawan_settings *)(XIP_BASE + FLASH_TARGET_OFFSET);
+
+	APP_LOG("FLASH", "Mark1: %0X Mark2: %0X", flash_settings->valid_mark_1, flash_settings->valid_mark_2);
+	APP_LOG("FLASH", "Region: %d", flash_settings->lora_region);
+
+	if ((flash_settings->valid_mark_1 != 0xAA) || (flash_settings->valid_mark_2 != LORAWAN_DATA_MARKER))
 	{
 		APP_LOG("FLASH", "No valid data found");
 
 		// Create default settings from devices flash ID
 		make_credentials();
-
-		// Write new data to the flash
-		eraseDataFlash();
-		writeDataToFlash((uint8_t *)&g_lorawan_settings);
 	}
 	else
 	{
-		APP_LOG("FLASH", "Found valid data in flash");
-		memcpy((void *)&g_lorawan_settings, (void *)&flash_settings, sizeof(flash_settings));
+		APP_LOG("FLASH", "Found valid data of older firmware in flash");
+		// The sector has no version, firmware before the AT interface settings did not write them
+		version = ((flash_settings->at_echo > 1) || (flash_settings->at_verbose > 1) ||
+				   !serial1_baud_valid(flash_settings->at_baudrate) || (flash_settings->at_flow_control > 1))
+					  ? 1
+					  : 2;
+		settings_upgrade((const uint8_t *)flash_settings, version, &g_lorawan_settings);
 	}
+
+	// Start the settings log, the sector of older firmware is not used anymore
+	settings_log_compact(&g_lorawan_settings);
 }
 
+/**
+ * @brief Request to save the settings
+ * The settings are written to the flash SETTINGS_WRITE_DELAY after the last change,
+ * with AT+SAVE or before a reset. Several changes are written together.
+ * 
+ * @return true always
+ */
 bool save_settings(void)
 {
-	// Get settings from flash
-	s_lorawan_settings flash_settings;
-	uint32_t ints = save_and_disable_interrupts();
-	memcpy((void *)&flash_settings, (void *)(XIP_BASE + FLASH_TARGET_OFFSET), sizeof(flash_settings));
-	restore_interrupts(ints);
+	g_settings_save_requests++;
+	g_settings_dirty_time = millis();
+	g_settings_dirty = true;
+	return true;
+}
 
-	// Compare flash content with current settings
-	if (memcmp((void *)&flash_settings, (void *)&g_lorawan_settings, sizeof(s_lorawan_settings)) != 0)
+/**
+ * @brief Write the settings to the flash if they were changed
+ * 
+ */
+void settings_flush(void)
+{
+	if (!g_settings_dirty)
 	{
-		APP_LOG("FLASH", "Flash content changed, writing new data");
-		// Write new data to the flash
-		eraseDataFlash();
-		writeDataToFlash((uint8_t *)&g_lorawan_settings);
+		return;
 	}
-	else
+	g_settings_dirty = false;
+
+	// Only the changed parts are appended to the settings log
+	settings_log_write(&g_lorawan_settings);
+}
+
+/**
+ * @brief Write changed settings to the flash after SETTINGS_WRITE_DELAY without further changes
+ * 
+ */
+void settings_flush_check(void)
+{
+	if (g_settings_dirty && ((millis() - g_settings_dirty_time) > SETTINGS_WRITE_DELAY) &&
+		!flash_defer(g_settings_dirty_time + SETTINGS_WRITE_DELAY))
 	{
-		APP_LOG("FLASH", "Flash content identical no need to write");
+		settings_flush();
 	}
-	return true;
 }
 
 void flash_reset(void)
@@ -156,9 +953,9 @@ void flash_reset(void)
 	// Create default settings from devices flash ID
 	make_credentials();
 
-	// Erase the flash, then call init_flash to restore defaults
-	eraseDataFlash();
-	writeDataToFlash((uint8_t *)&g_lorawan_settings);
+	// Start a new settings log sector with the defaults
+	settings_log_compact(&g_lorawan_settings);
+	g_settings_dirty = false;
 }
 
 /**
@@ -167,64 +964,14 @@ void flash_reset(void)
  */
 void log_settings(void)
 {
+#if APP_DEBUG > 0
+	char value[2 * SETTING_BYTES_MAX + 1];
+
 	APP_LOG("FLASH", "Saved settings:");
-	APP_LOG("FLASH", "000 Marks: %02X %02X", g_lorawan_settings.valid_mark_1, g_lorawan_settings.valid_mark_2);
-	APP_LOG("FLASH", "002 Dev EUI %02X%02X%02X%02X%02X%02X%02X%02X", g_lorawan_settings.node_device_eui[0], g_lorawan_settings.node_device_eui[1],
-			g_lorawan_settings.node_device_eui[2], g_lorawan_settings.node_device_eui[3],
-			g_lorawan_settings.node_device_eui[4], g_lorawan_settings.node_device_eui[5],
-			g_lorawan_settings.node_device_eui[6], g_lorawan_settings.node_device_eui[7]);
-	APP_LOG("FLASH", "010 App EUI %02X%02X%02X%02X%02X%02X%02X%02X", g_lorawan_settings.node_app_eui[0], g_lorawan_settings.node_app_eui[1],
-			g_lorawan_settings.node_app_eui[2], g_lorawan_settings.node_app_eui[3],
-			g_lorawan_settings.node_app_eui[4], g_lorawan_settings.node_app_eui[5],
-			g_lorawan_settings.node_app_eui[6], g_lorawan_settings.node_app_eui[7]);
-	APP_LOG("FLASH", "018 App Key %02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X",
-			g_lorawan_settings.node_app_key[0], g_lorawan_settings.node_app_key[1],
-			g_lorawan_settings.node_app_key[2], g_lorawan_settings.node_app_key[3],
-			g_lorawan_settings.node_app_key[4], g_lorawan_settings.node_app_key[5],
-			g_lorawan_settings.node_app_key[6], g_lorawan_settings.node_app_key[7],
-			g_lorawan_settings.node_app_key[8], g_lorawan_settings.node_app_key[9],
-			g_lorawan_settings.node_app_key[10], g_lorawan_settings.node_app_key[11],
-			g_lorawan_settings.node_app_key[12], g_lorawan_settings.node_app_key[13],
-			g_lorawan_settings.node_app_key[14], g_lorawan_settings.node_app_key[15]);
-	APP_LOG("FLASH", "034 Dev Addr %08lX", g_lorawan_settings.node_dev_addr);
-	APP_LOG("FLASH", "038 NWS Key %02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X",
-			g_lorawan_settings.node_nws_key[0], g_lorawan_settings.node_nws_key[1],
-			g_lorawan_settings.node_nws_key[2], g_lorawan_settings.node_nws_key[3],
-			g_lorawan_settings.node_nws_key[4], g_lorawan_settings.node_nws_key[5],
-			g_lorawan_settings.node_nws_key[6], g_lorawan_settings.node_nws_key[7],
-			g_lorawan_settings.node_nws_key[8], g_lorawan_settings.node_nws_key[9],
-			g_lorawan_settings.node_nws_key[10], g_lorawan_settings.node_nws_key[11],
-			g_lorawan_settings.node_nws_key[12], g_lorawan_settings.node_nws_key[13],
-			g_lorawan_settings.node_nws_key[14], g_lorawan_settings.node_nws_key[15]);
-	APP_LOG("FLASH", "054 Apps Key %02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X",
-			g_lorawan_settings.node_apps_key[0], g_lorawan_settings.node_apps_key[1],
-			g_lorawan_settings.node_apps_key[2], g_lorawan_settings.node_apps_key[3],
-			g_lorawan_settings.node_apps_key[4], g_lorawan_settings.node_apps_key[5],
-			g_lorawan_settings.node_apps_key[6], g_lorawan_settings.node_apps_key[7],
-			g_lorawan_settings.node_apps_key[8], g_lorawan_settings.node_apps_key[9],
-			g_lorawan_settings.node_apps_key[10], g_lorawan_settings.node_apps_key[11],
-			g_lorawan_settings.node_apps_key[12], g_lorawan_settings.node_apps_key[13],
-			g_lorawan_settings.node_apps_key[14], g_lorawan_settings.node_apps_key[15]);
-	APP_LOG("FLASH", "070 OTAA %s", g_lorawan_settings.otaa_enabled ? "enabled" : "disabled");
-	APP_LOG("FLASH", "071 ADR %s", g_lorawan_settings.adr_enabled ? "enabled" : "disabled");
-	APP_LOG("FLASH", "072 %s Network", g_lorawan_settings.public_network ? "Public" : "Private");
-	APP_LOG("FLASH", "073 Dutycycle %s", g_lorawan_settings.duty_cycle_enabled ? "enabled" : "disabled");
-	APP_LOG("FLASH", "074 Repeat time %ld", g_lorawan_settings.send_repeat_time);
-	APP_LOG("FLASH", "078 Join trials %d", g_lorawan_settings.join_trials);
-	APP_LOG("FLASH", "079 TX Power %d", g_lorawan_settings.tx_power);
-	APP_LOG("FLASH", "080 DR %d", g_lorawan_settings.data_rate);
-	APP_LOG("FLASH", "081 Class %d", g_lorawan_settings.lora_class);
-	APP_LOG("FLASH", "082 Subband %d", g_lorawan_settings.subband_channels);
-	APP_LOG("FLASH", "083 Auto join %s", g_lorawan_settings.auto_join ? "enabled" : "disabled");
-	APP_LOG("FLASH", "084 Fport %d", g_lorawan_settings.app_port);
-	APP_LOG("FLASH", "085 %s Message", g_lorawan_settings.confirmed_msg_enabled ? "Confirmed" : "Unconfirmed");
-	APP_LOG("FLASH", "086 Region %s", region_names[g_lorawan_settings.lora_region]);
-	APP_LOG("FLASH", "087 Mode %s", g_lorawan_settings.lorawan_enable ? "LPWAN" : "P2P");
-	APP_LOG("FLASH", "088 P2P frequency %ld", g_lorawan_settings.p2p_frequency);
-	APP_LOG("FLASH", "092 P2P TX Power %d", g_lorawan_settings.p2p_tx_power);
-	APP_LOG("FLASH", "093 P2P BW %d", g_lorawan_settings.p2p_bandwidth);
-	APP_LOG("FLASH", "094 P2P SF %d", g_lorawan_settings.p2p_sf);
-	APP_LOG("FLASH", "095 P2P CR %d", g_lorawan_settings.p2p_cr);
-	APP_LOG("FLASH", "096 P2P Preamble length %d", g_lorawan_settings.p2p_preamble_len);
-	APP_LOG("FLASH", "097 P2P Symbol Timeout %d", g_lorawan_settings.p2p_symbol_timeout);
+	for (uint8_t idx = 0; idx < g_settings_num; idx++)
+	{
+		setting_print(&g_settings[idx], value, sizeof(value), true);
+		APP_LOG("FLASH", "%03d %s %s", g_settings[idx].offset, g_settings[idx].name, value);
+	}
+#endif
 }
@@ -13,15 +13,6 @@
 /** LoRaWAN setting from flash */
 s_lorawan_settings g_lorawan_settings;
 
-/** Buffer for received LoRaWan data */
-uint8_t g_rx_lora_data[256];
-/** Length of received data */
-uint8_t g_rx_data_len = 0;
-/** Buffer for received LoRaWan data */
-uint8_t g_tx_lora_data[256];
-/** Length of received data */
-uint8_t g_tx_data_len = 0;
-
 /** RSSI of last received packet */
 int16_t g_last_rssi = 0;
 /** SNR of last received packet */
@@ -57,9 +48,18 @@ static void lpwan_class_confirm_handler(DeviceClass_t Class);
 static void lpwan_unconfirm_tx_finished(void);
 /** LoRaWAN callback after class change request finished */
 static void lpwan_confirm_tx_finished(bool result);
+/** Restore the session of the last join */
+static bool lpwan_session_restore(void);
+/** Save the session after a join */
+static void lpwan_session_store(void);
+/** Save the frame counters of the session */
+static void lpwan_session_counters(void);
 /** LoRaWAN Function to send a package */
 bool send_lpwan_packet(void);
 
+/** Uplinks between two saves of the frame counters, the saved uplink counter is up to 2 steps ahead */
+#define SESSION_FCNT_STEP 32
+
 /**@brief Structure containing LoRaWAN parameters, needed for lmh_init()
  * 
  * Set structure members to
@@ -136,13 +136,228 @@ int8_t init_lorawan(void)
 		return -3;
 	}
 
-	// Start Join process
+	// Start Join process, keep the request ID if the join was requested by AT+JOIN
+	if (async_pending(ASYNC_OP_JOIN) == 0)
+	{
+		async_start(ASYNC_OP_JOIN, 0);
+	}
+	if (lpwan_session_restore())
+	{
+		// Continue with the session of the last join, no join request needed
+		APP_LOG("LORA", "Restored session with dev address %08" PRIX32, g_lorawan_settings.session_dev_addr);
+		g_lorawan_initialized = true;
+		lpwan_joined_handler();
+		return 0;
+	}
 	lmh_join();
 
 	g_lorawan_initialized = true;
 	return 0;
 }
 
+/**
+ * @brief Identity of the device the session belongs to
+ * 
+ * @return uint32_t CRC32 of DevEUI, AppEUI, AppKey and region
+ */
+static uint32_t lpwan_session_id(void)
+{
+	uint32_t crc = calc_crc32(0, g_lorawan_settings.node_device_eui, sizeof(g_lorawan_settings.node_device_eui));
+	crc = calc_crc32(crc, g_lorawan_settings.node_app_eui, sizeof(g_lorawan_settings.node_app_eui));
+	crc = calc_crc32(crc, g_lorawan_settings.node_app_key, sizeof(g_lorawan_settings.node_app_key));
+	return calc_crc32(crc, &g_lorawan_settings.lora_region, sizeof(g_lorawan_settings.lora_region));
+}
+
+/**
+ * @brief Check if the region adds the channels of the join accept CFList
+ * The regions with a fixed channel plan only use the channel mask
+ * 
+ * @return true if the region has CFList channels
+ */
+static bool lpwan_session_cflist(void)
+{
+	switch (g_lorawan_settings.lora_region)
+	{
+	case LORAMAC_REGION_AU915:
+	case LORAMAC_REGION_CN470:
+	case LORAMAC_REGION_US915:
+		return false;
+	default:
+		return true;
+	}
+}
+
+/**
+ * @brief Number of words of the channel mask of the region
+ * 
+ * @return uint8_t words of the channel mask
+ */
+static uint8_t lpwan_session_mask_size(void)
+{
+	return lpwan_session_cflist() ? 1 : SESSION_CH_MASK_SIZE;
+}
+
+/**
+ * @brief Restore the session of the last OTAA join into the MAC
+ * The session is only used if the credentials and the region did not change since the join
+ * 
+ * @return true if the session was restored
+ */
+static bool lpwan_session_restore(void)
+{
+	if (!g_lorawan_settings.session_valid)
+	{
+		return false;
+	}
+	if (!g_lorawan_settings.otaa_enabled || (g_lorawan_settings.session_id != lpwan_session_id()))
+	{
+		// The next join creates a new session
+		lpwan_session_invalidate();
+		return false;
+	}
+
+	MibRequestConfirm_t mib_req;
+	mib_req.Type = MIB_DEV_ADDR;
+	mib_req.Param.DevAddr = g_lorawan_settings.session_dev_addr;
+	LoRaMacMibSetRequestConfirm(&mib_req);
+	mib_req.Type = MIB_NWK_SKEY;
+	mib_req.Param.NwkSKey = g_lorawan_settings.session_nwk_skey;
+	LoRaMacMibSetRequestConfirm(&mib_req);
+	mib_req.Type = MIB_APP_SKEY;
+	mib_req.Param.AppSKey = g_lorawan_settings.session_app_skey;
+	LoRaMacMibSetRequestConfirm(&mib_req);
+	mib_req.Type = MIB_UPLINK_COUNTER;
+	mib_req.Param.UpLinkCounter = g_lorawan_settings.session_fcnt_up;
+	LoRaMacMibSetRequestConfirm(&mib_req);
+	mib_req.Type = MIB_DOWNLINK_COUNTER;
+	mib_req.Param.DownLinkCounter = g_lorawan_settings.session_fcnt_down;
+	LoRaMacMibSetRequestConfirm(&mib_req);
+
+	// Parameters of the join accept, the MAC starts with the region defaults
+	mib_req.Type = MIB_RECEIVE_DELAY_1;
+	mib_req.Param.ReceiveDelay1 = g_lorawan_settings.session_rx1_delay * 1000;
+	LoRaMacMibSetRequestConfirm(&mib_req);
+	mib_req.Type = MIB_RECEIVE_DELAY_2;
+	mib_req.Param.ReceiveDelay2 = (g_lorawan_settings.session_rx1_delay + 1) * 1000;
+	LoRaMacMibSetRequestConfirm(&mib_req);
+	mib_req.Type = MIB_RX2_CHANNEL;
+	mib_req.Param.Rx2Channel.Frequency = g_lorawan_settings.session_rx2_freq;
+	mib_req.Param.Rx2Channel.Datarate = g_lorawan_settings.session_rx2_dr;
+	LoRaMacMibSetRequestConfirm(&mib_req);
+	for (uint8_t idx = 0; idx < SESSION_CFLIST_NUM; idx++)
+	{
+		const uint8_t *freq = &g_lorawan_settings.session_cflist[idx * 3];
+		ChannelParams_t channel = {0};
+		channel.Frequency = (freq[0] | (freq[1] << 8) | (freq[2] << 16)) * 100;
+		if (channel.Frequency != 0)
+		{
+			// Data rate range of CFList channels
+			channel.DrRange.Value = (DR_5 << 4) | DR_0;
+			LoRaMacChannelAdd(SESSION_CFLIST_FIRST + idx, channel);
+		}
+	}
+	// After the channels, adding a channel enables it in the mask
+	mib_req.Type = MIB_CHANNELS_MASK;
+	mib_req.Param.ChannelsMask = g_lorawan_settings.session_ch_mask;
+	LoRaMacMibSetRequestConfirm(&mib_req);
+
+	mib_req.Type = MIB_NETWORK_JOINED;
+	mib_req.Param.IsNetworkJoined = true;
+	LoRaMacMibSetRequestConfirm(&mib_req);
+	return true;
+}
+
+/**
+ * @brief Save the session of a new OTAA join
+ * 
+ */
+static void lpwan_session_store(void)
+{
+	MibRequestConfirm_t mib_req;
+	mib_req.Type = MIB_DEV_ADDR;
+	LoRaMacMibGetRequestConfirm(&mib_req);
+	g_lorawan_settings.session_dev_addr = mib_req.Param.DevAddr;
+	mib_req.Type = MIB_NWK_SKEY;
+	LoRaMacMibGetRequestConfirm(&mib_req);
+	memcpy(g_lorawan_settings.session_nwk_skey, mib_req.Param.NwkSKey, sizeof(g_lorawan_settings.session_nwk_skey));
+	mib_req.Type = MIB_APP_SKEY;
+	LoRaMacMibGetRequestConfirm(&mib_req);
+	memcpy(g_lorawan_settings.session_app_skey, mib_req.Param.AppSKey, sizeof(g_lorawan_settings.session_app_skey));
+
+	// Parameters of the join accept
+	mib_req.Type = MIB_RECEIVE_DELAY_1;
+	LoRaMacMibGetRequestConfirm(&mib_req);
+	g_lorawan_settings.session_rx1_delay = mib_req.Param.ReceiveDelay1 / 1000;
+	mib_req.Type = MIB_RX2_CHANNEL;
+	LoRaMacMibGetRequestConfirm(&mib_req);
+	g_lorawan_settings.session_rx2_freq = mib_req.Param.Rx2Channel.Frequency;
+	g_lorawan_settings.session_rx2_dr = mib_req.Param.Rx2Channel.Datarate;
+	memset(g_lorawan_settings.session_cflist, 0, sizeof(g_lorawan_settings.session_cflist));
+	if (lpwan_session_cflist())
+	{
+		mib_req.Type = MIB_CHANNELS;
+		LoRaMacMibGetRequestConfirm(&mib_req);
+		for (uint8_t idx = 0; idx < SESSION_CFLIST_NUM; idx++)
+		{
+			uint32_t freq = mib_req.Param.ChannelList[SESSION_CFLIST_FIRST + idx].Frequency / 100;
+			g_lorawan_settings.session_cflist[idx * 3] = freq & 0xFF;
+			g_lorawan_settings.session_cflist[idx * 3 + 1] = (freq >> 8) & 0xFF;
+			g_lorawan_settings.session_cflist[idx * 3 + 2] = (freq >> 16) & 0xFF;
+		}
+	}
+	mib_req.Type = MIB_CHANNELS_MASK;
+	LoRaMacMibGetRequestConfirm(&mib_req);
+	memcpy(g_lorawan_settings.session_ch_mask, mib_req.Param.ChannelsMask, lpwan_session_mask_size() * sizeof(uint16_t));
+
+	g_lorawan_settings.session_fcnt_up = 2 * SESSION_FCNT_STEP;
+	g_lorawan_settings.session_fcnt_down = 0;
+	g_lorawan_settings.session_id = lpwan_session_id();
+	g_lorawan_settings.session_valid = 1;
+	save_settings();
+}
+
+/**
+ * @brief Drop the saved session, the next join is a new OTAA join
+ * Used on AT+JOIN, join mode changes and ATR
+ * 
+ */
+void lpwan_session_invalidate(void)
+{
+	if (g_lorawan_settings.session_valid)
+	{
+		g_lorawan_settings.session_valid = 0;
+		save_settings();
+	}
+}
+
+/**
+ * @brief Move the saved uplink counter ahead before the MAC reaches it
+ * Saves the frame counters only once every SESSION_FCNT_STEP uplinks.
+ * Called before the uplink is sent, the checkpoint is written at once while the radio is idle,
+ * a reset before the delayed write would restore an old counter and reuse frame counters
+ * 
+ */
+static void lpwan_session_counters(void)
+{
+	if (!g_lorawan_settings.session_valid)
+	{
+		return;
+	}
+
+	MibRequestConfirm_t mib_req;
+	mib_req.Type = MIB_UPLINK_COUNTER;
+	LoRaMacMibGetRequestConfirm(&mib_req);
+	if (mib_req.Param.UpLinkCounter + SESSION_FCNT_STEP > g_lorawan_settings.session_fcnt_up)
+	{
+		g_lorawan_settings.session_fcnt_up = mib_req.Param.UpLinkCounter + 2 * SESSION_FCNT_STEP;
+		mib_req.Type = MIB_DOWNLINK_COUNTER;
+		LoRaMacMibGetRequestConfirm(&mib_req);
+		g_lorawan_settings.session_fcnt_down = mib_req.Param.DownLinkCounter;
+		save_settings();
+		settings_flush();
+	}
+}
+
 /**************************************************************/
 /* LoRaWAN callback functions                                            */
 /**************************************************************/
@@ -157,11 +372,8 @@ void lpwan_join_fail_handler(void)
 	APP_LOG("LORA", "Restart network join request");
 	g_join_result = false;
 	// Wake up task to report failed join
-	if (loop_thread != NULL)
-	{
-		APP_LOG("LORA", "Join failed, report event");
-		osSignalSet(loop_thread, SIGNAL_JOIN_FAIL);
-	}
+	APP_LOG("LORA", "Join failed, report event");
+	async_complete(ASYNC_OP_JOIN, ASYNC_FAIL, 0);
 }
 
 /**
@@ -175,7 +387,7 @@ static void lpwan_joined_handler(void)
 	if (g_lorawan_settings.otaa_enabled)
 	{
 		uint32_t otaaDevAddr = lmh_getDevAddr();
-		APP_LOG("LORA", "OTAA joined and got dev address %08lX", otaaDevAddr);
+		APP_LOG("LORA", "OTAA joined and got dev address %08" PRIX32, otaaDevAddr);
 	}
 	else
 	{
@@ -209,13 +421,16 @@ static void lpwan_joined_handler(void)
 		TimerStart(&app_timer);
 	}
 
-	g_join_result = true;
-	// Wake up task to report succesful join
-	if (loop_thread != NULL)
+	// Keep the session of a new OTAA join for the next reboot
+	if (g_lorawan_settings.otaa_enabled && !g_lorawan_settings.session_valid)
 	{
-		APP_LOG("LORA", "Join success, report event");
-		osSignalSet(loop_thread, SIGNAL_JOIN_SUCCESS);
+		lpwan_session_store();
 	}
+
+	g_join_result = true;
+	// Wake up task to report succesful join
+	APP_LOG("LORA", "Join success, report event");
+	async_complete(ASYNC_OP_JOIN, ASYNC_SUCCESS, 0);
 }
 
 /**
@@ -232,15 +447,8 @@ static void lpwan_rx_handler(lmh_app_data_t *app_data)
 	g_last_snr = app_data->snr;
 	g_last_fport = app_data->port;
 
-	// Copy the data into loop data buffer
-	memcpy(g_rx_lora_data, app_data->buffer, app_data->buffsize);
-	g_rx_data_len = app_data->buffsize;
-	// Wake up task to report succesful join
-	if (loop_thread != NULL)
-	{
-		APP_LOG("LORA", "Packet received, report event");
-		osSignalSet(loop_thread, SIGNAL_RX);
-	}
+	// Queue the data for the loop thread
+	rx_queue_add(app_data->port, app_data->rssi, app_data->snr, app_data->buffer, app_data->buffsize, 0);
 }
 
 /**
@@ -252,12 +460,7 @@ static void lpwan_class_confirm_handler(DeviceClass_t Class)
 {
 	APP_LOG("LORA", "switch to class %c done", "ABC"[Class]);
 
-	// Wake up task to report succesful join
-	if (loop_thread != NULL)
-	{
-		APP_LOG("LORA", "Join success, report event");
-		osSignalSet(loop_thread, SIGNAL_JOIN_SUCCESS);
-	}
+	// The join was already reported by lpwan_joined_handler()
 	g_lpwan_has_joined = true;
 }
 
@@ -269,12 +472,9 @@ static void lpwan_unconfirm_tx_finished(void)
 {
 	APP_LOG("LORA", "Uncomfirmed TX finished");
 	g_rx_fin_result = true;
-	// Wake up task to report succesful join
-	if (loop_thread != NULL)
-	{
-		APP_LOG("LORA", "TX success, report event");
-		osSignalSet(loop_thread, SIGNAL_UNCONF_TX);
-	}
+	// Wake up task to report succesful TX
+	APP_LOG("LORA", "TX success, report event");
+	async_complete(ASYNC_OP_SEND, ASYNC_SUCCESS, 0);
 }
 
 /**
@@ -286,20 +486,9 @@ static void lpwan_confirm_tx_finished(bool result)
 {
 	APP_LOG("LORA", "Comfirmed TX finished with result %s", result ? "ACK" : "NAK");
 	g_rx_fin_result = result;
-	// Wake up task to report succesful join
-	if (loop_thread != NULL)
-	{
-		if (g_rx_fin_result)
-		{
-			APP_LOG("LORA", "TX success, report event");
-			osSignalSet(loop_thread, SIGNAL_CONF_TX_ACK);
-		}
-		else
-		{
-			APP_LOG("LORA", "TX failed, report event");
-			osSignalSet(loop_thread, SIGNAL_CONF_TX_NAK);
-		}
-	}
+	// Wake up task to report the TX result
+	APP_LOG("LORA", "TX %s, report event", result ? "success" : "failed");
+	async_complete(ASYNC_OP_SEND, result ? ASYNC_SUCCESS : ASYNC_FAIL, 0);
 }
 
 /**
@@ -329,5 +518,67 @@ lmh_error_status send_lora_packet(uint8_t *data, uint8_t size, uint8_t fport)
 
 	memcpy(m_lora_app_data_buffer, data, size);
 
-	return lmh_send(&m_lora_app_data, g_lorawan_settings.confirmed_msg_enabled);
+	lpwan_session_counters();
+	lmh_error_status result = lmh_send(&m_lora_app_data, g_lorawan_settings.confirmed_msg_enabled);
+	if (result == LMH_SUCCESS)
+	{
+		async_start(ASYNC_OP_SEND, lorawan_time_on_air(size));
+	}
+	return result;
+}
+
+/**
+ * @brief Calculate the time on air of a LoRaWAN uplink with the configured data rate
+ * 
+ * @param size size of the application payload
+ * @return uint32_t time on air in milliseconds
+ */
+uint32_t lorawan_time_on_air(uint8_t size)
+{
+	uint8_t dr = g_lorawan_settings.data_rate;
+	uint8_t sf;
+	uint8_t bw = 0;
+
+	switch (g_lorawan_settings.lora_region)
+	{
+	case LORAMAC_REGION_US915:
+		// DR0 .. DR3 SF10 .. SF7 125 kHz, DR4 SF8 500 kHz
+		if (dr >= 4)
+		{
+			sf = 8;
+			bw = 2;
+		}
+		else
+		{
+			sf = 10 - dr;
+		}
+		break;
+	case LORAMAC_REGION_AU915:
+		// DR0 .. DR5 SF12 .. SF7 125 kHz, DR6 SF8 500 kHz
+		if (dr >= 6)
+		{
+			sf = 8;
+			bw = 2;
+		}
+		else
+		{
+			sf = 12 - dr;
+		}
+		break;
+	default:
+		// DR0 .. DR5 SF12 .. SF7 125 kHz, DR6 SF7 250 kHz
+		if (dr >= 6)
+		{
+			sf = 7;
+			bw = 1;
+		}
+		else
+		{
+			sf = 12 - dr;
+		}
+		break;
+	}
+
+	// MHDR, FHDR, FPort and MIC are added to the application payload
+	return lora_time_on_air(sf, bw, 1, 8, size + 13);
 }
@@ -14,6 +14,8 @@
 #include <rtos.h>
 #include <multicore.h>
 #include <time.h>
+#include <inttypes.h>
+#include <hardware/flash.h>
 
 using namespace rtos;
 using namespace mbed;
@@ -39,11 +41,28 @@ using namespace std::chrono;
 #define APP_LOG(...)
 #endif
 
-#define DualSerial(...)              \
-	do                               \
-	{                                \
-		Serial.printf(__VA_ARGS__);  \
-		Serial1.printf(__VA_ARGS__); \
+// Response buffer, collects output and writes it with one write() per port
+#define AT_RESP_SIZE 1024
+struct s_at_resp
+{
+	// Output port, NULL => all ports
+	Print *sink = NULL;
+	// Length of buffered output
+	uint16_t len = 0;
+	// Buffered output
+	char buf[AT_RESP_SIZE];
+};
+void at_resp_printf(s_at_resp *resp, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void at_resp_vprintf(s_at_resp *resp, const char *format, va_list args);
+void at_resp_hex(s_at_resp *resp, const uint8_t *data, uint16_t len);
+void at_resp_flush(s_at_resp *resp);
+extern s_at_resp g_urc_resp;
+
+#define DualSerial(...)                           \
+	do                                            \
+	{                                             \
+		at_resp_printf(&g_urc_resp, __VA_ARGS__); \
+		at_resp_flush(&g_urc_resp);               \
 	} while (0)
 
 // Firmware
@@ -58,34 +77,199 @@ extern osThreadId loop_thread;
 // Signals to wake up the loop() binary coded!!!!
 // Use only one bit per signal!!!!
 //***************************************************
-/** Unconfirmed TX finished */
-#define SIGNAL_UNCONF_TX 0x0001
-/** Confirmed TX finished, ACK received */
-#define SIGNAL_CONF_TX_ACK 0x0002
-/** Confirmed TX failed, no ACK received */
-#define SIGNAL_CONF_TX_NAK 0x0004
+/** Send or join finished, completion is in the completion queue */
+#define SIGNAL_ASYNC 0x0001
+/** Uplink queue has a packet to send */
+#define SIGNAL_QUEUE 0x0002
 /** Periodic sending triggered */
 #define SIGNAL_SEND 0x0008
-/** Join success */
-#define SIGNAL_JOIN_SUCCESS 0x0010
-/** Join success */
-#define SIGNAL_JOIN_FAIL 0x0020
 /** LoRaWAN packet received */
 #define SIGNAL_RX 0x0040
 /** Start Join */
 #define SIGNAL_JOIN 0x0080
+/** P2P backoff after a busy channel is over */
+#define SIGNAL_LBT 0x0100
+/** No P2P packets for the hop reset time */
+#define SIGNAL_HOP 0x0200
 
 // LoRaWAN
 int8_t init_lora(void);
 int8_t init_lorawan(void);
-bool send_p2p_packet(uint8_t *data, uint8_t size);
+uint16_t send_p2p_packet(uint8_t *data, uint8_t size);
+uint8_t p2p_tx_queue_pending(void);
+uint8_t p2p_tx_queue_free(void);
+void p2p_tx_retry(void);
+extern uint32_t g_p2p_cad_clear;
+extern uint32_t g_p2p_cad_busy;
+extern uint32_t g_p2p_lbt_dropped;
+
+// P2P airtime budget
+bool airtime_reserve(uint32_t airtime);
+void airtime_release(uint32_t airtime, bool sent);
+uint32_t airtime_used(void);
+uint32_t airtime_reserved(void);
+uint32_t airtime_remaining(void);
+
+// P2P frequency hopping
+/** Packet statistics of a hopping channel */
+struct s_hop_stats
+{
+	// Sent packets
+	uint32_t tx;
+	// Received packets
+	uint32_t rx;
+	// CAD with busy channel
+	uint32_t busy;
+	// Received packets with CRC error
+	uint32_t crc;
+};
+extern s_hop_stats g_hop_stats[];
+uint8_t p2p_hop_channel(void);
+uint32_t p2p_hop_frequency(void);
+void p2p_hop_next(void);
+void p2p_hop_reset(void);
+void p2p_hop_restart(void);
+uint32_t p2p_hop_index(void);
+void lpwan_session_invalidate(void);
 lmh_error_status send_lora_packet(uint8_t *data, uint8_t size, uint8_t fport = 0);
+uint32_t lora_time_on_air(uint8_t sf, uint8_t bw, uint8_t cr, uint16_t preamble_len, uint16_t size);
+uint32_t p2p_time_on_air(uint16_t size);
+uint32_t lorawan_time_on_air(uint8_t size);
+bool lora_radio_busy(void);
+bool lora_radio_rx_continuous(void);
+
+// Asynchronous operations, completions are reported with the request ID
+enum ASYNC_OP
+{
+	ASYNC_OP_SEND = 0,
+	ASYNC_OP_PSEND = 1,
+	ASYNC_OP_JOIN = 2,
+	ASYNC_OP_NUM = 3
+};
+enum ASYNC_RESULT
+{
+	ASYNC_SUCCESS = 0,
+	ASYNC_FAIL = 1,
+	ASYNC_BUSY = 2
+};
+uint16_t async_new_id(void);
+void async_begin(uint8_t op, uint16_t id, uint32_t airtime);
+uint16_t async_start(uint8_t op, uint32_t airtime);
+uint16_t async_pending(uint8_t op);
+void async_complete(uint8_t op, uint8_t result, uint8_t retries);
+void async_report(void);
+
+// Queue of received packets
+bool rx_queue_add(uint8_t fport, int16_t rssi, int8_t snr, const uint8_t *data, uint16_t size, uint32_t freq);
+void rx_queue_report(void);
+uint8_t rx_queue_pending(void);
+extern uint32_t g_rx_queue_received;
+extern uint32_t g_rx_queue_overflows;
+
+// Ring of flash pages, used by the uplink queue and the log of received packets
+/** No page */
+#define PAGE_RING_NONE 0xFFFF
+/** Header at the start of each page, the pages are written in the order of the sequence numbers */
+struct s_page_ring_header
+{
+	// Marker of a written page of the ring
+	uint32_t magic;
+	// Sequence number of the page
+	uint32_t seq;
+};
+/** Flash area of a ring and the RAM page that collects new entries, the entries have 32 bit fields */
+struct s_page_ring
+{
+	// Offset of the first sector in the flash
+	uint32_t offset;
+	// Number of sectors
+	uint16_t sectors;
+	// Marker of a written page
+	uint32_t magic;
+	// Next page to write and its sequence number
+	uint16_t write_page;
+	uint32_t seq;
+	// Page that collects new entries before it is written to the flash
+	uint8_t page[FLASH_PAGE_SIZE] __attribute__((aligned(4)));
+	// Used bytes of the RAM page, 0 if it is empty
+	uint16_t len;
+	// Time the first entry was added to the RAM page
+	time_t time;
+};
+const uint8_t *page_ring_page(const s_page_ring *ring, uint16_t page);
+uint16_t page_ring_pages(const s_page_ring *ring);
+bool page_ring_valid(const s_page_ring *ring, uint16_t page);
+uint16_t page_ring_init(s_page_ring *ring);
+void page_ring_start(s_page_ring *ring);
+uint16_t page_ring_write(s_page_ring *ring, void (*drop)(uint16_t first_page));
+bool page_ring_due(const s_page_ring *ring, uint32_t delay);
+void page_ring_clear(s_page_ring *ring);
+
+// Store and forward queue for uplinks
+void init_uplink_queue(void);
+bool uplink_queue_add(uint8_t *data, uint8_t size, uint8_t fport);
+void uplink_queue_send(void);
+void uplink_queue_flush(void);
+void uplink_queue_flush_check(void);
+void uplink_queue_clear(void);
+extern uint32_t g_uplink_queue_count;
+extern uint32_t g_uplink_queue_sent;
+extern uint32_t g_uplink_queue_dropped;
+extern uint32_t g_uplink_queue_writes;
+
+// Log of received packets in the flash
+/** Logged received packet as stored in the flash, followed by the payload, padded to 4 bytes */
+struct s_rx_log_entry
+{
+	// Length of the logged payload, 0xFF => end of the page
+	uint8_t len;
+	// Lowest byte of the CRC32 of the entry and the payload
+	uint8_t check;
+	// fPort of a LoRaWAN packet, 0 for LoRa P2P
+	uint8_t fport;
+	// Spreading factor of a LoRa P2P packet, 0 for LoRaWAN
+	uint8_t sf;
+	// RSSI of the packet
+	int16_t rssi;
+	// SNR of the packet
+	int8_t snr;
+	// Size of the received packet, larger than len if the payload was cut
+	uint8_t size;
+	// Number of the boot the packet was received in
+	uint32_t boot;
+	// Time in milliseconds since the boot
+	uint32_t time;
+	// Frequency of a LoRa P2P packet in Hz, 0 for LoRaWAN
+	uint32_t freq;
+};
+void init_rx_log(void);
+void rx_log_add(uint8_t fport, int16_t rssi, int8_t snr, const uint8_t *data, uint8_t size, time_t time, uint32_t freq);
+uint32_t rx_log_read(void (*callback)(const s_rx_log_entry *entry, void *arg), void *arg);
+void rx_log_flush(void);
+void rx_log_flush_check(void);
+void rx_log_clear(void);
+extern uint32_t g_rx_log_count;
+extern uint32_t g_rx_log_writes;
 extern bool g_lpwan_has_joined;
 extern bool g_rx_fin_result;
 extern bool g_join_result;
 extern uint32_t otaaDevAddr;
 
 #define LORAWAN_DATA_MARKER 0x55
+/** Largest number of P2P hopping channels */
+#define P2P_HOP_MAX 8
+
+/** Words of the channel mask of the session, 96 channels of CN470 */
+#define SESSION_CH_MASK_SIZE 6
+/** First channel of the join accept CFList */
+#define SESSION_CFLIST_FIRST 3
+/** Number of channels of the join accept CFList */
+#define SESSION_CFLIST_NUM 5
+
+/** Layout version of s_lorawan_settings, increase it and add a migration in flash.cpp on every layout change */
+#define LORAWAN_SETTINGS_VERSION 8
+/** Default baud rate of Serial1 */
+#define SERIAL1_DEFAULT_BAUD 115200
 struct s_lorawan_settings
 {
 	uint8_t valid_mark_1 = 0xAA;				// Just a marker for the Flash
@@ -148,6 +332,54 @@ struct s_lorawan_settings
 	uint16_t p2p_symbol_timeout = 0;
 	// Command from BLE to reset device
 	bool resetRequest = true;
+	// Echo of received AT command characters 0: off, 1: on
+	uint8_t at_echo = 1;
+	// AT result codes 0: numeric, 1: verbose text
+	uint8_t at_verbose = 1;
+	// Baud rate of Serial1
+	uint32_t at_baudrate = SERIAL1_DEFAULT_BAUD;
+	// RTS/CTS flow control of Serial1 0: off, 1: on
+	uint8_t at_flow_control = 0;
+	// Flag if the session of the last OTAA join is valid
+	uint8_t session_valid = 0;
+	// CRC32 of DevEUI, AppEUI, AppKey and region the session was joined with
+	uint32_t session_id = 0;
+	// Device address of the session
+	uint32_t session_dev_addr = 0;
+	// Network session key of the session
+	uint8_t session_nwk_skey[16] = {0};
+	// Application session key of the session
+	uint8_t session_app_skey[16] = {0};
+	// Uplink frame counter to continue with after a reboot, ahead of the used ones
+	uint32_t session_fcnt_up = 0;
+	// Downlink frame counter
+	uint32_t session_fcnt_down = 0;
+	// Log received packets to the flash 0: off, 1: on
+	uint8_t rx_log_enable = 0;
+	// P2P CAD retries after a busy channel before the packet is dropped 0 .. 10
+	uint8_t p2p_cad_retries = 3;
+	// P2P backoff before the first CAD retry in milliseconds, doubles with every retry
+	uint16_t p2p_backoff = 100;
+	// P2P time on air allowed in one hour in milliseconds, 0: no limit
+	uint32_t p2p_airtime_budget = 0;
+	// Number of P2P hopping channels, 0: hopping disabled, 2 .. P2P_HOP_MAX
+	uint8_t p2p_hop_num = 0;
+	// Time without packets in seconds before the hopping sequence starts again, 0: never
+	uint16_t p2p_hop_reset = 0;
+	// Seed of the hopping sequence, shared by all nodes of a network
+	uint32_t p2p_hop_seed = 0;
+	// Frequencies of the hopping channels in Hz
+	uint32_t p2p_hop_freq[P2P_HOP_MAX] = {0};
+	// RX2 frequency of the session in Hz
+	uint32_t session_rx2_freq = 0;
+	// Channel mask of the session
+	uint16_t session_ch_mask[SESSION_CH_MASK_SIZE] = {0};
+	// Frequencies of the CFList channels of the session in 100 Hz, 3 bytes LSB first like in the CFList, 0: no channel
+	uint8_t session_cflist[SESSION_CFLIST_NUM * 3] = {0};
+	// RX1 delay of the session in seconds
+	uint8_t session_rx1_delay = 0;
+	// RX2 data rate of the session
+	uint8_t session_rx2_dr = 0;
 };
 extern s_lorawan_settings g_lorawan_settings;
 extern bool g_lorawan_initialized;
@@ -156,10 +388,6 @@ extern int8_t g_last_snr;
 extern uint8_t g_last_fport;
 extern uint8_t m_lora_app_data_buffer[];
 extern bool g_lpwan_has_joined;
-extern uint8_t g_rx_data_len;
-extern uint8_t g_rx_lora_data[];
-extern uint8_t g_tx_lora_data[];
-extern uint8_t g_tx_data_len;
 enum P2P_RX_MODE
 {
 	RX_MODE_NONE = 0,
@@ -170,12 +398,103 @@ enum P2P_RX_MODE
 extern uint8_t g_lora_p2p_rx_mode;
 extern uint32_t g_lora_p2p_rx_time;
 
+// Settings registry
+/** Format of a setting in the AT commands */
+enum SETTING_FORMAT
+{
+	// Decimal number
+	SETTING_DEC = 0,
+	// HEX number, MSB first
+	SETTING_HEX = 1,
+	// Byte array as HEX string
+	SETTING_BYTES = 2,
+	// Name of the value from the value names
+	SETTING_NAME = 3
+};
+/** Groups of the status output */
+enum SETTING_GROUP
+{
+	SETTING_GROUP_NONE = 0,
+	SETTING_GROUP_DEVICE = 1,
+	SETTING_GROUP_LPWAN = 2,
+	SETTING_GROUP_P2P = 3
+};
+/** Setting can only be changed in LoRaWAN mode */
+#define SETTING_LPWAN 0x01
+/** Setting can only be changed in LoRa P2P mode */
+#define SETTING_P2P 0x02
+/** Radio has to be configured again after a change */
+#define SETTING_RADIO 0x04
+/** A change ends the saved OTAA session */
+#define SETTING_SESSION 0x08
+/** Largest SETTING_BYTES field */
+#define SETTING_BYTES_MAX 16
+struct s_setting
+{
+	// AT command, NULL if the setting has no command of its own
+	const char *cmd_name;
+	// Name in the status output
+	const char *name;
+	// Position and size in s_lorawan_settings
+	uint8_t offset;
+	uint8_t size;
+	// SETTING_FORMAT
+	uint8_t format;
+	// SETTING_LPWAN, SETTING_P2P, SETTING_RADIO, SETTING_SESSION
+	uint8_t flags;
+	// SETTING_GROUP
+	uint8_t group;
+	// Valid range of the value
+	uint32_t min;
+	uint32_t max;
+	// Names of the values for the status output, indexed by value, NULL for invalid values
+	const char *const *names;
+};
+extern const s_setting g_settings[];
+extern const uint8_t g_settings_num;
+extern const char *bandwidths[];
+extern const char *region_names[];
+const s_setting *setting_find(const char *cmd_name);
+uint32_t setting_get(const s_setting *setting);
+bool setting_parse(const s_setting *setting, const char *str, s_lorawan_settings *settings);
+void setting_print(const s_setting *setting, char *buf, uint16_t size, bool status);
+
 // AT command parser
-void at_serial_input(uint8_t cmd);
+enum AT_PORT
+{
+	AT_PORT_USB = 0,
+	AT_PORT_SERIAL1 = 1,
+	AT_PORT_NUM = 2
+};
+void at_serial_input(uint8_t cmd, uint8_t port);
+void at_init_ports(void);
 bool init_serial_task(void);
-extern char *region_names[];
+void serial1_attach_rx(void);
+bool serial1_baud_valid(uint32_t baud);
+void serial1_set_baud(uint32_t baud, uint8_t flow_control);
+void serial1_get_baud(uint32_t *baud, uint8_t *flow_control);
+void serial1_baud_confirm(void);
+void serial1_baud_apply(void);
+void serial1_baud_check(void);
+void init_at_cmd_task(void);
+void at_cmd_lock(void);
+void at_cmd_unlock(void);
+extern volatile uint32_t g_serial1_rx_overruns;
 bool user_at_handler(char *user_cmd, uint8_t cmd_size) __attribute__((weak));
 void at_settings(void);
+void at_report_rx(uint8_t fport, int16_t rssi, int8_t snr, uint8_t *data, uint16_t len);
+
+// Binary framed mode
+bool bin_mode_active(uint8_t port);
+void bin_mode_start(uint8_t port);
+void bin_mode_stop(uint8_t port);
+void bin_serial_input(uint8_t data, uint8_t port);
+void bin_send_event(uint8_t port, const uint8_t *data, uint16_t len);
+void bin_send_rx(uint8_t port, uint8_t fport, int16_t rssi, int8_t snr, const uint8_t *data, uint16_t len);
+
+// HEX codec
+int hex_decode(const char *hex, uint16_t hex_length, uint8_t *bin, uint16_t bin_length);
+uint16_t hex_encode(const uint8_t *bin, uint16_t bin_length, char *hex);
 
 // Battery
 void init_batt(void);
@@ -183,8 +502,44 @@ float read_batt(void);
 uint8_t get_lora_batt(void);
 uint8_t mv_to_percent(float mvolts);
 
+// Flash layout, counted from the end of the flash
+/** Sector of the settings of older firmware */
+#define FLASH_TARGET_OFFSET (PICO_FLASH_SIZE_BYTES - FLASH_SECTOR_SIZE)
+/** Number of flash sectors used for the settings log, the sectors are used round robin */
+#define SETTINGS_LOG_SECTORS 4
+/** Settings log area, directly below the sector used by older firmware */
+#define SETTINGS_LOG_OFFSET (FLASH_TARGET_OFFSET - SETTINGS_LOG_SECTORS * FLASH_SECTOR_SIZE)
+/** Number of flash sectors used for the uplink queue */
+#define UPLINK_QUEUE_SECTORS 4
+/** Uplink queue area, directly below the settings log */
+#define UPLINK_QUEUE_OFFSET (SETTINGS_LOG_OFFSET - UPLINK_QUEUE_SECTORS * FLASH_SECTOR_SIZE)
+/** Number of flash sectors used for the log of received packets */
+#define RX_LOG_SECTORS 8
+/** Log of received packets, directly below the uplink queue */
+#define RX_LOG_OFFSET (UPLINK_QUEUE_OFFSET - RX_LOG_SECTORS * FLASH_SECTOR_SIZE)
+
 // Fake Flash
 void init_flash(void);
 bool save_settings(void);
+void settings_flush(void);
+void settings_flush_check(void);
+extern uint32_t g_settings_save_requests;
+extern uint32_t g_settings_erases;
+extern uint32_t g_settings_log_records;
+extern uint32_t g_settings_boot_time;
 void log_settings(void);
+uint32_t calc_crc32(uint32_t crc, const uint8_t *data, uint16_t len);
+void flash_program(uint32_t offset, const uint8_t *data, uint16_t len);
+bool flash_erase(uint32_t offset);
+bool flash_defer(time_t since);
+void flash_erase_later(uint32_t offset);
+void flash_jobs_run(void);
+uint8_t flash_jobs_pending(void);
+extern uint32_t g_flash_blackout_max;
+extern uint32_t g_flash_blackout_radio;
+extern uint32_t g_flash_erase_deferred;
+extern uint32_t g_flash_erase_forced;
+extern uint32_t g_flash_erases;
+extern uint32_t g_flash_programs;
+extern uint32_t g_flash_blackout_total;
 void flash_reset(void);
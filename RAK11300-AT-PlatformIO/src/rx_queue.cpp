@@ -0,0 +1,113 @@
+/**
+ * @file rx_queue.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Queue of received packets between the LoRa callbacks and the loop thread
+ * @version 0.1
+ * @date 2021-10-09
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "main.h"
+
+/** Number of packets that can wait for the loop thread, must be a power of 2 */
+#define RX_QUEUE_SIZE 8
+
+/** Received packet */
+struct s_rx_packet
+{
+	// Time of reception in milliseconds
+	time_t time;
+	// RSSI of the packet
+	int16_t rssi;
+	// SNR of the packet
+	int8_t snr;
+	// fPort of the packet (0 for LoRa P2P)
+	uint8_t fport;
+	// Frequency of the packet in Hz (0 for LoRaWAN)
+	uint32_t freq;
+	// Length of the payload
+	uint16_t len;
+	// Payload
+	uint8_t data[256];
+};
+
+/** Packet queue, written from the LoRa callbacks, read by the loop thread */
+static s_rx_packet g_rx_queue[RX_QUEUE_SIZE];
+static volatile uint8_t g_rx_queue_head = 0;
+static volatile uint8_t g_rx_queue_tail = 0;
+
+/** Number of received packets */
+uint32_t g_rx_queue_received = 0;
+/** Number of packets lost because the queue was full */
+uint32_t g_rx_queue_overflows = 0;
+
+/**
+ * @brief Queue a received packet and wake up the loop thread to report it
+ * Only called from the radio callbacks, the loop thread is the only reader
+ *
+ * @param fport fPort of the packet (0 for LoRa P2P)
+ * @param rssi RSSI of the packet
+ * @param snr SNR of the packet
+ * @param data received data
+ * @param size length of received data
+ * @param freq frequency the packet was received on in Hz (0 for LoRaWAN)
+ * @return true if the packet was queued, false if the queue was full
+ */
+bool rx_queue_add(uint8_t fport, int16_t rssi, int8_t snr, const uint8_t *data, uint16_t size, uint32_t freq)
+{
+	g_rx_queue_received++;
+	if ((uint8_t)(g_rx_queue_head - g_rx_queue_tail) >= RX_QUEUE_SIZE)
+	{
+		// The older packets are kept, they are reported in the order of reception
+		g_rx_queue_overflows++;
+		return false;
+	}
+
+	s_rx_packet *packet = &g_rx_queue[g_rx_queue_head % RX_QUEUE_SIZE];
+	packet->time = millis();
+	packet->rssi = rssi;
+	packet->snr = snr;
+	packet->fport = fport;
+	packet->freq = freq;
+	packet->len = size > sizeof(packet->data) ? sizeof(packet->data) : size;
+	memcpy(packet->data, data, packet->len);
+	// The packet has to be complete before the loop thread can see it
+	__DMB();
+	g_rx_queue_head++;
+
+	if (loop_thread != NULL)
+	{
+		osSignalSet(loop_thread, SIGNAL_RX);
+	}
+	return true;
+}
+
+/**
+ * @brief Report and log all queued packets
+ * Signals of several packets are merged into one wake up, so the queue is emptied completely
+ *
+ */
+void rx_queue_report(void)
+{
+	while (g_rx_queue_tail != g_rx_queue_head)
+	{
+		s_rx_packet *packet = &g_rx_queue[g_rx_queue_tail % RX_QUEUE_SIZE];
+		APP_LOG("APP", "RX finished %d bytes, RSSI %d, SNR %d", packet->len, packet->rssi, packet->snr);
+		at_report_rx(packet->fport, packet->rssi, packet->snr, packet->data, packet->len);
+		rx_log_add(packet->fport, packet->rssi, packet->snr, packet->data, packet->len, packet->time, packet->freq);
+		// The slot is only released after the packet was used
+		__DMB();
+		g_rx_queue_tail++;
+	}
+}
+
+/**
+ * @brief Get the number of packets waiting to be reported
+ *
+ * @return uint8_t number of packets
+ */
+uint8_t rx_queue_pending(void)
+{
+	return g_rx_queue_head - g_rx_queue_tail;
+}
@@ -0,0 +1,425 @@
+/**
+ * @file uplink_queue.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Store and forward queue for LoRaWAN uplinks in the flash
+ * @version 0.1
+ * @date 2021-10-09
+ * 
+ * @copyright Copyright (c) 2021
+ * 
+ */
+#include "main.h"
+
+/** Number of flash pages in the uplink queue */
+#define UPLINK_QUEUE_PAGES (UPLINK_QUEUE_SECTORS * FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE)
+/** Number of flash pages in one sector */
+#define UPLINK_QUEUE_SECTOR_PAGES (FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE)
+/** Marker of a written uplink queue page "UPQ1" */
+#define UPLINK_QUEUE_MAGIC 0x31515055
+/** No unsent packet in the flash */
+#define UPLINK_QUEUE_NONE PAGE_RING_NONE
+
+/** Time in milliseconds a packet waits in RAM before its page is written to the flash */
+#define UPLINK_QUEUE_WRITE_DELAY 30000
+/** Time in milliseconds before sending is tried again if the LoRaWAN MAC was busy */
+#define UPLINK_QUEUE_RETRY_TIME 5000
+/** Duty cycle of queued uplinks is 1 / UPLINK_QUEUE_DUTY_CYCLE */
+#define UPLINK_QUEUE_DUTY_CYCLE 100
+
+/** Entry state, programmed from 0xFF to 0x00 after the packet was sent */
+#define UPLINK_QUEUE_QUEUED 0xFF
+#define UPLINK_QUEUE_SENT 0x00
+
+/** Header of a queued packet, followed by the payload */
+struct s_uplink_entry
+{
+	// UPLINK_QUEUE_QUEUED or UPLINK_QUEUE_SENT
+	uint8_t state;
+	// Length of the payload, 0xFF => end of the page
+	uint8_t len;
+	// fPort of the packet
+	uint8_t fport;
+	// Lowest byte of the CRC32 of length, fPort and payload
+	uint8_t check;
+};
+
+/** Pages of the queue in the flash and the RAM page with the newest packets */
+static s_page_ring g_uplink_ring = {UPLINK_QUEUE_OFFSET, UPLINK_QUEUE_SECTORS, UPLINK_QUEUE_MAGIC, 0, 1};
+/** Offset of the first unsent packet in the RAM page */
+static uint16_t g_uplink_page_read = 0;
+/** Page and offset of the oldest unsent packet in the flash, UPLINK_QUEUE_NONE if none */
+static uint16_t g_uplink_read_page = UPLINK_QUEUE_NONE;
+static uint16_t g_uplink_read_pos = 0;
+
+/** Time of the last queued uplink and the time to wait before the next one */
+static time_t g_uplink_last_send = 0;
+static uint32_t g_uplink_gap = 0;
+
+/** Timer to send the next queued uplink after the duty cycle wait */
+static TimerEvent_t uplink_queue_timer;
+
+/** Access from the AT command task and the loop */
+static Mutex g_uplink_queue_lock;
+
+/** Number of packets waiting in the queue */
+uint32_t g_uplink_queue_count = 0;
+/** Number of queued packets that were sent */
+uint32_t g_uplink_queue_sent = 0;
+/** Number of packets dropped because the queue was full or the packet could not be sent */
+uint32_t g_uplink_queue_dropped = 0;
+/** Number of pages written to the flash */
+uint32_t g_uplink_queue_writes = 0;
+
+/**
+ * @brief Check byte of a packet
+ * 
+ * @param entry packet header followed by the payload
+ * @return uint8_t check byte
+ */
+static uint8_t uplink_queue_check(const s_uplink_entry *entry)
+{
+	uint32_t crc = calc_crc32(0, &entry->len, 2);
+	return calc_crc32(crc, (const uint8_t *)entry + sizeof(s_uplink_entry), entry->len) & 0xFF;
+}
+
+/**
+ * @brief Find the next unsent packet in a page
+ * 
+ * @param data page data
+ * @param pos offset to start the search, receives the offset of the packet
+ * @param count if not NULL, receives the number of unsent packets from pos to the end of the page
+ * @return true if an unsent packet was found
+ */
+static bool uplink_queue_find(const uint8_t *data, uint16_t *pos, uint32_t *count)
+{
+	bool found = false;
+	uint16_t idx = *pos;
+	while (idx + sizeof(s_uplink_entry) <= FLASH_PAGE_SIZE)
+	{
+		const s_uplink_entry *entry = (const s_uplink_entry *)&data[idx];
+		if ((entry->len == 0xFF) || (idx + sizeof(s_uplink_entry) + entry->len > FLASH_PAGE_SIZE))
+		{
+			break;
+		}
+		if ((entry->state == UPLINK_QUEUE_QUEUED) && (entry->check == uplink_queue_check(entry)))
+		{
+			if (!found)
+			{
+				*pos = idx;
+				found = true;
+			}
+			if (count == NULL)
+			{
+				break;
+			}
+			(*count)++;
+		}
+		idx += sizeof(s_uplink_entry) + entry->len;
+	}
+	return found;
+}
+
+/**
+ * @brief Move the read position to the next unsent packet in the flash
+ * The search ends at the next page to write, starting there searches the whole queue
+ * 
+ * @param page page to start the search
+ * @param pos offset in the page to start the search
+ */
+static void uplink_queue_seek(uint16_t page, uint16_t pos)
+{
+	uint16_t pages = (g_uplink_ring.write_page + UPLINK_QUEUE_PAGES - page) % UPLINK_QUEUE_PAGES;
+	if (pages == 0)
+	{
+		pages = UPLINK_QUEUE_PAGES;
+	}
+	while (pages-- > 0)
+	{
+		if (page_ring_valid(&g_uplink_ring, page) && uplink_queue_find(page_ring_page(&g_uplink_ring, page), &pos, NULL))
+		{
+			g_uplink_read_page = page;
+			g_uplink_read_pos = pos;
+			return;
+		}
+		page = (page + 1) % UPLINK_QUEUE_PAGES;
+		pos = sizeof(s_page_ring_header);
+	}
+	g_uplink_read_page = UPLINK_QUEUE_NONE;
+}
+
+/**
+ * @brief Find the queued packets in the flash after a reboot
+ * 
+ */
+void init_uplink_queue(void)
+{
+	uint16_t newest = page_ring_init(&g_uplink_ring);
+	if (newest == PAGE_RING_NONE)
+	{
+		return;
+	}
+
+	// Count the unsent packets, the oldest page is the one after the newest page
+	g_uplink_queue_count = 0;
+	for (uint16_t idx = 1; idx <= UPLINK_QUEUE_PAGES; idx++)
+	{
+		uint16_t page = (newest + idx) % UPLINK_QUEUE_PAGES;
+		uint16_t pos = sizeof(s_page_ring_header);
+		if (page_ring_valid(&g_uplink_ring, page))
+		{
+			uplink_queue_find(page_ring_page(&g_uplink_ring, page), &pos, &g_uplink_queue_count);
+		}
+	}
+	uplink_queue_seek(g_uplink_ring.write_page, sizeof(s_page_ring_header));
+	APP_LOG("QUEUE", "%" PRIu32 " packets queued, next page %d", g_uplink_queue_count, g_uplink_ring.write_page);
+}
+
+/**
+ * @brief Drop the unsent packets of a sector before the sector is erased
+ * 
+ * @param first_page first page of the sector
+ */
+static void uplink_queue_drop(uint16_t first_page)
+{
+	uint16_t last_page = first_page + UPLINK_QUEUE_SECTOR_PAGES;
+	for (uint16_t page = first_page; page < last_page; page++)
+	{
+		uint16_t pos = sizeof(s_page_ring_header);
+		uint32_t dropped = 0;
+		if (page_ring_valid(&g_uplink_ring, page))
+		{
+			uplink_queue_find(page_ring_page(&g_uplink_ring, page), &pos, &dropped);
+		}
+		g_uplink_queue_dropped += dropped;
+		g_uplink_queue_count -= dropped;
+	}
+	if ((g_uplink_read_page >= first_page) && (g_uplink_read_page < last_page))
+	{
+		uplink_queue_seek(last_page % UPLINK_QUEUE_PAGES, sizeof(s_page_ring_header));
+	}
+}
+
+/**
+ * @brief Write the RAM page with the new packets to the flash
+ * 
+ */
+static void uplink_queue_write_page(void)
+{
+	if (g_uplink_page_read == g_uplink_ring.len)
+	{
+		// All packets were sent from RAM
+		g_uplink_ring.len = 0;
+		g_uplink_page_read = 0;
+		return;
+	}
+
+	// Sent packets are not copied to the flash
+	uint8_t *page = g_uplink_ring.page;
+	memmove(&page[sizeof(s_page_ring_header)], &page[g_uplink_page_read], g_uplink_ring.len - g_uplink_page_read);
+	g_uplink_ring.len -= g_uplink_page_read - sizeof(s_page_ring_header);
+	uint16_t written = page_ring_write(&g_uplink_ring, uplink_queue_drop);
+	g_uplink_queue_writes++;
+
+	if (g_uplink_read_page == UPLINK_QUEUE_NONE)
+	{
+		g_uplink_read_page = written;
+		g_uplink_read_pos = sizeof(s_page_ring_header);
+	}
+	g_uplink_page_read = 0;
+}
+
+/**
+ * @brief Add a packet to the uplink queue
+ * The packet is collected in RAM and written to the flash when the page is full
+ * or UPLINK_QUEUE_WRITE_DELAY after it was queued
+ * 
+ * @param data payload
+ * @param size size of the payload
+ * @param fport fPort, 0 => default fPort
+ * @return true if the packet was queued
+ */
+bool uplink_queue_add(uint8_t *data, uint8_t size, uint8_t fport)
+{
+	if (size > FLASH_PAGE_SIZE - sizeof(s_page_ring_header) - sizeof(s_uplink_entry))
+	{
+		return false;
+	}
+
+	g_uplink_queue_lock.lock();
+	if (g_uplink_ring.len + sizeof(s_uplink_entry) + size > FLASH_PAGE_SIZE)
+	{
+		uplink_queue_write_page();
+	}
+	if (g_uplink_ring.len == 0)
+	{
+		page_ring_start(&g_uplink_ring);
+		g_uplink_page_read = sizeof(s_page_ring_header);
+	}
+
+	s_uplink_entry *entry = (s_uplink_entry *)&g_uplink_ring.page[g_uplink_ring.len];
+	entry->state = UPLINK_QUEUE_QUEUED;
+	entry->len = size;
+	entry->fport = fport != 0 ? fport : g_lorawan_settings.app_port;
+	memcpy(&g_uplink_ring.page[g_uplink_ring.len + sizeof(s_uplink_entry)], data, size);
+	entry->check = uplink_queue_check(entry);
+	g_uplink_ring.len += sizeof(s_uplink_entry) + size;
+	g_uplink_queue_count++;
+	g_uplink_queue_lock.unlock();
+
+	if (loop_thread != NULL)
+	{
+		osSignalSet(loop_thread, SIGNAL_QUEUE);
+	}
+	return true;
+}
+
+/**
+ * @brief Write the queued packets from RAM to the flash
+ * Called before a reset
+ * 
+ */
+void uplink_queue_flush(void)
+{
+	g_uplink_queue_lock.lock();
+	uplink_queue_write_page();
+	g_uplink_queue_lock.unlock();
+}
+
+/**
+ * @brief Write the queued packets from RAM to the flash after UPLINK_QUEUE_WRITE_DELAY
+ * 
+ */
+void uplink_queue_flush_check(void)
+{
+	g_uplink_queue_lock.lock();
+	if (page_ring_due(&g_uplink_ring, UPLINK_QUEUE_WRITE_DELAY))
+	{
+		uplink_queue_write_page();
+	}
+	g_uplink_queue_lock.unlock();
+}
+
+/**
+ * @brief Discard all queued packets
+ * 
+ */
+void uplink_queue_clear(void)
+{
+	g_uplink_queue_lock.lock();
+	page_ring_clear(&g_uplink_ring);
+	g_uplink_queue_dropped += g_uplink_queue_count;
+	g_uplink_queue_count = 0;
+	g_uplink_page_read = 0;
+	g_uplink_read_page = UPLINK_QUEUE_NONE;
+	g_uplink_queue_lock.unlock();
+}
+
+/**
+ * @brief Timer callback, wake up the loop to send the next queued packet
+ * 
+ */
+static void uplink_queue_wakeup(void)
+{
+	if (loop_thread != NULL)
+	{
+		osSignalSet(loop_thread, SIGNAL_QUEUE);
+	}
+}
+
+/**
+ * @brief Restart the timer to try to send again
+ * 
+ * @param time time in milliseconds
+ */
+static void uplink_queue_retry(uint32_t time)
+{
+	uplink_queue_timer.oneShot = true;
+	TimerInit(&uplink_queue_timer, uplink_queue_wakeup);
+	TimerSetValue(&uplink_queue_timer, time);
+	TimerStart(&uplink_queue_timer);
+}
+
+/**
+ * @brief Send the oldest queued packet, the caller holds the AT command lock
+ * 
+ */
+static void uplink_queue_send_next(void)
+{
+	if (!g_lorawan_settings.lorawan_enable || !g_lpwan_has_joined || (async_pending(ASYNC_OP_SEND) != 0))
+	{
+		// Woken up again by the join or the completion of the packet in flight
+		return;
+	}
+
+	g_uplink_queue_lock.lock();
+
+	// Flash packets are older than the packets in RAM
+	s_uplink_entry *entry;
+	if (g_uplink_read_page != UPLINK_QUEUE_NONE)
+	{
+		entry = (s_uplink_entry *)&page_ring_page(&g_uplink_ring, g_uplink_read_page)[g_uplink_read_pos];
+	}
+	else if (g_uplink_page_read != g_uplink_ring.len)
+	{
+		entry = (s_uplink_entry *)&g_uplink_ring.page[g_uplink_page_read];
+	}
+	else
+	{
+		g_uplink_queue_lock.unlock();
+		return;
+	}
+
+	if ((millis() - g_uplink_last_send) < g_uplink_gap)
+	{
+		uplink_queue_retry(g_uplink_gap - (millis() - g_uplink_last_send));
+		g_uplink_queue_lock.unlock();
+		return;
+	}
+
+	lmh_error_status result = send_lora_packet((uint8_t *)entry + sizeof(s_uplink_entry), entry->len, entry->fport);
+	if (result == LMH_BUSY)
+	{
+		uplink_queue_retry(UPLINK_QUEUE_RETRY_TIME);
+		g_uplink_queue_lock.unlock();
+		return;
+	}
+
+	if (result == LMH_SUCCESS)
+	{
+		g_uplink_queue_sent++;
+		g_uplink_last_send = millis();
+		g_uplink_gap = g_lorawan_settings.duty_cycle_enabled ? lorawan_time_on_air(entry->len) * (UPLINK_QUEUE_DUTY_CYCLE - 1) : 0;
+	}
+	else
+	{
+		// Too large for the data rate
+		g_uplink_queue_dropped++;
+	}
+	g_uplink_queue_count--;
+
+	if (g_uplink_read_page != UPLINK_QUEUE_NONE)
+	{
+		uint8_t state = UPLINK_QUEUE_SENT;
+		flash_program(UPLINK_QUEUE_OFFSET + g_uplink_read_page * FLASH_PAGE_SIZE + g_uplink_read_pos, &state, 1);
+		uplink_queue_seek(g_uplink_read_page, g_uplink_read_pos + sizeof(s_uplink_entry) + entry->len);
+	}
+	else
+	{
+		g_uplink_page_read += sizeof(s_uplink_entry) + entry->len;
+	}
+	g_uplink_queue_lock.unlock();
+}
+
+/**
+ * @brief Send the oldest queued packet
+ * Called from the loop, only one packet is sent at a time. After each packet the
+ * queue waits for the completion and for the duty cycle time of the packet.
+ * AT+SEND uses the same send buffer and MAC on the AT command task, both send under the AT command lock.
+ * 
+ */
+void uplink_queue_send(void)
+{
+	at_cmd_lock();
+	uplink_queue_send_next();
+	at_cmd_unlock();
+}
@@ -0,0 +1,90 @@
+/**
+ * @file bench_at_dispatch.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Compare the AT command hash table lookup with the linear scan it replaced
+ * Every command must be found at its own index, unknown names must not be found
+ * @version 0.1
+ * @date 2021-10-09
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+// at_find_cmd() is static, the firmware file is part of this test instead of the firmware build
+#include "../../RAK11300-AT-PlatformIO/src/at_cmd.cpp"
+#include "host_emu.h"
+
+/** Repeats of each lookup */
+#define BENCH_LOOPS 20000
+
+/**
+ * @brief Linear scan of the command list like at_cmd_exec() did before the hash table
+ *
+ * @param name command name without "AT"
+ * @param len length of the name
+ * @return int index into g_at_cmd_list, -1 if not found
+ */
+static int linear_find_cmd(const char *name, uint16_t len)
+{
+	for (unsigned int idx = 0; idx < AT_CMD_NUM; idx++)
+	{
+		const char *cmd_name = g_at_cmd_list[idx].cmd_name;
+		if ((strlen(cmd_name) == len) && (strncmp(name, cmd_name, strlen(cmd_name)) == 0))
+		{
+			return idx;
+		}
+	}
+	return -1;
+}
+
+/**
+ * @brief Time BENCH_LOOPS lookups of all names
+ *
+ * @param find lookup function
+ * @param names names to look up
+ * @param num number of names
+ * @return double ns per lookup
+ */
+static double bench_lookup(int (*find)(const char *, uint16_t), const char **names, size_t num)
+{
+	volatile int sink = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int loop = 0; loop < BENCH_LOOPS; loop++)
+	{
+		for (size_t idx = 0; idx < num; idx++)
+		{
+			sink += find(names[idx], strlen(names[idx]));
+		}
+	}
+	auto end = std::chrono::steady_clock::now();
+	(void)sink;
+	return std::chrono::duration<double, std::nano>(end - start).count() / (BENCH_LOOPS * num);
+}
+
+int main(void)
+{
+	const char *names[AT_CMD_NUM];
+	for (unsigned int idx = 0; idx < AT_CMD_NUM; idx++)
+	{
+		names[idx] = g_at_cmd_list[idx].cmd_name;
+		EMU_CHECK(at_find_cmd(names[idx], strlen(names[idx])) == (int)idx);
+		EMU_CHECK(linear_find_cmd(names[idx], strlen(names[idx])) == (int)idx);
+	}
+
+	// Prefixes, extensions and case of known commands
+	const char *unknown[] = {"+", "+DEV", "+DEVEUIX", "+deveui", "+SEND2", "+NJMX", "X", "+PSENDD", "+ZZZ"};
+	for (size_t idx = 0; idx < sizeof(unknown) / sizeof(unknown[0]); idx++)
+	{
+		EMU_CHECK(at_find_cmd(unknown[idx], strlen(unknown[idx])) == -1);
+		EMU_CHECK(linear_find_cmd(unknown[idx], strlen(unknown[idx])) == -1);
+	}
+
+	double hash_ns = bench_lookup(at_find_cmd, names, AT_CMD_NUM);
+	double linear_ns = bench_lookup(linear_find_cmd, names, AT_CMD_NUM);
+	printf("%u commands, hash table %.1f ns, linear scan %.1f ns per lookup\n", (unsigned)AT_CMD_NUM, hash_ns, linear_ns);
+	const char *last = names[AT_CMD_NUM - 1];
+	const char *last_names[] = {last};
+	printf("last command %s: hash table %.1f ns, linear scan %.1f ns\n", last,
+		   bench_lookup(at_find_cmd, last_names, 1), bench_lookup(linear_find_cmd, last_names, 1));
+
+	return emu_result("bench_at_dispatch");
+}
@@ -0,0 +1,210 @@
+/**
+ * @file bench_hex.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Check the table based HEX codec and compare it with the decoders and the encoder it replaced
+ * Covers all byte values, payloads up to 255 bytes and invalid input at every position
+ * @version 0.1
+ * @date 2021-10-09
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "host_emu.h"
+
+/** Largest payload of AT+SEND and AT+PSEND */
+#define BENCH_PAYLOAD 255
+/** Repeats of each conversion */
+#define BENCH_LOOPS 20000
+
+/**
+ * @brief Payload decoder of at_exec_send() before the HEX codec, one strtol() per byte
+ * The loop bound is fixed, the old one read past the string
+ *
+ * @param hex HEX string
+ * @param bin output byte array
+ * @return int number of decoded bytes
+ */
+static int strtol_decode(const char *hex, uint8_t *bin)
+{
+	char buff_parse[3] = {0};
+	int data_size = strlen(hex);
+	int bin_idx = 0;
+	for (int idx = 0; idx < data_size; idx += 2)
+	{
+		buff_parse[0] = hex[idx];
+		buff_parse[1] = hex[idx + 1];
+		bin[bin_idx++] = strtol(buff_parse, NULL, 16);
+	}
+	return bin_idx;
+}
+
+/**
+ * @brief hex2bin() of at_cmd.cpp before the HEX codec, one branch chain per character
+ *
+ * @param hex HEX string
+ * @param bin output byte array
+ * @param bin_length size of the output byte array
+ * @return int number of decoded bytes, -1 if the conversion failed
+ */
+static int branch_decode(const char *hex, uint8_t *bin, uint16_t bin_length)
+{
+	uint16_t hex_length = strlen(hex);
+	const char *hex_end = hex + hex_length;
+	uint8_t *cur = bin;
+	uint8_t num_chars = 0;
+	uint8_t byte = 0;
+
+	if ((hex_length % 2 != 0) || (hex_length / 2 > bin_length))
+	{
+		return -1;
+	}
+	while (hex < hex_end)
+	{
+		if ('A' <= *hex && *hex <= 'F')
+		{
+			byte |= 10 + (*hex - 'A');
+		}
+		else if ('a' <= *hex && *hex <= 'f')
+		{
+			byte |= 10 + (*hex - 'a');
+		}
+		else if ('0' <= *hex && *hex <= '9')
+		{
+			byte |= *hex - '0';
+		}
+		else
+		{
+			return -1;
+		}
+		hex++;
+		num_chars++;
+		if (num_chars >= 2)
+		{
+			num_chars = 0;
+			*cur++ = byte;
+			byte = 0;
+		}
+		else
+		{
+			byte <<= 4;
+		}
+	}
+	return cur - bin;
+}
+
+/**
+ * @brief Key query encoder before the HEX codec, snprintf() with %02X per byte
+ *
+ * @param bin byte array
+ * @param bin_length number of bytes
+ * @param hex output string
+ * @return uint16_t length of the HEX string
+ */
+static uint16_t snprintf_encode(const uint8_t *bin, uint16_t bin_length, char *hex)
+{
+	uint16_t len = 0;
+	hex[0] = '\0';
+	for (uint16_t idx = 0; idx < bin_length; idx++)
+	{
+		len += snprintf(hex + len, 3, "%02X", bin[idx]);
+	}
+	return len;
+}
+
+/**
+ * @brief Time BENCH_LOOPS runs of a conversion
+ *
+ * @param run conversion
+ * @return double ns per run
+ */
+template <typename F>
+static double bench_run(F run)
+{
+	auto start = std::chrono::steady_clock::now();
+	for (int loop = 0; loop < BENCH_LOOPS; loop++)
+	{
+		run();
+	}
+	auto end = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::nano>(end - start).count() / BENCH_LOOPS;
+}
+
+int main(void)
+{
+	uint8_t bin[BENCH_PAYLOAD];
+	uint8_t ref_bin[BENCH_PAYLOAD];
+	uint8_t out[BENCH_PAYLOAD + 1];
+	char hex[2 * BENCH_PAYLOAD + 1];
+	char ref_hex[2 * BENCH_PAYLOAD + 1];
+
+	// All byte values, upper and lower case
+	for (uint16_t value = 0; value < 256; value++)
+	{
+		uint8_t byte = value;
+		EMU_CHECK(hex_encode(&byte, 1, hex) == 2);
+		snprintf_encode(&byte, 1, ref_hex);
+		EMU_CHECK(strcmp(hex, ref_hex) == 0);
+		EMU_CHECK((hex_decode(hex, 2, out, 1) == 1) && (out[0] == byte));
+		snprintf(hex, sizeof(hex), "%02x", byte);
+		EMU_CHECK((hex_decode(hex, 2, out, 1) == 1) && (out[0] == byte));
+	}
+
+	// Every payload length up to 255 bytes, odd and even lengths take different decoder paths
+	srand(11300);
+	for (uint16_t len = 0; len <= BENCH_PAYLOAD; len++)
+	{
+		for (uint16_t idx = 0; idx < len; idx++)
+		{
+			bin[idx] = rand();
+		}
+		EMU_CHECK(hex_encode(bin, len, hex) == 2 * len);
+		EMU_CHECK(strlen(hex) == 2 * (size_t)len);
+		snprintf_encode(bin, len, ref_hex);
+		EMU_CHECK(strcmp(hex, ref_hex) == 0);
+		memset(out, 0xA5, sizeof(out));
+		EMU_CHECK(hex_decode(hex, 2 * len, out, len) == len);
+		EMU_CHECK(memcmp(out, bin, len) == 0);
+		// Nothing written after the decoded bytes
+		EMU_CHECK(out[len] == 0xA5);
+		EMU_CHECK((strtol_decode(hex, ref_bin) == len) && (memcmp(ref_bin, bin, len) == 0));
+		EMU_CHECK(branch_decode(hex, ref_bin, len) == len);
+	}
+
+	// Odd length and a too small output
+	EMU_CHECK(hex_decode("ABC", 3, out, sizeof(out)) == -1);
+	EMU_CHECK(hex_decode("ABCD", 4, out, 1) == -1);
+	EMU_CHECK(hex_decode("", 0, out, 0) == 0);
+
+	// An invalid character anywhere in a 255 byte payload
+	for (uint16_t idx = 0; idx < BENCH_PAYLOAD; idx++)
+	{
+		bin[idx] = idx;
+	}
+	hex_encode(bin, BENCH_PAYLOAD, hex);
+	const char invalid[] = {'G', 'g', 'x', ' ', '-', ':', '/', '@', '`', '\0', (char)0x80, (char)0xFF};
+	for (uint16_t pos = 0; pos < 2 * BENCH_PAYLOAD; pos++)
+	{
+		char saved = hex[pos];
+		for (size_t inv = 0; inv < sizeof(invalid); inv++)
+		{
+			hex[pos] = invalid[inv];
+			EMU_CHECK(hex_decode(hex, 2 * BENCH_PAYLOAD, out, BENCH_PAYLOAD) == -1);
+		}
+		hex[pos] = saved;
+	}
+	EMU_CHECK(hex_decode(hex, 2 * BENCH_PAYLOAD, out, BENCH_PAYLOAD) == BENCH_PAYLOAD);
+
+	// 255 byte payload
+	volatile int sink = 0;
+	double table_dec = bench_run([&]() { sink += hex_decode(hex, 2 * BENCH_PAYLOAD, out, BENCH_PAYLOAD); });
+	double strtol_dec = bench_run([&]() { sink += strtol_decode(hex, ref_bin); });
+	double branch_dec = bench_run([&]() { sink += branch_decode(hex, ref_bin, BENCH_PAYLOAD); });
+	double table_enc = bench_run([&]() { sink += hex_encode(bin, BENCH_PAYLOAD, ref_hex); });
+	double snprintf_enc = bench_run([&]() { sink += snprintf_encode(bin, BENCH_PAYLOAD, ref_hex); });
+	(void)sink;
+	printf("%d byte payload decode: table %.0f ns, strtol %.0f ns, hex2bin %.0f ns\n", BENCH_PAYLOAD, table_dec,
+		   strtol_dec, branch_dec);
+	printf("%d byte payload encode: table %.0f ns, snprintf %.0f ns\n", BENCH_PAYLOAD, table_enc, snprintf_enc);
+
+	return emu_result("bench_hex");
+}
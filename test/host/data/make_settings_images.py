@@ -0,0 +1,116 @@
+#!/usr/bin/env python3
+"""Write the settings flash images of older firmware layouts used by test_settings_migration
+
+legacy_v1.bin, legacy_v1_ff.bin
+    Sector at FLASH_TARGET_OFFSET as written by the firmware before the AT interface settings,
+    s_lorawan_settings of the first release. The bytes after the struct are what the 256 byte
+    page write picked up behind it, 0x00 or 0xFF.
+legacy_v2.bin
+    Same sector with the AT interface settings appended (ATE/ATV, Serial1 baud rate and flow control).
+log_v3.bin .. log_v7.bin
+    Settings log sector of layout versions 3 to 7 with the snapshot, a committed record that
+    changes the data port to 20 and a record without commit that changes P2P SF to 12.
+
+The images are checked in, run this script only to add images of a new layout version.
+The layout is the one of the host build, lmh_confirm is 4 bytes.
+"""
+import os
+import struct
+import zlib
+
+SECTOR_SIZE = 4096
+LOG_MAGIC = 0x474F4C53
+
+# Fields of the first release, (struct format, value)
+V1_FIELDS = [
+    ("B", 0xAA), ("B", 0x55),
+    ("8s", bytes([0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08])),
+    ("8s", bytes([0x70, 0xB3, 0xD5, 0x7E, 0xD0, 0x00, 0x11, 0x22])),
+    ("16s", bytes(range(0x10, 0x20))),
+    ("I", 0x260B1234),
+    ("16s", bytes(range(0x20, 0x30))),
+    ("16s", bytes(range(0x30, 0x40))),
+    ("?", False), ("?", True), ("?", False), ("?", True),
+    ("I", 60000),
+    ("B", 3), ("B", 5), ("B", 2), ("B", 2), ("B", 2), ("?", True), ("B", 10),
+    ("i", 1),
+    ("B", 5), ("?", False),
+    ("I", 868100000),
+    ("B", 14), ("B", 1), ("B", 9), ("B", 2), ("B", 12),
+    ("H", 5),
+    ("?", False),
+]
+# Fields appended by each layout version
+V2_FIELDS = [("B", 0), ("B", 0), ("I", 9600), ("B", 1)]
+V3_FIELDS = [("B", 1), ("I", 0xC0FFEE01), ("I", 0x260B5678), ("16s", bytes(range(0x40, 0x50))),
+             ("16s", bytes(range(0x50, 0x60))), ("I", 1000), ("I", 5)]
+V4_FIELDS = [("B", 1)]
+V5_FIELDS = [("B", 5), ("H", 200)]
+V6_FIELDS = [("I", 36000)]
+V7_FIELDS = [("B", 3), ("H", 300), ("I", 0x5EED0001)] + [("I", 868300000 + idx * 200000) for idx in range(8)]
+LAYOUTS = {1: V1_FIELDS}
+LAYOUTS[2] = LAYOUTS[1] + V2_FIELDS
+LAYOUTS[3] = LAYOUTS[2] + V3_FIELDS
+LAYOUTS[4] = LAYOUTS[3] + V4_FIELDS
+LAYOUTS[5] = LAYOUTS[4] + V5_FIELDS
+LAYOUTS[6] = LAYOUTS[5] + V6_FIELDS
+LAYOUTS[7] = LAYOUTS[6] + V7_FIELDS
+
+# Offsets of the fields the log records change
+APP_PORT_OFFSET = 86
+P2P_SF_OFFSET = 102
+
+
+def pack(fields):
+    """Settings image of a layout with the padding of the C struct, without the padding after the last field"""
+    image = b""
+    for fmt, value in fields:
+        align = struct.calcsize(fmt) if fmt in ("H", "I", "i") else 1
+        image += b"\x00" * (-len(image) % align)
+        image += struct.pack("<" + fmt, value)
+    return image
+
+
+def crc16(data, crc=0xFFFF):
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else crc << 1
+            crc &= 0xFFFF
+    return crc
+
+
+def record(offset, data):
+    head = bytes([offset, len(data)])
+    rec = head + struct.pack("<H", crc16(data, crc16(head))) + data
+    return rec + b"\xff" * (-len(rec) % 4)
+
+
+def legacy_sector(image, fill):
+    page = image + bytes([fill]) * (256 - len(image))
+    return page + b"\xff" * (SECTOR_SIZE - len(page))
+
+
+def log_sector(version, image):
+    header = struct.pack("<IIHHI", LOG_MAGIC, 7, version, len(image), zlib.crc32(image))
+    sector = header + record(0, image) + record(APP_PORT_OFFSET, bytes([20])) + record(0, b"")
+    sector += record(P2P_SF_OFFSET, bytes([12]))
+    return sector + b"\xff" * (SECTOR_SIZE - len(sector))
+
+
+def main():
+    out_dir = os.path.dirname(os.path.abspath(__file__))
+    images = {
+        "legacy_v1.bin": legacy_sector(pack(LAYOUTS[1]), 0x00),
+        "legacy_v1_ff.bin": legacy_sector(pack(LAYOUTS[1]), 0xFF),
+        "legacy_v2.bin": legacy_sector(pack(LAYOUTS[2]), 0x00),
+    }
+    for version in range(3, 8):
+        images["log_v%d.bin" % version] = log_sector(version, pack(LAYOUTS[version]))
+    for name, data in images.items():
+        with open(os.path.join(out_dir, name), "wb") as out:
+            out.write(data)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,99 @@
+/**
+ * @file host_emu.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Control of the host emulation of the RAK11300 for the host tests
+ * @version 0.1
+ * @date 2021-10-09
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __HOST_EMU_H__
+#define __HOST_EMU_H__
+
+// main.h has no include guard, tests that include a firmware file get it from there
+#ifndef __AT_H__
+#include "at_cmd.h"
+#endif
+#include <hardware/flash.h>
+
+// Test checks
+extern uint32_t g_emu_failures;
+#define EMU_CHECK(cond)                                                      \
+	do                                                                       \
+	{                                                                        \
+		if (!(cond))                                                         \
+		{                                                                    \
+			printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+			g_emu_failures++;                                                \
+		}                                                                    \
+	} while (0)
+int emu_result(const char *name);
+
+// Virtual clock, millis() and micros() only move with delay(), flash operations and emu_time_advance()
+uint64_t emu_time_us(void);
+void emu_time_advance(uint64_t us);
+void emu_timers_run(void);
+
+// Output of the serial ports
+const char *emu_output(uint8_t port);
+void emu_output_clear(void);
+
+// Signals of the firmware to the loop thread, loop_thread must be set by the test
+int32_t emu_signals_take(void);
+
+// AT commands
+const char *emu_at(const char *cmd);
+void emu_at_idle(void);
+
+// Boots, each runs in a child process with the firmware state of the parent, the flash is shared
+int emu_run(int (*boot)(int), int arg);
+/** Exit code of a boot that ended with NVIC_SystemReset() */
+#define EMU_RESET 98
+/** Called by NVIC_SystemReset() before the boot ends */
+extern void (*g_emu_reset_hook)(void);
+
+// Flash
+void emu_flash_erase_all(void);
+uint32_t emu_flash_ops(void);
+/** Exit code of a boot that ended with a power cut */
+#define EMU_POWER_CUT 99
+void emu_flash_power_cut(uint32_t op);
+
+/** Flash statistics, shared by all boots */
+struct s_emu_flash_stats
+{
+	// Erased sectors
+	uint32_t erases;
+	// Programmed pages
+	uint32_t pages;
+	// Programmed bytes that are not 0xFF
+	uint64_t bytes;
+	// Modelled time in microseconds the flash was busy, the interrupts are disabled during this time
+	uint64_t busy_us;
+};
+void emu_flash_stats(s_emu_flash_stats *stats);
+void emu_flash_timing(uint32_t erase_us, uint32_t page_us);
+
+// Radio
+extern RadioState_t g_emu_radio_status;
+extern RadioEvents_t *g_emu_radio_events;
+extern uint8_t g_emu_lmh_join_status;
+
+// LoRaWAN MAC
+/** Channels of the emulated MAC, EU868 */
+#define EMU_CHANNELS 16
+#define EMU_DEFAULT_CHANNELS 3
+struct s_emu_mac
+{
+	ChannelParams_t channels[EMU_CHANNELS];
+	uint16_t mask[6];
+	uint32_t rx1_delay;
+	uint32_t rx2_delay;
+	Rx2ChannelParams_t rx2;
+};
+extern s_emu_mac g_emu_mac;
+/** Accept the join with the given parameters and the 5 CFList frequencies, 0: no channel */
+void emu_lmh_join_accept(uint32_t dev_addr, uint32_t rx1_delay, uint8_t rx2_dr, const uint32_t *cflist);
+
+#endif
@@ -0,0 +1,183 @@
+/**
+ * @file host_flash.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host emulation of the RP2040 flash and its XIP read window
+ * Erase sets a sector to 0xFF, programming can only clear bits like a NOR flash.
+ * Erase and program advance the virtual clock by their modelled duration.
+ * A power cut can be injected into any erase or program operation.
+ * @version 0.1
+ * @date 2021-10-09
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "host_emu.h"
+#include <assert.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/**
+ * @brief Allocate memory that is shared with child processes
+ * A flash written by a boot in a child is seen by the next one
+ *
+ * @param size size of the memory
+ * @param fill initial value of all bytes
+ * @return void* shared memory
+ */
+static void *emu_shared_alloc(size_t size, uint8_t fill)
+{
+	void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	assert(memory != MAP_FAILED);
+	memset(memory, fill, size);
+	return memory;
+}
+
+/** Emulated flash, XIP_BASE points to it, erased at start */
+uint8_t *emu_flash = (uint8_t *)emu_shared_alloc(PICO_FLASH_SIZE_BYTES, 0xFF);
+/** Statistics of all boots */
+static s_emu_flash_stats *g_emu_flash_stats = (s_emu_flash_stats *)emu_shared_alloc(sizeof(s_emu_flash_stats), 0);
+
+/** Modelled duration of a sector erase and a page program, typical values of the W25Q16JV of the RAK11300 */
+static uint32_t g_emu_erase_us = 45000;
+static uint32_t g_emu_page_us = 400;
+
+/** Interrupt state, the firmware must not nest save_and_disable_interrupts() */
+static bool g_emu_ints_disabled = false;
+
+/** Number of erase and program operations */
+static uint32_t g_emu_flash_ops = 0;
+/** Operation that is cut by a power loss, 0 for none */
+static uint32_t g_emu_power_cut = 0;
+
+/**
+ * @brief Let the power fail during a later flash operation
+ * An erase clears only the first half of the sector, a program writes only the first half of
+ * the bytes it changes, then the boot ends with EMU_POWER_CUT
+ *
+ * @param op number of the operation counted from now, 1 is the next one, 0 to cancel
+ */
+void emu_flash_power_cut(uint32_t op)
+{
+	g_emu_power_cut = (op == 0) ? 0 : g_emu_flash_ops + op;
+}
+
+/**
+ * @brief Number of erase and program operations since the start of the test
+ *
+ * @return uint32_t number of operations
+ */
+uint32_t emu_flash_ops(void)
+{
+	return g_emu_flash_ops;
+}
+
+/**
+ * @brief Set the modelled duration of the flash operations
+ *
+ * @param erase_us duration of a sector erase in microseconds
+ * @param page_us duration of a page program in microseconds
+ */
+void emu_flash_timing(uint32_t erase_us, uint32_t page_us)
+{
+	g_emu_erase_us = erase_us;
+	g_emu_page_us = page_us;
+}
+
+/**
+ * @brief Get the flash statistics of all boots
+ *
+ * @param stats receives the statistics
+ */
+void emu_flash_stats(s_emu_flash_stats *stats)
+{
+	memcpy(stats, g_emu_flash_stats, sizeof(s_emu_flash_stats));
+}
+
+/**
+ * @brief Count a flash operation and check if the power fails during it
+ *
+ * @param count number of bytes of the operation
+ * @return size_t number of bytes that are changed before the power fails
+ */
+static size_t emu_flash_op(size_t count)
+{
+	g_emu_flash_ops++;
+	return (g_emu_flash_ops == g_emu_power_cut) ? count / 2 : count;
+}
+
+/**
+ * @brief End the boot if the power failed during the last operation
+ *
+ */
+static void emu_flash_op_done(void)
+{
+	if (g_emu_flash_ops == g_emu_power_cut)
+	{
+		fflush(stdout);
+		_exit(EMU_POWER_CUT);
+	}
+}
+
+void flash_range_erase(uint32_t flash_offs, size_t count)
+{
+	assert(g_emu_ints_disabled);
+	assert((flash_offs % FLASH_SECTOR_SIZE) == 0);
+	assert((count % FLASH_SECTOR_SIZE) == 0);
+	assert(flash_offs + count <= PICO_FLASH_SIZE_BYTES);
+	memset(&emu_flash[flash_offs], 0xFF, emu_flash_op(count));
+	emu_flash_op_done();
+	uint32_t sectors = count / FLASH_SECTOR_SIZE;
+	g_emu_flash_stats->erases += sectors;
+	g_emu_flash_stats->busy_us += (uint64_t)sectors * g_emu_erase_us;
+	emu_time_advance((uint64_t)sectors * g_emu_erase_us);
+}
+
+void flash_range_program(uint32_t flash_offs, const uint8_t *data, size_t count)
+{
+	assert(g_emu_ints_disabled);
+	assert((flash_offs % FLASH_PAGE_SIZE) == 0);
+	assert((count % FLASH_PAGE_SIZE) == 0);
+	assert(flash_offs + count <= PICO_FLASH_SIZE_BYTES);
+	// Bytes programmed as 0xFF are unchanged, a cut program stops within the written data
+	size_t written = 0;
+	for (size_t idx = 0; idx < count; idx++)
+	{
+		written += (data[idx] != 0xFF);
+	}
+	size_t done = emu_flash_op(written);
+	for (size_t idx = 0; (idx < count) && (done > 0); idx++)
+	{
+		if (data[idx] != 0xFF)
+		{
+			emu_flash[flash_offs + idx] &= data[idx];
+			done--;
+		}
+	}
+	emu_flash_op_done();
+	uint32_t pages = count / FLASH_PAGE_SIZE;
+	g_emu_flash_stats->pages += pages;
+	g_emu_flash_stats->bytes += written;
+	g_emu_flash_stats->busy_us += (uint64_t)pages * g_emu_page_us;
+	emu_time_advance((uint64_t)pages * g_emu_page_us);
+}
+
+uint32_t save_and_disable_interrupts(void)
+{
+	assert(!g_emu_ints_disabled);
+	g_emu_ints_disabled = true;
+	return 1;
+}
+
+void restore_interrupts(uint32_t status)
+{
+	g_emu_ints_disabled = (status == 0);
+}
+
+/**
+ * @brief Erase the whole emulated flash, like a new device
+ *
+ */
+void emu_flash_erase_all(void)
+{
+	memset(emu_flash, 0xFF, PICO_FLASH_SIZE_BYTES);
+}
@@ -0,0 +1,316 @@
+/**
+ * @file host_platform.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host emulation of the Arduino, mbed and RTOS functions used by the firmware
+ * @version 0.1
+ * @date 2021-10-09
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "host_emu.h"
+#include <string>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/** Number of failed checks of the running test */
+uint32_t g_emu_failures = 0;
+
+/** Virtual time in microseconds, starts after the boot delay so that 0 is never a valid time stamp */
+static uint64_t g_emu_time_us = 1000000;
+
+/** Output of the serial ports */
+static std::string g_emu_output[AT_PORT_NUM];
+
+/** Signals set for the loop thread */
+static int32_t g_emu_signals = 0;
+/** Thread ID of the test, used as the loop thread */
+static int g_emu_thread;
+
+/** Nesting of the critical sections */
+static int g_emu_critical = 0;
+
+/** Running timers */
+#define EMU_TIMERS_MAX 16
+static TimerEvent_t *g_emu_timers[EMU_TIMERS_MAX];
+
+HostSerial Serial(AT_PORT_USB);
+HostSerial Serial1(AT_PORT_SERIAL1);
+static mbed::UnbufferedSerial g_emu_serial1_hw;
+
+/**
+ * @brief Print the result of a test
+ *
+ * @param name test name
+ * @return int exit code of the test, 0 if all checks passed
+ */
+int emu_result(const char *name)
+{
+	printf("%s: %s (%u failed checks)\n", name, g_emu_failures == 0 ? "PASS" : "FAIL", g_emu_failures);
+	return g_emu_failures == 0 ? 0 : 1;
+}
+
+uint64_t emu_time_us(void)
+{
+	return g_emu_time_us;
+}
+
+void emu_time_advance(uint64_t us)
+{
+	g_emu_time_us += us;
+}
+
+unsigned long millis(void)
+{
+	return g_emu_time_us / 1000;
+}
+
+unsigned long micros(void)
+{
+	return (uint32_t)g_emu_time_us;
+}
+
+void delay(unsigned long ms)
+{
+	emu_time_advance((uint64_t)ms * 1000);
+}
+
+void yield(void)
+{
+}
+
+void pinMode(uint32_t pin, uint32_t mode)
+{
+	(void)pin;
+	(void)mode;
+}
+
+void digitalWrite(uint32_t pin, uint32_t value)
+{
+	(void)pin;
+	(void)value;
+}
+
+int analogRead(uint32_t pin)
+{
+	(void)pin;
+	// About 4.0V battery voltage
+	return 2700;
+}
+
+void analogReadResolution(int bits)
+{
+	(void)bits;
+}
+
+void getUniqueDeviceID(uint8_t *id)
+{
+	static const uint8_t emu_id[8] = {0xE6, 0x60, 0x58, 0x38, 0x83, 0x2A, 0x4B, 0x2C};
+	memcpy(id, emu_id, sizeof(emu_id));
+}
+
+void (*g_emu_reset_hook)(void) = NULL;
+
+void NVIC_SystemReset(void)
+{
+	// A reset ends the emulated boot, tests that reboot run each boot in a child process
+	if (g_emu_reset_hook != NULL)
+	{
+		g_emu_reset_hook();
+	}
+	fflush(stdout);
+	_exit(EMU_RESET);
+}
+
+/**
+ * @brief Run a boot of the firmware in a child process
+ * The child starts with a copy of the firmware state of the caller, a caller that never
+ * ran firmware code gives every boot a fresh state. The flash is shared with the child.
+ *
+ * @param boot function of the boot, its return value is the exit code
+ * @param arg argument of the function
+ * @return int exit code of the boot, EMU_POWER_CUT after a power cut, EMU_RESET after a reset, -1 if it crashed
+ */
+int emu_run(int (*boot)(int), int arg)
+{
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		int result = boot(arg);
+		fflush(stdout);
+		_exit(result);
+	}
+	int status = 0;
+	if ((pid < 0) || (waitpid(pid, &status, 0) != pid) || !WIFEXITED(status))
+	{
+		return -1;
+	}
+	return WEXITSTATUS(status);
+}
+
+size_t HostSerial::write(uint8_t data)
+{
+	g_emu_output[_port].push_back((char)data);
+	return 1;
+}
+
+size_t HostSerial::write(const uint8_t *buffer, size_t size)
+{
+	g_emu_output[_port].append((const char *)buffer, size);
+	return size;
+}
+
+HostSerial::operator mbed::FileHandle *()
+{
+	return &g_emu_serial1_hw;
+}
+
+const char *emu_output(uint8_t port)
+{
+	return g_emu_output[port].c_str();
+}
+
+void emu_output_clear(void)
+{
+	for (uint8_t port = 0; port < AT_PORT_NUM; port++)
+	{
+		g_emu_output[port].clear();
+	}
+}
+
+void core_util_critical_section_enter(void)
+{
+	g_emu_critical++;
+}
+
+void core_util_critical_section_exit(void)
+{
+	g_emu_critical--;
+}
+
+osThreadId osThreadGetId(void)
+{
+	return &g_emu_thread;
+}
+
+int32_t osSignalSet(osThreadId thread_id, int32_t signals)
+{
+	(void)thread_id;
+	g_emu_signals |= signals;
+	return g_emu_signals;
+}
+
+osEvent osSignalWait(int32_t signals, uint32_t millisec)
+{
+	(void)signals;
+	osEvent event;
+	if ((g_emu_signals == 0) && (millisec != osWaitForever))
+	{
+		delay(millisec);
+	}
+	event.status = osEventSignal;
+	event.value.signals = emu_signals_take();
+	return event;
+}
+
+int32_t emu_signals_take(void)
+{
+	int32_t signals = g_emu_signals;
+	g_emu_signals = 0;
+	return signals;
+}
+
+void TimerInit(TimerEvent_t *obj, void (*callback)(void))
+{
+	obj->Callback = callback;
+	obj->IsRunning = false;
+}
+
+void TimerSetValue(TimerEvent_t *obj, uint32_t value)
+{
+	obj->ReloadValue = value;
+}
+
+void TimerStart(TimerEvent_t *obj)
+{
+	obj->Timestamp = millis() + obj->ReloadValue;
+	if (obj->IsRunning)
+	{
+		return;
+	}
+	for (uint8_t idx = 0; idx < EMU_TIMERS_MAX; idx++)
+	{
+		if (g_emu_timers[idx] == NULL)
+		{
+			g_emu_timers[idx] = obj;
+			obj->IsRunning = true;
+			return;
+		}
+	}
+}
+
+void TimerStop(TimerEvent_t *obj)
+{
+	for (uint8_t idx = 0; idx < EMU_TIMERS_MAX; idx++)
+	{
+		if (g_emu_timers[idx] == obj)
+		{
+			g_emu_timers[idx] = NULL;
+		}
+	}
+	obj->IsRunning = false;
+}
+
+/**
+ * @brief Call the callbacks of the timers that expired at the current virtual time
+ *
+ */
+void emu_timers_run(void)
+{
+	for (uint8_t idx = 0; idx < EMU_TIMERS_MAX; idx++)
+	{
+		TimerEvent_t *timer = g_emu_timers[idx];
+		if ((timer == NULL) || ((int32_t)(millis() - timer->Timestamp) < 0))
+		{
+			continue;
+		}
+		if (timer->oneShot)
+		{
+			TimerStop(timer);
+		}
+		else
+		{
+			timer->Timestamp += timer->ReloadValue;
+		}
+		timer->Callback();
+	}
+}
+
+/**
+ * @brief Execute an AT command like the AT command task does
+ *
+ * @param cmd command including "AT"
+ * @return const char* reply of the command on the USB port
+ */
+const char *emu_at(const char *cmd)
+{
+	char atcmd[ATCMD_SIZE];
+	snprintf(atcmd, sizeof(atcmd), "%s", cmd);
+	emu_output_clear();
+	at_cmd_exec(atcmd, strlen(atcmd), &Serial, AT_PORT_USB);
+	return emu_output(AT_PORT_USB);
+}
+
+/**
+ * @brief Background work of the AT command task when it wakes up without a command
+ *
+ */
+void emu_at_idle(void)
+{
+	serial1_baud_check();
+	settings_flush_check();
+	uplink_queue_flush_check();
+	rx_log_flush_check();
+	flash_jobs_run();
+}
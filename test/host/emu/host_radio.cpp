@@ -0,0 +1,328 @@
+/**
+ * @file host_radio.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host emulation of the SX126x radio and the LoRaWAN MAC helper
+ * The radio only tracks its state, the MAC only stores what the firmware sets
+ * @version 0.1
+ * @date 2021-10-09
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "host_emu.h"
+
+/** State of the radio */
+RadioState_t g_emu_radio_status = RF_IDLE;
+/** Radio callbacks of the firmware */
+RadioEvents_t *g_emu_radio_events = NULL;
+/** Join status reported by lmh_join_status_get() */
+uint8_t g_emu_lmh_join_status = LMH_RESET;
+
+/** Seed of the random generator */
+static uint32_t g_emu_random = 0x2545F491;
+
+/** MAC session */
+static uint32_t g_emu_dev_addr = 0;
+static uint8_t g_emu_nwk_skey[16];
+static uint8_t g_emu_app_skey[16];
+static uint32_t g_emu_fcnt_up = 0;
+static uint32_t g_emu_fcnt_down = 0;
+/** Callbacks of the firmware */
+static lmh_callback_t *g_emu_lmh_callbacks = NULL;
+
+/** MAC parameters, set to the region defaults by lmh_init() and changed by the join accept */
+s_emu_mac g_emu_mac;
+
+static void emu_radio_init(RadioEvents_t *events)
+{
+	g_emu_radio_events = events;
+}
+
+static RadioState_t emu_radio_get_status(void)
+{
+	return g_emu_radio_status;
+}
+
+static void emu_radio_set_channel(uint32_t freq)
+{
+	(void)freq;
+}
+
+static uint32_t emu_radio_random(void)
+{
+	g_emu_random = g_emu_random * 1664525 + 1013904223;
+	return g_emu_random;
+}
+
+static void emu_radio_set_rx_config(RadioModems_t modem, uint32_t bandwidth, uint32_t datarate, uint8_t coderate,
+									uint32_t bandwidthAfc, uint16_t preambleLen, uint16_t symbTimeout, bool fixLen,
+									uint8_t payloadLen, bool crcOn, bool freqHopOn, uint8_t hopPeriod, bool iqInverted,
+									bool rxContinuous)
+{
+}
+
+static void emu_radio_set_tx_config(RadioModems_t modem, int8_t power, uint32_t fdev, uint32_t bandwidth, uint32_t datarate,
+									uint8_t coderate, uint16_t preambleLen, bool fixLen, bool crcOn, bool freqHopOn,
+									uint8_t hopPeriod, bool iqInverted, uint32_t timeout)
+{
+}
+
+static void emu_radio_send(uint8_t *buffer, uint8_t size)
+{
+	(void)buffer;
+	(void)size;
+	g_emu_radio_status = RF_TX_RUNNING;
+}
+
+static void emu_radio_idle(void)
+{
+	g_emu_radio_status = RF_IDLE;
+}
+
+static void emu_radio_rx(uint32_t timeout)
+{
+	(void)timeout;
+	g_emu_radio_status = RF_RX_RUNNING;
+}
+
+static void emu_radio_start_cad(void)
+{
+	g_emu_radio_status = RF_CAD;
+}
+
+static void emu_radio_set_cad_params(uint8_t cadSymbolNum, uint8_t cadDetPeak, uint8_t cadDetMin, uint8_t cadExitMode,
+									 uint32_t cadTimeout)
+{
+}
+
+const struct Radio_s Radio = {
+	emu_radio_init,
+	emu_radio_get_status,
+	emu_radio_set_channel,
+	emu_radio_random,
+	emu_radio_set_rx_config,
+	emu_radio_set_tx_config,
+	emu_radio_send,
+	emu_radio_idle,
+	emu_radio_idle,
+	emu_radio_rx,
+	emu_radio_start_cad,
+	emu_radio_set_cad_params,
+};
+
+uint32_t lora_rak11300_init(void)
+{
+	return 0;
+}
+
+void BoardGetUniqueId(uint8_t *id)
+{
+	getUniqueDeviceID(id);
+}
+
+uint32_t BoardGetRandomSeed(void)
+{
+	return emu_radio_random();
+}
+
+LoRaMacStatus_t LoRaMacMibGetRequestConfirm(MibRequestConfirm_t *mibGet)
+{
+	switch (mibGet->Type)
+	{
+	case MIB_NETWORK_JOINED:
+		mibGet->Param.IsNetworkJoined = (g_emu_lmh_join_status == LMH_SET);
+		break;
+	case MIB_DEV_ADDR:
+		mibGet->Param.DevAddr = g_emu_dev_addr;
+		break;
+	case MIB_NWK_SKEY:
+		mibGet->Param.NwkSKey = g_emu_nwk_skey;
+		break;
+	case MIB_APP_SKEY:
+		mibGet->Param.AppSKey = g_emu_app_skey;
+		break;
+	case MIB_UPLINK_COUNTER:
+		mibGet->Param.UpLinkCounter = g_emu_fcnt_up;
+		break;
+	case MIB_DOWNLINK_COUNTER:
+		mibGet->Param.DownLinkCounter = g_emu_fcnt_down;
+		break;
+	case MIB_CHANNELS:
+		mibGet->Param.ChannelList = g_emu_mac.channels;
+		break;
+	case MIB_RX2_CHANNEL:
+		mibGet->Param.Rx2Channel = g_emu_mac.rx2;
+		break;
+	case MIB_CHANNELS_MASK:
+		mibGet->Param.ChannelsMask = g_emu_mac.mask;
+		break;
+	case MIB_RECEIVE_DELAY_1:
+		mibGet->Param.ReceiveDelay1 = g_emu_mac.rx1_delay;
+		break;
+	case MIB_RECEIVE_DELAY_2:
+		mibGet->Param.ReceiveDelay2 = g_emu_mac.rx2_delay;
+		break;
+	default:
+		return LORAMAC_STATUS_SERVICE_UNKNOWN;
+	}
+	return LORAMAC_STATUS_OK;
+}
+
+LoRaMacStatus_t LoRaMacMibSetRequestConfirm(MibRequestConfirm_t *mibSet)
+{
+	switch (mibSet->Type)
+	{
+	case MIB_NETWORK_JOINED:
+		g_emu_lmh_join_status = mibSet->Param.IsNetworkJoined ? LMH_SET : LMH_RESET;
+		break;
+	case MIB_DEV_ADDR:
+		g_emu_dev_addr = mibSet->Param.DevAddr;
+		break;
+	case MIB_NWK_SKEY:
+		memcpy(g_emu_nwk_skey, mibSet->Param.NwkSKey, sizeof(g_emu_nwk_skey));
+		break;
+	case MIB_APP_SKEY:
+		memcpy(g_emu_app_skey, mibSet->Param.AppSKey, sizeof(g_emu_app_skey));
+		break;
+	case MIB_UPLINK_COUNTER:
+		g_emu_fcnt_up = mibSet->Param.UpLinkCounter;
+		break;
+	case MIB_DOWNLINK_COUNTER:
+		g_emu_fcnt_down = mibSet->Param.DownLinkCounter;
+		break;
+	case MIB_RX2_CHANNEL:
+		g_emu_mac.rx2 = mibSet->Param.Rx2Channel;
+		break;
+	case MIB_CHANNELS_MASK:
+		memcpy(g_emu_mac.mask, mibSet->Param.ChannelsMask, sizeof(g_emu_mac.mask));
+		break;
+	case MIB_RECEIVE_DELAY_1:
+		g_emu_mac.rx1_delay = mibSet->Param.ReceiveDelay1;
+		break;
+	case MIB_RECEIVE_DELAY_2:
+		g_emu_mac.rx2_delay = mibSet->Param.ReceiveDelay2;
+		break;
+	default:
+		return LORAMAC_STATUS_SERVICE_UNKNOWN;
+	}
+	return LORAMAC_STATUS_OK;
+}
+
+LoRaMacStatus_t LoRaMacChannelAdd(uint8_t id, ChannelParams_t params)
+{
+	if ((id < EMU_DEFAULT_CHANNELS) || (id >= EMU_CHANNELS) || (params.Frequency == 0))
+	{
+		return LORAMAC_STATUS_PARAMETER_INVALID;
+	}
+	g_emu_mac.channels[id] = params;
+	g_emu_mac.mask[0] |= 1 << id;
+	return LORAMAC_STATUS_OK;
+}
+
+lmh_error_status lmh_init(lmh_callback_t *callbacks, lmh_param_t lora_param, bool otaa, eDeviceClass nodeClass,
+						  LoRaMacRegion_t region, bool region_change)
+{
+	g_emu_lmh_callbacks = callbacks;
+	g_emu_lmh_join_status = LMH_RESET;
+
+	// EU868 defaults
+	memset(&g_emu_mac, 0, sizeof(g_emu_mac));
+	for (uint8_t idx = 0; idx < EMU_DEFAULT_CHANNELS; idx++)
+	{
+		g_emu_mac.channels[idx].Frequency = 868100000 + idx * 200000;
+		g_emu_mac.channels[idx].DrRange.Value = (DR_5 << 4) | DR_0;
+	}
+	g_emu_mac.mask[0] = (1 << EMU_DEFAULT_CHANNELS) - 1;
+	g_emu_mac.rx1_delay = 1000;
+	g_emu_mac.rx2_delay = 2000;
+	g_emu_mac.rx2.Frequency = 869525000;
+	g_emu_mac.rx2.Datarate = DR_0;
+	return LMH_SUCCESS;
+}
+
+void emu_lmh_join_accept(uint32_t dev_addr, uint32_t rx1_delay, uint8_t rx2_dr, const uint32_t *cflist)
+{
+	g_emu_dev_addr = dev_addr;
+	memset(g_emu_nwk_skey, 0x11, sizeof(g_emu_nwk_skey));
+	memset(g_emu_app_skey, 0x22, sizeof(g_emu_app_skey));
+	g_emu_fcnt_up = 0;
+	g_emu_fcnt_down = 0;
+	g_emu_mac.rx1_delay = rx1_delay;
+	g_emu_mac.rx2_delay = rx1_delay + 1000;
+	g_emu_mac.rx2.Datarate = rx2_dr;
+	for (uint8_t idx = 0; idx < 5; idx++)
+	{
+		ChannelParams_t channel = {0};
+		channel.Frequency = cflist[idx];
+		channel.DrRange.Value = (DR_5 << 4) | DR_0;
+		LoRaMacChannelAdd(EMU_DEFAULT_CHANNELS + idx, channel);
+	}
+	g_emu_lmh_join_status = LMH_SET;
+	g_emu_lmh_callbacks->lmh_has_joined();
+}
+
+void lmh_join(void)
+{
+	g_emu_lmh_join_status = LMH_ONGOING;
+}
+
+lmh_join_status lmh_join_status_get(void)
+{
+	return (lmh_join_status)g_emu_lmh_join_status;
+}
+
+lmh_error_status lmh_send(lmh_app_data_t *app_data, lmh_confirm is_txconfirmed)
+{
+	if (g_emu_lmh_join_status != LMH_SET)
+	{
+		return LMH_ERROR;
+	}
+	g_emu_fcnt_up++;
+	return LMH_SUCCESS;
+}
+
+lmh_error_status lmh_class_request(DeviceClass_t newClass)
+{
+	return LMH_SUCCESS;
+}
+
+void lmh_datarate_set(uint8_t data_rate, bool enable_adr)
+{
+}
+
+bool lmh_setSubBandChannels(uint8_t subBand)
+{
+	return true;
+}
+
+void lmh_setDevEui(uint8_t *userDevEui)
+{
+}
+
+void lmh_setAppEui(uint8_t *userAppEui)
+{
+}
+
+void lmh_setAppKey(uint8_t *userAppKey)
+{
+}
+
+void lmh_setNwkSKey(uint8_t *userNwkSKey)
+{
+	memcpy(g_emu_nwk_skey, userNwkSKey, sizeof(g_emu_nwk_skey));
+}
+
+void lmh_setAppSKey(uint8_t *userAppSKey)
+{
+	memcpy(g_emu_app_skey, userAppSKey, sizeof(g_emu_app_skey));
+}
+
+void lmh_setDevAddr(uint32_t userDevAddr)
+{
+	g_emu_dev_addr = userDevAddr;
+}
+
+uint32_t lmh_getDevAddr(void)
+{
+	return g_emu_dev_addr;
+}
@@ -0,0 +1,281 @@
+/**
+ * @file run_at_script.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Run an AT command script on the emulated device and report the flash cost
+ * For every boot, command and wait of the script the sector erases, programmed pages and the
+ * time the interrupts were disabled are reported, with the modelled flash timing.
+ *
+ * run_at_script <script> [<erase us> <page program us>]
+ *
+ * @version 0.1
+ * @date 2021-10-09
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "host_emu.h"
+#include <string>
+#include <vector>
+#include <sys/mman.h>
+
+// main.cpp
+void setup(void);
+void loop(void);
+
+/** Time in milliseconds the firmware runs after each command */
+#define SCRIPT_CMD_IDLE 100
+/** Time in milliseconds the firmware runs after the script, longer than the settings write delay */
+#define SCRIPT_SETTLE 10000
+/** Time in milliseconds between two runs of the background work */
+#define SCRIPT_STEP 10
+
+/** Progress and totals of the script, shared by all boots */
+struct s_script_state
+{
+	// Next line to run
+	uint32_t line;
+	// Number of boots
+	uint32_t boots;
+	// Number of failed commands
+	uint32_t failed;
+	// Number of phases where the firmware counters do not match the emulator
+	uint32_t mismatches;
+	// Flash operations counted by the firmware, summed over all boots
+	uint32_t fw_erases;
+	uint32_t fw_programs;
+	uint64_t fw_blackout_total;
+	uint32_t fw_blackout_max;
+	// Save requests, each one was an erase and a program before the settings log
+	uint32_t save_requests;
+};
+static s_script_state *g_state;
+
+/** Lines of the script */
+static std::vector<std::string> g_lines;
+
+/** Current phase of the boot */
+static std::string g_phase;
+static s_emu_flash_stats g_phase_emu;
+static uint32_t g_phase_erases;
+static uint32_t g_phase_programs;
+static uint32_t g_phase_blackout;
+static uint32_t g_phase_requests;
+
+/**
+ * @brief Start a phase of the report
+ *
+ * @param name name of the phase
+ */
+static void phase_start(const std::string &name)
+{
+	g_phase = name;
+	emu_flash_stats(&g_phase_emu);
+	g_phase_erases = g_flash_erases;
+	g_phase_programs = g_flash_programs;
+	g_phase_blackout = g_flash_blackout_total;
+	g_phase_requests = g_settings_save_requests;
+}
+
+/**
+ * @brief End a phase, print its flash operations and add the counters of the firmware to the totals
+ *
+ * @param result result of the phase
+ */
+static void phase_end(const char *result)
+{
+	s_emu_flash_stats emu;
+	emu_flash_stats(&emu);
+	uint32_t erases = g_flash_erases - g_phase_erases;
+	uint32_t programs = g_flash_programs - g_phase_programs;
+	uint32_t blackout = g_flash_blackout_total - g_phase_blackout;
+
+	g_state->fw_erases += erases;
+	g_state->fw_programs += programs;
+	g_state->fw_blackout_total += blackout;
+	if (g_flash_blackout_max > g_state->fw_blackout_max)
+	{
+		g_state->fw_blackout_max = g_flash_blackout_max;
+	}
+	g_state->save_requests += g_settings_save_requests - g_phase_requests;
+
+	// The firmware must see every flash operation of the emulator
+	if ((erases != emu.erases - g_phase_emu.erases) || (programs != emu.pages - g_phase_emu.pages) ||
+		(blackout != emu.busy_us - g_phase_emu.busy_us))
+	{
+		g_state->mismatches++;
+	}
+
+	printf("%-42s %-8s %6u %6u %8llu %10.1f\n", g_phase.c_str(), result, erases, programs,
+		   (unsigned long long)(emu.bytes - g_phase_emu.bytes), blackout / 1000.0);
+}
+
+/**
+ * @brief A command reset the device, close its phase
+ *
+ */
+static void script_reset(void)
+{
+	phase_end("reset");
+}
+
+/**
+ * @brief Print the reply of a query, indented under its phase
+ *
+ * @param reply reply of the command
+ */
+static void script_print_reply(const std::string &reply)
+{
+	size_t start = 0;
+	while (start < reply.size())
+	{
+		size_t end = reply.find('\n', start);
+		if (end == std::string::npos)
+		{
+			end = reply.size();
+		}
+		std::string text = reply.substr(start, end - start);
+		while (!text.empty() && ((text.back() == '\r') || (text.back() == ' ')))
+		{
+			text.pop_back();
+		}
+		if (!text.empty() && (text != "OK"))
+		{
+			printf("    %s\n", text.c_str());
+		}
+		start = end + 1;
+	}
+}
+
+/**
+ * @brief Let the firmware run without commands
+ * Runs the timers, the loop task and the background work of the AT command task
+ *
+ * @param ms time in milliseconds
+ */
+static void script_idle(uint32_t ms)
+{
+	for (uint32_t time = 0; time < ms; time += SCRIPT_STEP)
+	{
+		emu_time_advance(SCRIPT_STEP * 1000);
+		emu_timers_run();
+		loop();
+		emu_at_idle();
+	}
+}
+
+/**
+ * @brief Boot the device and run the script from the next line, until the end or a reset
+ *
+ * @param arg not used
+ * @return int 0 at the end of the script
+ */
+static int script_boot(int arg)
+{
+	(void)arg;
+	g_emu_reset_hook = script_reset;
+	g_state->boots++;
+
+	phase_start("boot " + std::to_string(g_state->boots));
+	setup();
+	script_idle(SCRIPT_CMD_IDLE);
+	phase_end("");
+
+	while (g_state->line < g_lines.size())
+	{
+		std::string line = g_lines[g_state->line++];
+		if (line.rfind("WAIT ", 0) == 0)
+		{
+			uint32_t seconds = atoi(line.c_str() + 5);
+			phase_start("wait " + std::to_string(seconds) + " s");
+			script_idle(seconds * 1000);
+			phase_end("");
+			continue;
+		}
+
+		phase_start(line);
+		std::string reply = emu_at(line.c_str());
+		bool ok = (reply.find("OK") != std::string::npos) && (reply.find("ERROR") == std::string::npos);
+		if (!ok)
+		{
+			g_state->failed++;
+		}
+		script_idle(SCRIPT_CMD_IDLE);
+		phase_end(ok ? "OK" : "FAILED");
+		if ((line.find("=?") != std::string::npos) && ok)
+		{
+			script_print_reply(reply);
+		}
+	}
+
+	phase_start("settle " + std::to_string(SCRIPT_SETTLE / 1000) + " s");
+	script_idle(SCRIPT_SETTLE);
+	phase_end("");
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if ((argc != 2) && (argc != 4))
+	{
+		printf("run_at_script <script> [<erase us> <page program us>]\n");
+		return 2;
+	}
+	uint32_t erase_us = 45000;
+	uint32_t page_us = 400;
+	if (argc == 4)
+	{
+		erase_us = atoi(argv[2]);
+		page_us = atoi(argv[3]);
+	}
+	emu_flash_timing(erase_us, page_us);
+
+	FILE *script = fopen(argv[1], "r");
+	if (script == NULL)
+	{
+		printf("%s: not found\n", argv[1]);
+		return 2;
+	}
+	char buf[ATCMD_SIZE + 16];
+	while (fgets(buf, sizeof(buf), script) != NULL)
+	{
+		std::string line(buf);
+		while (!line.empty() && ((line.back() == '\n') || (line.back() == '\r') || (line.back() == ' ')))
+		{
+			line.pop_back();
+		}
+		if (line.empty() || (line[0] == '#'))
+		{
+			continue;
+		}
+		g_lines.push_back(line);
+	}
+	fclose(script);
+
+	g_state = (s_script_state *)mmap(NULL, sizeof(s_script_state), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	memset(g_state, 0, sizeof(s_script_state));
+
+	printf("%s, sector erase %u us, page program %u us\n\n", argv[1], erase_us, page_us);
+	printf("%-42s %-8s %6s %6s %8s %10s\n", "Phase", "Result", "Erases", "Pages", "Bytes", "Blackout ms");
+	int result;
+	do
+	{
+		result = emu_run(script_boot, 0);
+	} while (result == EMU_RESET);
+	EMU_CHECK(result == 0);
+	EMU_CHECK(g_state->failed == 0);
+	EMU_CHECK(g_state->mismatches == 0);
+
+	s_emu_flash_stats emu;
+	emu_flash_stats(&emu);
+	printf("\n%u boots, %u commands failed\n", g_state->boots, g_state->failed);
+	printf("Sector erases %u, pages programmed %u (%llu bytes)\n", emu.erases, emu.pages, (unsigned long long)emu.bytes);
+	printf("Interrupt blackout %.1f ms, longest %.1f ms\n", g_state->fw_blackout_total / 1000.0,
+		   g_state->fw_blackout_max / 1000.0);
+	printf("Erase and program on every save request like before the settings log: %u sector erases, blackout %.1f ms\n",
+		   g_state->save_requests, g_state->save_requests * (erase_us + page_us) / 1000.0);
+	EMU_CHECK(g_state->fw_erases == emu.erases);
+	EMU_CHECK(g_state->fw_programs == emu.pages);
+	EMU_CHECK(g_state->fw_blackout_total == emu.busy_us);
+
+	return emu_result("run_at_script");
+}
@@ -0,0 +1,106 @@
+/**
+ * @file Arduino.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host build of the Arduino API used by the firmware
+ * @version 0.1
+ * @date 2021-10-09
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __HOST_ARDUINO_H__
+#define __HOST_ARDUINO_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <math.h>
+#include <chrono>
+
+#include <mbed.h>
+#include <hardware/sync.h>
+
+#define HIGH 1
+#define LOW 0
+#define OUTPUT 1
+#define INPUT 0
+#define LED_BUILTIN 23
+#define LED_BLUE 24
+#define WB_A0 26
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void yield(void);
+void pinMode(uint32_t pin, uint32_t mode);
+void digitalWrite(uint32_t pin, uint32_t value);
+int analogRead(uint32_t pin);
+void analogReadResolution(int bits);
+void getUniqueDeviceID(uint8_t *id);
+void NVIC_SystemReset(void);
+
+/** Memory barrier, the host build is single threaded */
+#define __DMB() __sync_synchronize()
+
+/**
+ * @brief Output stream, the firmware uses write() and the print functions
+ *
+ */
+class Print
+{
+public:
+	virtual ~Print() {}
+	virtual size_t write(uint8_t data) = 0;
+	virtual size_t write(const uint8_t *buffer, size_t size)
+	{
+		for (size_t idx = 0; idx < size; idx++)
+		{
+			write(buffer[idx]);
+		}
+		return size;
+	}
+	size_t print(const char *str) { return write((const uint8_t *)str, strlen(str)); }
+	size_t println(const char *str) { return print(str) + print("\r\n"); }
+	size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3)))
+	{
+		char buf[512];
+		va_list args;
+		va_start(args, format);
+		int len = vsnprintf(buf, sizeof(buf), format, args);
+		va_end(args);
+		if (len < 0)
+		{
+			return 0;
+		}
+		return write((const uint8_t *)buf, (size_t)len < sizeof(buf) ? len : sizeof(buf) - 1);
+	}
+};
+
+/**
+ * @brief Serial port, output is collected by the emulator, input is fed by the tests
+ *
+ */
+class HostSerial : public Print
+{
+public:
+	HostSerial(uint8_t port) : _port(port) {}
+	size_t write(uint8_t data);
+	size_t write(const uint8_t *buffer, size_t size);
+	void begin(unsigned long baud) { (void)baud; }
+	int available(void) { return 0; }
+	int read(void) { return -1; }
+	void attach(void (*callback)(void)) { (void)callback; }
+	operator bool() { return true; }
+	operator mbed::FileHandle *();
+
+private:
+	uint8_t _port;
+};
+extern HostSerial Serial;
+extern HostSerial Serial1;
+
+#endif
@@ -0,0 +1,288 @@
+/**
+ * @file LoRaWan-Arduino.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host build of the SX126x-Arduino API used by the firmware
+ * The radio and the LoRaWAN MAC are replaced by the emulator in emu/host_radio.cpp
+ * @version 0.1
+ * @date 2021-10-09
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __HOST_LORAWAN_ARDUINO_H__
+#define __HOST_LORAWAN_ARDUINO_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Radio
+typedef enum
+{
+	MODEM_FSK = 0,
+	MODEM_LORA
+} RadioModems_t;
+
+typedef enum
+{
+	RF_IDLE = 0,
+	RF_RX_RUNNING,
+	RF_TX_RUNNING,
+	RF_CAD
+} RadioState_t;
+
+typedef enum
+{
+	LORA_CAD_01_SYMBOL = 0x00,
+	LORA_CAD_02_SYMBOL = 0x01,
+	LORA_CAD_04_SYMBOL = 0x02,
+	LORA_CAD_08_SYMBOL = 0x03,
+	LORA_CAD_16_SYMBOL = 0x04
+} RadioLoRaCadSymbols_t;
+
+typedef enum
+{
+	LORA_CAD_ONLY = 0x00,
+	LORA_CAD_RX = 0x01,
+	LORA_CAD_LBT = 0x10
+} RadioCadExitModes_t;
+
+typedef struct
+{
+	void (*TxDone)(void);
+	void (*TxTimeout)(void);
+	void (*RxDone)(uint8_t *payload, uint16_t size, int16_t rssi, int8_t snr);
+	void (*RxTimeout)(void);
+	void (*RxError)(void);
+	void (*FhssChangeChannel)(uint8_t currentChannel);
+	void (*CadDone)(bool channelActivityDetected);
+} RadioEvents_t;
+
+struct Radio_s
+{
+	void (*Init)(RadioEvents_t *events);
+	RadioState_t (*GetStatus)(void);
+	void (*SetChannel)(uint32_t freq);
+	uint32_t (*Random)(void);
+	void (*SetRxConfig)(RadioModems_t modem, uint32_t bandwidth, uint32_t datarate, uint8_t coderate,
+						uint32_t bandwidthAfc, uint16_t preambleLen, uint16_t symbTimeout, bool fixLen,
+						uint8_t payloadLen, bool crcOn, bool freqHopOn, uint8_t hopPeriod, bool iqInverted,
+						bool rxContinuous);
+	void (*SetTxConfig)(RadioModems_t modem, int8_t power, uint32_t fdev, uint32_t bandwidth, uint32_t datarate,
+						uint8_t coderate, uint16_t preambleLen, bool fixLen, bool crcOn, bool freqHopOn,
+						uint8_t hopPeriod, bool iqInverted, uint32_t timeout);
+	void (*Send)(uint8_t *buffer, uint8_t size);
+	void (*Sleep)(void);
+	void (*Standby)(void);
+	void (*Rx)(uint32_t timeout);
+	void (*StartCad)(void);
+	void (*SetCadParams)(uint8_t cadSymbolNum, uint8_t cadDetPeak, uint8_t cadDetMin, uint8_t cadExitMode,
+						 uint32_t cadTimeout);
+};
+extern const struct Radio_s Radio;
+
+uint32_t lora_rak11300_init(void);
+
+// Timer
+typedef struct TimerEvent_s
+{
+	uint32_t Timestamp;
+	uint32_t ReloadValue;
+	bool IsRunning;
+	bool oneShot = true;
+	void (*Callback)(void);
+	struct TimerEvent_s *Next;
+} TimerEvent_t;
+
+void TimerInit(TimerEvent_t *obj, void (*callback)(void));
+void TimerStart(TimerEvent_t *obj);
+void TimerStop(TimerEvent_t *obj);
+void TimerSetValue(TimerEvent_t *obj, uint32_t value);
+
+// Board
+void BoardGetUniqueId(uint8_t *id);
+uint32_t BoardGetRandomSeed(void);
+
+// LoRaWAN MAC
+typedef enum
+{
+	LORAMAC_REGION_AS923 = 0,
+	LORAMAC_REGION_AU915,
+	LORAMAC_REGION_CN470,
+	LORAMAC_REGION_CN779,
+	LORAMAC_REGION_EU433,
+	LORAMAC_REGION_EU868,
+	LORAMAC_REGION_KR920,
+	LORAMAC_REGION_IN865,
+	LORAMAC_REGION_US915,
+	LORAMAC_REGION_AS923_2,
+	LORAMAC_REGION_AS923_3,
+	LORAMAC_REGION_AS923_4,
+	LORAMAC_REGION_RU864
+} LoRaMacRegion_t;
+
+typedef enum eDeviceClass
+{
+	CLASS_A,
+	CLASS_B,
+	CLASS_C
+} DeviceClass_t;
+
+#define DR_0 0
+#define DR_1 1
+#define DR_2 2
+#define DR_3 3
+#define DR_4 4
+#define DR_5 5
+
+typedef enum eMib
+{
+	MIB_DEVICE_CLASS,
+	MIB_NETWORK_JOINED,
+	MIB_ADR,
+	MIB_NET_ID,
+	MIB_DEV_ADDR,
+	MIB_NWK_SKEY,
+	MIB_APP_SKEY,
+	MIB_PUBLIC_NETWORK,
+	MIB_CHANNELS,
+	MIB_RX2_CHANNEL,
+	MIB_CHANNELS_MASK,
+	MIB_RECEIVE_DELAY_1,
+	MIB_RECEIVE_DELAY_2,
+	MIB_UPLINK_COUNTER,
+	MIB_DOWNLINK_COUNTER
+} Mib_t;
+
+typedef union uDrRange
+{
+	int8_t Value;
+	struct sFields
+	{
+		int8_t Min : 4;
+		int8_t Max : 4;
+	} Fields;
+} DrRange_t;
+
+typedef struct sChannelParams
+{
+	uint32_t Frequency;
+	uint32_t Rx1Frequency;
+	DrRange_t DrRange;
+	uint8_t Band;
+} ChannelParams_t;
+
+typedef struct sRx2ChannelParams
+{
+	uint32_t Frequency;
+	uint8_t Datarate;
+} Rx2ChannelParams_t;
+
+typedef union uMibParam
+{
+	DeviceClass_t Class;
+	bool IsNetworkJoined;
+	bool AdrEnable;
+	uint32_t NetID;
+	uint32_t DevAddr;
+	uint8_t *NwkSKey;
+	uint8_t *AppSKey;
+	bool EnablePublicNetwork;
+	ChannelParams_t *ChannelList;
+	Rx2ChannelParams_t Rx2Channel;
+	uint16_t *ChannelsMask;
+	uint32_t ReceiveDelay1;
+	uint32_t ReceiveDelay2;
+	uint32_t UpLinkCounter;
+	uint32_t DownLinkCounter;
+} MibParam_t;
+
+typedef struct eMibRequestConfirm
+{
+	Mib_t Type;
+	MibParam_t Param;
+} MibRequestConfirm_t;
+
+typedef enum eLoRaMacStatus
+{
+	LORAMAC_STATUS_OK,
+	LORAMAC_STATUS_BUSY,
+	LORAMAC_STATUS_SERVICE_UNKNOWN,
+	LORAMAC_STATUS_PARAMETER_INVALID
+} LoRaMacStatus_t;
+
+LoRaMacStatus_t LoRaMacMibGetRequestConfirm(MibRequestConfirm_t *mibGet);
+LoRaMacStatus_t LoRaMacMibSetRequestConfirm(MibRequestConfirm_t *mibSet);
+LoRaMacStatus_t LoRaMacChannelAdd(uint8_t id, ChannelParams_t params);
+
+// LoRaMAC helper
+typedef enum
+{
+	LMH_SUCCESS = 0,
+	LMH_BUSY = -1,
+	LMH_ERROR = -2
+} lmh_error_status;
+
+typedef enum
+{
+	LMH_UNCONFIRMED_MSG = 0,
+	LMH_CONFIRMED_MSG = !LMH_UNCONFIRMED_MSG
+} lmh_confirm;
+
+typedef enum
+{
+	LMH_RESET = 0,
+	LMH_SET = 1,
+	LMH_ONGOING = 2,
+	LMH_FAILED = 3
+} lmh_join_status;
+
+typedef struct
+{
+	uint8_t *buffer;
+	uint8_t buffsize;
+	uint8_t port;
+	int16_t rssi;
+	int8_t snr;
+} lmh_app_data_t;
+
+typedef struct
+{
+	bool adr_enable;
+	int8_t tx_data_rate;
+	bool enable_public_network;
+	uint8_t nb_trials;
+	int8_t tx_power;
+	bool duty_cycle;
+} lmh_param_t;
+
+typedef struct
+{
+	uint8_t (*BoardGetBatteryLevel)(void);
+	void (*BoardGetUniqueId)(uint8_t *id);
+	uint32_t (*BoardGetRandomSeed)(void);
+	void (*lmh_RxData)(lmh_app_data_t *appdata);
+	void (*lmh_has_joined)(void);
+	void (*lmh_ConfirmClass)(DeviceClass_t Class);
+	void (*lmh_has_join_failed)(void);
+	void (*lmh_unconf_finished)(void);
+	void (*lmh_conf_result)(bool result);
+} lmh_callback_t;
+
+lmh_error_status lmh_init(lmh_callback_t *callbacks, lmh_param_t lora_param, bool otaa,
+						  eDeviceClass nodeClass = CLASS_A, LoRaMacRegion_t region = LORAMAC_REGION_EU868,
+						  bool region_change = false);
+void lmh_join(void);
+lmh_join_status lmh_join_status_get(void);
+lmh_error_status lmh_send(lmh_app_data_t *app_data, lmh_confirm is_txconfirmed);
+lmh_error_status lmh_class_request(DeviceClass_t newClass);
+void lmh_datarate_set(uint8_t data_rate, bool enable_adr);
+bool lmh_setSubBandChannels(uint8_t subBand);
+void lmh_setDevEui(uint8_t *userDevEui);
+void lmh_setAppEui(uint8_t *userAppEui);
+void lmh_setAppKey(uint8_t *userAppKey);
+void lmh_setNwkSKey(uint8_t *userNwkSKey);
+void lmh_setAppSKey(uint8_t *userAppSKey);
+void lmh_setDevAddr(uint32_t userDevAddr);
+uint32_t lmh_getDevAddr(void);
+
+#endif
@@ -0,0 +1,28 @@
+/**
+ * @file flash.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host build of the RP2040 flash API, the flash is emulated in RAM
+ * @version 0.1
+ * @date 2021-10-09
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __HOST_HARDWARE_FLASH_H__
+#define __HOST_HARDWARE_FLASH_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define FLASH_PAGE_SIZE (1u << 8)
+#define FLASH_SECTOR_SIZE (1u << 12)
+#define PICO_FLASH_SIZE_BYTES (2 * 1024 * 1024)
+
+/** Emulated flash, mapped into the XIP window */
+extern uint8_t *emu_flash;
+#define XIP_BASE ((uintptr_t)emu_flash)
+
+void flash_range_erase(uint32_t flash_offs, size_t count);
+void flash_range_program(uint32_t flash_offs, const uint8_t *data, size_t count);
+
+#endif
@@ -0,0 +1,26 @@
+/**
+ * @file gpio.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host build of the RP2040 GPIO API used for Serial1 flow control
+ * @version 0.1
+ * @date 2021-10-09
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __HOST_HARDWARE_GPIO_H__
+#define __HOST_HARDWARE_GPIO_H__
+
+enum gpio_function
+{
+	GPIO_FUNC_UART = 2,
+	GPIO_FUNC_NULL = 0x1f
+};
+
+inline void gpio_set_function(unsigned int gpio, enum gpio_function fn)
+{
+	(void)gpio;
+	(void)fn;
+}
+
+#endif
@@ -0,0 +1,19 @@
+/**
+ * @file sync.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host build of the RP2040 interrupt control, blackouts are measured by the flash emulator
+ * @version 0.1
+ * @date 2021-10-09
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __HOST_HARDWARE_SYNC_H__
+#define __HOST_HARDWARE_SYNC_H__
+
+#include <stdint.h>
+
+uint32_t save_and_disable_interrupts(void);
+void restore_interrupts(uint32_t status);
+
+#endif
@@ -0,0 +1,31 @@
+/**
+ * @file uart.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host build of the RP2040 UART API used for Serial1 flow control
+ * @version 0.1
+ * @date 2021-10-09
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __HOST_HARDWARE_UART_H__
+#define __HOST_HARDWARE_UART_H__
+
+typedef struct uart_inst uart_inst_t;
+#define uart0 ((uart_inst_t *)0)
+
+inline void uart_set_irq_enables(uart_inst_t *uart, bool rx_has_data, bool tx_needs_data)
+{
+	(void)uart;
+	(void)rx_has_data;
+	(void)tx_needs_data;
+}
+inline void uart_set_hw_flow(uart_inst_t *uart, bool cts, bool rts)
+{
+	(void)uart;
+	(void)cts;
+	(void)rts;
+}
+inline void uart_tx_wait_blocking(uart_inst_t *uart) { (void)uart; }
+
+#endif
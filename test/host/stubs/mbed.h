@@ -0,0 +1,59 @@
+/**
+ * @file mbed.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host build of the mbed OS API used by the firmware
+ * @version 0.1
+ * @date 2021-10-09
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __HOST_MBED_H__
+#define __HOST_MBED_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace mbed
+{
+	class FileHandle
+	{
+	public:
+		virtual ~FileHandle() {}
+	};
+
+	class SerialBase
+	{
+	public:
+		enum IrqType
+		{
+			RxIrq = 0,
+			TxIrq = 1
+		};
+	};
+
+	/** Low level UART behind Serial1, the host build never receives on it */
+	class UnbufferedSerial : public FileHandle, public SerialBase
+	{
+	public:
+		bool readable(void) { return false; }
+		ssize_t read(void *buffer, size_t size)
+		{
+			(void)buffer;
+			(void)size;
+			return 0;
+		}
+		void attach(void (*callback)(void), IrqType type = RxIrq)
+		{
+			(void)callback;
+			(void)type;
+		}
+		void baud(int baudrate) { (void)baudrate; }
+	};
+}
+
+/** Interrupts are not emulated, the host build is single threaded */
+void core_util_critical_section_enter(void);
+void core_util_critical_section_exit(void);
+
+#endif
@@ -0,0 +1,91 @@
+/**
+ * @file rtos.h
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Host build of the mbed RTOS API used by the firmware
+ * Threads are not started, the tests call the thread functions of the firmware directly
+ * @version 0.1
+ * @date 2021-10-09
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#ifndef __HOST_RTOS_H__
+#define __HOST_RTOS_H__
+
+#include <stdint.h>
+
+typedef void *osThreadId;
+typedef int32_t osStatus;
+
+enum osPriority
+{
+	osPriorityNormal = 24
+};
+
+#define osWaitForever 0xFFFFFFFFU
+#define osEventSignal 0x08
+
+struct osEvent
+{
+	osStatus status;
+	union
+	{
+		int32_t signals;
+	} value;
+};
+
+osThreadId osThreadGetId(void);
+int32_t osSignalSet(osThreadId thread_id, int32_t signals);
+osEvent osSignalWait(int32_t signals, uint32_t millisec);
+
+namespace rtos
+{
+	class Thread
+	{
+	public:
+		Thread(osPriority priority = osPriorityNormal, uint32_t stack_size = 4096)
+		{
+			(void)priority;
+			(void)stack_size;
+		}
+		osStatus start(void (*task)(void))
+		{
+			(void)task;
+			return 0;
+		}
+		osStatus set_priority(osPriority priority)
+		{
+			(void)priority;
+			return 0;
+		}
+	};
+
+	class Mutex
+	{
+	public:
+		void lock(void) {}
+		void unlock(void) {}
+	};
+
+	class Semaphore
+	{
+	public:
+		Semaphore(int32_t count = 0) : _count(count) {}
+		void acquire(void) { _count--; }
+		bool try_acquire(void)
+		{
+			if (_count <= 0)
+			{
+				return false;
+			}
+			_count--;
+			return true;
+		}
+		void release(void) { _count++; }
+
+	private:
+		int32_t _count;
+	};
+}
+
+#endif
@@ -0,0 +1,85 @@
+/**
+ * @file test_session_restore.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Join, reboot and check that the restored session has the parameters of the join accept
+ * The join accept sets RX1 delay, RX2 data rate and CFList channels that differ from the region
+ * defaults, the MAC after the reboot must use them without a new join.
+ * @version 0.1
+ * @date 2021-10-09
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "host_emu.h"
+
+/** Device address of the join accept */
+#define JOIN_DEV_ADDR 0x260BAAAA
+/** RX1 delay of the join accept in milliseconds, the region default is 1000 */
+#define JOIN_RX1_DELAY 5000
+/** RX2 data rate of the join accept, the region default is DR_0 */
+#define JOIN_RX2_DR DR_3
+/** Channels 3 .. 7 of the join accept CFList */
+static const uint32_t join_cflist[5] = {867100000, 867300000, 867500000, 867700000, 867900000};
+
+/**
+ * @brief Boot and join, the session is saved
+ *
+ * @param arg unused
+ * @return int number of failed checks
+ */
+static int boot_join(int arg)
+{
+	init_flash();
+	g_lorawan_settings.lorawan_enable = true;
+	g_lorawan_settings.otaa_enabled = true;
+	g_lorawan_settings.lora_region = LORAMAC_REGION_EU868;
+	save_settings();
+
+	EMU_CHECK(init_lorawan() == 0);
+	EMU_CHECK(g_emu_lmh_join_status == LMH_ONGOING);
+	emu_lmh_join_accept(JOIN_DEV_ADDR, JOIN_RX1_DELAY, JOIN_RX2_DR, join_cflist);
+	settings_flush();
+
+	EMU_CHECK(g_lorawan_settings.session_valid == 1);
+	EMU_CHECK(g_lorawan_settings.session_rx1_delay == JOIN_RX1_DELAY / 1000);
+	EMU_CHECK(g_lorawan_settings.session_rx2_dr == JOIN_RX2_DR);
+	EMU_CHECK(g_lorawan_settings.session_ch_mask[0] == 0xFF);
+	return g_emu_failures;
+}
+
+/**
+ * @brief Boot and check the restored session in the MAC
+ *
+ * @param arg unused
+ * @return int number of failed checks
+ */
+static int boot_restore(int arg)
+{
+	init_flash();
+	EMU_CHECK(init_lorawan() == 0);
+
+	// No join request, the session of the last join is used
+	EMU_CHECK(g_emu_lmh_join_status == LMH_SET);
+	EMU_CHECK(g_lpwan_has_joined);
+	EMU_CHECK(lmh_getDevAddr() == JOIN_DEV_ADDR);
+	EMU_CHECK(g_emu_mac.rx1_delay == JOIN_RX1_DELAY);
+	EMU_CHECK(g_emu_mac.rx2_delay == JOIN_RX1_DELAY + 1000);
+	EMU_CHECK(g_emu_mac.rx2.Frequency == 869525000);
+	EMU_CHECK(g_emu_mac.rx2.Datarate == JOIN_RX2_DR);
+	for (uint8_t idx = 0; idx < 5; idx++)
+	{
+		EMU_CHECK(g_emu_mac.channels[EMU_DEFAULT_CHANNELS + idx].Frequency == join_cflist[idx]);
+		EMU_CHECK(g_emu_mac.channels[EMU_DEFAULT_CHANNELS + idx].DrRange.Value == ((DR_5 << 4) | DR_0));
+	}
+	EMU_CHECK(g_emu_mac.mask[0] == 0xFF);
+	return g_emu_failures;
+}
+
+int main(void)
+{
+	emu_flash_erase_all();
+	EMU_CHECK(emu_run(boot_join, 0) == 0);
+	EMU_CHECK(emu_run(boot_restore, 0) == 0);
+
+	return emu_result("test_session_restore");
+}
@@ -0,0 +1,276 @@
+/**
+ * @file test_settings_migration.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Boot with settings flash images of older firmware and check that nothing is lost
+ * The images in data/ are written by data/make_settings_images.py
+ * @version 0.1
+ * @date 2021-10-09
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "host_emu.h"
+#include <stddef.h>
+
+// Offsets the images were made with, a layout change must keep them
+static_assert(offsetof(s_lorawan_settings, app_port) == 86, "Layout of the recorded images changed");
+static_assert(offsetof(s_lorawan_settings, confirmed_msg_enabled) == 88, "Layout of the recorded images changed");
+static_assert(offsetof(s_lorawan_settings, p2p_sf) == 102, "Layout of the recorded images changed");
+static_assert(offsetof(s_lorawan_settings, at_echo) == 109, "Layout of the recorded images changed");
+static_assert(offsetof(s_lorawan_settings, session_valid) == 117, "Layout of the recorded images changed");
+static_assert(offsetof(s_lorawan_settings, rx_log_enable) == 168, "Layout of the recorded images changed");
+static_assert(offsetof(s_lorawan_settings, p2p_cad_retries) == 169, "Layout of the recorded images changed");
+static_assert(offsetof(s_lorawan_settings, p2p_airtime_budget) == 172, "Layout of the recorded images changed");
+static_assert(offsetof(s_lorawan_settings, p2p_hop_num) == 176, "Layout of the recorded images changed");
+
+/**
+ * @brief Load an image into the emulated flash, the rest of the flash is erased
+ *
+ * @param name file name in data/
+ * @param offset offset in the flash
+ * @return true if the image was loaded
+ */
+static bool load_image(const char *name, uint32_t offset)
+{
+	char path[256];
+	snprintf(path, sizeof(path), "%s/%s", HOST_TEST_DATA, name);
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+	{
+		printf("%s: not found\n", path);
+		return false;
+	}
+	emu_flash_erase_all();
+	size_t len = fread(&emu_flash[offset], 1, FLASH_SECTOR_SIZE, file);
+	fclose(file);
+	return len == FLASH_SECTOR_SIZE;
+}
+
+/**
+ * @brief Find the settings log sector with the highest sequence number
+ *
+ * @return const uint8_t* start of the sector, NULL if there is none
+ */
+static const uint8_t *newest_log_sector(void)
+{
+	const uint8_t *newest = NULL;
+	uint32_t newest_seq = 0;
+	for (uint8_t sector = 0; sector < SETTINGS_LOG_SECTORS; sector++)
+	{
+		const uint8_t *data = &emu_flash[SETTINGS_LOG_OFFSET + sector * FLASH_SECTOR_SIZE];
+		uint32_t magic, seq;
+		memcpy(&magic, &data[0], 4);
+		memcpy(&seq, &data[4], 4);
+		if ((magic == 0x474F4C53) && ((newest == NULL) || (seq > newest_seq)))
+		{
+			newest = data;
+			newest_seq = seq;
+		}
+	}
+	return newest;
+}
+
+/**
+ * @brief Check the settings of the first release, they are in every image
+ *
+ * @param app_port expected data port, changed by the log records
+ */
+static void check_v1_fields(uint8_t app_port)
+{
+	const uint8_t dev_eui[8] = {0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08};
+	const uint8_t app_eui[8] = {0x70, 0xB3, 0xD5, 0x7E, 0xD0, 0x00, 0x11, 0x22};
+	uint8_t key[16];
+
+	EMU_CHECK(g_lorawan_settings.valid_mark_1 == 0xAA);
+	EMU_CHECK(g_lorawan_settings.valid_mark_2 == LORAWAN_DATA_MARKER);
+	EMU_CHECK(memcmp(g_lorawan_settings.node_device_eui, dev_eui, 8) == 0);
+	EMU_CHECK(memcmp(g_lorawan_settings.node_app_eui, app_eui, 8) == 0);
+	for (uint8_t idx = 0; idx < 16; idx++)
+	{
+		key[idx] = 0x10 + idx;
+	}
+	EMU_CHECK(memcmp(g_lorawan_settings.node_app_key, key, 16) == 0);
+	EMU_CHECK(g_lorawan_settings.node_dev_addr == 0x260B1234);
+	for (uint8_t idx = 0; idx < 16; idx++)
+	{
+		key[idx] = 0x20 + idx;
+	}
+	EMU_CHECK(memcmp(g_lorawan_settings.node_nws_key, key, 16) == 0);
+	for (uint8_t idx = 0; idx < 16; idx++)
+	{
+		key[idx] = 0x30 + idx;
+	}
+	EMU_CHECK(memcmp(g_lorawan_settings.node_apps_key, key, 16) == 0);
+	EMU_CHECK(!g_lorawan_settings.otaa_enabled);
+	EMU_CHECK(g_lorawan_settings.adr_enabled);
+	EMU_CHECK(!g_lorawan_settings.public_network);
+	EMU_CHECK(g_lorawan_settings.duty_cycle_enabled);
+	EMU_CHECK(g_lorawan_settings.send_repeat_time == 60000);
+	EMU_CHECK(g_lorawan_settings.join_trials == 3);
+	EMU_CHECK(g_lorawan_settings.tx_power == 5);
+	EMU_CHECK(g_lorawan_settings.data_rate == 2);
+	EMU_CHECK(g_lorawan_settings.lora_class == 2);
+	EMU_CHECK(g_lorawan_settings.subband_channels == 2);
+	EMU_CHECK(g_lorawan_settings.auto_join);
+	EMU_CHECK(g_lorawan_settings.app_port == app_port);
+	EMU_CHECK(g_lorawan_settings.confirmed_msg_enabled == LMH_CONFIRMED_MSG);
+	EMU_CHECK(g_lorawan_settings.lora_region == 5);
+	EMU_CHECK(!g_lorawan_settings.lorawan_enable);
+	EMU_CHECK(g_lorawan_settings.p2p_frequency == 868100000);
+	EMU_CHECK(g_lorawan_settings.p2p_tx_power == 14);
+	EMU_CHECK(g_lorawan_settings.p2p_bandwidth == 1);
+	// The record without commit record must not be used
+	EMU_CHECK(g_lorawan_settings.p2p_sf == 9);
+	EMU_CHECK(g_lorawan_settings.p2p_cr == 2);
+	EMU_CHECK(g_lorawan_settings.p2p_preamble_len == 12);
+	EMU_CHECK(g_lorawan_settings.p2p_symbol_timeout == 5);
+	EMU_CHECK(!g_lorawan_settings.resetRequest);
+}
+
+/**
+ * @brief Check the settings added after the first release, recorded or migration defaults
+ *
+ * @param version layout version of the image
+ */
+static void check_new_fields(uint16_t version)
+{
+	s_lorawan_settings defaults;
+
+	EMU_CHECK(g_lorawan_settings.at_echo == (version >= 2 ? 0 : 1));
+	EMU_CHECK(g_lorawan_settings.at_verbose == (version >= 2 ? 0 : 1));
+	EMU_CHECK(g_lorawan_settings.at_baudrate == (version >= 2 ? 9600 : SERIAL1_DEFAULT_BAUD));
+	EMU_CHECK(g_lorawan_settings.at_flow_control == (version >= 2 ? 1 : 0));
+	// Sessions saved without the MAC parameters of layout version 8 are joined again
+	EMU_CHECK(g_lorawan_settings.session_valid == 0);
+	if (version >= 3)
+	{
+		EMU_CHECK(g_lorawan_settings.session_id == 0xC0FFEE01);
+		EMU_CHECK(g_lorawan_settings.session_dev_addr == 0x260B5678);
+		EMU_CHECK(g_lorawan_settings.session_nwk_skey[0] == 0x40);
+		EMU_CHECK(g_lorawan_settings.session_app_skey[15] == 0x5F);
+		EMU_CHECK(g_lorawan_settings.session_fcnt_up == 1000);
+		EMU_CHECK(g_lorawan_settings.session_fcnt_down == 5);
+	}
+	EMU_CHECK(g_lorawan_settings.rx_log_enable == (version >= 4 ? 1 : 0));
+	EMU_CHECK(g_lorawan_settings.p2p_cad_retries == (version >= 5 ? 5 : defaults.p2p_cad_retries));
+	EMU_CHECK(g_lorawan_settings.p2p_backoff == (version >= 5 ? 200 : defaults.p2p_backoff));
+	EMU_CHECK(g_lorawan_settings.p2p_airtime_budget == (version >= 6 ? 36000 : 0));
+	EMU_CHECK(g_lorawan_settings.p2p_hop_num == (version >= 7 ? 3 : 0));
+	EMU_CHECK(g_lorawan_settings.p2p_hop_reset == (version >= 7 ? 300 : 0));
+	EMU_CHECK(g_lorawan_settings.p2p_hop_seed == (version >= 7 ? 0x5EED0001 : 0));
+	EMU_CHECK(g_lorawan_settings.p2p_hop_freq[0] == (version >= 7 ? 868300000 : 0));
+	EMU_CHECK(g_lorawan_settings.p2p_hop_freq[P2P_HOP_MAX - 1] == (version >= 7 ? 869700000 : 0));
+	EMU_CHECK(g_lorawan_settings.session_rx2_freq == 0);
+	EMU_CHECK(g_lorawan_settings.session_ch_mask[0] == 0);
+	EMU_CHECK(g_lorawan_settings.session_cflist[0] == 0);
+	EMU_CHECK(g_lorawan_settings.session_rx1_delay == 0);
+	EMU_CHECK(g_lorawan_settings.session_rx2_dr == 0);
+}
+
+/**
+ * @brief Check that the newest settings log sector holds the current settings in the current layout
+ *
+ */
+static void check_log_sector(void)
+{
+	const uint8_t *sector = newest_log_sector();
+	EMU_CHECK(sector != NULL);
+	if (sector == NULL)
+	{
+		return;
+	}
+	uint16_t version, size;
+	uint32_t crc;
+	memcpy(&version, &sector[8], 2);
+	memcpy(&size, &sector[10], 2);
+	memcpy(&crc, &sector[12], 4);
+	EMU_CHECK(version == LORAWAN_SETTINGS_VERSION);
+	EMU_CHECK(size == sizeof(s_lorawan_settings));
+	// The snapshot record follows the 16 byte sector header and the 4 byte record header
+	EMU_CHECK(crc == calc_crc32(0, &sector[20], sizeof(s_lorawan_settings)));
+}
+
+/**
+ * @brief Boot with a settings sector of firmware before the settings log
+ *
+ * @param name image file
+ * @param version layout version of the image
+ */
+static void test_legacy(const char *name, uint16_t version)
+{
+	printf("%s\n", name);
+	if (!load_image(name, FLASH_TARGET_OFFSET))
+	{
+		g_emu_failures++;
+		return;
+	}
+	uint32_t erases = g_flash_erases;
+	init_flash();
+	check_v1_fields(10);
+	check_new_fields(version);
+	// The settings log sectors are still erased, the upgrade needs no erase
+	EMU_CHECK(g_flash_erases == erases);
+	check_log_sector();
+	// The sector of the older firmware is left as it was
+	EMU_CHECK(emu_flash[FLASH_TARGET_OFFSET] == 0xAA);
+
+	// Boot again from the settings log
+	g_lorawan_settings.app_port = 0;
+	init_flash();
+	check_v1_fields(10);
+	check_new_fields(version);
+}
+
+/**
+ * @brief Boot with a settings log sector of an older layout version
+ *
+ * @param name image file
+ * @param version layout version of the image
+ */
+static void test_log(const char *name, uint16_t version)
+{
+	printf("%s\n", name);
+	if (!load_image(name, SETTINGS_LOG_OFFSET))
+	{
+		g_emu_failures++;
+		return;
+	}
+	uint32_t programs = g_flash_programs;
+	uint32_t erases = g_flash_erases;
+	init_flash();
+	check_v1_fields(20);
+	check_new_fields(version);
+	// The image is upgraded in RAM, nothing is written until the settings change
+	EMU_CHECK(g_flash_programs == programs);
+	// Snapshot, the committed record and its commit record
+	EMU_CHECK(g_settings_log_records == 3);
+
+	// The first change starts a sector in the current layout, the old one stays as a fallback
+	g_lorawan_settings.session_rx1_delay = 5;
+	save_settings();
+	settings_flush();
+	EMU_CHECK(g_flash_erases == erases);
+	check_log_sector();
+	EMU_CHECK(memcmp(&emu_flash[SETTINGS_LOG_OFFSET], "SLOG", 4) == 0);
+
+	g_lorawan_settings.app_port = 0;
+	init_flash();
+	check_v1_fields(20);
+	EMU_CHECK(g_lorawan_settings.session_rx1_delay == 5);
+	g_lorawan_settings.session_rx1_delay = 0;
+	check_new_fields(version);
+}
+
+int main(void)
+{
+	test_legacy("legacy_v1.bin", 1);
+	test_legacy("legacy_v1_ff.bin", 1);
+	test_legacy("legacy_v2.bin", 2);
+	test_log("log_v3.bin", 3);
+	test_log("log_v4.bin", 4);
+	test_log("log_v5.bin", 5);
+	test_log("log_v6.bin", 6);
+	test_log("log_v7.bin", 7);
+
+	return emu_result("test_settings_migration");
+}
@@ -0,0 +1,190 @@
+/**
+ * @file test_settings_power_cut.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Cut the power at every flash operation of a settings write and check the next boot
+ * Every boot must find either the settings before or after the interrupted write, and the
+ * write after it must survive the next boot. The writes go through compactions of all
+ * settings log sectors.
+ * @version 0.1
+ * @date 2021-10-09
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "host_emu.h"
+
+// Defaults of a device without settings, flash.cpp
+void make_credentials(void);
+
+/** Number of settings writes */
+#define CUT_WRITES 600
+/** Boot results */
+#define BOOT_OLD 0
+#define BOOT_NEW 1
+#define BOOT_LOST 2
+
+/** Flash operation the power is cut at, used by the boot that writes */
+static uint32_t g_cut_op = 0;
+
+/**
+ * @brief Change the settings like write number write does
+ * Most writes change a few bytes, some change a key or most of the settings
+ *
+ * @param write number of the write, starting at 1
+ */
+static void apply_write(int write)
+{
+	g_lorawan_settings.app_port = write & 0xFF;
+	g_lorawan_settings.send_repeat_time = write * 1000;
+	if ((write % 5) == 0)
+	{
+		g_lorawan_settings.node_app_key[write % 16] = write;
+	}
+	if ((write % 7) == 0)
+	{
+		g_lorawan_settings.p2p_frequency = 868000000 + write * 100;
+		g_lorawan_settings.p2p_sf = 7 + write % 6;
+	}
+	if ((write % 97) == 0)
+	{
+		for (uint8_t idx = 0; idx < P2P_HOP_MAX; idx++)
+		{
+			g_lorawan_settings.p2p_hop_freq[idx] = 868000000 + write * 1000 + idx;
+		}
+		memset(g_lorawan_settings.session_nwk_skey, write, sizeof(g_lorawan_settings.session_nwk_skey));
+	}
+}
+
+/**
+ * @brief Settings after a number of writes
+ *
+ * @param writes number of writes
+ * @param settings receives the settings
+ */
+static void expected_settings(int writes, s_lorawan_settings *settings)
+{
+	s_lorawan_settings defaults;
+	s_lorawan_settings saved;
+	memcpy((void *)&saved, (void *)&g_lorawan_settings, sizeof(saved));
+	memcpy((void *)&g_lorawan_settings, (void *)&defaults, sizeof(defaults));
+	make_credentials();
+	for (int write = 1; write <= writes; write++)
+	{
+		apply_write(write);
+	}
+	memcpy((void *)settings, (void *)&g_lorawan_settings, sizeof(s_lorawan_settings));
+	memcpy((void *)&g_lorawan_settings, (void *)&saved, sizeof(saved));
+}
+
+/**
+ * @brief Boot and do the next write, the power is cut at g_cut_op
+ *
+ * @param write number of the write, 0 to boot only
+ * @return int 0 if the write finished before the power cut
+ */
+static int boot_write(int write)
+{
+	init_flash();
+	if (write == 0)
+	{
+		return 0;
+	}
+	if (g_cut_op != 0)
+	{
+		emu_flash_power_cut(g_cut_op);
+	}
+	apply_write(write);
+	save_settings();
+	settings_flush();
+	return 0;
+}
+
+/**
+ * @brief Boot and check if the settings are the ones before or after a write
+ *
+ * @param write number of the write
+ * @return int BOOT_OLD, BOOT_NEW or BOOT_LOST
+ */
+static int boot_check(int write)
+{
+	s_lorawan_settings expected;
+	init_flash();
+	expected_settings(write - 1, &expected);
+	if (memcmp((void *)&expected, (void *)&g_lorawan_settings, sizeof(expected)) == 0)
+	{
+		return BOOT_OLD;
+	}
+	expected_settings(write, &expected);
+	if (memcmp((void *)&expected, (void *)&g_lorawan_settings, sizeof(expected)) == 0)
+	{
+		return BOOT_NEW;
+	}
+	return BOOT_LOST;
+}
+
+/**
+ * @brief Boot and write the settings after write, like a user repeating the interrupted change
+ *
+ * @param write number of the write
+ * @return int 0
+ */
+static int boot_repeat(int write)
+{
+	s_lorawan_settings expected;
+	init_flash();
+	expected_settings(write, &expected);
+	memcpy((void *)&g_lorawan_settings, (void *)&expected, sizeof(expected));
+	save_settings();
+	settings_flush();
+	return 0;
+}
+
+int main(void)
+{
+	static uint8_t saved_flash[SETTINGS_LOG_SECTORS * FLASH_SECTOR_SIZE];
+	uint32_t cuts = 0;
+	uint32_t boots_old = 0;
+	uint32_t boots_new = 0;
+
+	// The first boot writes the defaults
+	emu_flash_erase_all();
+	g_cut_op = 0;
+	EMU_CHECK(emu_run(boot_write, 0) == 0);
+
+	for (int write = 1; write <= CUT_WRITES; write++)
+	{
+		memcpy(saved_flash, &emu_flash[SETTINGS_LOG_OFFSET], sizeof(saved_flash));
+		for (g_cut_op = 1;; g_cut_op++)
+		{
+			int result = emu_run(boot_write, write);
+			if (result != EMU_POWER_CUT)
+			{
+				// The write needs less flash operations
+				EMU_CHECK(result == 0);
+				break;
+			}
+			cuts++;
+			int boot = emu_run(boot_check, write);
+			if (boot != BOOT_OLD && boot != BOOT_NEW)
+			{
+				printf("write %d, power cut at flash operation %u: settings lost\n", write, g_cut_op);
+			}
+			EMU_CHECK(boot == BOOT_OLD || boot == BOOT_NEW);
+			boots_old += (boot == BOOT_OLD);
+			boots_new += (boot == BOOT_NEW);
+
+			EMU_CHECK(emu_run(boot_repeat, write) == 0);
+			EMU_CHECK(emu_run(boot_check, write) == BOOT_NEW);
+			memcpy(&emu_flash[SETTINGS_LOG_OFFSET], saved_flash, sizeof(saved_flash));
+		}
+		// Continue with the completed write
+		g_cut_op = 0;
+		memcpy(&emu_flash[SETTINGS_LOG_OFFSET], saved_flash, sizeof(saved_flash));
+		EMU_CHECK(emu_run(boot_write, write) == 0);
+		EMU_CHECK(emu_run(boot_check, write) == BOOT_NEW);
+	}
+	printf("%d writes, %u power cuts: %u boots with the old settings, %u with the new ones\n", CUT_WRITES, cuts,
+		   boots_old, boots_new);
+
+	return emu_result("test_settings_power_cut");
+}
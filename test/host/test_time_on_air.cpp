@@ -0,0 +1,169 @@
+/**
+ * @file test_time_on_air.cpp
+ * @author Bernd Giesecke (bernd.giesecke@rakwireless.com)
+ * @brief Check the LoRa time on air against the Semtech formula and the P2P airtime budget
+ * The formula is computed in floating point for all SF, bandwidth_hz, coding rates, payload
+ * sizes from 0 to 255 bytes and several preamble lengths.
+ * @version 0.1
+ * @date 2021-10-09
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+#include "host_emu.h"
+
+/** Bandwidths in Hz in the order of the radio setting */
+static const double bandwidth_hz[10] = {125000.0, 250000.0, 500000.0, 500000.0 / 8, 500000.0 / 12,
+									  500000.0 / 16, 500000.0 / 24, 500000.0 / 32, 500000.0 / 48, 500000.0 / 64};
+
+/**
+ * @brief Time on air of a packet with explicit header and CRC, SX126x datasheet chapter 6.1.4
+ * Low data rate optimization is used when a symbol is longer than 16 ms
+ *
+ * @param sf spreading factor 5 .. 12
+ * @param bw bandwidth setting 0 .. 9
+ * @param cr coding rate 1 .. 4 for 4/5 .. 4/8
+ * @param preamble_len preamble length in symbols
+ * @param size payload size in bytes
+ * @return double time on air in milliseconds
+ */
+static double semtech_time_on_air(int sf, int bw, int cr, int preamble_len, int size)
+{
+	double t_sym = pow(2.0, sf) / bandwidth_hz[bw] * 1000.0;
+	int ldro = (t_sym > 16.0) ? 1 : 0;
+	double n_payload;
+	double n_preamble;
+	if (sf < 7)
+	{
+		n_preamble = preamble_len + 6.25;
+		n_payload = 8 + ceil(fmax(8.0 * size + 16 - 4 * sf + 20, 0) / (4.0 * sf)) * (cr + 4);
+	}
+	else
+	{
+		n_preamble = preamble_len + 4.25;
+		n_payload = 8 + ceil(fmax(8.0 * size + 16 - 4 * sf + 8 + 20, 0) / (4.0 * (sf - 2 * ldro))) * (cr + 4);
+	}
+	return (n_preamble + n_payload) * t_sym;
+}
+
+/**
+ * @brief Compare the calculator with the formula for all settings
+ *
+ */
+static void test_all_settings(void)
+{
+	const int preambles[] = {6, 8, 12, 16, 100, 1000, 65535};
+	uint32_t checked = 0;
+	for (int sf = 5; sf <= 12; sf++)
+	{
+		for (int bw = 0; bw < 10; bw++)
+		{
+			for (int cr = 1; cr <= 4; cr++)
+			{
+				for (int preamble : preambles)
+				{
+					for (int size = 0; size <= 255; size++)
+					{
+						double exact = semtech_time_on_air(sf, bw, cr, preamble, size);
+						// Rounded up to full milliseconds, the tolerance covers the floating point error of exact values
+						uint32_t expected = (uint32_t)ceil(exact - 1e-6);
+						uint32_t toa = lora_time_on_air(sf, bw, cr, preamble, size);
+						if (toa != expected)
+						{
+							printf("SF%d BW%d CR%d preamble %d size %d: %u ms, formula %.3f ms\n", sf, bw, cr, preamble,
+								   size, toa, exact);
+							g_emu_failures++;
+						}
+						checked++;
+					}
+				}
+			}
+		}
+	}
+	printf("%u combinations checked\n", checked);
+}
+
+/**
+ * @brief Values of the Semtech LoRa calculator, 8 symbols preamble, CR 4/5
+ *
+ */
+static void test_calculator_values(void)
+{
+	// SF7 125 kHz 10 bytes 41.216 ms, 51 bytes 102.656 ms
+	EMU_CHECK(lora_time_on_air(7, 0, 1, 8, 10) == 42);
+	EMU_CHECK(lora_time_on_air(7, 0, 1, 8, 51) == 103);
+	// SF12 125 kHz 10 bytes 991.232 ms with low data rate optimization
+	EMU_CHECK(lora_time_on_air(12, 0, 1, 8, 10) == 992);
+	// SF9 500 kHz 20 bytes 46.336 ms
+	EMU_CHECK(lora_time_on_air(9, 2, 1, 8, 20) == 47);
+}
+
+/**
+ * @brief Check AT+TOA with the P2P settings
+ *
+ */
+static void test_at_toa(void)
+{
+	char expected[32];
+	g_lorawan_settings.p2p_sf = 10;
+	g_lorawan_settings.p2p_bandwidth = 1;
+	g_lorawan_settings.p2p_cr = 2;
+	g_lorawan_settings.p2p_preamble_len = 12;
+	snprintf(expected, sizeof(expected), "+TOA:%u", (uint32_t)ceil(semtech_time_on_air(10, 1, 2, 12, 64) - 1e-6));
+	EMU_CHECK(strstr(emu_at("AT+TOA=64"), expected) != NULL);
+	EMU_CHECK(strstr(emu_at("AT+TOA=0"), "ERROR") != NULL);
+	EMU_CHECK(strstr(emu_at("AT+TOA=256"), "ERROR") != NULL);
+}
+
+/**
+ * @brief Check the budget over the sliding one hour window
+ *
+ */
+static void test_budget(void)
+{
+	g_lorawan_settings.p2p_airtime_budget = 1000;
+	EMU_CHECK(airtime_remaining() == 1000);
+
+	// Queued packets count against the budget until they are sent or dropped
+	EMU_CHECK(airtime_reserve(600));
+	EMU_CHECK(!airtime_reserve(500));
+	EMU_CHECK(airtime_reserved() == 600);
+	airtime_release(600, true);
+	EMU_CHECK(airtime_used() == 600);
+	EMU_CHECK(airtime_remaining() == 400);
+	EMU_CHECK(airtime_reserve(300));
+	airtime_release(300, false);
+	EMU_CHECK(airtime_used() == 600);
+
+	// 30 minutes later
+	emu_time_advance(30ULL * 60 * 1000000);
+	EMU_CHECK(airtime_reserve(300));
+	airtime_release(300, true);
+	EMU_CHECK(airtime_used() == 900);
+	EMU_CHECK(!airtime_reserve(101));
+	EMU_CHECK(airtime_remaining() == 100);
+
+	// The first packet leaves the window after one hour
+	emu_time_advance(31ULL * 60 * 1000000);
+	EMU_CHECK(airtime_used() == 300);
+	EMU_CHECK(airtime_reserve(700));
+	airtime_release(700, false);
+	emu_time_advance(30ULL * 60 * 1000000);
+	EMU_CHECK(airtime_used() == 0);
+
+	// Without a budget the whole window is available
+	g_lorawan_settings.p2p_airtime_budget = 0;
+	EMU_CHECK(airtime_reserve(4000000));
+	airtime_release(4000000, false);
+	EMU_CHECK(airtime_remaining() == 3600000);
+}
+
+int main(void)
+{
+	test_all_settings();
+	test_calculator_values();
+	test_at_toa();
+	test_budget();
+
+	return emu_result("test_time_on_air");
+}